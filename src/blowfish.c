@@ -225,7 +225,7 @@ static void BfCtxMixKey(BfBlowfishContext *ctx, uint32_t *keyBufp, uint32_t keyl
 	BfCtxInit(ctx, (unsigned char *) keyBufp, keylen);
 }
 
-static void BfCtxInitWithKey(BfBlowfishContext *ctx, uint32_t key, const unsigned char *fwHeader) {
+static void BfCtxDeriveKey(BfBlowfishContext *ctx, uint32_t key, const unsigned char *fwHeader) {
 	memcpy(ctx, &sInitTable, sizeof(BfBlowfishContext));
 
 	uint32_t keyBufp[3];
@@ -242,6 +242,51 @@ static void BfCtxInitWithKey(BfBlowfishContext *ctx, uint32_t key, const unsigne
 	BfCtxMixKey(ctx, keyBufp, 12);
 }
 
+#ifdef _MSC_VER
+#define BF_THREAD_LOCAL __declspec(thread)
+#else
+#define BF_THREAD_LOCAL _Thread_local
+#endif
+
+#define BF_KEY_CACHE_SIZE 4
+
+typedef struct BfKeyCacheEntry_ {
+	int valid;
+	unsigned char keyData[12];              // header bytes 0x8-0xB and 0x18-0x1F the key is derived from
+	unsigned int lastUse;
+	BfBlowfishContext ctx;
+} BfKeyCacheEntry;
+
+//deriving a key runs over a thousand block encryptions, and the same few images are en/decrypted over
+//and over. Each thread keeps its own cache so that no locking is needed.
+static BF_THREAD_LOCAL BfKeyCacheEntry sKeyCache[BF_KEY_CACHE_SIZE];
+static BF_THREAD_LOCAL unsigned int sKeyCacheClock = 0;
+
+static void BfCtxInitWithKey(BfBlowfishContext *ctx, uint32_t key, const unsigned char *fwHeader) {
+	unsigned char keyData[12];
+	memcpy(keyData + 0, &key, 4);
+	memcpy(keyData + 4, fwHeader + 0x18, 8);
+	
+	BfKeyCacheEntry *entry = NULL;
+	for (int i = 0; i < BF_KEY_CACHE_SIZE; i++) {
+		BfKeyCacheEntry *cand = &sKeyCache[i];
+		if (cand->valid && memcmp(cand->keyData, keyData, sizeof(keyData)) == 0) {
+			cand->lastUse = ++sKeyCacheClock;
+			memcpy(ctx, &cand->ctx, sizeof(BfBlowfishContext));
+			return;
+		}
+		
+		//replace an unused entry, or else the least recently used
+		if (entry == NULL || (entry->valid && (!cand->valid || cand->lastUse < entry->lastUse))) entry = cand;
+	}
+	
+	BfCtxDeriveKey(&entry->ctx, key, fwHeader);
+	memcpy(entry->keyData, keyData, sizeof(keyData));
+	entry->valid = 1;
+	entry->lastUse = ++sKeyCacheClock;
+	memcpy(ctx, &entry->ctx, sizeof(BfBlowfishContext));
+}
+
 void BfDecrypt(unsigned char *buf, unsigned int len, const unsigned char *fwHeader) {
 	//init blowfish
 	BfBlowfishContext ctx;
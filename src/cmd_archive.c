@@ -0,0 +1,381 @@
+#include "cmd_common.h"
+#include "firmware.h"
+#include "blowfish.h"
+#include "compression.h"
+#include "digest.h"
+
+#include <string.h>
+
+#define ARCHIVE_MANIFEST_MAGIC "fwutil-archive 1"
+
+void CmdHelpArchive(void) {
+	puts("");
+	puts("Usage: archive put <store> <name>");
+	puts("       archive get <store> <name> <filename>");
+	puts("");
+	puts("Stores firmware images in a content-addressed object store. The store is an");
+	puts("existing directory. An image is split into its header, its five modules and");
+	puts("the remaining bytes (user settings, wireless tables and free space). Each part is");
+	puts("stored once as <store>/<digest>.bin, keyed by its MD5 digest, so modules that");
+	puts("repeat between dumps of the same firmware version are only stored once. The");
+	puts("ARM9 and ARM7 static modules are stored decrypted, so they do not depend on the");
+	puts("header they were encrypted with.");
+	puts("");
+	puts("The image's manifest is written to <store>/<name>.txt.");
+	puts("");
+	puts("Subcommands:");
+	puts("  put    Archive the current firmware image under the specified name.");
+	puts("  get    Rebuild the archived image and write it to the specified file.");
+}
+
+static char *ArchiveGetPath(const char *store, const char *name, const char *ext) {
+	size_t len = strlen(store) + 1 + strlen(name) + strlen(ext) + 1;
+	char *path = malloc(len);
+	sprintf(path, "%s/%s%s", store, name, ext);
+	return path;
+}
+
+static unsigned char *ArchiveReadFile(const char *path, unsigned int *pSize) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) return NULL;
+	
+	fseek(fp, 0, SEEK_END);
+	unsigned int size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	
+	unsigned char *buf = malloc(size + 1);
+	if (fread(buf, 1, size, fp) != size) {
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	
+	buf[size] = '\0';
+	*pSize = size;
+	return buf;
+}
+
+//
+// Store an object by its digest. Returns the number of bytes newly written to the store, or -1 on failure.
+//
+static int ArchivePutObject(const char *store, const unsigned char *buf, unsigned int size, char *digestStr) {
+	unsigned char digest[16];
+	ComputeMd5(buf, size, digest);
+	DgDigestToString(digest, digestStr);
+	
+	char *path = ArchiveGetPath(store, digestStr, ".bin");
+	
+	//objects are immutable: if one with this digest exists, its contents are the same
+	FILE *fp = fopen(path, "rb");
+	if (fp != NULL) {
+		fclose(fp);
+		free(path);
+		return 0;
+	}
+	
+	fp = fopen(path, "wb");
+	if (fp == NULL) {
+		printf("Could not open '%s' for write access.\n", path);
+		free(path);
+		return -1;
+	}
+	
+	int ok = fwrite(buf, 1, size, fp) == size;
+	fclose(fp);
+	
+	if (!ok) {
+		printf("Could not write '%s'.\n", path);
+		remove(path);
+		free(path);
+		return -1;
+	}
+	
+	free(path);
+	return size;
+}
+
+static unsigned char *ArchiveGetObject(const char *store, const char *digestStr, unsigned int *pSize) {
+	char *path = ArchiveGetPath(store, digestStr, ".bin");
+	unsigned char *buf = ArchiveReadFile(path, pSize);
+	if (buf == NULL) {
+		printf("Could not read object '%s'.\n", path);
+		free(path);
+		return NULL;
+	}
+	free(path);
+	
+	//check object integrity
+	unsigned char digest[16];
+	char str[33];
+	ComputeMd5(buf, *pSize, digest);
+	DgDigestToString(digest, str);
+	if (strcmp(str, digestStr) != 0) {
+		printf("Object %s is corrupt.\n", digestStr);
+		free(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+//
+// Gather the bytes of the image not covered by the header or a module, in ascending address order.
+//
+static unsigned char *ArchiveGatherRest(const unsigned char *buffer, unsigned int size, const unsigned char *covered, unsigned int *pRestSize) {
+	unsigned char *rest = malloc(size);
+	unsigned int restSize = 0;
+	for (unsigned int i = 0; i < size; i++) {
+		if (!covered[i]) rest[restSize++] = buffer[i];
+	}
+	*pRestSize = restSize;
+	return rest;
+}
+
+static int ArchiveMarkCovered(unsigned char *covered, unsigned int size, uint32_t addr, uint32_t len) {
+	if (addr > size || len > (size - addr)) return 0;
+	
+	//overlapping modules are left in the rest of the image
+	for (unsigned int i = 0; i < len; i++) {
+		if (covered[addr + i]) return 0;
+	}
+	memset(covered + addr, 1, len);
+	return 1;
+}
+
+static void ArchivePut(const char *store, const char *name) {
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	
+	FirmwareModule mods[FW_MODULE_COUNT];
+	GetFirmwareModules(buffer, size, mods);
+	
+	unsigned char *covered = calloc(size, 1);
+	unsigned char *rest = NULL, *restComp = NULL;
+	char *manifestPath = NULL;
+	FILE *fp = NULL;
+	
+	unsigned int nTotal = 0, nWritten = 0;
+	char digestStr[33];
+	int nModules = 0;
+	int stored[FW_MODULE_COUNT];
+	char modDigests[FW_MODULE_COUNT][33];
+	
+	char manifest[1024];
+	unsigned int manifestLen = 0;
+	
+	//image digest, used to check the rebuilt image
+	unsigned char imageDigest[16];
+	ComputeMd5(buffer, size, imageDigest);
+	DgDigestToString(imageDigest, digestStr);
+	manifestLen += sprintf(manifest + manifestLen, "%s\nsize %08X\nimage %s\n", ARCHIVE_MANIFEST_MAGIC, size, digestStr);
+	
+	//header
+	ArchiveMarkCovered(covered, size, 0, sizeof(FlashHeader));
+	int nNew = ArchivePutObject(store, buffer, sizeof(FlashHeader), digestStr);
+	if (nNew < 0) goto End;
+	nTotal += sizeof(FlashHeader);
+	nWritten += nNew;
+	manifestLen += sprintf(manifest + manifestLen, "header %s\n", digestStr);
+	
+	//modules, stored as they appear in flash (static modules decrypted)
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		FirmwareModule *mod = &mods[i];
+		stored[i] = mod->data != NULL && mod->size > 0 && ArchiveMarkCovered(covered, size, mod->romAddr, mod->size);
+		if (!stored[i]) continue;
+		
+		unsigned char *obj = malloc(mod->size);
+		memcpy(obj, buffer + mod->romAddr, mod->size);
+		if (i == FW_MODULE_ARM9_STATIC || i == FW_MODULE_ARM7_STATIC) BfDecrypt(obj, mod->size, buffer);
+		
+		nNew = ArchivePutObject(store, obj, mod->size, modDigests[i]);
+		free(obj);
+		if (nNew < 0) goto End;
+		
+		nTotal += mod->size;
+		nWritten += nNew;
+		nModules++;
+		manifestLen += sprintf(manifest + manifestLen, "module %d %08X %08X %s\n", i, mod->romAddr, mod->size, modDigests[i]);
+	}
+	
+	//remaining bytes (mostly free space, so compress them)
+	unsigned int restSize, restCompSize;
+	rest = ArchiveGatherRest(buffer, size, covered, &restSize);
+	restComp = CxCompressLZ(rest, restSize, &restCompSize);
+	nNew = ArchivePutObject(store, restComp, restCompSize, digestStr);
+	if (nNew < 0) goto End;
+	nTotal += restCompSize;
+	nWritten += nNew;
+	manifestLen += sprintf(manifest + manifestLen, "rest %s\n", digestStr);
+	
+	manifestPath = ArchiveGetPath(store, name, ".txt");
+	fp = fopen(manifestPath, "wb");
+	if (fp == NULL) {
+		printf("Could not open '%s' for write access.\n", manifestPath);
+		goto End;
+	}
+	fwrite(manifest, 1, manifestLen, fp);
+	fclose(fp);
+	fp = NULL;
+	
+	puts("");
+	printf("Archived %s as '%s'.\n", GetCurrentFilePath(), name);
+	printf("  Modules stored        : %d\n", nModules);
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (!stored[i]) printf("  Module %d could not be split from the image and is stored with the rest.\n", i);
+	}
+	printf("  Object bytes          : %d\n", nTotal);
+	printf("  New bytes written     : %d\n", nWritten);
+	printf("  Deduplicated bytes    : %d\n", nTotal - nWritten);
+
+End:
+	if (fp != NULL) fclose(fp);
+	if (manifestPath != NULL) free(manifestPath);
+	if (restComp != NULL) free(restComp);
+	if (rest != NULL) free(rest);
+	free(covered);
+	FreeFirmwareModules(mods);
+}
+
+static void ArchiveGet(const char *store, const char *name, const char *filename) {
+	char *manifestPath = ArchiveGetPath(store, name, ".txt");
+	unsigned int manifestSize;
+	char *manifest = (char *) ArchiveReadFile(manifestPath, &manifestSize);
+	if (manifest == NULL) {
+		printf("Could not read manifest '%s'.\n", manifestPath);
+		free(manifestPath);
+		return;
+	}
+	free(manifestPath);
+	
+	unsigned char *buffer = NULL, *covered = NULL, *obj = NULL, *rest = NULL;
+	unsigned int size = 0, objSize;
+	char imageDigest[33] = { 0 }, headerDigest[33] = { 0 }, restDigest[33] = { 0 };
+	int nModules = 0;
+	int modIndex[FW_MODULE_COUNT];
+	uint32_t modRomAddr[FW_MODULE_COUNT], modSize[FW_MODULE_COUNT];
+	char modDigests[FW_MODULE_COUNT][33];
+	
+	//parse manifest
+	char *line = strtok(manifest, "\r\n");
+	if (line == NULL || strcmp(line, ARCHIVE_MANIFEST_MAGIC) != 0) {
+		printf("'%s' is not an archive manifest.\n", name);
+		goto End;
+	}
+	while ((line = strtok(NULL, "\r\n")) != NULL) {
+		if (sscanf(line, "size %x", &size) == 1) continue;
+		if (sscanf(line, "image %32s", imageDigest) == 1) continue;
+		if (sscanf(line, "header %32s", headerDigest) == 1) continue;
+		if (sscanf(line, "rest %32s", restDigest) == 1) continue;
+		if (nModules < FW_MODULE_COUNT && sscanf(line, "module %d %x %x %32s", &modIndex[nModules], &modRomAddr[nModules], &modSize[nModules], modDigests[nModules]) == 4) {
+			nModules++;
+			continue;
+		}
+		printf("Unrecognized manifest line: %s\n", line);
+		goto End;
+	}
+	if (size < sizeof(FlashHeader) || !imageDigest[0] || !headerDigest[0] || !restDigest[0]) {
+		printf("Manifest for '%s' is incomplete.\n", name);
+		goto End;
+	}
+	
+	buffer = calloc(size, 1);
+	covered = calloc(size, 1);
+	
+	//header
+	obj = ArchiveGetObject(store, headerDigest, &objSize);
+	if (obj == NULL) goto End;
+	if (objSize != sizeof(FlashHeader)) {
+		printf("Object %s has the wrong size.\n", headerDigest);
+		goto End;
+	}
+	memcpy(buffer, obj, objSize);
+	ArchiveMarkCovered(covered, size, 0, objSize);
+	free(obj);
+	obj = NULL;
+	
+	//modules
+	for (int i = 0; i < nModules; i++) {
+		obj = ArchiveGetObject(store, modDigests[i], &objSize);
+		if (obj == NULL) goto End;
+		if (objSize != modSize[i] || !ArchiveMarkCovered(covered, size, modRomAddr[i], objSize)) {
+			printf("Object %s does not fit the image.\n", modDigests[i]);
+			goto End;
+		}
+		
+		if (modIndex[i] == FW_MODULE_ARM9_STATIC || modIndex[i] == FW_MODULE_ARM7_STATIC) BfEncrypt(obj, objSize, buffer);
+		memcpy(buffer + modRomAddr[i], obj, objSize);
+		free(obj);
+		obj = NULL;
+	}
+	
+	//remaining bytes fill the gaps in ascending order
+	obj = ArchiveGetObject(store, restDigest, &objSize);
+	if (obj == NULL) goto End;
+	
+	unsigned int restSize = 0;
+	rest = CxDecompressLZ(obj, objSize, &restSize);
+	unsigned int nGaps = 0;
+	for (unsigned int i = 0; i < size; i++) {
+		if (!covered[i]) nGaps++;
+	}
+	if (rest == NULL || restSize != nGaps) {
+		printf("Object %s does not fit the image.\n", restDigest);
+		goto End;
+	}
+	
+	unsigned int restPos = 0;
+	for (unsigned int i = 0; i < size; i++) {
+		if (!covered[i]) buffer[i] = rest[restPos++];
+	}
+	
+	//check the rebuilt image
+	unsigned char digest[16];
+	char digestStr[33];
+	ComputeMd5(buffer, size, digest);
+	DgDigestToString(digest, digestStr);
+	if (strcmp(digestStr, imageDigest) != 0) {
+		printf("Rebuilt image digest %s does not match archived digest %s.\n", digestStr, imageDigest);
+		goto End;
+	}
+	
+	FILE *fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		printf("Could not open '%s' for write access.\n", filename);
+		goto End;
+	}
+	fwrite(buffer, size, 1, fp);
+	fclose(fp);
+	
+	printf("Rebuilt '%s' (%d bytes) to %s.\n", name, size, filename);
+
+End:
+	if (rest != NULL) free(rest);
+	if (obj != NULL) free(obj);
+	if (covered != NULL) free(covered);
+	if (buffer != NULL) free(buffer);
+	free(manifest);
+}
+
+void CmdProcArchive(int argc, const char **argv) {
+	if (argc < 4) {
+		CmdHelpArchive();
+		return;
+	}
+	
+	const char *subcommand = argv[1];
+	const char *store = argv[2];
+	const char *name = argv[3];
+	
+	if (strcmp(subcommand, "put") == 0) {
+		if (!RequireFirmwareImage()) return;
+		ArchivePut(store, name);
+	} else if (strcmp(subcommand, "get") == 0) {
+		if (argc < 5) {
+			CmdHelpArchive();
+			return;
+		}
+		ArchiveGet(store, name, argv[4]);
+	} else {
+		printf("Unknown subcommand '%s'.\n", subcommand);
+	}
+}
@@ -39,7 +39,7 @@ void CmdProcClean(int argc, const char **argv) {
 	
 	FlashHeader *hdr = (FlashHeader *) buffer;
 	
-	char fname[1024];
+	char fname[1024] = "";
 	printf("Save config path (enter to skip): ");
 	fgets(fname, sizeof(fname), stdin);
 	
@@ -210,7 +210,7 @@ void CmdProcRestore(int argc, const char **argv) {
 		connExSettingsSize = 0x600;
 	}
 	
-	char textbuffer[1024];
+	char textbuffer[1024] = "";
 	if (wlTable != NULL) {
 		printf("Restore wireless init table? (y/n) ");
 		fgets(textbuffer, sizeof(textbuffer), stdin);
@@ -1,63 +1,195 @@
 #include "cmd_common.h"
 #include "firmware.h"
+#include "libfwutil_internal.h"
+#include "thread.h"
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
-static char *gFirmwarePath = NULL;
-static unsigned char *gFirmware = NULL;
-static unsigned int gFirmwareSize = 0;
+
+static FwContext *gContext = NULL;            // current image, NULL if none
 static int gQuit = 0;
 
+typedef struct OpenImage_ {
+	FwContext *ctx;
+	unsigned int lastUse;
+} OpenImage;
+
+//images kept open besides the current one, so that switching back to them does not load them again
+static OpenImage *gOpenImages = NULL;
+static unsigned int gNOpenImages = 0;
+static unsigned int gMaxOpenImages = 1;
+static unsigned int gOpenImageClock = 0;
+
+
+FwContext *GetFirmwareContext(void) {
+	return gContext;
+}
 
 const char *GetCurrentFilePath(void) {
-	return gFirmwarePath;
+	return gContext != NULL ? FwGetPath(gContext) : NULL;
 }
 
 unsigned char *GetFirmwareImage(unsigned int *pSize) {
-	*pSize = gFirmwareSize;
-	return gFirmware;
+	if (gContext == NULL) {
+		*pSize = 0;
+		return NULL;
+	}
+	return FwGetImage(gContext, pSize);
+}
+
+const FirmwareRamView *GetFirmwareRamView(void) {
+	return FwGetRamView(gContext);
+}
+
+void CommitFirmwareImage(const char *label) {
+	if (gContext == NULL) return;
+	
+	FwCommit(gContext, label, NULL);
+}
+
+static void CloseOpenImage(unsigned int index) {
+	FwFreeContext(gOpenImages[index].ctx);
+	memmove(gOpenImages + index, gOpenImages + index + 1, (gNOpenImages - index - 1) * sizeof(OpenImage));
+	gNOpenImages--;
+}
+
+static int FindOpenImage(const char *path) {
+	for (unsigned int i = 0; i < gNOpenImages; i++) {
+		if (strcmp(FwGetPath(gOpenImages[i].ctx), path) == 0) return i;
+	}
+	return -1;
+}
+
+//
+// Close the current image, cancelling its background jobs first.
+//
+static void CloseCurrentImage(void) {
+	CancelImageJobs(gContext);
+	FwFreeContext(gContext);
+	gContext = NULL;
+}
+
+//
+// Make room to open another image by closing the least recently used open image. Images with unsaved
+// changes or background jobs are never closed. Returns 0 if no image can be closed.
+//
+static int MakeRoomForImage(void) {
+	unsigned int nOpen = gNOpenImages + (gContext != NULL);
+	if (gMaxOpenImages <= 1 || nOpen < gMaxOpenImages) return 1;
+	
+	int lru = -1;
+	for (unsigned int i = 0; i < gNOpenImages; i++) {
+		FwContext *ctx = gOpenImages[i].ctx;
+		if (FwIsModified(ctx) || HasImageJobs(ctx)) continue;
+		if (lru < 0 || gOpenImages[i].lastUse < gOpenImages[lru].lastUse) lru = i;
+	}
+	if (lru < 0) return 0;
+	
+	CloseOpenImage(lru);
+	return 1;
+}
+
+static void ParkFirmwareImage(void) {
+	if (gContext == NULL) return;
+	
+	if (gMaxOpenImages <= 1) {
+		//only the current image is kept
+		CloseCurrentImage();
+		return;
+	}
+	
+	gOpenImages = realloc(gOpenImages, (gNOpenImages + 1) * sizeof(OpenImage));
+	gOpenImages[gNOpenImages].ctx = gContext;
+	gOpenImages[gNOpenImages].lastUse = ++gOpenImageClock;
+	gNOpenImages++;
+	gContext = NULL;
+}
+
+FwContext *ExchangeFirmwareContext(FwContext *ctx) {
+	FwContext *prev = gContext;
+	gContext = ctx;
+	return prev;
+}
+
+void SetOpenImageLimit(unsigned int limit) {
+	gMaxOpenImages = limit < 1 ? 1 : limit;
+}
+
+int SelectFirmwareImage(const char *path) {
+	if (path == NULL) {
+		ParkFirmwareImage();
+		return 1;
+	}
+	if (gContext != NULL && strcmp(FwGetPath(gContext), path) == 0) return 1;
+	
+	int index = FindOpenImage(path);
+	if (index < 0) return 0;
+	
+	//the image's history moves with it
+	FwContext *ctx = gOpenImages[index].ctx;
+	memmove(gOpenImages + index, gOpenImages + index + 1, (gNOpenImages - index - 1) * sizeof(OpenImage));
+	gNOpenImages--;
+	ParkFirmwareImage();
+	gContext = ctx;
+	return 1;
 }
 
 int LoadFirmwareImage(const char *path) {
-	FILE *fp = fopen(path, "rb");
-	if (fp == NULL) {
-		printf("Could not open file '%s' for read acces.\n", path);
+	//with several images open, an open image may hold another client's edits or jobs, so it is only
+	//replaced when nothing would be lost
+	int index = FindOpenImage(path);
+	FwContext *open = index >= 0 ? gOpenImages[index].ctx : NULL;
+	if (gContext != NULL && strcmp(FwGetPath(gContext), path) == 0) open = gContext;
+	if (gMaxOpenImages > 1 && open != NULL && (FwIsModified(open) || HasImageJobs(open))) {
+		printf("Could not load '%s': the open image has unsaved changes or background jobs.\n", path);
+		printf("Use 'use %s' to switch to it.\n", path);
 		return 0;
 	}
 	
-	fseek(fp, 0, SEEK_END);
-	unsigned int size = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
-	unsigned char *buf = malloc(size);
-	fread(buf, size, 1, fp);
-	fclose(fp);
-	
-	if (size < (4 * 1024)) {
-		printf("Invalid firmware image size (%d bytes).\n", size);
-		free(buf);
+	FwContext *ctx = FwCreateContext(NULL);
+	FwStatus status = FwLoadFile(ctx, path);
+	if (status != FW_OK) {
+		if (status == FW_ERR_IO) printf("Could not open file '%s' for read acces.\n", path);
+		else printf("Could not load '%s': %s.\n", path, FwGetStatusString(status));
+		FwFreeContext(ctx);
 		return 0;
 	}
 	
-	if (gFirmwarePath != NULL) {
-		free(gFirmwarePath);
+	//loading an open image again replaces it
+	index = FindOpenImage(path);
+	if (index >= 0) {
+		CancelImageJobs(gOpenImages[index].ctx);
+		CloseOpenImage(index);
 	}
-	if (gFirmware != NULL) {
-		free(gFirmware);
+	if (gContext != NULL && strcmp(FwGetPath(gContext), path) == 0) CloseCurrentImage();
+	if (!MakeRoomForImage()) {
+		printf("Could not load '%s': all %d open images have unsaved changes or background jobs.\n", path, gMaxOpenImages);
+		puts("Save one of them, or wait for its jobs, first.");
+		FwFreeContext(ctx);
+		return 0;
 	}
+	ParkFirmwareImage();
 	
-	gFirmwarePath = strdup(path);
-	gFirmware = buf;
-	gFirmwareSize = size;
-	printf("Loaded %s.\n", gFirmwarePath);
+	gContext = ctx;
+	printf("Loaded %s.\n", path);
 	return 1;
 }
 
 int RequireFirmwareImage(void) {
-	if (gFirmware == NULL) {
+	if (gContext == NULL) {
 		puts("No valid firmware image loaded.");
 		puts("Load a firmware image using the 'load' command.");
 		return 0;
@@ -81,11 +213,13 @@ uint64_t ParseArgNumberULLEx(const char *arg, unsigned int defRadix) {
 	int radix = defRadix;
 	uint64_t val = 0;
 	
-	if (gFirmware != NULL && gFirmwareSize >= 0x200 && arg[0] == '$') {
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	if (buffer != NULL && size >= 0x200 && arg[0] == '$') {
 		//pseudo-variable expansion
 		arg++;
 		
-		FlashHeader *hdr = (FlashHeader *) gFirmware;
+		FlashHeader *hdr = (FlashHeader *) buffer;
 		uint32_t arm9StaticRomAddr = (hdr->arm9StaticRomAddr * 4) << hdr->arm9RomAddrScale;
 		uint32_t arm7StaticRomAddr = (hdr->arm7StaticRomAddr * 4) << hdr->arm7RomAddrScale;
 		uint32_t arm9SecondaryRomAddr = (hdr->arm9SecondaryRomAddr * 4) * 2;
@@ -155,3 +289,267 @@ uint64_t ParseArgNumberULL(const char *arg) {
 uint32_t ParseArgNumber(const char *arg) {
 	return (uint32_t) ParseArgNumberULL(arg);
 }
+
+char *JoinArgs(int argc, const char **argv) {
+	size_t len = 1;
+	for (int i = 0; i < argc; i++) len += strlen(argv[i]) + 1;
+	
+	char *str = malloc(len);
+	str[0] = '\0';
+	for (int i = 0; i < argc; i++) {
+		if (i > 0) strcat(str, " ");
+		strcat(str, argv[i]);
+	}
+	return str;
+}
+
+int ParseEffortArg(int argc, const char **argv, int i, CxEffort *effort) {
+	if ((i + 1) >= argc) return 0;
+	
+	if (strcmp(argv[i], "-p") == 0) {
+		effort->nPasses = (unsigned int) ParseArgNumberULLEx(argv[i + 1], 10);
+		return 2;
+	}
+	if (strcmp(argv[i], "-d") == 0) {
+		effort->deadline = ThGetTime() + strtod(argv[i + 1], NULL);
+		return 2;
+	}
+	return 0;
+}
+
+int EnumerateDirectory(const char *path, EnumerateFileCallback callback, void *arg) {
+	size_t pathLen = strlen(path);
+
+#ifdef _WIN32
+	char *pattern = malloc(pathLen + 3);
+	sprintf(pattern, "%s\\*", path);
+	
+	WIN32_FIND_DATAA fd;
+	HANDLE hFind = FindFirstFileA(pattern, &fd);
+	free(pattern);
+	if (hFind == INVALID_HANDLE_VALUE) return 0;
+	
+	do {
+		if (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+		
+		char *filePath = malloc(pathLen + 1 + strlen(fd.cFileName) + 1);
+		sprintf(filePath, "%s\\%s", path, fd.cFileName);
+		callback(filePath, arg);
+		free(filePath);
+	} while (FindNextFileA(hFind, &fd));
+	FindClose(hFind);
+#else
+	DIR *dir = opendir(path);
+	if (dir == NULL) return 0;
+	
+	struct dirent *ent;
+	while ((ent = readdir(dir)) != NULL) {
+		char *filePath = malloc(pathLen + 1 + strlen(ent->d_name) + 1);
+		sprintf(filePath, "%s/%s", path, ent->d_name);
+		
+		struct stat st;
+		if (stat(filePath, &st) == 0 && S_ISREG(st.st_mode)) callback(filePath, arg);
+		free(filePath);
+	}
+	closedir(dir);
+#endif
+	return 1;
+}
+
+struct FileLock_ {
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	int fd;
+#endif
+};
+
+FileLock *LockSharedFile(const char *path) {
+	char *lockPath = malloc(strlen(path) + 6);
+	if (lockPath == NULL) return NULL;
+	sprintf(lockPath, "%s.lock", path);
+	
+	FileLock *lock = malloc(sizeof(FileLock));
+	if (lock == NULL) {
+		free(lockPath);
+		return NULL;
+	}
+	
+#ifdef _WIN32
+	lock->handle = CreateFileA(lockPath, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	OVERLAPPED ov;
+	memset(&ov, 0, sizeof(ov));
+	if (lock->handle == INVALID_HANDLE_VALUE || !LockFileEx(lock->handle, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov)) {
+		if (lock->handle != INVALID_HANDLE_VALUE) CloseHandle(lock->handle);
+		free(lock);
+		lock = NULL;
+	}
+#else
+	struct flock fl;
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	
+	lock->fd = open(lockPath, O_RDWR | O_CREAT, 0644);
+	int locked = 0;
+	if (lock->fd >= 0) {
+		while (!(locked = fcntl(lock->fd, F_SETLKW, &fl) == 0) && errno == EINTR);
+	}
+	if (!locked) {
+		if (lock->fd >= 0) close(lock->fd);
+		free(lock);
+		lock = NULL;
+	}
+#endif
+	
+	free(lockPath);
+	return lock;
+}
+
+void UnlockSharedFile(FileLock *lock) {
+	if (lock == NULL) return;
+	
+	//closing the file releases the lock. The lock file is left in place: if it were removed, a process
+	//waiting on the old file and one creating a new file could both hold a lock.
+#ifdef _WIN32
+	CloseHandle(lock->handle);
+#else
+	close(lock->fd);
+#endif
+	free(lock);
+}
+
+int RenameOverFile(const char *from, const char *to) {
+#ifdef _WIN32
+	return MoveFileExA(from, to, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+	return rename(from, to) == 0;
+#endif
+}
+
+int WriteFileReplace(const char *path, const void *data, unsigned int size) {
+	char *tmpPath = malloc(strlen(path) + 5);
+	sprintf(tmpPath, "%s.tmp", path);
+	
+	FILE *fp = fopen(tmpPath, "wb");
+	if (fp == NULL) {
+		free(tmpPath);
+		return 0;
+	}
+	
+	int ok = fwrite(data, 1, size, fp) == size;
+	ok = fflush(fp) == 0 && ok;
+	fclose(fp);
+	
+	if (!ok || !RenameOverFile(tmpPath, path)) {
+		remove(tmpPath);
+		ok = 0;
+	}
+	free(tmpPath);
+	return ok;
+}
+
+static void AddImagePath(const char *path, void *arg) {
+	ImagePathList *list = (ImagePathList *) arg;
+	list->paths = realloc(list->paths, (list->nPaths + 1) * sizeof(char *));
+	list->paths[list->nPaths] = malloc(strlen(path) + 1);
+	strcpy(list->paths[list->nPaths], path);
+	list->nPaths++;
+}
+
+void AddImagePaths(ImagePathList *list, const char *path) {
+	if (!EnumerateDirectory(path, AddImagePath, list)) AddImagePath(path, list);
+}
+
+void FreeImagePaths(ImagePathList *list) {
+	for (unsigned int i = 0; i < list->nPaths; i++) free(list->paths[i]);
+	free(list->paths);
+	list->paths = NULL;
+	list->nPaths = 0;
+}
+
+typedef struct ImagePath_ {
+	char *path;
+	char *fullPath;                         // absolute path, so that one file reached two ways compares equal
+} ImagePath;
+
+static int CompareImagePaths(const void *a, const void *b) {
+	return strcmp(((const ImagePath *) a)->fullPath, ((const ImagePath *) b)->fullPath);
+}
+
+static const char *GetImageFileName(const char *path) {
+	const char *name = path;
+	for (const char *p = path; *p; p++) {
+		if (*p == '/' || *p == '\\') name = p + 1;
+	}
+	return name;
+}
+
+static int CompareImageNames(const void *a, const void *b) {
+	return strcmp(GetImageFileName(*(const char *const *) a), GetImageFileName(*(const char *const *) b));
+}
+
+int SortImagePaths(ImagePathList *list, const char *outDir) {
+	ImagePath *paths = malloc((list->nPaths + 1) * sizeof(ImagePath));
+	for (unsigned int i = 0; i < list->nPaths; i++) {
+		paths[i].path = list->paths[i];
+#ifdef _WIN32
+		paths[i].fullPath = _fullpath(NULL, list->paths[i], 0);
+#else
+		paths[i].fullPath = realpath(list->paths[i], NULL);
+#endif
+		//a file that does not exist is only reported later, under the path it was given
+		if (paths[i].fullPath == NULL) {
+			paths[i].fullPath = malloc(strlen(list->paths[i]) + 1);
+			strcpy(paths[i].fullPath, list->paths[i]);
+		}
+	}
+	
+	//directory listings are unordered; sorting keeps the order the same every time
+	qsort(paths, list->nPaths, sizeof(ImagePath), CompareImagePaths);
+	unsigned int nPaths = 0;
+	for (unsigned int i = 0; i < list->nPaths; i++) {
+		if (nPaths > 0 && strcmp(paths[i].fullPath, paths[nPaths - 1].fullPath) == 0) {
+			free(paths[i].path);
+			free(paths[i].fullPath);
+			continue;
+		}
+		paths[nPaths++] = paths[i];
+	}
+	
+	list->nPaths = nPaths;
+	for (unsigned int i = 0; i < nPaths; i++) {
+		list->paths[i] = paths[i].path;
+		free(paths[i].fullPath);
+	}
+	free(paths);
+	if (outDir == NULL) return 1;
+	
+	//each image is written to the output directory under its file name
+	char **sorted = malloc((nPaths + 1) * sizeof(char *));
+	memcpy(sorted, list->paths, nPaths * sizeof(char *));
+	qsort(sorted, nPaths, sizeof(char *), CompareImageNames);
+	
+	int ok = 1;
+	for (unsigned int i = 1; i < nPaths && ok; i++) {
+		if (CompareImageNames(&sorted[i - 1], &sorted[i]) != 0) continue;
+		
+		printf("'%s' and '%s' would both be written to '%s/%s'.\n", sorted[i - 1], sorted[i], outDir, GetImageFileName(sorted[i]));
+		ok = 0;
+	}
+	free(sorted);
+	return ok;
+}
+
+char *GetImageOutputPath(const char *path, const char *outDir) {
+	if (outDir == NULL) {
+		char *copy = malloc(strlen(path) + 1);
+		strcpy(copy, path);
+		return copy;
+	}
+	
+	const char *name = GetImageFileName(path);
+	char *outPath = malloc(strlen(outDir) + 1 + strlen(name) + 1);
+	sprintf(outPath, "%s/%s", outDir, name);
+	return outPath;
+}
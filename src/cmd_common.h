@@ -4,6 +4,11 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+//
+// Get the library context of the currently open firmware image, or NULL if none is open.
+//
+struct FwContext_ *GetFirmwareContext(void);
+
 //
 // Get the current open file path.
 //
@@ -14,11 +19,41 @@ const char *GetCurrentFilePath(void);
 //
 unsigned char *GetFirmwareImage(unsigned int *pSize);
 
+//
+// Get the RAM view of the currently open firmware image. The view is rebuilt only when the image has
+// changed since it was last built.
+//
+const struct FirmwareRamView_ *GetFirmwareRamView(void);
+
+//
+// Record the changes made to the firmware image since the last commit as one undoable edit.
+//
+void CommitFirmwareImage(const char *label);
+
 //
 // Load a firmware image from a file path.
 //
 int LoadFirmwareImage(const char *path);
 
+//
+// Make an image loaded earlier the current one, with its undo journal. Returns 0 if no image from the
+// path is open. A NULL path leaves no image current.
+//
+int SelectFirmwareImage(const char *path);
+
+//
+// Set how many images are kept open. When an image is loaded or selected, the current image is kept open
+// unless the limit is 1. When the limit is reached, loading another image closes the least recently used
+// one that has no unsaved changes or background jobs, and fails if there is none.
+//
+void SetOpenImageLimit(unsigned int limit);
+
+//
+// Make a context current without changing the set of open images, and return the previous one, so that
+// a context can be worked on and the previous one restored.
+//
+struct FwContext_ *ExchangeFirmwareContext(struct FwContext_ *ctx);
+
 //
 // Returns 1 if a firmware image is open, 0 otherwise.
 //
@@ -41,6 +76,121 @@ uint32_t ParseArgNumber(const char *arg);
 uint64_t ParseArgNumberULL(const char *arg);
 uint64_t ParseArgNumberULLEx(const char *arg, unsigned int defRadix);
 
+//
+// Join arguments with spaces into a newly allocated string.
+//
+char *JoinArgs(int argc, const char **argv);
+
+//
+// Parse an effort flag of a command that compresses modules: -p <passes> sets the ASH refinement passes
+// and -d <seconds> sets a deadline from now. Returns the number of arguments used, or 0 if argv[i] is
+// not an effort flag.
+//
+struct CxEffort_;
+int ParseEffortArg(int argc, const char **argv, int i, struct CxEffort_ *effort);
+
+//
+// Call a function for each file in a directory. Returns 0 if the path is not a directory.
+//
+typedef void (*EnumerateFileCallback)(const char *path, void *arg);
+int EnumerateDirectory(const char *path, EnumerateFileCallback callback, void *arg);
+
+//
+// Take an exclusive lock on a file shared between processes, kept in a lock file next to it, waiting
+// for other holders to release it. The lock is released when freed or when the process exits. Returns
+// NULL if the lock file could not be created.
+//
+typedef struct FileLock_ FileLock;
+FileLock *LockSharedFile(const char *path);
+void UnlockSharedFile(FileLock *lock);
+
+//
+// Rename a file over another one, replacing it in one step so that the destination always exists.
+//
+int RenameOverFile(const char *from, const char *to);
+
+//
+// Write a file by writing a temporary file next to it and renaming it over the file, so that an
+// interrupted write leaves the old file intact. Returns 0 on failure.
+//
+int WriteFileReplace(const char *path, const void *data, unsigned int size);
+
+//
+// Image files given to a command that works on many images, as files or as directories of files.
+//
+typedef struct ImagePathList_ {
+	char **paths;
+	unsigned int nPaths;
+} ImagePathList;
+
+void AddImagePaths(ImagePathList *list, const char *path);
+void FreeImagePaths(ImagePathList *list);
+
+//
+// Sort the paths and keep each file once, even when it was given both directly and through its
+// directory. With an output directory, images are written there under their file names, so two
+// images with the same file name are reported and 0 returned.
+//
+int SortImagePaths(ImagePathList *list, const char *outDir);
+
+//
+// Path an image is written to: the image itself, or its file name in the output directory. Free the
+// result with free.
+//
+char *GetImageOutputPath(const char *path, const char *outDir);
+
+
+// ----- background jobs
+
+typedef struct Job_ Job;
+
+//
+// Work of a job, run on a worker thread. It must not use the firmware image; what it needs from the
+// image is copied into its argument before the job starts. job is NULL when the work is run directly.
+//
+typedef void (*JobWorkProc)(Job *job, void *arg);
+
+//
+// Completion of a job, called on the command thread. apply is nonzero if the job was not cancelled and the
+// image is unchanged since it started, in which case the result may be applied to the image. The
+// argument should be freed either way.
+//
+typedef void (*JobFinishProc)(Job *job, void *arg, int apply);
+
+//
+// Start a job on a worker thread. When the work is done, the job is finished before the next command.
+//
+Job *StartJob(const char *label, JobWorkProc work, JobFinishProc finish, void *arg);
+
+//
+// Describe the part of the work in progress, and get the progress and cancellation state for the job's
+// compression. These accept a NULL job.
+//
+void SetJobStage(Job *job, const char *stage);
+struct CxProgress_ *GetJobProgress(Job *job);
+int IsJobCancelled(Job *job);
+
+//
+// Finish the jobs whose work is done, or wait for all jobs to finish, cancelling them first if cancel is
+// nonzero.
+//
+void PollJobs(void);
+void WaitJobs(int cancel);
+
+//
+// Set the client the following commands are run for. Jobs are finished before that client's next
+// command, and jobs, cancel and wait only see the client's own jobs. The command line is client 0.
+//
+void SetJobClient(unsigned int client);
+
+//
+// Cancel and finish the jobs started by a client, or on an image, for example before the image is
+// closed. Check whether an image has jobs.
+//
+void CancelClientJobs(unsigned int client);
+void CancelImageJobs(const struct FwContext_ *ctx);
+int HasImageJobs(const struct FwContext_ *ctx);
+
 
 // ----- command procs
 
@@ -51,17 +201,42 @@ void CmdProcVerify(int argc, const char **argv);
 void CmdProcMap(int argc, const char **argv);
 void CmdProcLoad(int argc, const char **argv);
 void CmdProcSave(int argc, const char **argv);
+void CmdProcUse(int argc, const char **argv);
 void CmdProcClean(int argc, const char **argv);
 void CmdProcRestore(int argc, const char **argv);
 void CmdProcExport(int argc, const char **argv);
 void CmdProcImport(int argc, const char **argv);
+void CmdProcBatchImport(int argc, const char **argv);
+void CmdProcProvision(int argc, const char **argv);
 void CmdProcLoc(int argc, const char **argv);
+void CmdProcSymbolize(int argc, const char **argv);
+void CmdProcFind(int argc, const char **argv);
+void CmdProcXref(int argc, const char **argv);
 void CmdProcEB(int argc, const char **argv);
 void CmdProcDB(int argc, const char **argv);
+void CmdProcWR(int argc, const char **argv);
 void CmdProcMD5(int argc, const char **argv);
 void CmdProcUser(int argc, const char **argv);
 void CmdProxFix(int argc, const char **argv);
 void CmdProcCompact(int argc, const char **argv);
+void CmdProcDefrag(int argc, const char **argv);
+void CmdProcProbe(int argc, const char **argv);
+void CmdProcArchive(int argc, const char **argv);
+void CmdProcUnpack(int argc, const char **argv);
+void CmdProcPack(int argc, const char **argv);
+void CmdProcIdentify(int argc, const char **argv);
+void CmdProcDiff(int argc, const char **argv);
+void CmdProcMkPatch(int argc, const char **argv);
+void CmdProcApplyPatch(int argc, const char **argv);
+void CmdProcApplyIps(int argc, const char **argv);
+void CmdProcApplyBps(int argc, const char **argv);
+void CmdProcUndo(int argc, const char **argv);
+void CmdProcRedo(int argc, const char **argv);
+void CmdProcSnapshot(int argc, const char **argv);
+void CmdProcRevert(int argc, const char **argv);
+void CmdProcJobs(int argc, const char **argv);
+void CmdProcCancel(int argc, const char **argv);
+void CmdProcWait(int argc, const char **argv);
 void CmdProcQuit(int argc, const char **argv);
 
 
@@ -73,16 +248,41 @@ void CmdHelpVerify(void);
 void CmdHelpMap(void);
 void CmdHelpLoad(void);
 void CmdHelpSave(void);
+void CmdHelpUse(void);
 void CmdHelpClean(void);
 void CmdHelpRestore(void);
 void CmdHelpExport(void);
 void CmdHelpImport(void);
+void CmdHelpBatchImport(void);
+void CmdHelpProvision(void);
 void CmdHelpLoc(void);
+void CmdHelpSymbolize(void);
+void CmdHelpFind(void);
+void CmdHelpXref(void);
 void CmdHelpEB(void);
 void CmdHelpDB(void);
+void CmdHelpWR(void);
 void CmdHelpMD5(void);
 void CmdHelpUser(void);
 void CmdHelpFix(void);
 void CmdHelpCompact(void);
+void CmdHelpDefrag(void);
+void CmdHelpProbe(void);
+void CmdHelpArchive(void);
+void CmdHelpUnpack(void);
+void CmdHelpPack(void);
+void CmdHelpIdentify(void);
+void CmdHelpDiff(void);
+void CmdHelpMkPatch(void);
+void CmdHelpApplyPatch(void);
+void CmdHelpApplyIps(void);
+void CmdHelpApplyBps(void);
+void CmdHelpUndo(void);
+void CmdHelpRedo(void);
+void CmdHelpSnapshot(void);
+void CmdHelpRevert(void);
+void CmdHelpJobs(void);
+void CmdHelpCancel(void);
+void CmdHelpWait(void);
 void CmdHelpQuit(void);
 
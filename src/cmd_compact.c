@@ -1,121 +1,162 @@
 #include "cmd_common.h"
 #include "firmware.h"
-#include "blowfish.h"
+#include "libfwutil.h"
 
 #include <string.h>
 
 void CmdHelpCompact(void) {
 	puts("");
-	puts("Usage: compact");
+	puts("Usage: compact [flags...]");
 	puts("");
 	puts("Recompresses each of the firmware's modules. Recompressing the modules may free");
 	puts("up space to be used for larger data.");
+	puts("");
+	puts("Flags:");
+	puts("  -b     Run in the background. See the jobs command.");
+	puts("  -d     Stop compressing after a number of seconds, keeping the best result.");
+	puts("         Modules compressed after the time is up are compressed quickly.");
+	puts("  -p     Number of ASH refinement passes (default 2). More passes may compress");
+	puts("         better but take longer.");
+}
+
+void CmdHelpDefrag(void) {
+	puts("");
+	puts("Usage: defrag");
+	puts("");
+	puts("Moves the firmware's modules together at the start of the image without");
+	puts("recompressing them, so that all free space is left after the last module. The");
+	puts("compressed and encrypted module data is moved as-is, so the module CRCs do not");
+	puts("change. Use compact to also recompress the modules.");
+}
+
+static const char *const sCompactModuleNames[] = { "ARM9 static   ", "ARM7 static   ", "ARM9 secondary", "ARM7 secondary", "Resources     " };
+
+static void CompactWork(Job *job, void *arg) {
+	FwCompact *compact = (FwCompact *) arg;
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (IsJobCancelled(job)) return;
+		SetJobStage(job, sCompactModuleNames[i]);
+		
+		if (FwRunCompactModule(compact, i, GetJobProgress(job)) != FW_OK) return;
+	}
+}
+
+static void CompactFinish(Job *job, void *arg, int apply) {
+	(void) job;
+	FwCompact *compact = (FwCompact *) arg;
+	
+	if (apply) {
+		FwCompactResult result;
+		FwStatus status = FwApplyCompact(GetFirmwareContext(), compact, &result);
+		if (status == FW_OK || status == FW_ERR_NO_SPACE) {
+			unsigned int size1 = 0, size2 = 0;
+			for (int i = 0; i < FW_MODULE_COUNT; i++) {
+				printf("%s: %08X -> %08X\n", sCompactModuleNames[i], result.oldSizes[i], result.newSizes[i]);
+				size1 += result.oldSizes[i];
+				size2 += result.newSizes[i];
+			}
+			puts("");
+			printf("Total saved: %08X\n", size1 - size2);
+		}
+		
+		if (status == FW_ERR_NO_SPACE) puts("The recompressed modules do not fit in the image.");
+		else if (status != FW_OK) puts("The modules could not be compressed.");
+	}
+	
+	FwFreeCompact(compact);
 }
 
 void CmdProcCompact(int argc, const char **argv) {
 	//compact the firmware. We do this by recompressing the binaries and relocating
-	//them to save as much space as possible. We will use the lower granularity
-	//wherever appropriate to move all unused space to the end.
-	(void) argc;
-	(void) argv;
-	
-	unsigned int size;
-	unsigned char *buffer = GetFirmwareImage(&size);
-	
-	//flash header
-	FlashHeader *hdr = (FlashHeader *) buffer;
-	
-	uint32_t arm9SecondaryRomAddr, arm9SecondarySize, arm9SecondaryRamAddr, arm9SecondaryUncompressed;
-	uint32_t arm7SecondaryRomAddr, arm7SecondarySize, arm7SecondaryRamAddr, arm7SecondaryUncompressed;
-	uint32_t    arm9StaticRomAddr,    arm9StaticSize,    arm9StaticRamAddr,    arm9StaticUncompressed;
-	uint32_t    arm7StaticRomAddr,    arm7StaticSize,    arm7StaticRamAddr,    arm7StaticUncompressed;
-	uint32_t          rsrcRomAddr,          rsrcSize,          rsrcRamAddr,          rsrcUncompressed;
-	
-	//unpack firmware and data headers
-	CxCompressionType type9, type7, typeRsrc;
-	unsigned char *arm9Static = GetArm9StaticInfo(buffer, size, &arm9StaticRomAddr, &arm9StaticRamAddr, &arm9StaticSize, &arm9StaticUncompressed);
-	unsigned char *arm7Static = GetArm7StaticInfo(buffer, size, &arm7StaticRomAddr, &arm7StaticRamAddr, &arm7StaticSize, &arm7StaticUncompressed);
-	unsigned char *arm9Secondary = GetArm9SecondaryInfo(buffer, size, &arm9SecondaryRomAddr, &arm9SecondaryRamAddr, &arm9SecondarySize, &arm9SecondaryUncompressed, &type9);
-	unsigned char *arm7Secondary = GetArm7SecondaryInfo(buffer, size, &arm7SecondaryRomAddr, &arm7SecondaryRamAddr, &arm7SecondarySize, &arm7SecondaryUncompressed, &type7);
-	unsigned char *rsrc = GetResourcesPackInfo(buffer, size, &rsrcRomAddr, &rsrcRamAddr, &rsrcSize, &rsrcUncompressed, &typeRsrc);
+	//them to save as much space as possible. The layout planner picks the module
+	//order and address granularity that leave the largest free region.
+	if (!RequireFirmwareImage()) return;
+	
+	int background = 0;
+	CxEffort effort = { CX_ASH_DEFAULT_PASSES, 0, 0.0, NULL };
+	for (int i = 1; i < argc; i++) {
+		int nUsed = ParseEffortArg(argc, argv, i, &effort);
+		if (nUsed > 0) {
+			i += nUsed - 1;
+		} else if (strcmp(argv[i], "-b") == 0) {
+			background = 1;
+		} else {
+			printf("Unrecognized flag %s.\n", argv[i]);
+		}
+	}
 	
-	if (arm9Static == NULL || arm7Static == NULL || arm9Secondary == NULL || arm7Secondary == NULL || rsrc == NULL) {
-		if (arm9Static    == NULL) printf("The ARM9 static module could not be decompressed.\n");
-		if (arm7Static    == NULL) printf("The ARM7 static module could not be decompressed.\n");
-		if (arm9Secondary == NULL) printf("The ARM9 secondary module could not be decompressed.\n");
-		if (arm7Secondary == NULL) printf("The ARM7 secondary module could not be decompressed.\n");
-		if (rsrc          == NULL) printf("The resources pack could not be decompressed.\n");
-		goto End;
+	FwCompact *compact;
+	FwStatus status = FwBeginCompact(GetFirmwareContext(), &effort, &compact);
+	if (status == FW_ERR_CORRUPT_MODULE) {
+		const char *const errors[] = {
+			"The ARM9 static module could not be decompressed.",
+			"The ARM7 static module could not be decompressed.",
+			"The ARM9 secondary module could not be decompressed.",
+			"The ARM7 secondary module could not be decompressed.",
+			"The resources pack could not be decompressed."
+		};
+		const FirmwareRamView *view = GetFirmwareRamView();
+		for (int i = 0; i < FW_MODULE_COUNT && view != NULL; i++) {
+			if (view->modules[i].data == NULL) puts(errors[i]);
+		}
+		return;
+	} else if (status != FW_OK) {
+		printf("The modules could not be compacted: %s.\n", FwGetStatusString(status));
+		return;
 	}
 	puts("");
 	
 	//recompress each module
+	if (background) {
+		char *label = JoinArgs(argc, argv);
+		StartJob(label, CompactWork, CompactFinish, compact);
+		free(label);
+	} else {
+		CompactWork(NULL, compact);
+		CompactFinish(NULL, compact, 1);
+	}
+}
+
+void CmdProcDefrag(int argc, const char **argv) {
+	(void) argc;
+	(void) argv;
 	
-	unsigned int arm9StaticRecompSize, arm7StaticRecompSize, arm9SecondaryRecompSize, arm7SecondaryRecompSize, rsrcRecompSize;
-	
-	unsigned char *arm9StaticRecomp = CxCompressLZ(arm9Static, arm9StaticUncompressed, &arm9StaticRecompSize);
-	arm9StaticRecomp = CxPadCompressed(arm9StaticRecomp, arm9StaticRecompSize, 8, &arm9StaticRecompSize);
-	printf("ARM9 static   : %08X -> %08X\n", arm9StaticSize, arm9StaticRecompSize);
-	
-	unsigned char *arm7StaticRecomp = CxCompressLZ(arm7Static, arm7StaticUncompressed, &arm7StaticRecompSize);
-	arm7StaticRecomp = CxPadCompressed(arm7StaticRecomp, arm7StaticRecompSize, 8, &arm7StaticRecompSize);
-	printf("ARM7 static   : %08X -> %08X\n", arm7StaticSize, arm7StaticRecompSize);
-	
-	unsigned char *arm9SecondaryRecomp = CxCompressAshFirmware(arm9Secondary, arm9SecondaryUncompressed, &arm9SecondaryRecompSize);
-	arm9SecondaryRecomp = CxPadCompressed(arm9SecondaryRecomp, arm9SecondaryRecompSize, 8, &arm9SecondaryRecompSize);
-	printf("ARM9 secondary: %08X -> %08X\n", arm9SecondarySize, arm9SecondaryRecompSize);
-	
-	unsigned char *arm7SecondaryRecomp = CxCompressAshFirmware(arm7Secondary, arm7SecondaryUncompressed, &arm7SecondaryRecompSize);
-	arm7SecondaryRecomp = CxPadCompressed(arm7SecondaryRecomp, arm7SecondaryRecompSize, 8, &arm7SecondaryRecompSize);
-	printf("ARM7 secondary: %08X -> %08X\n", arm7SecondarySize, arm7SecondaryRecompSize);
+	if (!RequireFirmwareImage()) return;
+	
+	FwDefragResult result;
+	switch (FwDefragment(GetFirmwareContext(), &result)) {
+		case FW_OK:
+			break;
+		case FW_ERR_INVALID_IMAGE:
+			puts("The firmware modules overlap and cannot be moved.");
+			return;
+		case FW_ERR_NO_SPACE:
+			puts("The firmware modules extend into the user configuration and cannot be moved.");
+			return;
+		default:
+			puts("The firmware modules could not be read.");
+			return;
+	}
 	
-	unsigned char *rsrcRecomp = CxCompressAshFirmware(rsrc, rsrcUncompressed, &rsrcRecompSize);
-	rsrcRecomp = CxPadCompressed(rsrcRecomp, rsrcRecompSize, 8, &rsrcRecompSize);
-	printf("Resources     : %08X -> %08X\n", rsrcSize, rsrcRecompSize);
+	//list modules by their old flash address
+	int order[FW_MODULE_COUNT];
+	for (int i = 0; i < FW_MODULE_COUNT; i++) order[i] = i;
+	for (int i = 1; i < FW_MODULE_COUNT; i++) {
+		for (int j = i; j > 0 && result.oldAddrs[order[j - 1]] > result.oldAddrs[order[j]]; j--) {
+			int t = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = t;
+		}
+	}
 	
-	unsigned int size1 = arm9StaticSize + arm7StaticSize + arm9SecondarySize + arm7SecondarySize + rsrcSize;
-	unsigned int size2 = arm9StaticRecompSize + arm7StaticRecompSize + arm9SecondaryRecompSize + arm7SecondaryRecompSize + rsrcRecompSize;
+	const char *const modnames[] = { "ARM9 static   ", "ARM7 static   ", "ARM9 secondary", "ARM7 secondary", "Resources     " };
 	puts("");
-	printf("Total saved: %08X\n", size1 - size2);
-	
-	//encrypt modules
-	BfEncrypt(arm9StaticRecomp, arm9StaticRecompSize, buffer);
-	BfEncrypt(arm7StaticRecomp, arm7StaticRecompSize, buffer);
-	
-	//place updated module 
-	unsigned int offs = 0x200;
-	memcpy(buffer + offs, arm9StaticRecomp, arm9StaticRecompSize);
-	hdr->arm9RomAddrScale = 1; // 8x
-	hdr->arm9StaticRomAddr = (offs / 8);
-	
-	offs += arm9StaticRecompSize;
-	memcpy(buffer + offs, arm7StaticRecomp, arm7StaticRecompSize);
-	hdr->arm7RomAddrScale = 1; // 8x
-	hdr->arm7StaticRomAddr = (offs / 8);
-	
-	offs += arm7StaticRecompSize;
-	memcpy(buffer + offs, arm9SecondaryRecomp, arm9SecondaryRecompSize);
-	hdr->arm9SecondaryRomAddr = (offs / 8);
-	
-	offs += arm9SecondaryRecompSize;
-	memcpy(buffer + offs, arm7SecondaryRecomp, arm7SecondaryRecompSize);
-	hdr->arm7SecondaryRomAddr = (offs / 8);
-	
-	offs += arm7SecondaryRecompSize;
-	memcpy(buffer + offs, rsrcRecomp, rsrcRecompSize);
-	hdr->resourceRomAddr = (offs / 8);
-	
-	
-	free(arm9StaticRecomp);
-	free(arm7StaticRecomp);
-	free(arm9SecondaryRecomp);
-	free(arm7SecondaryRecomp);
-	free(rsrcRecomp);
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		int mod = order[i];
+		printf("%s: %08X -> %08X (%08X bytes)\n", modnames[mod], result.oldAddrs[mod], result.newAddrs[mod], result.sizes[mod]);
+	}
 	
-End:
-	if (arm9Static    != NULL) free(arm9Static);
-	if (arm7Static    != NULL) free(arm7Static);
-	if (arm9Secondary != NULL) free(arm9Secondary);
-	if (arm7Secondary != NULL) free(arm7Secondary);
-	if (rsrc          != NULL) free(rsrc);
+	puts("");
+	printf("Free space after modules: %08X -> %08X\n", result.oldFree, result.newFree);
 }
@@ -0,0 +1,283 @@
+#include "cmd_common.h"
+#include "firmware.h"
+#include "delta.h"
+
+#include <string.h>
+#include <stddef.h>
+
+#define DIFF_MAX_HUNKS 32 // maximum number of changed regions listed per module
+
+typedef struct DiffField_ {
+	const char *name;
+	unsigned int offset;
+	unsigned int size;
+} DiffField;
+
+#define DIFF_FIELD(type,field) { #field, offsetof(type, field), sizeof(((type *) NULL)->field) }
+
+static const DiffField sHeaderFields[] = {
+	DIFF_FIELD(FlashHeader, arm9SecondaryRomAddr),
+	DIFF_FIELD(FlashHeader, arm7SecondaryRomAddr),
+	DIFF_FIELD(FlashHeader, secondaryCrc),
+	DIFF_FIELD(FlashHeader, staticCrc),
+	DIFF_FIELD(FlashHeader, blowfishKey),
+	DIFF_FIELD(FlashHeader, arm9StaticRomAddr),
+	DIFF_FIELD(FlashHeader, arm9StaticRamAddr),
+	DIFF_FIELD(FlashHeader, arm7StaticRomAddr),
+	DIFF_FIELD(FlashHeader, arm7StaticRamAddr),
+	{ "addrScale",  0x14, 2 },
+	DIFF_FIELD(FlashHeader, resourceRomAddr),
+	DIFF_FIELD(FlashHeader, timestamp),
+	DIFF_FIELD(FlashHeader, ipl2Type),
+	DIFF_FIELD(FlashHeader, pad1E),
+	DIFF_FIELD(FlashHeader, nvramUserConfigAddr),
+	DIFF_FIELD(FlashHeader, field22),
+	DIFF_FIELD(FlashHeader, field24),
+	DIFF_FIELD(FlashHeader, resourceCrc),
+	DIFF_FIELD(FlashHeader, field28),
+	{ NULL, 0, 0 }
+};
+
+//offsets relative to the start of the wireless table (0x2A)
+static const DiffField sWirelessFields[] = {
+	DIFF_FIELD(FlashRfBbInfo, crc),
+	DIFF_FIELD(FlashRfBbInfo, tableSize),
+	DIFF_FIELD(FlashRfBbInfo, vendor),
+	DIFF_FIELD(FlashRfBbInfo, module),
+	DIFF_FIELD(FlashRfBbInfo, serial),
+	DIFF_FIELD(FlashRfBbInfo, macAddr),
+	DIFF_FIELD(FlashRfBbInfo, allowedChannel),
+	DIFF_FIELD(FlashRfBbInfo, macFlags),
+	DIFF_FIELD(FlashRfBbInfo, rfType),
+	DIFF_FIELD(FlashRfBbInfo, rfRegisterBits),
+	DIFF_FIELD(FlashRfBbInfo, rfInitRegisterCount),
+	DIFF_FIELD(FlashRfBbInfo, rfChannelRegisterCount),
+	DIFF_FIELD(FlashRfBbInfo, macInitRegs),
+	DIFF_FIELD(FlashRfBbInfo, bbInitRegs),
+	{ "rfTables", sizeof(FlashRfBbInfo), 0x200 - 0x2A - sizeof(FlashRfBbInfo) },
+	{ NULL, 0, 0 }
+};
+
+static const DiffField sNcdFields[] = {
+	DIFF_FIELD(FlashUserConfigData, version),
+	DIFF_FIELD(FlashUserConfigData, favoriteColor),
+	DIFF_FIELD(FlashUserConfigData, birthday),
+	DIFF_FIELD(FlashUserConfigData, nickname),
+	DIFF_FIELD(FlashUserConfigData, nicknameLength),
+	DIFF_FIELD(FlashUserConfigData, comment),
+	DIFF_FIELD(FlashUserConfigData, commentLength),
+	DIFF_FIELD(FlashUserConfigData, alarmHour),
+	DIFF_FIELD(FlashUserConfigData, alarmMinute),
+	DIFF_FIELD(FlashUserConfigData, alarmSecond),
+	DIFF_FIELD(FlashUserConfigData, alarmEnableWeek),
+	{ "tpCalib",    0x58, 0x0C },
+	{ "option",     0x64, 2 },
+	DIFF_FIELD(FlashUserConfigData, timezone),
+	DIFF_FIELD(FlashUserConfigData, rtcClockAdjust),
+	DIFF_FIELD(FlashUserConfigData, rtcOffset),
+	DIFF_FIELD(FlashUserConfigData, saveCount),
+	DIFF_FIELD(FlashUserConfigData, crc),
+	DIFF_FIELD(FlashUserConfigData, exVersion),
+	DIFF_FIELD(FlashUserConfigData, exLanguage),
+	DIFF_FIELD(FlashUserConfigData, languages),
+	DIFF_FIELD(FlashUserConfigData, pad78),
+	DIFF_FIELD(FlashUserConfigData, exCrc),
+	{ NULL, 0, 0 }
+};
+
+static const char *const sModuleNames[] = {
+	"ARM9 Static", "ARM7 Static", "ARM9 Secondary", "ARM7 Secondary", "Resources Pack"
+};
+
+void CmdHelpDiff(void) {
+	puts("");
+	puts("Usage: diff <file name>");
+	puts("       diff <file name 1> <file name 2>");
+	puts("");
+	puts("Compares two firmware images. With one file, the current image is compared to");
+	puts("the file. Header, wireless table and user configuration fields are compared");
+	puts("directly. Modules are decompressed and their contents matched so that changed");
+	puts("regions are reported by RAM address, unaffected by the shifting of compressed");
+	puts("data.");
+}
+
+static void PrintFieldBytes(const unsigned char *p, unsigned int size) {
+	//multi-byte scalars are printed as numbers, other fields as bytes
+	if (size == 2) printf("%04X", p[0] | (p[1] << 8));
+	else if (size == 4) printf("%08X", p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24));
+	else {
+		for (unsigned int i = 0; i < size && i < 16; i++) printf("%02X", p[i]);
+		if (size > 16) printf("...");
+	}
+}
+
+static int DiffFields(const char *section, const DiffField *fields, const unsigned char *a, const unsigned char *b) {
+	int nDiffs = 0;
+	for (const DiffField *field = fields; field->name != NULL; field++) {
+		if (memcmp(a + field->offset, b + field->offset, field->size) == 0) continue;
+		
+		printf("  %-8s %-20s : ", section, field->name);
+		PrintFieldBytes(a + field->offset, field->size);
+		printf(" -> ");
+		PrintFieldBytes(b + field->offset, field->size);
+		puts("");
+		nDiffs++;
+	}
+	return nDiffs;
+}
+
+static void PrintHunk(uint32_t oldRam, uint32_t oldStart, uint32_t oldEnd, uint32_t newRam, uint32_t newStart, uint32_t newEnd) {
+	if (oldEnd > oldStart) printf("    %08X-%08X", oldRam + oldStart, oldRam + oldEnd - 1);
+	else printf("    %-17s", "(inserted)");
+	printf(" -> ");
+	if (newEnd > newStart) printf("%08X-%08X", newRam + newStart, newRam + newEnd - 1);
+	else printf("%-17s", "(deleted)");
+	printf("  (%X -> %X bytes)\n", oldEnd - oldStart, newEnd - newStart);
+}
+
+static int DiffModule(int index, const FirmwareModule *modA, const FirmwareModule *modB) {
+	if (modA->data == NULL || modB->data == NULL) {
+		if (modA->data != NULL || modB->data != NULL) {
+			printf("  %s: only one image's module could be decompressed.\n", sModuleNames[index]);
+			return 1;
+		}
+		return 0;
+	}
+	
+	if (modA->uncompressed == modB->uncompressed && memcmp(modA->data, modB->data, modA->uncompressed) == 0) {
+		if (modA->ramAddr != modB->ramAddr) {
+			printf("  %s: identical, load address %08X -> %08X.\n", sModuleNames[index], modA->ramAddr, modB->ramAddr);
+			return 1;
+		}
+		return 0;
+	}
+	
+	unsigned int nOps;
+	DlOp *ops = DlComputeDelta(modA->data, modA->uncompressed, modB->data, modB->uncompressed, &nOps);
+	
+	//each run of operations between two in-order copies is a changed region
+	unsigned int nHunks = 0, nCopied = 0;
+	uint32_t oldPos = 0, newPos = 0;
+	for (unsigned int i = 0; i <= nOps; i++) {
+		uint32_t oldNext = modA->uncompressed, newNext = modB->uncompressed;
+		if (i < nOps) {
+			if (ops[i].type != DL_OP_COPY) continue;
+			oldNext = ops[i].srcOffset;
+			newNext = ops[i].dstOffset;
+			nCopied += ops[i].length;
+		}
+		
+		//copies from earlier in the source (moved data) leave the old region empty
+		if (oldNext < oldPos) oldNext = oldPos;
+		if (oldNext > oldPos || newNext > newPos) {
+			if (nHunks == 0) {
+				printf("  %s: %X -> %X bytes, RAM %08X -> %08X\n", sModuleNames[index], modA->uncompressed, modB->uncompressed, modA->ramAddr, modB->ramAddr);
+			}
+			if (nHunks < DIFF_MAX_HUNKS) PrintHunk(modA->ramAddr, oldPos, oldNext, modB->ramAddr, newPos, newNext);
+			nHunks++;
+		}
+		
+		if (i < nOps) {
+			oldPos = ops[i].srcOffset + ops[i].length;
+			newPos = ops[i].dstOffset + ops[i].length;
+		}
+	}
+	if (nHunks > DIFF_MAX_HUNKS) printf("    ... %d more changed regions\n", nHunks - DIFF_MAX_HUNKS);
+	if (nHunks == 0) {
+		//all data matched, but out of order
+		printf("  %s: %X -> %X bytes, RAM %08X -> %08X, data reordered\n", sModuleNames[index], modA->uncompressed, modB->uncompressed, modA->ramAddr, modB->ramAddr);
+	}
+	printf("    %d%% of the new module matched the old module.\n", modB->uncompressed ? (int) ((uint64_t) nCopied * 100 / modB->uncompressed) : 100);
+	
+	free(ops);
+	return 1;
+}
+
+static void DiffImages(const unsigned char *bufA, unsigned int sizeA, const unsigned char *bufB, unsigned int sizeB) {
+	int nDiffs = 0;
+	const FlashHeader *hdrA = (const FlashHeader *) bufA;
+	const FlashHeader *hdrB = (const FlashHeader *) bufB;
+	
+	puts("");
+	if (sizeA != sizeB) {
+		printf("  Image size: %X -> %X bytes\n", sizeA, sizeB);
+		nDiffs++;
+	}
+	
+	nDiffs += DiffFields("Header", sHeaderFields, bufA, bufB);
+	nDiffs += DiffFields("Wireless", sWirelessFields, bufA + 0x2A, bufB + 0x2A);
+	
+	//both user configuration copies
+	uint32_t ncdA = hdrA->nvramUserConfigAddr * 8, ncdB = hdrB->nvramUserConfigAddr * 8;
+	if ((ncdA + 0x200) <= sizeA && (ncdB + 0x200) <= sizeB) {
+		nDiffs += DiffFields("NCD 0", sNcdFields, bufA + ncdA, bufB + ncdB);
+		nDiffs += DiffFields("NCD 1", sNcdFields, bufA + ncdA + 0x100, bufB + ncdB + 0x100);
+	}
+	
+	FirmwareModule modsA[FW_MODULE_COUNT], modsB[FW_MODULE_COUNT];
+	GetFirmwareModules(bufA, sizeA, modsA);
+	GetFirmwareModules(bufB, sizeB, modsB);
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		nDiffs += DiffModule(i, &modsA[i], &modsB[i]);
+	}
+	FreeFirmwareModules(modsA);
+	FreeFirmwareModules(modsB);
+	
+	if (nDiffs == 0) {
+		if (sizeA == sizeB && memcmp(bufA, bufB, sizeA) == 0) puts("Images are identical.");
+		else puts("No differences in fields or module contents (other bytes differ).");
+	}
+}
+
+static unsigned char *DiffLoadFile(const char *path, unsigned int *pSize) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Could not open file '%s' for read acces.\n", path);
+		return NULL;
+	}
+	
+	fseek(fp, 0, SEEK_END);
+	unsigned int size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	
+	unsigned char *buf = malloc(size);
+	unsigned int nRead = fread(buf, 1, size, fp);
+	fclose(fp);
+	
+	if (nRead != size || size < (4 * 1024)) {
+		printf("Invalid firmware image size (%d bytes).\n", size);
+		free(buf);
+		return NULL;
+	}
+	
+	*pSize = size;
+	return buf;
+}
+
+void CmdProcDiff(int argc, const char **argv) {
+	if (argc < 2) {
+		CmdHelpDiff();
+		return;
+	}
+	
+	unsigned char *bufA = NULL, *bufB = NULL;
+	unsigned int sizeA, sizeB;
+	if (argc >= 3) {
+		bufA = DiffLoadFile(argv[1], &sizeA);
+		if (bufA == NULL) return;
+		
+		bufB = DiffLoadFile(argv[2], &sizeB);
+		if (bufB != NULL) DiffImages(bufA, sizeA, bufB, sizeB);
+		free(bufA);
+	} else {
+		if (!RequireFirmwareImage()) return;
+		
+		bufB = DiffLoadFile(argv[1], &sizeB);
+		if (bufB == NULL) return;
+		
+		unsigned char *buffer = GetFirmwareImage(&sizeA);
+		DiffImages(buffer, sizeA, bufB, sizeB);
+	}
+	
+	if (bufB != NULL) free(bufB);
+}
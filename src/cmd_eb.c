@@ -1,5 +1,8 @@
 #include "cmd_common.h"
 #include "firmware.h"
+#include "libfwutil.h"
+
+#include <string.h>
 
 void CmdHelpEB(void) {
 	puts("");
@@ -18,40 +21,78 @@ void CmdProcEB(int argc, const char **argv) {
 		return;
 	}
 	
-	unsigned int size;
-	unsigned char *buffer = GetFirmwareImage(&size);
-	
 	uint32_t addr = ParseArgNumber(argv[1]);
-	if (addr >= size) {
-		printf("Address %08X is out of bounds.\n", addr);
-		return;
-	}
-	
-	int i;
-	for (i = 2; i < argc && addr < size; i++) {
-		uint8_t bval = ParseArgNumber(argv[i]);
-		buffer[addr++] = bval;
+	unsigned int nBytes = argc - 2;
+	unsigned char *bytes = malloc(nBytes + 1);
+	for (unsigned int i = 0; i < nBytes; i++) {
+		bytes[i] = ParseArgNumber(argv[i + 2]);
 	}
 	
-	if (i < argc) {
+	unsigned int nWritten;
+	if (FwWriteBytes(GetFirmwareContext(), addr, bytes, nBytes, &nWritten) != FW_OK) {
+		printf("Address %08X is out of bounds.\n", addr);
+	} else if (nWritten < nBytes) {
 		puts("");
-		printf("Write truncated to %d byte(s).\n", i - 2);
+		printf("Write truncated to %d byte(s).\n", nWritten);
 	}
+	free(bytes);
 }
 
 void CmdHelpDB(void) {
 	puts("");
-	puts("Usage: db <address> [size]");
+	puts("Usage: db [-r] <address> [size]");
 	puts("");
 	puts("Dumps the bytes at the specified address. If size is not specified, then up to");
 	puts("128 bytes are dumped. The address is interpreted in hexadecimal by default.");
 	puts("Prefix with '0n' to input decimal, or '0o' for octal. Hexadecimal values may");
 	puts("optionally be prefixed with '0x' or suffixed with 'h'.");
+	puts("");
+	puts("With -r, the address is a RAM address, and the decompressed bytes of the module");
+	puts("loaded there are dumped.");
+}
+
+static void DumpBytes(const unsigned char *base, uint32_t baseAddr, uint32_t addr, uint32_t nBytes) {
+	puts("");
+	printf("          |  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F | 0123456789ABCDEF \n");
+	printf("----------+-------------------------------------------------+------------------\n");
+	
+	uint32_t rowAddr = (addr & ~0xF);
+	uint32_t rowLast = (addr + nBytes - 1) & ~0xF;
+	while (rowAddr <= rowLast) {
+		printf(" %08X | ", rowAddr);
+		
+		for (unsigned int i = 0; i < 16; i++) {
+			uint32_t baddr = rowAddr + i;
+			if (baddr >= addr && baddr < (addr + nBytes)) printf("%02X ", base[baddr - baseAddr]);
+			else printf("   ");
+		}
+		
+		printf("| ");
+		for (unsigned int i = 0; i < 16; i++) {
+			uint32_t baddr = rowAddr + i;
+			if (baddr >= addr && baddr < (addr + nBytes)) {
+				unsigned char b = base[baddr - baseAddr];
+				if (b < 0x20 || b >= 0x7F) b = '.';
+				printf("%c", b);
+			}
+			else printf(" ");
+		}
+		
+		printf("\n");
+		
+		rowAddr += 0x10;
+	}
 }
 
 void CmdProcDB(int argc, const char **argv) {
 	if (!RequireFirmwareImage()) return;
 	
+	int ram = (argc >= 2 && strcmp(argv[1], "-r") == 0);
+	if (ram) {
+		argc--;
+		argv++;
+	}
+	
 	if (argc < 2) {
 		CmdHelpDB();
 		return;
@@ -61,6 +102,22 @@ void CmdProcDB(int argc, const char **argv) {
 	unsigned char *buffer = GetFirmwareImage(&size);
 	
 	uint32_t addr = ParseArgNumber(argv[1]);
+	uint32_t baseAddr = 0;
+	
+	if (ram) {
+		//dump from the decompressed module loaded at the address
+		const FirmwareRamView *view = GetFirmwareRamView();
+		int module;
+		if (FindFirmwareRamRegions(view, addr, &module, 1) == 0) {
+			printf("No module is loaded at address %08X.\n", addr);
+			return;
+		}
+		
+		const FirmwareModule *mod = &view->modules[module];
+		buffer = mod->data;
+		baseAddr = mod->ramAddr;
+		size = mod->ramAddr + mod->uncompressed;
+	}
 	
 	if (addr >= size) {
 		printf("Address %08X is out of bounds.\n", addr);
@@ -78,35 +135,70 @@ void CmdProcDB(int argc, const char **argv) {
 		printf("Dump truncated to %d bytes.\n", nBytes);
 	}
 	
+	DumpBytes(buffer, baseAddr, addr, nBytes);
+}
+
+void CmdHelpWR(void) {
 	puts("");
-	printf("          |  0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F | 0123456789ABCDEF \n");
-	printf("----------+-------------------------------------------------+------------------\n");
+	puts("Usage: wr <RAM address> <bytes...>");
+	puts("");
+	puts("Writes bytes into the module that is loaded at the specified RAM address. The");
+	puts("module is recompressed, re-encrypted and laid out again, and its CRC is updated.");
+	puts("LZ compressed modules are only re-encoded around the written bytes; ASH");
+	puts("compressed modules are recompressed entirely. Values are parsed as with eb.");
+}
+
+void CmdProcWR(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
 	
-	uint32_t rowAddr = (addr & ~0xF);
-	uint32_t rowLast = (addr + nBytes - 1) & ~0xF;
-	while (rowAddr <= rowLast) {
-		printf(" %08X | ", rowAddr);
-		
-		for (unsigned int i = 0; i < 16; i++) {
-			uint32_t baddr = rowAddr + i;
-			if (baddr >= addr && baddr < (addr + nBytes)) printf("%02X ", buffer[baddr]);
-			else printf("   ");
+	if (argc < 3) {
+		CmdHelpWR();
+		return;
+	}
+	
+	FwContext *ctx = GetFirmwareContext();
+	uint32_t addr = ParseArgNumber(argv[1]);
+	unsigned int nBytes = argc - 2;
+	unsigned char *bytes = malloc(nBytes);
+	for (unsigned int i = 0; i < nBytes; i++) {
+		bytes[i] = ParseArgNumber(argv[i + 2]);
+	}
+	
+	//report truncation and a slow recompression up front, since the write does all of its work at once
+	FwInfo info;
+	if (FwGetInfo(ctx, &info) == FW_OK) {
+		int modno = -1, valid = 1;
+		for (int i = 0; i < FW_MODULE_COUNT; i++) {
+			const FwModuleInfo *mod = &info.modules[i];
+			valid = valid && mod->valid;
+			if (mod->ramAddr && addr >= mod->ramAddr && addr < (mod->ramAddr + mod->uncompressed)) modno = i;
 		}
 		
-		printf("| ");
-		for (unsigned int i = 0; i < 16; i++) {
-			uint32_t baddr = rowAddr + i;
-			if (baddr >= addr && baddr < (addr + nBytes)) {
-				unsigned char b = buffer[baddr];
-				if (b < 0x20 || b >= 0x7F) b = '.';
-				printf("%c", b);
+		if (valid && modno != -1) {
+			const FwModuleInfo *mod = &info.modules[modno];
+			if (nBytes > (mod->ramAddr + mod->uncompressed - addr)) {
+				printf("Write truncated to %d byte(s).\n", mod->ramAddr + mod->uncompressed - addr);
 			}
-			else printf(" ");
+			if (mod->type == CX_COMPRESSION_ASH) printf("Compressing...\n");
 		}
-		
-		printf("\n");
-		
-		rowAddr += 0x10;
+	}
+	
+	FwWriteRamResult result;
+	FwStatus status = FwWriteRam(ctx, addr, bytes, nBytes, &result);
+	free(bytes);
+	
+	switch (status) {
+		case FW_OK:
+			printf("Wrote %d byte(s) at module offset 0x%X, compressed size %08X -> %08X.\n", result.nWritten, result.offset, result.oldSize, result.newSize);
+			break;
+		case FW_ERR_NOT_FOUND:
+			printf("No module is loaded at address %08X.\n", addr);
+			break;
+		case FW_ERR_NO_SPACE:
+			puts("The module does not fit in the image.");
+			break;
+		default:
+			puts("The firmware modules could not be decompressed.");
+			break;
 	}
 }
-
@@ -1,7 +1,8 @@
 #include "cmd_common.h"
 #include "firmware.h"
-#include "blowfish.h"
+#include "libfwutil.h"
 #include "compression.h"
+#include "thread.h"
 
 #include <string.h>
 
@@ -21,6 +22,14 @@ void CmdHelpExport(void) {
 	puts("  -c     Do not decompress the module");
 }
 
+static int ParseModuleName(const char *modname) {
+	const char *const modnames[] = { "arm9", "arm7", "arm9s", "arm7s", "rsrc" };
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (strcmp(modname, modnames[i]) == 0) return i;
+	}
+	return -1;
+}
+
 void CmdProcExport(int argc, const char **argv) {
 	if (!RequireFirmwareImage()) return;
 	
@@ -44,100 +53,19 @@ void CmdProcExport(int argc, const char **argv) {
 		}
 	}
 	
-	unsigned char *result = NULL;
-	unsigned int resultSize = 0;
-	
-	unsigned int size;
-	unsigned char *buffer = GetFirmwareImage(&size);
-	
-	//decompress module
-	CxCompressionType type9, type7, typeRsrc;
-	if (strcmp(modname, "arm9") == 0) {
-		uint32_t arm9StaticRomAddr, arm9StaticSize, arm9StaticRamAddr, arm9StaticUncompressed;
-		unsigned char *arm9Static = GetArm9StaticInfo(buffer, size, &arm9StaticRomAddr, &arm9StaticRamAddr, &arm9StaticSize, &arm9StaticUncompressed);
-		
-		if (decompress) {
-			result = arm9Static;
-			resultSize = arm9StaticUncompressed;
-		} else {
-			free(arm9Static);
-			resultSize = arm9StaticSize;
-			result = malloc(resultSize);
-			memcpy(result, buffer + arm9StaticRomAddr, resultSize);
-			
-			if (decrypt) {
-				//decrypt
-				BfDecrypt(result, resultSize, buffer);
-			}
-		}
-	} else if (strcmp(modname, "arm7") == 0) {
-		uint32_t arm7StaticRomAddr, arm7StaticSize, arm7StaticRamAddr, arm7StaticUncompressed;
-		unsigned char *arm7Static = GetArm7StaticInfo(buffer, size, &arm7StaticRomAddr, &arm7StaticRamAddr, &arm7StaticSize, &arm7StaticUncompressed);
-		
-		if (decompress) {
-			result = arm7Static;
-			resultSize = arm7StaticUncompressed;
-		} else {
-			free(arm7Static);
-			resultSize = arm7StaticSize;
-			result = malloc(resultSize);
-			memcpy(result, buffer + arm7StaticRomAddr, resultSize);
-			
-			if (decrypt) {
-				//decrypt
-				BfDecrypt(result, resultSize, buffer);
-			}
-		}
-	} else if (strcmp(modname, "arm9s") == 0) {
-		uint32_t arm9SecondaryRomAddr, arm9SecondarySize, arm9SecondaryRamAddr, arm9SecondaryUncompressed;
-		unsigned char *arm9Secondary = GetArm9SecondaryInfo(buffer, size, &arm9SecondaryRomAddr, &arm9SecondaryRamAddr, &arm9SecondarySize, &arm9SecondaryUncompressed, &type9);
-		
-		if (decompress) {
-			//write decompressed
-			result = arm9Secondary;
-			resultSize = arm9SecondaryUncompressed;
-		} else {
-			//copy compressed
-			free(arm9Secondary);
-			resultSize = arm9SecondarySize;
-			result = malloc(resultSize);
-			memcpy(result, buffer + arm9SecondaryRomAddr, resultSize);
-		}
-	} else if (strcmp(modname, "arm7s") == 0) {
-		uint32_t arm7SecondaryRomAddr, arm7SecondarySize, arm7SecondaryRamAddr, arm7SecondaryUncompressed;
-		unsigned char *arm7Secondary = GetArm7SecondaryInfo(buffer, size, &arm7SecondaryRomAddr, &arm7SecondaryRamAddr, &arm7SecondarySize, &arm7SecondaryUncompressed, &type7);
-		
-		if (decompress) {
-			//write decompressed
-			result = arm7Secondary;
-			resultSize = arm7SecondaryUncompressed;
-		} else {
-			//copy compressed
-			free(arm7Secondary);
-			resultSize = arm7SecondarySize;
-			result = malloc(resultSize);
-			memcpy(result, buffer + arm7SecondaryRomAddr, resultSize);
-		}
-	} else if (strcmp(modname, "rsrc") == 0) {
-		uint32_t rsrcRomAddr, rsrcSize, rsrcRamAddr, rsrcUncompressed;
-		unsigned char *rsrc = GetResourcesPackInfo(buffer, size, &rsrcRomAddr, &rsrcRamAddr, &rsrcSize, &rsrcUncompressed, &typeRsrc);
-		
-		if (decompress) {
-			//write decompressed
-			result = rsrc;
-			resultSize = rsrcUncompressed;
-		} else {
-			//copy compressed
-			free(rsrc);
-			resultSize = rsrcSize;
-			result = malloc(resultSize);
-			memcpy(result, buffer + rsrcRomAddr, resultSize);
-		}
-	} else {
+	int modno = ParseModuleName(modname);
+	if (modno < 0) {
 		printf("Unknown module name '%s'.\n", modname);
 		return;
 	}
 	
+	//the static modules are stored encrypted, the others are only compressed
+	int form = decompress ? FW_FORM_UNCOMPRESSED : (decrypt ? FW_FORM_COMPRESSED : FW_FORM_STORED);
+	
+	unsigned char *result;
+	unsigned int resultSize;
+	FwExportModule(GetFirmwareContext(), modno, form, &result, &resultSize);
+	
 	if (result == NULL) {
 		puts("Could not extract module.");
 		return;
@@ -146,14 +74,14 @@ void CmdProcExport(int argc, const char **argv) {
 	FILE *fp = fopen(filename, "wb");
 	if (fp == NULL) {
 		printf("Could not open '%s' for write access.\n", filename);
-		free(result);
+		FwFreeData(GetFirmwareContext(), result);
 		return;
 	}
 	
 	fwrite(result, resultSize, 1, fp);
 	fclose(fp);
 	
-	free(result);
+	FwFreeData(GetFirmwareContext(), result);
 }
 
 void CmdHelpImport(void) {
@@ -174,6 +102,36 @@ void CmdHelpImport(void) {
 	puts("Flags:");
 	puts("  -c     Imported module is compressed.");
 	puts("  -e     Imported module is compressed and encrypted.");
+	puts("  -b     Compress in the background. See the jobs command.");
+	puts("  -f     Stop compressing as soon as the module fits in the image.");
+	puts("  -d     Stop compressing after a number of seconds, keeping the best result.");
+	puts("  -p     Number of ASH refinement passes (default 2). More passes may compress");
+	puts("         better but take longer.");
+}
+
+static void ImportWork(Job *job, void *arg) {
+	FwImport *import = (FwImport *) arg;
+	SetJobStage(job, "compressing");
+	
+	FwRunImport(import, GetJobProgress(job));
+}
+
+static void ImportFinish(Job *job, void *arg, int apply) {
+	(void) job;
+	FwImport *import = (FwImport *) arg;
+	
+	if (apply) {
+		FwStatus status = FwApplyImport(GetFirmwareContext(), import, NULL);
+		if (status == FW_ERR_NO_SPACE) {
+			printf("The module is too large.\n");
+		} else if (status == FW_ERR_CORRUPT_MODULE) {
+			printf("The module could not be decompressed.\n");
+		} else if (status != FW_OK) {
+			printf("The module could not be compressed.\n");
+		}
+	}
+	
+	FwFreeImport(import);
 }
 
 void CmdProcImport(int argc, const char **argv) {
@@ -184,27 +142,34 @@ void CmdProcImport(int argc, const char **argv) {
 		return;
 	}
 	
-	int decrypt = 1, decompress = 1;
+	int decrypt = 1, decompress = 1, fit = 0, background = 0;
 	const char *modname = argv[1];
 	const char *filename = argv[2];
+	CxEffort effort = { CX_ASH_DEFAULT_PASSES, 0, 0.0, NULL };
 	
 	for (int i = 3; i < argc; i++) {
-		if (strcmp(argv[i], "-e") == 0) {
+		int nUsed = ParseEffortArg(argc, argv, i, &effort);
+		if (nUsed > 0) {
+			i += nUsed - 1;
+		} else if (strcmp(argv[i], "-e") == 0) {
 			decrypt = 0;
 			decompress = 0;
 		} else if (strcmp(argv[i], "-c") == 0) {
 			decompress = 0;
+		} else if (strcmp(argv[i], "-f") == 0) {
+			fit = 1;
+		} else if (strcmp(argv[i], "-b") == 0) {
+			background = 1;
 		} else {
 			printf("Unrecognized flag %s.\n", argv[i]);
 		}
 	}
 	
-	unsigned int size;
-	unsigned char *buffer = GetFirmwareImage(&size);
-	
-	
-	//flash header
-	FlashHeader *hdr = (FlashHeader *) buffer;
+	int modno = ParseModuleName(modname);
+	if (modno < 0) {
+		printf("Unknown module name '%s'.\n", modname);
+		return;
+	}
 	
 	FILE *fp = fopen(filename, "rb");
 	if (fp == NULL) {
@@ -212,175 +177,251 @@ void CmdProcImport(int argc, const char **argv) {
 		return;
 	}
 	
-	unsigned int inSize, padSize;
-	unsigned char *inbuf;
 	fseek(fp, 0, SEEK_END);
-	inSize = ftell(fp);
+	unsigned int inSize = ftell(fp);
 	fseek(fp, 0, SEEK_SET);
 	
-	//calculate padded size
-	if (!decompress) {
-		//pad size: for compressed (regardless of encryption), pad to 8.
-		padSize = (inSize + 7) & ~7;
-	} else {
-		//else: no padding
-		padSize = inSize;
-	}
-	
-	inbuf = calloc(padSize, 1);
+	unsigned char *inbuf = calloc(inSize, 1);
 	fread(inbuf, inSize, 1, fp);
 	fclose(fp);
-	inSize = padSize;
-	
-	uint32_t arm9SecondaryRomAddr, arm9SecondarySize, arm9SecondaryRamAddr, arm9SecondaryUncompressed;
-	uint32_t arm7SecondaryRomAddr, arm7SecondarySize, arm7SecondaryRamAddr, arm7SecondaryUncompressed;
-	uint32_t    arm9StaticRomAddr,    arm9StaticSize,    arm9StaticRamAddr,    arm9StaticUncompressed;
-	uint32_t    arm7StaticRomAddr,    arm7StaticSize,    arm7StaticRamAddr,    arm7StaticUncompressed;
-	uint32_t          rsrcRomAddr,          rsrcSize,          rsrcRamAddr,          rsrcUncompressed;
-	
-	//unpack firmware and data headers
-	CxCompressionType type9, type7, typeRsrc;
-	unsigned char *arm9Static = GetArm9StaticInfo(buffer, size, &arm9StaticRomAddr, &arm9StaticRamAddr, &arm9StaticSize, &arm9StaticUncompressed);
-	unsigned char *arm7Static = GetArm7StaticInfo(buffer, size, &arm7StaticRomAddr, &arm7StaticRamAddr, &arm7StaticSize, &arm7StaticUncompressed);
-	unsigned char *arm9Secondary = GetArm9SecondaryInfo(buffer, size, &arm9SecondaryRomAddr, &arm9SecondaryRamAddr, &arm9SecondarySize, &arm9SecondaryUncompressed, &type9);
-	unsigned char *arm7Secondary = GetArm7SecondaryInfo(buffer, size, &arm7SecondaryRomAddr, &arm7SecondaryRamAddr, &arm7SecondarySize, &arm7SecondaryUncompressed, &type7);
-	unsigned char *rsrc = GetResourcesPackInfo(buffer, size, &rsrcRomAddr, &rsrcRamAddr, &rsrcSize, &rsrcUncompressed, &typeRsrc);
-	
-	//locate the load addresses for secondary modules and resources pack
-	GetSecondaryResourceLoadAddresses(arm9Static, arm9StaticUncompressed, arm7Static, arm7StaticUncompressed, &arm9SecondaryRamAddr, &arm7SecondaryRamAddr, &rsrcRamAddr);
-	
-	//can discard uncompressed binaries
-	if (arm9Static != NULL) free(arm9Static);
-	if (arm7Static != NULL) free(arm7Static);
-	if (arm9Secondary != NULL) free(arm9Secondary);
-	if (arm7Secondary != NULL) free(arm7Secondary);
-	if (rsrc != NULL) free(rsrc);
-	
-	//pull out compressed+encrypted modules
-	arm9Static = malloc(arm9StaticSize);
-	arm7Static = malloc(arm7StaticSize);
-	arm9Secondary = malloc(arm9SecondarySize);
-	arm7Secondary = malloc(arm7SecondarySize);
-	rsrc = malloc(rsrcSize);
-	
-	memcpy(arm9Static, buffer + arm9StaticRomAddr, arm9StaticSize);
-	memcpy(arm7Static, buffer + arm7StaticRomAddr, arm7StaticSize);
-	memcpy(arm9Secondary, buffer + arm9SecondaryRomAddr, arm9SecondarySize);
-	memcpy(arm7Secondary, buffer + arm7SecondaryRomAddr, arm7SecondarySize);
-	memcpy(rsrc, buffer + rsrcRomAddr, rsrcSize);
+	
+	//the library pads and encrypts compressed modules as they are stored
+	int form = decompress ? FW_FORM_UNCOMPRESSED : (decrypt ? FW_FORM_COMPRESSED : FW_FORM_STORED);
+	
+	FwImport *import;
+	FwStatus status = FwBeginImport(GetFirmwareContext(), modno, form, inbuf, inSize, &effort, fit ? FW_IMPORT_FIT : 0, &import);
+	free(inbuf);
+	if (status != FW_OK) {
+		printf("The module could not be imported: %s.\n", FwGetStatusString(status));
+		return;
+	}
+	
+	if (form == FW_FORM_UNCOMPRESSED) {
+		if (background) {
+			char *label = JoinArgs(argc, argv);
+			StartJob(label, ImportWork, ImportFinish, import);
+			free(label);
+			return;
+		}
+		
+		int isAsh = GetFirmwareRamView()->modules[modno].type == CX_COMPRESSION_ASH;
+		if (isAsh) printf("Compressing...\n");
+		ImportWork(NULL, import);
+		if (isAsh) printf("Done.\n");
+	}
+	
+	ImportFinish(NULL, import, 1);
+}
+
+
+void CmdHelpBatchImport(void) {
+	puts("");
+	puts("Usage: batchimport <module> <filename> <image...> [flags...]");
+	puts("");
+	puts("Imports the same module into many firmware image files. The module is");
+	puts("compressed once, then each image gets its own copy, encrypted with that image's");
+	puts("key for the static modules, laid out and checksummed. The images are processed");
+	puts("in parallel. An image argument may be a directory, in which case every file in");
+	puts("it is processed. Images are written back in place unless -o is given. The");
+	puts("compression type of a secondary module or resources pack is taken from the");
+	puts("first image, and images that use another type are skipped.");
+	puts("");
+	puts("Use one of the following for the module parameter:");
+	puts("  arm9   ARM9 Static module");
+	puts("  arm7   ARM7 static module");
+	puts("  arm9s  ARM9 Secondary module");
+	puts("  arm7s  ARM7 Secondary module");
+	puts("  rsrc   Resources pack");
+	puts("");
+	puts("Flags:");
+	puts("  -c     Imported module is compressed.");
+	puts("  -o     Directory to write the updated images to. The images must have");
+	puts("         different file names.");
+	puts("  -j     Number of threads to use (default one per processor).");
+}
+
+typedef struct BatchImportImage_ {
+	const char *path;
+	const char *status;                     // result, printed after all images are done
+} BatchImportImage;
+
+typedef struct BatchImportContext_ {
+	int modno;
+	CxCompressionType type;
+	const unsigned char *comp;              // compressed module, not encrypted
+	unsigned int compSize;
+	const char *outDir;
+	BatchImportImage *images;
+	unsigned int nImages;
+} BatchImportContext;
+
+static void BatchImportTask(unsigned int task, void *arg) {
+	BatchImportContext *ctx = (BatchImportContext *) arg;
+	BatchImportImage *image = &ctx->images[task];
+	
+	//each image is imported into in its own context, the same way import works on the open image
+	FwContext *fw = FwCreateContext(NULL);
+	if (fw == NULL) {
+		image->status = FwGetStatusString(FW_ERR_NO_MEMORY);
+		return;
+	}
+	FwStatus status = FwLoadFile(fw, image->path);
+	if (status != FW_OK) {
+		image->status = status == FW_ERR_INVALID_IMAGE ? "is not a valid firmware image" : "could not be read";
+		goto End;
+	}
+	
+	unsigned int size;
+	unsigned char *buffer = FwGetImage(fw, &size);
+	uint32_t romAddrs[FW_MODULE_COUNT], modSizes[FW_MODULE_COUNT];
+	if (!GetFirmwareModuleExtents(buffer, size, romAddrs, modSizes)) {
+		image->status = "is not a valid firmware image";
+		goto End;
+	}
+	
+	//the module was compressed for the first image's compression type
+	int isStatic = ctx->modno == FW_MODULE_ARM9_STATIC || ctx->modno == FW_MODULE_ARM7_STATIC;
+	CxCompressionType type = buffer[romAddrs[ctx->modno]] == 0x10 ? CX_COMPRESSION_LZ : CX_COMPRESSION_ASH;
+	if (!isStatic && type != ctx->type) {
+		image->status = "uses a different compression type, skipped";
+		goto End;
+	}
+	
+	//the layout is limited by the user configuration address of each image
+	status = FwImportModule(fw, ctx->modno, FW_FORM_COMPRESSED, ctx->comp, ctx->compSize, NULL, 0, NULL);
+	if (status == FW_ERR_NO_SPACE) {
+		image->status = "has no room for the module, skipped";
+		goto End;
+	} else if (status == FW_ERR_CORRUPT_MODULE) {
+		image->status = "has a module that could not be decompressed, skipped";
+		goto End;
+	} else if (status != FW_OK) {
+		image->status = FwGetStatusString(status);
+		goto End;
+	}
+	
+	//write the image
+	buffer = FwGetImage(fw, &size);
+	char *outPath = GetImageOutputPath(image->path, ctx->outDir);
+	image->status = WriteFileReplace(outPath, buffer, size) ? "updated" : "could not be written";
+	free(outPath);
+
+End:
+	FwFreeContext(fw);
+}
+
+void CmdProcBatchImport(int argc, const char **argv) {
+	if (argc < 4) {
+		CmdHelpBatchImport();
+		return;
+	}
+	
+	const char *modname = argv[1];
+	const char *filename = argv[2];
+	int decompress = 1;
+	int nThreads = ThGetProcessorCount();
+	
+	BatchImportContext ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ImagePathList paths = { 0 };
 	
 	//get module name
 	const char *const modnames[] = { "arm9", "arm7", "arm9s", "arm7s", "rsrc" };
-	int modno = -1;
+	ctx.modno = -1;
 	for (int i = 0; i < 5; i++) {
 		if (strcmp(modname, modnames[i]) == 0) {
-			modno = i;
+			ctx.modno = i;
 			break;
 		}
 	}
+	if (ctx.modno == -1) {
+		printf("Unknown module name '%s'.\n", modname);
+		return;
+	}
 	
-	uint32_t modSizes[]          = { arm9StaticSize, arm7StaticSize, arm9SecondarySize, arm7SecondarySize, rsrcSize };
-	unsigned char *mods[]        = { arm9Static,     arm7Static,     arm9Secondary,     arm7Secondary,     rsrc     };
-	CxCompressionType modComps[] = { CX_COMPRESSION_NONE, CX_COMPRESSION_NONE, type9, type7, typeRsrc };
-	
-	//replace module
-	{
-		free(mods[modno]);
-		modSizes[modno] = 0;
-		
-		if (decompress) {
-			//source file is uncompressed, unencrypted.
-			if (modno == 0 || modno == 1) {
-				//ARM9 or ARM7 static: must be LZ compressed, then encrypted
-				unsigned int compSize;
-				unsigned char *comp = CxCompressLZ(inbuf, inSize, &compSize);
-				comp = CxPadCompressed(comp, compSize, 8, &compSize);
-				free(inbuf);
-				
-				//encrypt
-				BfEncrypt(comp, compSize, buffer);
-				
-				mods[modno] = comp;
-				modSizes[modno] = compSize;
-			} else {
-				//secondary/resource: must be either LZ or ASH compressed
-				unsigned char *comp = NULL;
-				unsigned int compSize = 0;
-				if (modComps[modno] == CX_COMPRESSION_ASH) {
-					//ASH compress
-					printf("Compressing...\n");
-					comp = CxCompressAshFirmware(inbuf, inSize, &compSize);
-					printf("Done.\n");
-				} else {
-					//LZ compress
-					comp = CxCompressLZ(inbuf, inSize, &compSize);
-				}
-				comp = CxPadCompressed(comp, compSize, 8, &compSize);
-				free(inbuf);
-				
-				mods[modno] = comp;
-				modSizes[modno] = compSize;
-			}
-		} else if (decrypt) {
-			//source file is compressed, unencrypted.
-			if (modno == 0 || modno == 1) {
-				//static modules: must be encrypted
-				BfEncrypt(inbuf, inSize, buffer);
-			} else {
-				//secondary/resource modules: not encrypted
-			}
-			mods[modno] = inbuf;
-			modSizes[modno] = inSize;
+	for (int i = 3; i < argc; i++) {
+		if (strcmp(argv[i], "-c") == 0) {
+			decompress = 0;
+		} else if (strcmp(argv[i], "-o") == 0 && (i + 1) < argc) {
+			ctx.outDir = argv[++i];
+		} else if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc) {
+			nThreads = ParseArgNumberULLEx(argv[++i], 10);
 		} else {
-			//source file is compressed, encrypted.
-			mods[modno] = inbuf;
-			modSizes[modno] = inSize;
+			AddImagePaths(&paths, argv[i]);
 		}
 	}
-	
-	//check size
-	uint32_t totalSize = 0;
-	for (int i = 0; i < 5; i++) {
-		totalSize += modSizes[i];
-		totalSize = (totalSize + 7) & ~7;
+	if (paths.nPaths == 0) {
+		puts("No images specified.");
+		return;
 	}
 	
-	//get max address
-	uint32_t maxAddr = hdr->nvramUserConfigAddr * 8 - 0x400;
-	if (HasTwlSettings(hdr->ipl2Type)) maxAddr -= 0x600;
-	if (maxAddr > size) maxAddr = size;
+	//each file is imported into once, and written where no other image is written
+	if (!SortImagePaths(&paths, ctx.outDir)) goto End;
+	ctx.nImages = paths.nPaths;
+	ctx.images = calloc(ctx.nImages, sizeof(BatchImportImage));
+	for (unsigned int i = 0; i < ctx.nImages; i++) ctx.images[i].path = paths.paths[i];
 	
-	if ((totalSize + 0x200) >= maxAddr) {
-		printf("The module is too large.\n");
+	FILE *fp = fopen(filename, "rb");
+	if (fp == NULL) {
+		printf("Could not open '%s' for read access.\n", filename);
 		goto End;
 	}
 	
-	//write modules
-	uint32_t curOffs = 0x200;
-	for (int i = 0; i < 5; i++) {
-		//write offset
-		switch (i) {
-			case 0: hdr->arm9StaticRomAddr    = curOffs / 8; hdr->arm9RomAddrScale = 1; break;
-			case 1: hdr->arm7StaticRomAddr    = curOffs / 8; hdr->arm7RomAddrScale = 1; break;
-			case 2: hdr->arm9SecondaryRomAddr = curOffs / 8; break;
-			case 3: hdr->arm7SecondaryRomAddr = curOffs / 8; break;
-			case 4: hdr->resourceRomAddr      = curOffs / 8; break;
+	unsigned int inSize;
+	fseek(fp, 0, SEEK_END);
+	inSize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	
+	unsigned char *inbuf = calloc((inSize + 7) & ~7, 1);
+	fread(inbuf, inSize, 1, fp);
+	fclose(fp);
+	
+	//the compression type of the first image is used for all images
+	int isStatic = ctx.modno == FW_MODULE_ARM9_STATIC || ctx.modno == FW_MODULE_ARM7_STATIC;
+	ctx.type = CX_COMPRESSION_LZ;
+	if (!isStatic) {
+		FwContext *first = FwCreateContext(NULL);
+		if (first != NULL && FwLoadFile(first, ctx.images[0].path) == FW_OK) {
+			unsigned int size;
+			unsigned char *buffer = FwGetImage(first, &size);
+			uint32_t romAddrs[FW_MODULE_COUNT];
+			GetFirmwareModuleRomAddrs(buffer, romAddrs);
+			if (romAddrs[ctx.modno] < size && buffer[romAddrs[ctx.modno]] != 0x10) ctx.type = CX_COMPRESSION_ASH;
 		}
-		
-		//get source
-		unsigned char *src = mods[i];
-		unsigned int modSize = modSizes[i];
-		memcpy(buffer + curOffs, src, modSize);
-		
-		curOffs += modSize;
-		curOffs = (curOffs + 7) & ~7;
+		if (first != NULL) FwFreeContext(first);
 	}
 	
-	UpdateFirmwareModuleChecksums(buffer, size);
+	//compress once for all images. The static modules are encrypted per image.
+	unsigned char *comp;
+	unsigned int compSize;
+	if (decompress && isStatic) {
+		comp = CxCompressLZ(inbuf, inSize, &compSize);
+		comp = CxPadCompressed(comp, compSize, 8, &compSize);
+		free(inbuf);
+	} else if (decompress) {
+		if (ctx.type == CX_COMPRESSION_ASH) printf("Compressing...\n");
+		comp = CompressFirmwareModule(NULL, ctx.modno, ctx.type, inbuf, inSize, &compSize);
+		free(inbuf);
+		if (ctx.type == CX_COMPRESSION_ASH) printf("Done.\n");
+	} else {
+		comp = inbuf;
+		compSize = (inSize + 7) & ~7;
+	}
+	ctx.comp = comp;
+	ctx.compSize = compSize;
 	
-End:
-	for (int i = 0; i < 5; i++) {
-		if (mods[i] != NULL) free(mods[i]);
+	ThRunTasks(BatchImportTask, &ctx, ctx.nImages, nThreads);
+	
+	int nUpdated = 0;
+	for (unsigned int i = 0; i < ctx.nImages; i++) {
+		BatchImportImage *image = &ctx.images[i];
+		printf("%s: %s\n", image->path, image->status);
+		if (strcmp(image->status, "updated") == 0) nUpdated++;
 	}
-}
+	printf("Updated %d of %d image(s).\n", nUpdated, ctx.nImages);
+	free(comp);
 
+End:
+	free(ctx.images);
+	FreeImagePaths(&paths);
+}
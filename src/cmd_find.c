@@ -0,0 +1,157 @@
+#include "cmd_common.h"
+#include "firmware.h"
+#include "search.h"
+
+#include <string.h>
+
+static const char *const sModuleNames[] = {
+	"ARM9 Static", "ARM7 Static", "ARM9 Secondary", "ARM7 Secondary", "Resources Pack"
+};
+
+typedef struct FindState_ {
+	const char *const *patternText;
+	unsigned int *nHits;
+	int module;                             // module being scanned, -1 for the raw image
+	uint32_t ramAddr;
+} FindState;
+
+void CmdHelpFind(void) {
+	puts("");
+	puts("Usage: find <pattern...> [-f <pattern file>]");
+	puts("");
+	puts("Searches the raw firmware image and each decompressed module for all of the");
+	puts("patterns at once. Hits in the raw image are reported by flash offset, hits in");
+	puts("modules by module offset and RAM address.");
+	puts("");
+	puts("Patterns:");
+	puts("  E92D4FF0  Hexadecimal bytes. Use ?? to match any byte, or ? for any nibble.");
+	puts("  s:text    ASCII string. Quote the pattern if it contains spaces.");
+	puts("  u:text    UTF-16 string.");
+	puts("");
+	puts("Flags:");
+	puts("  -f     Read patterns from a file, one per line.");
+}
+
+static int FindParsePattern(const char *text, unsigned char *bytes, unsigned char *mask, unsigned int maxLength, unsigned int *pLength) {
+	unsigned int length = 0;
+	
+	if (text[0] == 's' && text[1] == ':') {
+		for (const char *p = text + 2; *p; p++) {
+			if (length >= maxLength) return 0;
+			bytes[length] = *p;
+			mask[length++] = 0xFF;
+		}
+	} else if (text[0] == 'u' && text[1] == ':') {
+		for (const char *p = text + 2; *p; p++) {
+			if ((length + 2) > maxLength) return 0;
+			bytes[length] = *p;
+			mask[length++] = 0xFF;
+			bytes[length] = 0;
+			mask[length++] = 0xFF;
+		}
+	} else {
+		return SrParseHexPattern(text, bytes, mask, maxLength, pLength);
+	}
+	
+	*pLength = length;
+	return length > 0;
+}
+
+static int FindCallback(int pattern, unsigned int offset, void *arg) {
+	FindState *state = (FindState *) arg;
+	
+	if (state->module == -1) {
+		printf("  %-24s  flash %08X\n", state->patternText[pattern], offset);
+	} else {
+		printf("  %-24s  %s + 0x%X, RAM %08X\n", state->patternText[pattern], sModuleNames[state->module], offset, state->ramAddr + offset);
+	}
+	state->nHits[pattern]++;
+	return 0;
+}
+
+void CmdProcFind(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 2) {
+		CmdHelpFind();
+		return;
+	}
+	
+	SrMatcher matcher;
+	SrMatcherInit(&matcher);
+	
+	char **patternText = NULL;
+	unsigned int nPatterns = 0;
+	unsigned int *nHits = NULL;
+	
+	for (int i = 1; i < argc; i++) {
+		char line[256];
+		FILE *fp = NULL;
+		const char *text = argv[i];
+		
+		if (strcmp(argv[i], "-f") == 0 && (i + 1) < argc) {
+			fp = fopen(argv[++i], "r");
+			if (fp == NULL) {
+				printf("Could not open file '%s' for read acces.\n", argv[i]);
+				goto End;
+			}
+		}
+		
+		//one pattern from the command line, or each line of a pattern file
+		while (fp == NULL || fgets(line, sizeof(line), fp) != NULL) {
+			if (fp != NULL) {
+				line[strcspn(line, "\r\n")] = '\0';
+				if (line[0] == '\0' || line[0] == '#') continue;
+				text = line;
+			}
+			
+			unsigned char bytes[256], mask[256];
+			unsigned int length;
+			if (!FindParsePattern(text, bytes, mask, sizeof(bytes), &length) || SrMatcherAdd(&matcher, bytes, mask, length) == -1) {
+				printf("Invalid pattern '%s'.\n", text);
+				if (fp != NULL) fclose(fp);
+				goto End;
+			}
+			
+			patternText = realloc(patternText, (nPatterns + 1) * sizeof(char *));
+			patternText[nPatterns++] = strdup(text);
+			if (fp == NULL) break;
+		}
+		if (fp != NULL) fclose(fp);
+	}
+	
+	nHits = calloc(nPatterns, sizeof(unsigned int));
+	FindState state;
+	state.patternText = (const char *const *) patternText;
+	state.nHits = nHits;
+	
+	//raw image
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	puts("");
+	state.module = -1;
+	state.ramAddr = 0;
+	SrMatcherScan(&matcher, buffer, size, FindCallback, &state);
+	
+	//decompressed modules
+	const FirmwareRamView *view = GetFirmwareRamView();
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		const FirmwareModule *mod = &view->modules[i];
+		if (mod->data == NULL) continue;
+		
+		state.module = i;
+		state.ramAddr = mod->ramAddr;
+		SrMatcherScan(&matcher, mod->data, mod->uncompressed, FindCallback, &state);
+	}
+	
+	puts("");
+	for (unsigned int i = 0; i < nPatterns; i++) {
+		printf("%-24s  %d hit(s)\n", patternText[i], nHits[i]);
+	}
+
+End:
+	for (unsigned int i = 0; i < nPatterns; i++) free(patternText[i]);
+	free(patternText);
+	free(nHits);
+	SrMatcherFree(&matcher);
+}
@@ -13,21 +13,46 @@ static const HelpEntry sHelpEntries[] = {
 	{ "quit",    CmdHelpQuit    },
 	{ "load",    CmdHelpLoad    },
 	{ "save",    CmdHelpSave    },
+	{ "use",     CmdHelpUse     },
+	{ "archive", CmdHelpArchive },
+	{ "unpack",  CmdHelpUnpack  },
+	{ "pack",    CmdHelpPack    },
 	{ "info",    CmdHelpInfo    },
 	{ "wl",      CmdHelpWl      },
 	{ "verify",  CmdHelpVerify  },
 	{ "map",     CmdHelpMap     },
 	{ "compact", CmdHelpCompact },
+	{ "defrag",  CmdHelpDefrag  },
+	{ "probe",   CmdHelpProbe   },
+	{ "identify", CmdHelpIdentify },
+	{ "diff",    CmdHelpDiff    },
 	{ "md5",     CmdHelpMD5     },
 	{ "clean",   CmdHelpClean   },
 	{ "restore", CmdHelpRestore },
 	{ "fix",     CmdHelpFix     },
 	{ "import",  CmdHelpImport  },
+	{ "batchimport", CmdHelpBatchImport },
+	{ "provision", CmdHelpProvision },
 	{ "export",  CmdHelpExport  },
+	{ "mkpatch", CmdHelpMkPatch },
+	{ "applypatch", CmdHelpApplyPatch },
+	{ "applyips", CmdHelpApplyIps },
+	{ "applybps", CmdHelpApplyBps },
+	{ "undo",    CmdHelpUndo    },
+	{ "redo",    CmdHelpRedo    },
+	{ "snapshot", CmdHelpSnapshot },
+	{ "revert",  CmdHelpRevert  },
+	{ "jobs",    CmdHelpJobs    },
+	{ "cancel",  CmdHelpCancel  },
+	{ "wait",    CmdHelpWait    },
 	{ "user",    CmdHelpUser    },
 	{ "loc",     CmdHelpLoc     },
+	{ "symbolize", CmdHelpSymbolize },
+	{ "find",    CmdHelpFind    },
+	{ "xref",    CmdHelpXref    },
 	{ "eb",      CmdHelpEB      },
-	{ "db",      CmdHelpDB      }
+	{ "db",      CmdHelpDB      },
+	{ "wr",      CmdHelpWR      }
 };
 
 void CmdHelpHelp(void) {
@@ -63,23 +88,50 @@ void CmdProcHelp(int argc, const char **argv) {
 	puts("File commands:");
 	puts("  load         Load a firmware image.");
 	puts("  save         Saves a firmware image to disk.");
+	puts("  archive      Stores or rebuilds firmware images in a deduplicating store.");
+	puts("  pack         Rebuilds the firmware image from an unpacked directory.");
+	puts("  unpack       Writes the parts of the firmware image to a directory.");
+	puts("  use          Switches to an open firmware image.");
+	puts("");
+	puts("Job commands:");
+	puts("  cancel       Cancels a background job.");
+	puts("  jobs         Lists the background jobs and their progress.");
+	puts("  wait         Waits for background jobs to finish.");
 	puts("");
 	puts("Reporting commands:");
+	puts("  diff         Compares two firmware images.");
+	puts("  find         Searches the image and modules for byte and string patterns.");
+	puts("  identify     Identifies the firmware build from module digests.");
 	puts("  info         Print basic information about a firmware image.");
 	puts("  loc          Locate a module occupying an address.");
 	puts("  map          Prints a map of the firmware address space.");
 	puts("  md5          Calculates the MD5 sum of the firmware image.");
+	puts("  probe        Quickly identify firmware image files without loading them.");
+	puts("  symbolize    Resolves a file of RAM addresses to modules and symbols.");
 	puts("  user         Prints the user configuration information.");
 	puts("  verify       Verify a firmware image.");
+	puts("  xref         Lists the calls and literal references to an address.");
 	puts("");
 	puts("Manipulation commands:");
+	puts("  applybps     Applies a BPS patch to the firmware image.");
+	puts("  applyips     Applies an IPS patch to the firmware image.");
+	puts("  applypatch   Applies a module patch to the firmware image.");
+	puts("  batchimport  Imports a module into many firmware image files.");
 	puts("  clean        Cleans the user configuration and wireless configuration.");
 	puts("  compact      Compacts the firmware image.");
 	puts("  db           Dump bytes from the firmware image.");
+	puts("  defrag       Packs modules together without recompressing them.");
 	puts("  eb           Enter bytes into the firmware image.");
 	puts("  export       Exports a firmware component.");
 	puts("  fix          Fixes problems in the firmware image.");
 	puts("  import       Import a firmware component.");
+	puts("  mkpatch      Creates a module patch against the firmware image.");
+	puts("  provision    Sets unique MAC addresses and settings in many image files.");
+	puts("  redo         Redoes the last undone change to the firmware image.");
 	puts("  restore      Restore firmware configuration from a file.");
+	puts("  revert       Reverts the firmware image to a named snapshot.");
+	puts("  snapshot     Saves the state of the firmware image under a name.");
+	puts("  undo         Undoes the last change to the firmware image.");
 	puts("  wl           Modify the firmware wireless information.");
+	puts("  wr           Write bytes into a module at a RAM address.");
 }
@@ -0,0 +1,402 @@
+#include "cmd_common.h"
+#include "firmware.h"
+#include "digest.h"
+
+#include <string.h>
+
+#define IDENTIFY_INDEX_MAGIC   "fwutil-index 1"
+#define IDENTIFY_DEFAULT_INDEX "fwindex.txt"
+
+typedef struct IdBuild_ {
+	unsigned char timestamp[5];
+	char *name;
+} IdBuild;
+
+typedef struct IdModuleRef_ {
+	int module;
+	int build;
+	struct IdModuleRef_ *next;
+} IdModuleRef;
+
+typedef struct IdIndex_ {
+	IdBuild *builds;
+	int nBuilds;
+	DgTable images;                         // raw image digest -> build index + 1
+	DgTable modules;                        // decompressed module digest -> IdModuleRef list
+	FILE *fpAppend;                         // index file, open for appending new entries
+} IdIndex;
+
+static const char *const sModuleNames[] = {
+	"ARM9 Static", "ARM7 Static", "ARM9 Secondary", "ARM7 Secondary", "Resources Pack"
+};
+
+void CmdHelpIdentify(void) {
+	puts("");
+	puts("Usage: identify [-i <index>]");
+	puts("       identify add <file|directory> [-n <name>] [-i <index>]");
+	puts("");
+	puts("Identifies the firmware build of the current image by looking up the digests of");
+	puts("its decompressed modules in an index of known builds. Builds are keyed by the");
+	puts("build timestamp in the flash header. Images whose modules belong to different");
+	puts("builds are reported as mixed.");
+	puts("");
+	puts("The add subcommand indexes a reference dump, or every file in a directory of");
+	puts("reference dumps. Dumps that are already indexed are skipped, so a directory may");
+	puts("be re-added as new dumps arrive.");
+	puts("");
+	puts("Flags:");
+	puts("  -i     Index file to use (default " IDENTIFY_DEFAULT_INDEX ").");
+	puts("  -n     Build name for added dumps (default: the first dump's file name).");
+}
+
+static void PrintTimestamp(const unsigned char *timestamp) {
+	printf("20%02X/%02X/%02X %02X:%02X", timestamp[4], timestamp[3], timestamp[2], timestamp[1], timestamp[0]);
+}
+
+static int IdFindBuild(IdIndex *index, const unsigned char *timestamp) {
+	for (int i = 0; i < index->nBuilds; i++) {
+		if (memcmp(index->builds[i].timestamp, timestamp, sizeof(index->builds[i].timestamp)) == 0) return i;
+	}
+	return -1;
+}
+
+static int IdAddBuild(IdIndex *index, const unsigned char *timestamp, const char *name) {
+	index->builds = realloc(index->builds, (index->nBuilds + 1) * sizeof(IdBuild));
+	
+	IdBuild *build = &index->builds[index->nBuilds];
+	memcpy(build->timestamp, timestamp, sizeof(build->timestamp));
+	build->name = strdup(name);
+	return index->nBuilds++;
+}
+
+static void IdAddModule(IdIndex *index, const unsigned char *digest, int module, int build) {
+	IdModuleRef **slot = (IdModuleRef **) DgTableInsert(&index->modules, digest);
+	
+	//a module may be shared by several builds
+	for (IdModuleRef *ref = *slot; ref != NULL; ref = ref->next) {
+		if (ref->module == module && ref->build == build) return;
+	}
+	
+	IdModuleRef *ref = malloc(sizeof(IdModuleRef));
+	ref->module = module;
+	ref->build = build;
+	ref->next = *slot;
+	*slot = ref;
+}
+
+static void IdFreeIndex(IdIndex *index) {
+	for (unsigned int i = 0; i < index->modules.capacity; i++) {
+		IdModuleRef *ref = (IdModuleRef *) index->modules.entries[i].value;
+		while (ref != NULL) {
+			IdModuleRef *next = ref->next;
+			free(ref);
+			ref = next;
+		}
+	}
+	for (int i = 0; i < index->nBuilds; i++) free(index->builds[i].name);
+	if (index->builds != NULL) free(index->builds);
+	if (index->fpAppend != NULL) fclose(index->fpAppend);
+	
+	DgTableFree(&index->images);
+	DgTableFree(&index->modules);
+}
+
+static int IdLoadIndex(IdIndex *index, const char *path, int forWrite) {
+	memset(index, 0, sizeof(*index));
+	DgTableInit(&index->images);
+	DgTableInit(&index->modules);
+	
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		if (!forWrite) {
+			printf("Could not open index '%s'.\n", path);
+			return 0;
+		}
+		
+		//create a new index
+		index->fpAppend = fopen(path, "wb");
+		if (index->fpAppend == NULL) {
+			printf("Could not open '%s' for write access.\n", path);
+			return 0;
+		}
+		fprintf(index->fpAppend, "%s\n", IDENTIFY_INDEX_MAGIC);
+		return 1;
+	}
+	
+	char line[512];
+	int lineNo = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		lineNo++;
+		
+		if (lineNo == 1) {
+			if (strcmp(line, IDENTIFY_INDEX_MAGIC) == 0) continue;
+			printf("'%s' is not a firmware index.\n", path);
+			fclose(fp);
+			return 0;
+		}
+		
+		unsigned int ts[5];
+		int build, module, nameOffset;
+		char digestStr[33];
+		unsigned char digest[DG_DIGEST_SIZE];
+		if (sscanf(line, "build %2x%2x%2x%2x%2x %n", &ts[4], &ts[3], &ts[2], &ts[1], &ts[0], &nameOffset) == 5) {
+			unsigned char timestamp[5];
+			for (int i = 0; i < 5; i++) timestamp[i] = ts[i];
+			IdAddBuild(index, timestamp, line + nameOffset);
+		} else if (sscanf(line, "image %32s %d", digestStr, &build) == 2 && DgParseDigest(digestStr, digest) && build >= 0 && build < index->nBuilds) {
+			*DgTableInsert(&index->images, digest) = (void *) (intptr_t) (build + 1);
+		} else if (sscanf(line, "module %d %32s %d", &module, digestStr, &build) == 3 && DgParseDigest(digestStr, digest) && build >= 0 && build < index->nBuilds) {
+			IdAddModule(index, digest, module, build);
+		} else if (line[0] != '\0') {
+			printf("%s(%d): unrecognized index entry.\n", path, lineNo);
+		}
+	}
+	fclose(fp);
+	
+	if (forWrite) {
+		index->fpAppend = fopen(path, "ab");
+		if (index->fpAppend == NULL) {
+			printf("Could not open '%s' for write access.\n", path);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void IdDigestModules(const unsigned char *buffer, unsigned int size, unsigned char (*digests)[DG_DIGEST_SIZE], int *present) {
+	FirmwareModule mods[FW_MODULE_COUNT];
+	GetFirmwareModules(buffer, size, mods);
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		present[i] = mods[i].data != NULL;
+		if (present[i]) ComputeMd5(mods[i].data, mods[i].uncompressed, digests[i]);
+	}
+	FreeFirmwareModules(mods);
+}
+
+// ----- index updates
+
+typedef struct IdAddContext_ {
+	IdIndex *index;
+	const char *name;
+	int nAdded;
+	int nSkipped;
+} IdAddContext;
+
+static const char *GetFileName(const char *path) {
+	const char *name = path;
+	for (const char *p = path; *p; p++) {
+		if (*p == '/' || *p == '\\') name = p + 1;
+	}
+	return name;
+}
+
+static void IdAddFile(const char *path, void *arg) {
+	IdAddContext *ctx = (IdAddContext *) arg;
+	IdIndex *index = ctx->index;
+	
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Could not open file '%s' for read acces.\n", path);
+		return;
+	}
+	fseek(fp, 0, SEEK_END);
+	unsigned int size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	
+	//skip files that cannot be firmware images
+	if (size < (4 * 1024) || size > (16 * 1024 * 1024)) {
+		fclose(fp);
+		return;
+	}
+	
+	unsigned char *buffer = malloc(size);
+	unsigned int nRead = fread(buffer, 1, size, fp);
+	fclose(fp);
+	if (nRead != size) {
+		free(buffer);
+		return;
+	}
+	
+	//already indexed dumps are recognized by their raw digest without decoding them
+	unsigned char imageDigest[DG_DIGEST_SIZE];
+	ComputeMd5(buffer, size, imageDigest);
+	if (DgTableFind(&index->images, imageDigest) != NULL) {
+		ctx->nSkipped++;
+		free(buffer);
+		return;
+	}
+	
+	unsigned char digests[FW_MODULE_COUNT][DG_DIGEST_SIZE];
+	int present[FW_MODULE_COUNT];
+	IdDigestModules(buffer, size, digests, present);
+	if (!present[FW_MODULE_ARM9_STATIC] || !present[FW_MODULE_ARM7_STATIC]) {
+		printf("%s: not a valid firmware image, skipped.\n", path);
+		free(buffer);
+		return;
+	}
+	
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	int build = IdFindBuild(index, hdr->timestamp);
+	if (build == -1) {
+		const char *name = ctx->name != NULL ? ctx->name : GetFileName(path);
+		build = IdAddBuild(index, hdr->timestamp, name);
+		fprintf(index->fpAppend, "build %02X%02X%02X%02X%02X %s\n", hdr->timestamp[4], hdr->timestamp[3], hdr->timestamp[2], hdr->timestamp[1], hdr->timestamp[0], name);
+	}
+	
+	char digestStr[33];
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (!present[i]) continue;
+		
+		IdAddModule(index, digests[i], i, build);
+		DgDigestToString(digests[i], digestStr);
+		fprintf(index->fpAppend, "module %d %s %d\n", i, digestStr, build);
+	}
+	
+	*DgTableInsert(&index->images, imageDigest) = (void *) (intptr_t) (build + 1);
+	DgDigestToString(imageDigest, digestStr);
+	fprintf(index->fpAppend, "image %s %d\n", digestStr, build);
+	
+	printf("%s: indexed as %s (", path, index->builds[build].name);
+	PrintTimestamp(hdr->timestamp);
+	printf(").\n");
+	ctx->nAdded++;
+	free(buffer);
+}
+
+static void IdentifyAdd(const char *indexPath, const char *path, const char *name) {
+	IdIndex index;
+	if (!IdLoadIndex(&index, indexPath, 1)) {
+		IdFreeIndex(&index);
+		return;
+	}
+	
+	IdAddContext ctx;
+	ctx.index = &index;
+	ctx.name = name;
+	ctx.nAdded = 0;
+	ctx.nSkipped = 0;
+	
+	if (!EnumerateDirectory(path, IdAddFile, &ctx)) IdAddFile(path, &ctx);
+	
+	printf("Indexed %d new dump(s), %d already indexed. Index has %d build(s).\n", ctx.nAdded, ctx.nSkipped, index.nBuilds);
+	IdFreeIndex(&index);
+}
+
+// ----- identification
+
+static void IdentifyImage(const char *indexPath) {
+	IdIndex index;
+	if (!IdLoadIndex(&index, indexPath, 0)) {
+		IdFreeIndex(&index);
+		return;
+	}
+	
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	
+	unsigned char digests[FW_MODULE_COUNT][DG_DIGEST_SIZE];
+	int present[FW_MODULE_COUNT];
+	IdDigestModules(buffer, size, digests, present);
+	
+	//count, per build, the modules that match it
+	int *nMatches = calloc(index.nBuilds + 1, sizeof(int));
+	int nKnown = 0, nPresent = 0;
+	
+	puts("");
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		printf("  %-19s : ", sModuleNames[i]);
+		if (!present[i]) {
+			puts("(failed to decompress)");
+			continue;
+		}
+		nPresent++;
+		
+		IdModuleRef **slot = (IdModuleRef **) DgTableFind(&index.modules, digests[i]);
+		int found = 0;
+		if (slot != NULL) {
+			for (IdModuleRef *ref = *slot; ref != NULL; ref = ref->next) {
+				if (ref->module != i) continue;
+				
+				printf("%s%s", found ? ", " : "", index.builds[ref->build].name);
+				nMatches[ref->build]++;
+				found = 1;
+			}
+		}
+		if (found) nKnown++;
+		puts(found ? "" : "(unknown)");
+	}
+	puts("");
+	
+	unsigned char imageDigest[DG_DIGEST_SIZE];
+	ComputeMd5(buffer, size, imageDigest);
+	void **imageSlot = DgTableFind(&index.images, imageDigest);
+	if (imageSlot != NULL) {
+		printf("Image is identical to an indexed dump of %s.\n", index.builds[(intptr_t) *imageSlot - 1].name);
+	}
+	
+	//a build explains the image if every known module belongs to it
+	int nCandidates = 0;
+	for (int i = 0; i < index.nBuilds; i++) {
+		if (nKnown == 0 || nMatches[i] != nKnown) continue;
+		
+		printf("Build                   : %s (", index.builds[i].name);
+		PrintTimestamp(index.builds[i].timestamp);
+		printf(")\n");
+		nCandidates++;
+		
+		if (memcmp(index.builds[i].timestamp, hdr->timestamp, sizeof(hdr->timestamp)) != 0) {
+			printf("  Header build date ");
+			PrintTimestamp(hdr->timestamp);
+			printf(" does not match this build.\n");
+		}
+	}
+	
+	if (nKnown == 0) {
+		puts("No module matches a known build.");
+	} else if (nCandidates == 0) {
+		puts("WARNING: image mixes modules from different builds.");
+	}
+	if (nKnown > 0 && nKnown < nPresent) {
+		printf("%d module(s) do not match any known build.\n", nPresent - nKnown);
+	}
+	
+	free(nMatches);
+	IdFreeIndex(&index);
+}
+
+void CmdProcIdentify(int argc, const char **argv) {
+	const char *indexPath = IDENTIFY_DEFAULT_INDEX;
+	const char *name = NULL;
+	const char *addPath = NULL;
+	int add = 0;
+	
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-i") == 0 && (i + 1) < argc) {
+			indexPath = argv[++i];
+		} else if (strcmp(argv[i], "-n") == 0 && (i + 1) < argc) {
+			name = argv[++i];
+		} else if (i == 1 && strcmp(argv[i], "add") == 0) {
+			add = 1;
+		} else if (add && addPath == NULL) {
+			addPath = argv[i];
+		} else {
+			printf("Unrecognized argument %s.\n", argv[i]);
+			return;
+		}
+	}
+	
+	if (add) {
+		if (addPath == NULL) {
+			CmdHelpIdentify();
+			return;
+		}
+		IdentifyAdd(indexPath, addPath, name);
+		return;
+	}
+	
+	if (!RequireFirmwareImage()) return;
+	IdentifyImage(indexPath);
+}
@@ -20,35 +20,6 @@ void CmdHelpInfo(void) {
 	puts("using the verify command.");
 }
 
-static const char *GetIpl2TypeString(int type) {
-	if (type == IPL2_TYPE_NORMAL) type = 0;
-	
-	const char *typestr = "DS";
-	if (type & IPL2_TYPE_USG) {
-		if (type & IPL2_TYPE_CPU_NTR) {
-			typestr = "DS Lite with CPU-NTR";
-		} else {
-			typestr = "DS Lite";
-		}
-	} else if (type & IPL2_TYPE_TWL) {
-		typestr = "DSi";
-		type &= ~(IPL2_TYPE_EXT_LANGUAGE | IPL2_TYPE_CHINESE | IPL2_TYPE_KOREAN);
-	}
-	
-	const char *region = "World";
-	if (type & IPL2_TYPE_EXT_LANGUAGE) {
-		if (type & IPL2_TYPE_CHINESE) {
-			region = "iQue";
-		} else if (type & IPL2_TYPE_KOREAN) {
-			region = "Korea";
-		}
-	}
-	
-	static char buffer[64];
-	sprintf(buffer, "%s (%s)", typestr, region);
-	return buffer;
-}
-
 static SerialType DecodeSerial(const uint8_t *raw, uint64_t *pSerial) {
 	//IS-NITRO-EMULATOR and IS-NITRO-CAPTURE devices arrange the serial number in
 	//opposite endiannesses. We need to detect the endianness.
@@ -0,0 +1,320 @@
+#include "cmd_common.h"
+#include "firmware.h"
+
+#include <string.h>
+
+void CmdHelpApplyIps(void) {
+	puts("");
+	puts("Usage: applyips <patch file name>");
+	puts("");
+	puts("Applies an IPS patch to the firmware image. After all records are applied, the");
+	puts("CRCs of the modules, wireless table, user configuration and connection settings");
+	puts("that the patch changed are updated. Only the modules whose CRCs need updating");
+	puts("are decompressed. Records that would extend the image are rejected.");
+}
+
+void CmdHelpApplyBps(void) {
+	puts("");
+	puts("Usage: applybps <patch file name>");
+	puts("");
+	puts("Applies a BPS patch to the firmware image. The source and patch checksums are");
+	puts("checked before the patch is applied. After the patch is applied, the CRCs of the");
+	puts("modules, wireless table, user configuration and connection settings that the");
+	puts("patch changed are updated. The patch must not change the image size.");
+}
+
+static unsigned char *ReadPatchFile(const char *path, unsigned int *pSize) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Could not open file '%s' for read acces.\n", path);
+		return NULL;
+	}
+	
+	fseek(fp, 0, SEEK_END);
+	unsigned int size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	
+	unsigned char *buf = malloc(size);
+	unsigned int nRead = fread(buf, 1, size, fp);
+	fclose(fp);
+	
+	if (nRead != size) {
+		printf("Could not read '%s'.\n", path);
+		free(buf);
+		return NULL;
+	}
+	
+	*pSize = size;
+	return buf;
+}
+
+static int RegionChanged(const unsigned char *oldImage, const unsigned char *newImage, unsigned int size, uint32_t addr, uint32_t len) {
+	if (addr >= size) return 0;
+	if (len > (size - addr)) len = size - addr;
+	return memcmp(oldImage + addr, newImage + addr, len) != 0;
+}
+
+//
+// Update the CRCs covering the parts of the image a patch changed, and commit the patched image.
+//
+static void CommitPatchedImage(unsigned char *buffer, unsigned char *image, unsigned int size) {
+	FlashHeader *oldHdr = (FlashHeader *) buffer;
+	FlashHeader *hdr = (FlashHeader *) image;
+	
+	uint32_t oldRomAddrs[FW_MODULE_COUNT], romAddrs[FW_MODULE_COUNT];
+	GetFirmwareModuleRomAddrs(buffer, oldRomAddrs);
+	GetFirmwareModuleRomAddrs(image, romAddrs);
+	
+	//a module is bounded by the next module or the connection settings, without decompressing it
+	uint32_t limit = GetFirmwareModuleLimit(image, size);
+	unsigned int moduleMask = 0;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		uint32_t end = limit;
+		for (int j = 0; j < FW_MODULE_COUNT; j++) {
+			if (romAddrs[j] > romAddrs[i] && romAddrs[j] < end) end = romAddrs[j];
+		}
+		
+		if (romAddrs[i] != oldRomAddrs[i] || (end > romAddrs[i] && RegionChanged(buffer, image, size, romAddrs[i], end - romAddrs[i]))) {
+			moduleMask |= 1 << i;
+		}
+	}
+	
+	//the static modules are encrypted with a key derived from the header
+	if (memcmp(&oldHdr->blowfishKey, &hdr->blowfishKey, sizeof(hdr->blowfishKey)) != 0 || memcmp(oldHdr->unscrambleKey, hdr->unscrambleKey, sizeof(hdr->unscrambleKey)) != 0) {
+		moduleMask |= (1 << FW_MODULE_ARM9_STATIC) | (1 << FW_MODULE_ARM7_STATIC);
+	}
+	
+	if (moduleMask) UpdateFirmwareModuleChecksumsEx(image, size, moduleMask);
+	
+	int wlChanged = RegionChanged(buffer, image, size, 0x2A, 0x200 - 0x2A);
+	if (wlChanged) UpdateWirelessTableChecksum(image);
+	
+	int nTables = 0;
+	uint32_t ncdAddr = hdr->nvramUserConfigAddr * 8;
+	for (int i = 0; i < 2; i++) {
+		if (!RegionChanged(buffer, image, size, ncdAddr + i * 0x100, 0x100)) continue;
+		UpdateUserConfigChecksum(image, size, i);
+		nTables++;
+	}
+	
+	if (ncdAddr >= 0x400) {
+		uint32_t connAddr = ncdAddr - 0x400;
+		for (int i = 0; i < 3; i++) {
+			if (!RegionChanged(buffer, image, size, connAddr + i * 0x100, 0x100)) continue;
+			UpdateConnectionChecksum(image, size, i);
+			nTables++;
+		}
+		if (HasTwlSettings(hdr->ipl2Type) && connAddr >= 0x600) {
+			for (int i = 0; i < 3; i++) {
+				if (!RegionChanged(buffer, image, size, connAddr - 0x600 + i * 0x200, 0x200)) continue;
+				UpdateConnectionChecksum(image, size, i + 3);
+				nTables++;
+			}
+		}
+	}
+	
+	unsigned int nChanged = 0;
+	for (unsigned int i = 0; i < size; i++) {
+		if (buffer[i] != image[i]) nChanged++;
+	}
+	memcpy(buffer, image, size);
+	
+	printf("Patch applied, %d bytes changed.\n", nChanged);
+	printf("  Modules updated       :");
+	const char *const modnames[] = { "arm9", "arm7", "arm9s", "arm7s", "rsrc" };
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (moduleMask & (1 << i)) printf(" %s", modnames[i]);
+	}
+	puts(moduleMask ? "" : " none");
+	printf("  Wireless table        : %s\n", wlChanged ? "updated" : "unchanged");
+	printf("  Settings blocks       : %d updated\n", nTables);
+}
+
+// ----- IPS
+
+void CmdProcApplyIps(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 2) {
+		CmdHelpApplyIps();
+		return;
+	}
+	
+	unsigned int size, patchSize;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	unsigned char *patch = ReadPatchFile(argv[1], &patchSize);
+	if (patch == NULL) return;
+	
+	unsigned char *image = malloc(size);
+	memcpy(image, buffer, size);
+	
+	if (patchSize < 8 || memcmp(patch, "PATCH", 5) != 0) {
+		printf("'%s' is not an IPS patch.\n", argv[1]);
+		goto End;
+	}
+	
+	unsigned int pos = 5, nRecords = 0;
+	while (1) {
+		if ((patchSize - pos) < 3) goto Corrupt;
+		if (memcmp(patch + pos, "EOF", 3) == 0) break;
+		if ((patchSize - pos) < 5) goto Corrupt;
+		
+		uint32_t offset = (patch[pos + 0] << 16) | (patch[pos + 1] << 8) | patch[pos + 2];
+		uint32_t length = (patch[pos + 3] << 8) | patch[pos + 4];
+		pos += 5;
+		
+		if (length == 0) {
+			//RLE record
+			if ((patchSize - pos) < 3) goto Corrupt;
+			length = (patch[pos + 0] << 8) | patch[pos + 1];
+			if (offset > size || length > (size - offset)) goto OutOfRange;
+			memset(image + offset, patch[pos + 2], length);
+			pos += 3;
+		} else {
+			if ((patchSize - pos) < length) goto Corrupt;
+			if (offset > size || length > (size - offset)) goto OutOfRange;
+			memcpy(image + offset, patch + pos, length);
+			pos += length;
+		}
+		nRecords++;
+	}
+	
+	printf("Applying %d record(s).\n", nRecords);
+	CommitPatchedImage(buffer, image, size);
+	goto End;
+
+OutOfRange:
+	printf("The patch writes past the end of the image (record %d).\n", nRecords);
+	goto End;
+Corrupt:
+	puts("The patch is corrupt.");
+End:
+	free(image);
+	free(patch);
+}
+
+// ----- BPS
+
+static uint64_t BpsReadNumber(const unsigned char *patch, unsigned int end, unsigned int *pPos, int *pError) {
+	uint64_t data = 0, shift = 1;
+	while (1) {
+		if (*pPos >= end || shift > (1ull << 56)) {
+			*pError = 1;
+			return 0;
+		}
+		
+		unsigned char x = patch[(*pPos)++];
+		data += (x & 0x7F) * shift;
+		if (x & 0x80) break;
+		shift <<= 7;
+		data += shift;
+	}
+	return data;
+}
+
+#define BPS_SOURCE_READ  0
+#define BPS_TARGET_READ  1
+#define BPS_SOURCE_COPY  2
+#define BPS_TARGET_COPY  3
+
+void CmdProcApplyBps(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 2) {
+		CmdHelpApplyBps();
+		return;
+	}
+	
+	unsigned int size, patchSize;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	unsigned char *patch = ReadPatchFile(argv[1], &patchSize);
+	if (patch == NULL) return;
+	
+	unsigned char *image = calloc(size, 1);
+	
+	if (patchSize < (4 + 12) || memcmp(patch, "BPS1", 4) != 0) {
+		printf("'%s' is not a BPS patch.\n", argv[1]);
+		goto End;
+	}
+	
+	//checksums
+	unsigned int end = patchSize - 12;
+	uint32_t sourceCrc = *(uint32_t *) (patch + end + 0);
+	uint32_t targetCrc = *(uint32_t *) (patch + end + 4);
+	uint32_t patchCrc  = *(uint32_t *) (patch + end + 8);
+	if (ComputeCrc32(patch, patchSize - 4, 0) != patchCrc) goto Corrupt;
+	if (ComputeCrc32(buffer, size, 0) != sourceCrc) {
+		puts("The patch was not created for this image.");
+		goto End;
+	}
+	
+	int error = 0;
+	unsigned int pos = 4;
+	uint64_t sourceSize = BpsReadNumber(patch, end, &pos, &error);
+	uint64_t targetSize = BpsReadNumber(patch, end, &pos, &error);
+	uint64_t metadataSize = BpsReadNumber(patch, end, &pos, &error);
+	if (error || metadataSize > (end - pos)) goto Corrupt;
+	pos += (unsigned int) metadataSize;
+	
+	if (sourceSize != size || targetSize != size) {
+		printf("The patch changes the image size (%d -> %d bytes).\n", (int) sourceSize, (int) targetSize);
+		goto End;
+	}
+	
+	uint32_t outPos = 0;
+	int64_t sourceRel = 0, targetRel = 0;
+	unsigned int nActions = 0;
+	while (pos < end) {
+		uint64_t data = BpsReadNumber(patch, end, &pos, &error);
+		if (error) goto Corrupt;
+		
+		int command = data & 3;
+		uint64_t length = (data >> 2) + 1;
+		if (length > (size - outPos)) goto Corrupt;
+		
+		switch (command) {
+			case BPS_SOURCE_READ:
+				memcpy(image + outPos, buffer + outPos, length);
+				break;
+			case BPS_TARGET_READ:
+				if (length > (end - pos)) goto Corrupt;
+				memcpy(image + outPos, patch + pos, length);
+				pos += length;
+				break;
+			case BPS_SOURCE_COPY:
+			case BPS_TARGET_COPY:
+			{
+				uint64_t offs = BpsReadNumber(patch, end, &pos, &error);
+				if (error) goto Corrupt;
+				
+				int64_t *rel = (command == BPS_SOURCE_COPY) ? &sourceRel : &targetRel;
+				*rel += (offs & 1) ? -(int64_t) (offs >> 1) : (int64_t) (offs >> 1);
+				if (*rel < 0 || (uint64_t) *rel + length > size) goto Corrupt;
+				
+				if (command == BPS_SOURCE_COPY) {
+					memcpy(image + outPos, buffer + *rel, length);
+				} else {
+					//target copies may overlap their own output, so copy bytewise
+					if ((uint64_t) *rel >= outPos) goto Corrupt;
+					for (uint64_t i = 0; i < length; i++) image[outPos + i] = image[*rel + i];
+				}
+				*rel += length;
+				break;
+			}
+		}
+		outPos += length;
+		nActions++;
+	}
+	
+	if (outPos != size || ComputeCrc32(image, size, 0) != targetCrc) goto Corrupt;
+	
+	printf("Applying %d action(s).\n", nActions);
+	CommitPatchedImage(buffer, image, size);
+	goto End;
+
+Corrupt:
+	puts("The patch is corrupt.");
+End:
+	free(image);
+	free(patch);
+}
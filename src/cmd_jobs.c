@@ -0,0 +1,256 @@
+#include "cmd_common.h"
+#include "compression.h"
+#include "libfwutil.h"
+#include "thread.h"
+
+#include <string.h>
+
+struct Job_ {
+	unsigned int id;
+	char *label;                            // command line that started the job
+	JobWorkProc work;
+	JobFinishProc finish;
+	void *arg;
+	ThThread *thread;
+	volatile int done;                      // set by the worker thread when the work is done
+	const char *volatile stage;             // part of the work in progress
+	CxProgress progress;
+	FwContext *ctx;                         // image the job was started on
+	unsigned int client;                    // client that started the job
+	unsigned char *image;                   // copy of the image when the job started
+	unsigned int size;
+	double startTime;
+};
+
+static Job **gJobs = NULL;
+static unsigned int gNJobs = 0;
+static unsigned int gNextJobId = 1;
+static unsigned int gJobClient = 0;
+
+void CmdHelpJobs(void) {
+	puts("");
+	puts("Usage: jobs");
+	puts("");
+	puts("Lists the commands running in the background, with the part of the work in");
+	puts("progress, the compression pass and how far the pass has got. Commands are run");
+	puts("in the background with their -b flag. Other commands can be used while a job");
+	puts("runs. When a job is done, its result is applied to the image it was started");
+	puts("on before the next command, unless that image was changed while it ran, in");
+	puts("which case the result is discarded. In server mode, each client only sees its");
+	puts("own jobs, and the jobs of a client that disconnects are cancelled.");
+}
+
+void CmdHelpCancel(void) {
+	puts("");
+	puts("Usage: cancel [job]");
+	puts("");
+	puts("Cancels a background job, or all of them. The image is left as it was before");
+	puts("the job started.");
+}
+
+void CmdHelpWait(void) {
+	puts("");
+	puts("Usage: wait [job]");
+	puts("");
+	puts("Waits for a background job, or all of them, to finish, and applies the results.");
+}
+
+static void JobEntry(void *arg) {
+	Job *job = (Job *) arg;
+	job->work(job, job->arg);
+	job->done = 1;
+}
+
+Job *StartJob(const char *label, JobWorkProc work, JobFinishProc finish, void *arg) {
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	
+	Job *job = calloc(1, sizeof(Job));
+	job->id = gNextJobId++;
+	job->label = strdup(label);
+	job->work = work;
+	job->finish = finish;
+	job->arg = arg;
+	job->ctx = GetFirmwareContext();
+	job->client = gJobClient;
+	job->image = malloc(size);
+	memcpy(job->image, buffer, size);
+	job->size = size;
+	job->startTime = ThGetTime();
+	
+	gJobs = realloc(gJobs, (gNJobs + 1) * sizeof(Job *));
+	gJobs[gNJobs++] = job;
+	
+	job->thread = ThCreateThread(JobEntry, job);
+	if (job->thread == NULL) {
+		//run it on this thread instead
+		JobEntry(job);
+	}
+	
+	printf("[%d] %s started.\n", job->id, job->label);
+	return job;
+}
+
+void SetJobStage(Job *job, const char *stage) {
+	if (job != NULL) job->stage = stage;
+}
+
+struct CxProgress_ *GetJobProgress(Job *job) {
+	return job != NULL ? &job->progress : NULL;
+}
+
+int IsJobCancelled(Job *job) {
+	return job != NULL && job->progress.cancel;
+}
+
+static void FinishJob(unsigned int index) {
+	Job *job = gJobs[index];
+	if (job->thread != NULL) ThJoinThread(job->thread);
+	
+	//the result is only applied to the image the job was started on, and only if it is unchanged. The
+	//image is made current while the job finishes, whichever image the client has now.
+	FwContext *prev = ExchangeFirmwareContext(job->ctx);
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	int apply = 0;
+	if (job->progress.cancel) {
+		printf("[%d] %s cancelled.\n", job->id, job->label);
+	} else if (buffer == NULL || size != job->size || memcmp(buffer, job->image, size) != 0) {
+		printf("[%d] %s discarded: the image changed while it ran.\n", job->id, job->label);
+	} else {
+		printf("[%d] %s done.\n", job->id, job->label);
+		apply = 1;
+	}
+	
+	job->finish(job, job->arg, apply);
+	if (apply) CommitFirmwareImage(job->label);
+	ExchangeFirmwareContext(prev);
+	
+	memmove(gJobs + index, gJobs + index + 1, (gNJobs - index - 1) * sizeof(Job *));
+	gNJobs--;
+	free(job->image);
+	free(job->label);
+	free(job);
+}
+
+void SetJobClient(unsigned int client) {
+	gJobClient = client;
+}
+
+void PollJobs(void) {
+	unsigned int i = 0;
+	while (i < gNJobs) {
+		if (gJobs[i]->done && gJobs[i]->client == gJobClient) FinishJob(i);
+		else i++;
+	}
+}
+
+void WaitJobs(int cancel) {
+	if (cancel) {
+		for (unsigned int i = 0; i < gNJobs; i++) gJobs[i]->progress.cancel = 1;
+	}
+	while (gNJobs > 0) FinishJob(0);
+}
+
+//
+// Finish the jobs of a client or of an image, cancelling them first if cancel is nonzero.
+//
+static void FinishMatchingJobs(int byClient, unsigned int client, const FwContext *ctx, int cancel) {
+	unsigned int i = 0;
+	while (i < gNJobs) {
+		Job *job = gJobs[i];
+		if (byClient ? job->client != client : job->ctx != ctx) {
+			i++;
+			continue;
+		}
+		
+		if (cancel) job->progress.cancel = 1;
+		FinishJob(i);
+	}
+}
+
+void CancelClientJobs(unsigned int client) {
+	FinishMatchingJobs(1, client, NULL, 1);
+}
+
+void CancelImageJobs(const FwContext *ctx) {
+	if (ctx != NULL) FinishMatchingJobs(0, 0, ctx, 1);
+}
+
+int HasImageJobs(const FwContext *ctx) {
+	for (unsigned int i = 0; i < gNJobs; i++) {
+		if (gJobs[i]->ctx == ctx) return 1;
+	}
+	return 0;
+}
+
+static int FindJob(const char *arg) {
+	unsigned int id = (unsigned int) ParseArgNumberULLEx(arg, 10);
+	for (unsigned int i = 0; i < gNJobs; i++) {
+		if (gJobs[i]->id == id && gJobs[i]->client == gJobClient) return i;
+	}
+	
+	printf("No job %s.\n", arg);
+	return -1;
+}
+
+static unsigned int CountClientJobs(void) {
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < gNJobs; i++) {
+		if (gJobs[i]->client == gJobClient) n++;
+	}
+	return n;
+}
+
+void CmdProcJobs(int argc, const char **argv) {
+	(void) argc;
+	(void) argv;
+	
+	PollJobs();
+	if (CountClientJobs() == 0) {
+		puts("No jobs.");
+		return;
+	}
+	
+	double now = ThGetTime();
+	for (unsigned int i = 0; i < gNJobs; i++) {
+		Job *job = gJobs[i];
+		if (job->client != gJobClient) continue;
+		
+		printf("[%d] %5.1fs  %s\n", job->id, now - job->startTime, job->label);
+		
+		//progress is written by the worker thread, so take one reading of each field
+		const char *stage = job->stage;
+		unsigned int pass = job->progress.pass, nPasses = job->progress.nPasses;
+		unsigned int pos = job->progress.pos, size = job->progress.size;
+		if (stage == NULL || size == 0) continue;
+		
+		printf("      %s: pass %d/%d, %08X/%08X bytes (%d%%)\n", stage, pass, nPasses, pos, size, (int) ((uint64_t) pos * 100 / size));
+	}
+}
+
+void CmdProcCancel(int argc, const char **argv) {
+	if (argc < 2) {
+		if (CountClientJobs() == 0) puts("No jobs.");
+		CancelClientJobs(gJobClient);
+		return;
+	}
+	
+	int index = FindJob(argv[1]);
+	if (index < 0) return;
+	
+	gJobs[index]->progress.cancel = 1;
+	FinishJob(index);
+}
+
+void CmdProcWait(int argc, const char **argv) {
+	if (argc < 2) {
+		FinishMatchingJobs(1, gJobClient, NULL, 0);
+		return;
+	}
+	
+	int index = FindJob(argv[1]);
+	if (index < 0) return;
+	
+	FinishJob(index);
+}
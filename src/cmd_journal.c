@@ -0,0 +1,126 @@
+#include "cmd_common.h"
+#include "libfwutil.h"
+
+void CmdHelpUndo(void) {
+	puts("");
+	puts("Usage: undo [count]");
+	puts("");
+	puts("Undoes the last change to the firmware image, or the last count changes. Every");
+	puts("command that modifies the image is recorded as one change. Only the 4KB pages");
+	puts("the change modified are restored. Loading an image clears the history.");
+}
+
+void CmdHelpRedo(void) {
+	puts("");
+	puts("Usage: redo [count]");
+	puts("");
+	puts("Redoes the last undone change to the firmware image, or the last count undone");
+	puts("changes. Making a new change discards the changes that could be redone.");
+}
+
+void CmdHelpSnapshot(void) {
+	puts("");
+	puts("Usage: snapshot [name]");
+	puts("");
+	puts("Saves the current state of the firmware image under a name, replacing any");
+	puts("snapshot of the same name. Snapshots share unchanged pages with the image, so");
+	puts("they are cheap to take. Without a name, the snapshots are listed with the number");
+	puts("of pages that differ from the current image.");
+}
+
+void CmdHelpRevert(void) {
+	puts("");
+	puts("Usage: revert <name>");
+	puts("");
+	puts("Reverts the firmware image to a snapshot taken with the snapshot command. Only");
+	puts("the pages that differ from the snapshot are restored. The revert is recorded as");
+	puts("a change, so it can be undone.");
+}
+
+static void PrintJournalEntry(const char *action, const FwEditInfo *edit) {
+	printf("%s '%s' (%d page%s).\n", action, edit->label, edit->nPages, edit->nPages == 1 ? "" : "s");
+}
+
+static int ParseJournalCount(int argc, const char **argv) {
+	if (argc < 2) return 1;
+	
+	int count = (int) ParseArgNumberULLEx(argv[1], 10);
+	return count < 1 ? 1 : count;
+}
+
+void CmdProcUndo(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	int count = ParseJournalCount(argc, argv);
+	for (int i = 0; i < count; i++) {
+		FwEditInfo edit;
+		if (FwUndo(GetFirmwareContext(), &edit) != FW_OK) {
+			puts("Nothing to undo.");
+			break;
+		}
+		PrintJournalEntry("Undid", &edit);
+	}
+}
+
+void CmdProcRedo(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	int count = ParseJournalCount(argc, argv);
+	for (int i = 0; i < count; i++) {
+		FwEditInfo edit;
+		if (FwRedo(GetFirmwareContext(), &edit) != FW_OK) {
+			puts("Nothing to redo.");
+			break;
+		}
+		PrintJournalEntry("Redid", &edit);
+	}
+}
+
+void CmdProcSnapshot(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	FwContext *ctx = GetFirmwareContext();
+	if (argc < 2) {
+		unsigned int nSnapshots = FwGetSnapshotCount(ctx);
+		if (nSnapshots == 0) {
+			puts("No snapshots.");
+			return;
+		}
+		
+		for (unsigned int i = 0; i < nSnapshots; i++) {
+			FwSnapshotInfo snapshot;
+			FwGetSnapshot(ctx, i, &snapshot);
+			printf("  %-16s %d page%s differ\n", snapshot.name, snapshot.nPagesDiffer, snapshot.nPagesDiffer == 1 ? "" : "s");
+		}
+		return;
+	}
+	
+	FwStatus status = FwTakeSnapshot(ctx, argv[1]);
+	if (status != FW_OK) {
+		printf("Could not save snapshot '%s': %s.\n", argv[1], FwGetStatusString(status));
+		return;
+	}
+	printf("Saved snapshot '%s'.\n", argv[1]);
+}
+
+void CmdProcRevert(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 2) {
+		CmdHelpRevert();
+		return;
+	}
+	
+	unsigned int nPages;
+	FwStatus status = FwRevert(GetFirmwareContext(), argv[1], &nPages);
+	if (status == FW_ERR_NOT_FOUND) {
+		printf("No snapshot named '%s'.\n", argv[1]);
+		return;
+	}
+	if (status != FW_OK) {
+		printf("Could not revert to '%s': %s.\n", argv[1], FwGetStatusString(status));
+		return;
+	}
+	
+	printf("Reverted to '%s' (%d page%s).\n", argv[1], nPages, nPages == 1 ? "" : "s");
+}
@@ -1,5 +1,6 @@
 #include "cmd_common.h"
 #include "firmware.h"
+#include "libfwutil.h"
 
 void CmdHelpLoad(void) {
 	puts("");
@@ -18,6 +19,29 @@ void CmdProcLoad(int argc, const char **argv) {
 	LoadFirmwareImage(filename);
 }
 
+void CmdHelpUse(void) {
+	puts("");
+	puts("Usage: use <file name>");
+	puts("");
+	puts("Switches to a firmware image that is already open, with its unsaved changes and");
+	puts("undo history, or loads it if it is not open. Images stay open only when fwutil");
+	puts("runs as a server, where each connection has its own current image.");
+}
+
+void CmdProcUse(int argc, const char **argv) {
+	if (argc < 2) {
+		CmdHelpUse();
+		return;
+	}
+	
+	const char *filename = argv[1];
+	if (SelectFirmwareImage(filename)) {
+		printf("Using %s.\n", filename);
+	} else {
+		LoadFirmwareImage(filename);
+	}
+}
+
 void CmdHelpSave(void) {
 	puts("");
 	puts("Usage: save [file name]");
@@ -33,14 +57,7 @@ void CmdProcSave(int argc, const char **argv) {
 		outpath = argv[1];
 	}
 	
-	unsigned int size;
-	unsigned char *buffer = GetFirmwareImage(&size);
-	
-	FILE *fp = fopen(outpath, "wb");
-	if (fp == NULL) {
+	if (FwSaveFile(GetFirmwareContext(), outpath) != FW_OK) {
 		printf("Could not open '%s' for write access.\n", outpath);
 	}
-	
-	fwrite(buffer, size, 1, fp);
-	fclose(fp);
 }
@@ -1,11 +1,20 @@
 #include "cmd_common.h"
 #include "firmware.h"
 
+#include <string.h>
+
 void CmdHelpMap(void) {
 	puts("");
 	puts("Usage: map");
+	puts("       map plan [-m <bytes>]");
 	puts("");
 	puts("Prints a map of the firmware image's address space.");
+	puts("");
+	puts("With plan, prints the module layout that leaves the largest contiguous free");
+	puts("region below the connection settings, searching all module orders and address");
+	puts("scales. With -m, prints instead the layout that moves the fewest bytes of module");
+	puts("data while leaving a free region of at least the specified size (hexadecimal).");
+	puts("The plan is used by compact and import.");
 }
 
 typedef struct Region_ {
@@ -23,11 +32,63 @@ static int RegionComparator(const void *e1, const void *e2) {
 	return 0;
 }
 
+static void MapPlan(int argc, const char **argv) {
+	int objective = FW_LAYOUT_MAX_FREE;
+	uint32_t minFree = 0;
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-m") == 0 && (i + 1) < argc) {
+			objective = FW_LAYOUT_MIN_MOVED;
+			minFree = ParseArgNumber(argv[++i]);
+		} else {
+			printf("Unrecognized argument %s.\n", argv[i]);
+			return;
+		}
+	}
+	
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	
+	uint32_t romAddrs[FW_MODULE_COUNT], compSizes[FW_MODULE_COUNT];
+	if (!GetFirmwareModuleExtents(buffer, size, romAddrs, compSizes)) {
+		puts("The firmware modules could not be read.");
+		return;
+	}
+	
+	FirmwareLayout layout;
+	if (!PlanFirmwareLayout(buffer, size, compSizes, objective, minFree, &layout)) {
+		puts("The firmware modules do not fit below the connection settings.");
+		return;
+	}
+	
+	const char *const modnames[] = { "ARM9 Static", "ARM7 Static", "ARM9 Secondary", "ARM7 Secondary", "Resources Pack" };
+	uint32_t limit = GetFirmwareModuleLimit(buffer, size);
+	
+	puts("");
+	puts("Module            Current   Planned   Size");
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		printf("%-16s  %08X  %08X  %08X%s\n", modnames[i], romAddrs[i], layout.romAddrs[i], compSizes[i],
+			layout.romAddrs[i] != romAddrs[i] ? "  (moved)" : "");
+	}
+	puts("");
+	printf("Largest free region: %08X -> %08X\n", GetLargestFreeRegion(romAddrs, compSizes, limit), layout.largestFree);
+	printf("Bytes moved        : %08X\n", layout.bytesMoved);
+	if (objective == FW_LAYOUT_MIN_MOVED && layout.largestFree < minFree) {
+		printf("No layout leaves %08X bytes free.\n", minFree);
+	}
+}
+
 void CmdProcMap(int argc, const char **argv) {
 	//map out the firmware address regions.
 	if (!RequireFirmwareImage()) return;
-	(void) argc;
-	(void) argv;
+	
+	if (argc >= 2) {
+		if (strcmp(argv[1], "plan") == 0) {
+			MapPlan(argc, argv);
+		} else {
+			CmdHelpMap();
+		}
+		return;
+	}
 	
 	unsigned int size;
 	unsigned char *buffer = GetFirmwareImage(&size);
@@ -0,0 +1,411 @@
+#include "cmd_common.h"
+#include "firmware.h"
+#include "blowfish.h"
+#include "compression.h"
+#include "delta.h"
+
+#include <string.h>
+
+#define PATCH_MAGIC           "FWPT"
+#define PATCH_VERSION         1
+
+#define PATCH_SECTION_HEADER  0 // byte runs in the flash header and wireless table (0x000-0x1FF)
+#define PATCH_SECTION_NCD     1 // byte runs in the user configuration (both copies)
+#define PATCH_SECTION_MODULE  2 // copy/insert operations against a decoded module
+
+#define PATCH_RUN_GAP         8 // differing bytes closer than this are merged into one run
+
+typedef struct PatchWriter_ {
+	unsigned char *buf;
+	unsigned int size;
+	unsigned int capacity;
+} PatchWriter;
+
+typedef struct PatchReader_ {
+	const unsigned char *buf;
+	unsigned int size;
+	unsigned int pos;
+	int error;
+} PatchReader;
+
+void CmdHelpMkPatch(void) {
+	puts("");
+	puts("Usage: mkpatch <target file name> <patch file name>");
+	puts("");
+	puts("Creates a patch that turns the current firmware image into the target image.");
+	puts("Modules are compared decompressed and stored as copy/insert operations against");
+	puts("the current image's modules. Changed bytes of the header, wireless table and user");
+	puts("configuration are stored individually, so the patch does not overwrite bytes that");
+	puts("differ between consoles unless the target changes them.");
+}
+
+void CmdHelpApplyPatch(void) {
+	puts("");
+	puts("Usage: applypatch <patch file name>");
+	puts("");
+	puts("Applies a patch created by mkpatch to the current firmware image. The patched");
+	puts("modules are rebuilt, recompressed and re-encrypted, the modules are laid out");
+	puts("again and the module, wireless table and user configuration CRCs are updated.");
+	puts("The patch is only applied if every module it changes matches the module it was");
+	puts("created against.");
+}
+
+// ----- patch encoding
+
+static void PatchWrite(PatchWriter *writer, const void *data, unsigned int size) {
+	if ((writer->size + size) > writer->capacity) {
+		while ((writer->size + size) > writer->capacity) writer->capacity = writer->capacity ? writer->capacity * 2 : 0x1000;
+		writer->buf = realloc(writer->buf, writer->capacity);
+	}
+	memcpy(writer->buf + writer->size, data, size);
+	writer->size += size;
+}
+
+static void PatchWrite32(PatchWriter *writer, uint32_t n) {
+	unsigned char bytes[4] = { n & 0xFF, (n >> 8) & 0xFF, (n >> 16) & 0xFF, n >> 24 };
+	PatchWrite(writer, bytes, sizeof(bytes));
+}
+
+static void PatchWriteSectionHeader(PatchWriter *writer, int kind, int index) {
+	unsigned char bytes[4] = { kind, index, 0, 0 };
+	PatchWrite(writer, bytes, sizeof(bytes));
+}
+
+static const unsigned char *PatchRead(PatchReader *reader, unsigned int size) {
+	if (reader->error || size > (reader->size - reader->pos)) {
+		reader->error = 1;
+		return NULL;
+	}
+	const unsigned char *p = reader->buf + reader->pos;
+	reader->pos += size;
+	return p;
+}
+
+static uint32_t PatchRead32(PatchReader *reader) {
+	const unsigned char *p = PatchRead(reader, 4);
+	if (p == NULL) return 0;
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+//
+// Write the runs of differing bytes of a region. Returns the number of runs written.
+//
+static int PatchWriteRuns(PatchWriter *writer, int kind, const unsigned char *base, const unsigned char *target, unsigned int size) {
+	PatchWriter runs = { 0 };
+	int nRuns = 0;
+	
+	unsigned int i = 0;
+	while (i < size) {
+		if (base[i] == target[i]) {
+			i++;
+			continue;
+		}
+		
+		unsigned int start = i, end = i + 1;
+		for (unsigned int j = end; j < size && j < (end + PATCH_RUN_GAP); j++) {
+			if (base[j] != target[j]) end = j + 1;
+		}
+		
+		PatchWrite32(&runs, start);
+		PatchWrite32(&runs, end - start);
+		PatchWrite(&runs, target + start, end - start);
+		nRuns++;
+		i = end;
+	}
+	
+	if (nRuns > 0) {
+		PatchWriteSectionHeader(writer, kind, 0);
+		PatchWrite32(writer, nRuns);
+		PatchWrite(writer, runs.buf, runs.size);
+	}
+	if (runs.buf != NULL) free(runs.buf);
+	return nRuns;
+}
+
+static void PatchWriteModule(PatchWriter *writer, int index, const FirmwareModule *base, const FirmwareModule *target) {
+	unsigned char digest[16];
+	
+	PatchWriteSectionHeader(writer, PATCH_SECTION_MODULE, index);
+	ComputeMd5(base->data, base->uncompressed, digest);
+	PatchWrite(writer, digest, sizeof(digest));
+	ComputeMd5(target->data, target->uncompressed, digest);
+	PatchWrite(writer, digest, sizeof(digest));
+	PatchWrite32(writer, target->uncompressed);
+	PatchWrite32(writer, target->type);
+	
+	unsigned int nOps;
+	DlOp *ops = DlComputeDelta(base->data, base->uncompressed, target->data, target->uncompressed, &nOps);
+	PatchWrite32(writer, nOps);
+	for (unsigned int i = 0; i < nOps; i++) {
+		//operation type in the low bit of the length word
+		PatchWrite32(writer, (ops[i].length << 1) | (ops[i].type == DL_OP_INSERT));
+		if (ops[i].type == DL_OP_COPY) PatchWrite32(writer, ops[i].srcOffset);
+		else PatchWrite(writer, target->data + ops[i].dstOffset, ops[i].length);
+	}
+	free(ops);
+}
+
+void CmdProcMkPatch(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 3) {
+		CmdHelpMkPatch();
+		return;
+	}
+	
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	
+	FILE *fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		printf("Could not open file '%s' for read acces.\n", argv[1]);
+		return;
+	}
+	fseek(fp, 0, SEEK_END);
+	unsigned int targetSize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	unsigned char *target = malloc(targetSize);
+	unsigned int nRead = fread(target, 1, targetSize, fp);
+	fclose(fp);
+	
+	if (nRead != targetSize || targetSize != size) {
+		printf("The target image must be the same size as the current image (%d bytes).\n", size);
+		free(target);
+		return;
+	}
+	
+	FirmwareModule baseMods[FW_MODULE_COUNT], targetMods[FW_MODULE_COUNT];
+	GetFirmwareModules(buffer, size, baseMods);
+	GetFirmwareModules(target, size, targetMods);
+	
+	PatchWriter writer = { 0 };
+	PatchWrite(&writer, PATCH_MAGIC, 4);
+	PatchWrite32(&writer, PATCH_VERSION);
+	
+	int nSections = 0, nModules = 0;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (baseMods[i].data == NULL || targetMods[i].data == NULL) {
+			printf("Could not decompress module %d of both images.\n", i);
+			goto End;
+		}
+		if (baseMods[i].uncompressed == targetMods[i].uncompressed && memcmp(baseMods[i].data, targetMods[i].data, baseMods[i].uncompressed) == 0) continue;
+		
+		PatchWriteModule(&writer, i, &baseMods[i], &targetMods[i]);
+		nSections++;
+		nModules++;
+	}
+	
+	if (PatchWriteRuns(&writer, PATCH_SECTION_HEADER, buffer, target, 0x200)) nSections++;
+	
+	//user configuration, only when it has not moved
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	FlashHeader *targetHdr = (FlashHeader *) target;
+	uint32_t ncdAddr = hdr->nvramUserConfigAddr * 8;
+	if (hdr->nvramUserConfigAddr == targetHdr->nvramUserConfigAddr && (ncdAddr + 0x200) <= size) {
+		if (PatchWriteRuns(&writer, PATCH_SECTION_NCD, buffer + ncdAddr, target + ncdAddr, 0x200)) nSections++;
+	}
+	
+	fp = fopen(argv[2], "wb");
+	if (fp == NULL) {
+		printf("Could not open '%s' for write access.\n", argv[2]);
+		goto End;
+	}
+	fwrite(writer.buf, writer.size, 1, fp);
+	fclose(fp);
+	
+	printf("Wrote patch with %d section(s), %d module(s) changed, %d bytes.\n", nSections, nModules, writer.size);
+
+End:
+	if (writer.buf != NULL) free(writer.buf);
+	FreeFirmwareModules(baseMods);
+	FreeFirmwareModules(targetMods);
+	free(target);
+}
+
+// ----- patch application
+
+static int PatchApplyRuns(PatchReader *reader, unsigned char *region, unsigned int size, int *pTouchedLo, int *pTouchedHi, unsigned int split) {
+	uint32_t nRuns = PatchRead32(reader);
+	for (uint32_t i = 0; i < nRuns && !reader->error; i++) {
+		uint32_t offset = PatchRead32(reader);
+		uint32_t length = PatchRead32(reader);
+		const unsigned char *data = PatchRead(reader, length);
+		if (data == NULL || offset > size || length > (size - offset)) return 0;
+		
+		memcpy(region + offset, data, length);
+		
+		//record which part of the region was touched, for CRC updates
+		if (offset < split) *pTouchedLo = 1;
+		if ((offset + length) > split) *pTouchedHi = 1;
+	}
+	return !reader->error;
+}
+
+static unsigned char *PatchBuildModule(PatchReader *reader, int index, const FirmwareModule *base, unsigned int *pSize, CxCompressionType *pType) {
+	const unsigned char *baseDigest = PatchRead(reader, 16);
+	const unsigned char *targetDigest = PatchRead(reader, 16);
+	uint32_t targetSize = PatchRead32(reader);
+	CxCompressionType type = (CxCompressionType) PatchRead32(reader);
+	uint32_t nOps = PatchRead32(reader);
+	if (reader->error) return NULL;
+	
+	unsigned char digest[16];
+	ComputeMd5(base->data, base->uncompressed, digest);
+	if (memcmp(digest, baseDigest, sizeof(digest)) != 0) {
+		printf("Module %d does not match the module the patch was created against.\n", index);
+		return NULL;
+	}
+	
+	unsigned char *out = malloc(targetSize);
+	uint32_t outPos = 0;
+	for (uint32_t i = 0; i < nOps; i++) {
+		uint32_t word = PatchRead32(reader);
+		uint32_t length = word >> 1;
+		if (reader->error || length > (targetSize - outPos)) goto Error;
+		
+		if (word & 1) {
+			const unsigned char *data = PatchRead(reader, length);
+			if (data == NULL) goto Error;
+			memcpy(out + outPos, data, length);
+		} else {
+			uint32_t srcOffset = PatchRead32(reader);
+			if (reader->error || srcOffset > base->uncompressed || length > (base->uncompressed - srcOffset)) goto Error;
+			memcpy(out + outPos, base->data + srcOffset, length);
+		}
+		outPos += length;
+	}
+	
+	ComputeMd5(out, targetSize, digest);
+	if (outPos != targetSize || memcmp(digest, targetDigest, sizeof(digest)) != 0) goto Error;
+	
+	*pSize = targetSize;
+	*pType = type;
+	return out;
+
+Error:
+	printf("Patch data for module %d is corrupt.\n", index);
+	free(out);
+	return NULL;
+}
+
+void CmdProcApplyPatch(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 2) {
+		CmdHelpApplyPatch();
+		return;
+	}
+	
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	
+	FILE *fp = fopen(argv[1], "rb");
+	if (fp == NULL) {
+		printf("Could not open file '%s' for read acces.\n", argv[1]);
+		return;
+	}
+	fseek(fp, 0, SEEK_END);
+	unsigned int patchSize = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	unsigned char *patch = malloc(patchSize);
+	unsigned int nRead = fread(patch, 1, patchSize, fp);
+	fclose(fp);
+	
+	//the image is patched in a copy, so that a failed patch leaves it unchanged
+	unsigned char *image = malloc(size);
+	memcpy(image, buffer, size);
+	
+	FirmwareModule mods[FW_MODULE_COUNT];
+	GetFirmwareModules(buffer, size, mods);
+	
+	unsigned char *comps[FW_MODULE_COUNT] = { 0 };
+	uint32_t compSizes[FW_MODULE_COUNT] = { 0 };
+	unsigned char *patched[FW_MODULE_COUNT] = { 0 };
+	uint32_t patchedSizes[FW_MODULE_COUNT] = { 0 };
+	CxCompressionType patchedTypes[FW_MODULE_COUNT] = { 0 };
+	int wlTouched = 0, ncdTouched[2] = { 0 }, nModules = 0;
+	
+	PatchReader reader = { patch, nRead, 0, 0 };
+	const unsigned char *magic = PatchRead(&reader, 4);
+	if (nRead != patchSize || magic == NULL || memcmp(magic, PATCH_MAGIC, 4) != 0 || PatchRead32(&reader) != PATCH_VERSION) {
+		printf("'%s' is not a firmware patch.\n", argv[1]);
+		goto End;
+	}
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (mods[i].data == NULL) {
+			printf("Could not decompress module %d.\n", i);
+			goto End;
+		}
+	}
+	
+	//decode sections
+	while (reader.pos < reader.size) {
+		const unsigned char *section = PatchRead(&reader, 4);
+		if (section == NULL) break;
+		
+		int kind = section[0], index = section[1];
+		if (kind == PATCH_SECTION_HEADER) {
+			int hdrTouched = 0;
+			if (!PatchApplyRuns(&reader, image, 0x200, &hdrTouched, &wlTouched, 0x2A)) break;
+		} else if (kind == PATCH_SECTION_NCD) {
+			FlashHeader *hdr = (FlashHeader *) image;
+			uint32_t ncdAddr = hdr->nvramUserConfigAddr * 8;
+			if ((ncdAddr + 0x200) > size) {
+				puts("The image has no user configuration to patch.");
+				goto End;
+			}
+			if (!PatchApplyRuns(&reader, image + ncdAddr, 0x200, &ncdTouched[0], &ncdTouched[1], 0x100)) break;
+		} else if (kind == PATCH_SECTION_MODULE && index < FW_MODULE_COUNT && patched[index] == NULL) {
+			patched[index] = PatchBuildModule(&reader, index, &mods[index], &patchedSizes[index], &patchedTypes[index]);
+			if (patched[index] == NULL) goto End;
+			nModules++;
+		} else {
+			reader.error = 1;
+			break;
+		}
+	}
+	if (reader.error) {
+		puts("The patch is corrupt.");
+		goto End;
+	}
+	
+	//compress patched modules; carry the others over, re-encrypting the static modules in case the key changed
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (patched[i] != NULL) {
+			comps[i] = CompressFirmwareModule(image, i, patchedTypes[i], patched[i], patchedSizes[i], &compSizes[i]);
+			continue;
+		}
+		
+		compSizes[i] = mods[i].size;
+		comps[i] = malloc(compSizes[i]);
+		memcpy(comps[i], buffer + mods[i].romAddr, compSizes[i]);
+		if (i == FW_MODULE_ARM9_STATIC || i == FW_MODULE_ARM7_STATIC) {
+			BfDecrypt(comps[i], compSizes[i], buffer);
+			BfEncrypt(comps[i], compSizes[i], image);
+		}
+	}
+	
+	if (!RelayoutFirmwareModules(image, size, comps, compSizes)) {
+		puts("The patched modules do not fit in the image.");
+		goto End;
+	}
+	
+	UpdateFirmwareModuleChecksums(image, size);
+	if (wlTouched) UpdateWirelessTableChecksum(image);
+	for (int i = 0; i < 2; i++) {
+		if (ncdTouched[i]) UpdateUserConfigChecksum(image, size, i);
+	}
+	
+	memcpy(buffer, image, size);
+	printf("Patch applied, %d module(s) rebuilt.\n", nModules);
+
+End:
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (comps[i] != NULL) free(comps[i]);
+		if (patched[i] != NULL) free(patched[i]);
+	}
+	FreeFirmwareModules(mods);
+	free(image);
+	free(patch);
+}
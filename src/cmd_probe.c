@@ -0,0 +1,85 @@
+#include "cmd_common.h"
+#include "firmware.h"
+
+void CmdHelpProbe(void) {
+	puts("");
+	puts("Usage: probe <file name...>");
+	puts("");
+	puts("Prints the image type, module locations and header-declared module sizes of one");
+	puts("or more firmware image files. Only the flash header, the module headers and the");
+	puts("user configuration version are read from each file, so this may be used to");
+	puts("quickly triage large numbers of images. The working image is not changed.");
+}
+
+static unsigned int ProbeFileReadCallback(void *arg, uint32_t offset, void *dest, unsigned int size) {
+	FILE *fp = (FILE *) arg;
+	if (fseek(fp, offset, SEEK_SET) != 0) return 0;
+	
+	return fread(dest, 1, size, fp);
+}
+
+static const char *GetCompressionTypeString(CxCompressionType type) {
+	switch (type) {
+		case CX_COMPRESSION_LZ:
+			return "LZ";
+		case CX_COMPRESSION_ASH:
+			return "ASH";
+		default:
+			return "-";
+	}
+}
+
+static void ProbeFile(const char *path) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Could not open file '%s' for read acces.\n", path);
+		return;
+	}
+	
+	fseek(fp, 0, SEEK_END);
+	unsigned int size = ftell(fp);
+	
+	FirmwareProbeInfo info;
+	if (size < (4 * 1024) || !ProbeFirmware(ProbeFileReadCallback, fp, size, &info)) {
+		printf("%s: Invalid firmware image size (%d bytes).\n", path, size);
+		fclose(fp);
+		return;
+	}
+	fclose(fp);
+	
+	FlashHeader *hdr = (FlashHeader *) info.header;
+	FirmwareProbeModule *mods = info.modules;
+	
+	printf("%s:\n", path);
+	printf("  Image type            : %s\n", GetIpl2TypeString(hdr->ipl2Type));
+	printf("  IPL2 type             : %02X\n", hdr->ipl2Type);
+	printf("  Build date            : 20%02X/%02X/%02X %02X:%02X\n", hdr->timestamp[4], hdr->timestamp[3], hdr->timestamp[2], hdr->timestamp[1], hdr->timestamp[0]);
+	printf("  Flash capacity        : %d KB (image %d KB)\n", 128 << hdr->flashCapacity, size / 1024);
+	printf("  Module                : Offset   Type  Address  Compressed Uncompressed\n");
+	printf("    ARM9 Static         : %08X %-5s %08X %-10s %08X\n", mods[FW_MODULE_ARM9_STATIC].romAddr, GetCompressionTypeString(mods[FW_MODULE_ARM9_STATIC].type), mods[FW_MODULE_ARM9_STATIC].ramAddr, "-", mods[FW_MODULE_ARM9_STATIC].uncompressed);
+	printf("    ARM7 Static         : %08X %-5s %08X %-10s %08X\n", mods[FW_MODULE_ARM7_STATIC].romAddr, GetCompressionTypeString(mods[FW_MODULE_ARM7_STATIC].type), mods[FW_MODULE_ARM7_STATIC].ramAddr, "-", mods[FW_MODULE_ARM7_STATIC].uncompressed);
+	
+	const char *const secondaryNames[] = { "ARM9 Secondary", "ARM7 Secondary", "Resources Pack" };
+	for (int i = FW_MODULE_ARM9_SECONDARY; i < FW_MODULE_COUNT; i++) {
+		FirmwareProbeModule *mod = &mods[i];
+		printf("    %-19s : %08X %-5s %-8s ", secondaryNames[i - FW_MODULE_ARM9_SECONDARY], mod->romAddr, GetCompressionTypeString(mod->type), "-");
+		if (mod->type == CX_COMPRESSION_ASH) printf("%08X   ", mod->compressed);
+		else printf("%-10s ", "-");
+		printf("%08X\n", mod->uncompressed);
+	}
+	
+	printf("  User config           : %08X (version %d, %d)\n", info.ncdAddr, info.ncdVersion[0], info.ncdVersion[1]);
+	printf("  Bytes read            : %d\n", info.nBytesRead);
+}
+
+void CmdProcProbe(int argc, const char **argv) {
+	if (argc < 2) {
+		CmdHelpProbe();
+		return;
+	}
+	
+	for (int i = 1; i < argc; i++) {
+		puts("");
+		ProbeFile(argv[i]);
+	}
+}
@@ -0,0 +1,543 @@
+#include "cmd_common.h"
+#include "firmware.h"
+#include "libfwutil.h"
+#include "thread.h"
+
+#include <string.h>
+#include <time.h>
+
+#define PROVISION_POOL_MAGIC   "fwutil-macpool 1"
+#define PROVISION_DEFAULT_POOL "macpool.txt"
+#define PROVISION_DEFAULT_LOG  "provision.log"
+
+#define PROVISION_MAX_BBP      16
+
+void CmdHelpProvision(void) {
+	puts("");
+	puts("Usage: provision <template> <image...> [flags...]");
+	puts("       provision pool <OUI> <first> <last> [-p <pool>]");
+	puts("");
+	puts("Provisions many firmware image files at once. Each image gets a MAC address");
+	puts("allocated from the MAC pool and the settings of the template. The wireless table");
+	puts("and user configuration CRCs are updated. The images are processed in parallel");
+	puts("and written back in place unless -o is given. An image argument may be a");
+	puts("directory, in which case every file in it is provisioned. Every image is");
+	puts("recorded in the audit log.");
+	puts("");
+	puts("The MAC pool holds a range of addresses for each OUI. Addresses are allocated");
+	puts("in order and never handed out twice. The OUI is chosen by the generation of the");
+	puts("image's wireless module. Use provision pool to add or change the range of an OUI.");
+	puts("");
+	puts("The template has one setting per line:");
+	puts("  nickname <text>        Owner nickname (up to 10 characters)");
+	puts("  comment <text>         Owner comment (up to 26 characters)");
+	puts("  color <0-15>           Favorite color");
+	puts("  birthday <month> <day> Owner birthday");
+	puts("  language <0-7>         Language");
+	puts("  channels <mask>        Allowed wireless channel mask");
+	puts("  bbp <register> <value> BBP initialization register value");
+	puts("");
+	puts("Flags:");
+	puts("  -p     MAC pool file to use (default " PROVISION_DEFAULT_POOL ").");
+	puts("  -l     Audit log to append to (default " PROVISION_DEFAULT_LOG ").");
+	puts("  -o     Directory to write the provisioned images to.");
+	puts("  -j     Number of threads to use (default one per processor).");
+}
+
+// ----- template
+
+typedef struct ProvisionTemplate_ {
+	int hasNickname;
+	uint16_t nickname[10];
+	uint8_t nicknameLength;
+	int hasComment;
+	uint16_t comment[26];
+	uint8_t commentLength;
+	int color;                              // -1 if not set
+	int birthdayMonth;                      // 0 if not set
+	int birthdayDay;
+	int language;                           // -1 if not set
+	int hasChannels;
+	uint16_t channels;
+	int nBbp;
+	uint8_t bbpRegs[PROVISION_MAX_BBP];
+	uint8_t bbpValues[PROVISION_MAX_BBP];
+} ProvisionTemplate;
+
+static unsigned int ProvisionSetString(uint16_t *dest, unsigned int maxLen, const char *text) {
+	unsigned int len = 0;
+	memset(dest, 0, maxLen * sizeof(uint16_t));
+	while (text[len] != '\0' && len < maxLen) {
+		dest[len] = (unsigned char) text[len];
+		len++;
+	}
+	return len;
+}
+
+static int ProvisionLoadTemplate(const char *path, ProvisionTemplate *tmpl) {
+	memset(tmpl, 0, sizeof(*tmpl));
+	tmpl->color = -1;
+	tmpl->language = -1;
+	
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		printf("Could not open template '%s'.\n", path);
+		return 0;
+	}
+	
+	char line[256];
+	int lineNo = 0, ok = 1;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		lineNo++;
+		
+		int n;
+		unsigned int a, b;
+		if (line[0] == '\0' || line[0] == '#') {
+			continue;
+		} else if (strncmp(line, "nickname ", 9) == 0) {
+			tmpl->hasNickname = 1;
+			tmpl->nicknameLength = ProvisionSetString(tmpl->nickname, 10, line + 9);
+		} else if (strncmp(line, "comment ", 8) == 0) {
+			tmpl->hasComment = 1;
+			tmpl->commentLength = ProvisionSetString(tmpl->comment, 26, line + 8);
+		} else if (sscanf(line, "color %d", &n) == 1 && n >= 0 && n < 16) {
+			tmpl->color = n;
+		} else if (sscanf(line, "birthday %u %u", &a, &b) == 2 && a >= 1 && a <= 12 && b >= 1 && b <= 31) {
+			tmpl->birthdayMonth = a;
+			tmpl->birthdayDay = b;
+		} else if (sscanf(line, "language %d", &n) == 1 && n >= 0 && n < 8) {
+			tmpl->language = n;
+		} else if (sscanf(line, "channels %i", &n) == 1) {
+			tmpl->hasChannels = 1;
+			tmpl->channels = n;
+		} else if (sscanf(line, "bbp %i %i", &a, &b) == 2 && a < sizeof(((FlashRfBbInfo *) 0)->bbInitRegs) && tmpl->nBbp < PROVISION_MAX_BBP) {
+			tmpl->bbpRegs[tmpl->nBbp] = a;
+			tmpl->bbpValues[tmpl->nBbp] = b;
+			tmpl->nBbp++;
+		} else {
+			printf("%s(%d): invalid template setting.\n", path, lineNo);
+			ok = 0;
+		}
+	}
+	fclose(fp);
+	return ok;
+}
+
+// ----- MAC pool
+
+typedef struct ProvisionPoolEntry_ {
+	unsigned char oui[3];
+	uint32_t first;                         // range of the low 24 bits
+	uint32_t last;
+	uint32_t next;                          // next address to allocate, last + 1 when exhausted
+} ProvisionPoolEntry;
+
+typedef struct ProvisionPool_ {
+	ProvisionPoolEntry *entries;
+	int nEntries;
+} ProvisionPool;
+
+static int ProvisionParseOui(const char *str, unsigned char *oui) {
+	unsigned int nDigits = 0;
+	memset(oui, 0, 3);
+	for (; *str; str++) {
+		char c = *str;
+		if (c == '-' || c == ':' || c == '.') continue;
+		
+		int digit = -1;
+		if (c >= '0' && c <= '9') digit = (c - '0') + 0x0;
+		if (c >= 'a' && c <= 'f') digit = (c - 'a') + 0xA;
+		if (c >= 'A' && c <= 'F') digit = (c - 'A') + 0xA;
+		if (digit == -1 || nDigits >= 6) return 0;
+		
+		oui[nDigits / 2] |= digit << (4 - 4 * (nDigits & 1));
+		nDigits++;
+	}
+	return nDigits == 6;
+}
+
+static ProvisionPoolEntry *ProvisionFindPool(ProvisionPool *pool, const unsigned char *oui) {
+	for (int i = 0; i < pool->nEntries; i++) {
+		if (memcmp(pool->entries[i].oui, oui, 3) == 0) return &pool->entries[i];
+	}
+	return NULL;
+}
+
+static int ProvisionLoadPool(const char *path, ProvisionPool *pool, int mustExist) {
+	pool->entries = NULL;
+	pool->nEntries = 0;
+	
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		if (mustExist) printf("Could not open MAC pool '%s'. Use provision pool to create it.\n", path);
+		return !mustExist;
+	}
+	
+	char line[256];
+	int lineNo = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		lineNo++;
+		
+		if (lineNo == 1) {
+			if (strcmp(line, PROVISION_POOL_MAGIC) == 0) continue;
+			printf("'%s' is not a MAC pool.\n", path);
+			fclose(fp);
+			return 0;
+		}
+		
+		char ouiStr[16];
+		unsigned char oui[3];
+		uint32_t first, last, next;
+		if (sscanf(line, "pool %15s %x %x %x", ouiStr, &first, &last, &next) == 4 && ProvisionParseOui(ouiStr, oui) && first <= last && last <= 0xFFFFFF) {
+			pool->entries = realloc(pool->entries, (pool->nEntries + 1) * sizeof(ProvisionPoolEntry));
+			ProvisionPoolEntry *entry = &pool->entries[pool->nEntries++];
+			memcpy(entry->oui, oui, 3);
+			entry->first = first;
+			entry->last = last;
+			entry->next = next;
+		} else if (line[0] != '\0') {
+			printf("%s(%d): unrecognized pool entry.\n", path, lineNo);
+			fclose(fp);
+			return 0;
+		}
+	}
+	fclose(fp);
+	return 1;
+}
+
+static int ProvisionSavePool(const char *path, const ProvisionPool *pool) {
+	//write a new file and rename it over the pool, so that an interrupted write does not lose the pool
+	char *tmpPath = malloc(strlen(path) + 5);
+	sprintf(tmpPath, "%s.tmp", path);
+	
+	FILE *fp = fopen(tmpPath, "wb");
+	if (fp == NULL) {
+		printf("Could not open '%s' for write access.\n", tmpPath);
+		free(tmpPath);
+		return 0;
+	}
+	
+	fprintf(fp, "%s\n", PROVISION_POOL_MAGIC);
+	for (int i = 0; i < pool->nEntries; i++) {
+		const ProvisionPoolEntry *entry = &pool->entries[i];
+		fprintf(fp, "pool %02X-%02X-%02X %06X %06X %06X\n", entry->oui[0], entry->oui[1], entry->oui[2], entry->first, entry->last, entry->next);
+	}
+	int ok = fflush(fp) == 0;
+	fclose(fp);
+	
+	if (!ok || !RenameOverFile(tmpPath, path)) {
+		printf("Could not write MAC pool '%s'.\n", path);
+		ok = 0;
+	}
+	free(tmpPath);
+	return ok;
+}
+
+//
+// Allocate the next address of an image's wireless module generation. Returns 0 when the pools of
+// all OUIs of the generation are exhausted.
+//
+static int ProvisionAllocateMac(ProvisionPool *pool, int gen, unsigned char *mac) {
+	const unsigned char (*ouis)[3];
+	int nOuis = GetWirelessOuis(gen, &ouis);
+	
+	for (int i = 0; i < nOuis; i++) {
+		ProvisionPoolEntry *entry = ProvisionFindPool(pool, ouis[i]);
+		if (entry == NULL || entry->next < entry->first || entry->next > entry->last) continue;
+		
+		memcpy(mac, entry->oui, 3);
+		mac[3] = (entry->next >> 16) & 0xFF;
+		mac[4] = (entry->next >>  8) & 0xFF;
+		mac[5] = (entry->next >>  0) & 0xFF;
+		entry->next++;
+		return 1;
+	}
+	return 0;
+}
+
+static void ProvisionSetPool(const char *path, const char *ouiStr, const char *firstStr, const char *lastStr) {
+	unsigned char oui[3];
+	if (!ProvisionParseOui(ouiStr, oui)) {
+		printf("Invalid OUI '%s'.\n", ouiStr);
+		return;
+	}
+	
+	uint32_t first = ParseArgNumberULLEx(firstStr, 16);
+	uint32_t last = ParseArgNumberULLEx(lastStr, 16);
+	if (first > last || last > 0xFFFFFF) {
+		puts("The range must be within 000000-FFFFFF.");
+		return;
+	}
+	
+	//the pool is locked from loading to saving, so that no other process hands out the same addresses
+	ProvisionPool pool = { 0 };
+	FileLock *lock = LockSharedFile(path);
+	if (lock == NULL) {
+		printf("Could not lock MAC pool '%s'.\n", path);
+		return;
+	}
+	if (!ProvisionLoadPool(path, &pool, 0)) goto End;
+	
+	ProvisionPoolEntry *entry = ProvisionFindPool(&pool, oui);
+	if (entry == NULL) {
+		pool.entries = realloc(pool.entries, (pool.nEntries + 1) * sizeof(ProvisionPoolEntry));
+		entry = &pool.entries[pool.nEntries++];
+		memcpy(entry->oui, oui, 3);
+		entry->next = first;
+	}
+	
+	//addresses that were already allocated in the range stay allocated
+	entry->first = first;
+	entry->last = last;
+	if (entry->next < first) entry->next = first;
+	
+	if (ProvisionSavePool(path, &pool)) {
+		printf("Pool %02X-%02X-%02X: %06X-%06X, next %06X.\n", oui[0], oui[1], oui[2], first, last, entry->next);
+	}
+
+End:
+	UnlockSharedFile(lock);
+	if (pool.entries != NULL) free(pool.entries);
+}
+
+// ----- provisioning
+
+typedef struct ProvisionImage_ {
+	const char *path;
+	int gen;                                // wireless module generation, -1 if the image is unusable
+	unsigned char mac[6];
+	int hasMac;
+	const char *status;                     // result, printed and logged after all images are done
+} ProvisionImage;
+
+typedef struct ProvisionContext_ {
+	const ProvisionTemplate *tmpl;
+	const char *outDir;
+	ProvisionImage *images;
+	unsigned int nImages;
+} ProvisionContext;
+
+static void ProvisionApplyUserConfig(const ProvisionTemplate *tmpl, FlashUserConfigData *ncd, int hasExConfig) {
+	if (tmpl->hasNickname) {
+		memcpy(ncd->nickname, tmpl->nickname, sizeof(ncd->nickname));
+		ncd->nicknameLength = tmpl->nicknameLength;
+		ncd->hasNickname = 1;
+	}
+	if (tmpl->hasComment) {
+		memcpy(ncd->comment, tmpl->comment, sizeof(ncd->comment));
+		ncd->commentLength = tmpl->commentLength;
+	}
+	if (tmpl->color != -1) {
+		ncd->favoriteColor = tmpl->color;
+		ncd->hasFavoriteColor = 1;
+	}
+	if (tmpl->birthdayMonth) {
+		ncd->birthday.month = tmpl->birthdayMonth;
+		ncd->birthday.day = tmpl->birthdayDay;
+	}
+	if (tmpl->language != -1) {
+		ncd->language = tmpl->language;
+		ncd->hasLanguage = 1;
+		if (hasExConfig && ncd->exVersion == 1) ncd->exLanguage = tmpl->language;
+	}
+}
+
+static void ProvisionTask(unsigned int task, void *arg) {
+	ProvisionContext *ctx = (ProvisionContext *) arg;
+	ProvisionImage *image = &ctx->images[task];
+	const ProvisionTemplate *tmpl = ctx->tmpl;
+	if (!image->hasMac) return;
+	
+	//each image is edited in its own context
+	FwContext *fw = FwCreateContext(NULL);
+	if (fw == NULL) {
+		image->status = FwGetStatusString(FW_ERR_NO_MEMORY);
+		return;
+	}
+	FwStatus status = FwLoadFile(fw, image->path);
+	if (status != FW_OK) {
+		image->status = status == FW_ERR_INVALID_IMAGE ? "is not a valid firmware image" : "could not be read";
+		goto End;
+	}
+	
+	unsigned int size;
+	unsigned char *buffer = FwGetImage(fw, &size);
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	FlashRfBbInfo *wl = (FlashRfBbInfo *) (buffer + 0x2A);
+	uint32_t ncdAddr = hdr->nvramUserConfigAddr * 8;
+	if (ncdAddr >= size || (ncdAddr + 0x200) > size) {
+		image->status = "has no user configuration";
+		goto End;
+	}
+	
+	//wireless table
+	memcpy(wl->macAddr, image->mac, sizeof(wl->macAddr));
+	if (tmpl->hasChannels) wl->allowedChannel = tmpl->channels;
+	for (int i = 0; i < tmpl->nBbp; i++) wl->bbInitRegs[tmpl->bbpRegs[i]] = tmpl->bbpValues[i];
+	UpdateWirelessTableChecksum(buffer);
+	
+	//both copies of the user configuration; copies that are not in use are left alone
+	int nConfigs = 0;
+	for (int i = 0; i < 2; i++) {
+		FlashUserConfigData *ncd = (FlashUserConfigData *) (buffer + ncdAddr + i * 0x100);
+		if (ncd->version != 5) continue;
+		
+		ProvisionApplyUserConfig(tmpl, ncd, HasExConfig(hdr->ipl2Type));
+		UpdateUserConfigChecksum(buffer, size, i);
+		nConfigs++;
+	}
+	if (nConfigs == 0) {
+		image->status = "has no valid user configuration";
+		goto End;
+	}
+	
+	//write the image. The address is already committed to the pool, so an interrupted write must not
+	//leave a truncated image behind.
+	char *outPath = GetImageOutputPath(image->path, ctx->outDir);
+	image->status = WriteFileReplace(outPath, buffer, size) ? "provisioned" : "could not be written";
+	free(outPath);
+
+End:
+	FwFreeContext(fw);
+}
+
+static void ProvisionImages(const char *templatePath, ProvisionContext *ctx, const char *poolPath, const char *logPath, int nThreads) {
+	ProvisionTemplate tmpl;
+	if (!ProvisionLoadTemplate(templatePath, &tmpl)) return;
+	ctx->tmpl = &tmpl;
+	
+	//the pool is locked from loading until the allocated addresses are saved, so that no other process
+	//hands out the same addresses
+	ProvisionPool pool = { 0 };
+	FileLock *lock = LockSharedFile(poolPath);
+	if (lock == NULL) {
+		printf("Could not lock MAC pool '%s'.\n", poolPath);
+		return;
+	}
+	if (!ProvisionLoadPool(poolPath, &pool, 1)) goto End;
+	
+	FILE *log = fopen(logPath, "ab");
+	if (log == NULL) {
+		printf("Could not open '%s' for write access.\n", logPath);
+		goto End;
+	}
+	
+	//allocate the addresses in image order, and commit them to the pool before any image is written so
+	//that no address is handed out again, even if provisioning is interrupted
+	for (unsigned int i = 0; i < ctx->nImages; i++) {
+		ProvisionImage *image = &ctx->images[i];
+		FwContext *fw = FwCreateContext(NULL);
+		FwStatus status = fw != NULL ? FwLoadFile(fw, image->path) : FW_ERR_NO_MEMORY;
+		if (status != FW_OK) {
+			image->status = status == FW_ERR_INVALID_IMAGE ? "is not a valid firmware image" : "could not be read";
+			FwFreeContext(fw);
+			continue;
+		}
+		
+		unsigned int size;
+		image->gen = GetWirelessOuiGeneration(FwGetImage(fw, &size));
+		FwFreeContext(fw);
+		
+		image->hasMac = ProvisionAllocateMac(&pool, image->gen, image->mac);
+		if (!image->hasMac) image->status = "no addresses left in the MAC pool";
+	}
+	if (!ProvisionSavePool(poolPath, &pool)) {
+		fclose(log);
+		goto End;
+	}
+	UnlockSharedFile(lock);
+	lock = NULL;
+	
+	ThRunTasks(ProvisionTask, ctx, ctx->nImages, nThreads);
+	
+	char timestamp[32];
+	time_t now = time(NULL);
+	strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+	
+	int nProvisioned = 0;
+	for (unsigned int i = 0; i < ctx->nImages; i++) {
+		ProvisionImage *image = &ctx->images[i];
+		char macStr[18] = "-";
+		if (image->hasMac) {
+			sprintf(macStr, "%02X-%02X-%02X-%02X-%02X-%02X", image->mac[0], image->mac[1], image->mac[2], image->mac[3], image->mac[4], image->mac[5]);
+		}
+		
+		printf("%s: %s %s\n", image->path, macStr, image->status);
+		fprintf(log, "%s\t%s\t%s\t%s\t%s\n", timestamp, templatePath, image->path, macStr, image->status);
+		if (strcmp(image->status, "provisioned") == 0) nProvisioned++;
+	}
+	fclose(log);
+	printf("Provisioned %d of %d image(s).\n", nProvisioned, ctx->nImages);
+
+End:
+	UnlockSharedFile(lock);
+	if (pool.entries != NULL) free(pool.entries);
+}
+
+void CmdProcProvision(int argc, const char **argv) {
+	if (argc < 3) {
+		CmdHelpProvision();
+		return;
+	}
+	
+	const char *poolPath = PROVISION_DEFAULT_POOL;
+	const char *logPath = PROVISION_DEFAULT_LOG;
+	int nThreads = ThGetProcessorCount();
+	
+	ProvisionContext ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ImagePathList paths = { 0 };
+	
+	int isPool = strcmp(argv[1], "pool") == 0;
+	const char *args[3];
+	int nArgs = 0;
+	
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-p") == 0 && (i + 1) < argc) {
+			poolPath = argv[++i];
+		} else if (strcmp(argv[i], "-l") == 0 && (i + 1) < argc) {
+			logPath = argv[++i];
+		} else if (strcmp(argv[i], "-o") == 0 && (i + 1) < argc) {
+			ctx.outDir = argv[++i];
+		} else if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc) {
+			nThreads = ParseArgNumberULLEx(argv[++i], 10);
+		} else if (isPool && nArgs < 3) {
+			args[nArgs++] = argv[i];
+		} else if (isPool) {
+			printf("Unrecognized argument %s.\n", argv[i]);
+			return;
+		} else {
+			AddImagePaths(&paths, argv[i]);
+		}
+	}
+	
+	if (isPool) {
+		if (nArgs < 3) {
+			CmdHelpProvision();
+			return;
+		}
+		ProvisionSetPool(poolPath, args[0], args[1], args[2]);
+		return;
+	}
+	
+	if (paths.nPaths == 0) {
+		puts("No images specified.");
+		return;
+	}
+	
+	//addresses are allocated in path order, once per file, and only when every image can be written
+	//where no other image is written
+	if (SortImagePaths(&paths, ctx.outDir)) {
+		ctx.nImages = paths.nPaths;
+		ctx.images = calloc(ctx.nImages, sizeof(ProvisionImage));
+		for (unsigned int i = 0; i < ctx.nImages; i++) {
+			ctx.images[i].path = paths.paths[i];
+			ctx.images[i].gen = -1;
+		}
+		ProvisionImages(argv[1], &ctx, poolPath, logPath, nThreads);
+		free(ctx.images);
+	}
+	FreeImagePaths(&paths);
+}
@@ -0,0 +1,132 @@
+#include "cmd_common.h"
+#include "firmware.h"
+#include "symbols.h"
+
+#include <string.h>
+
+static const char *const sModuleNames[] = {
+	"ARM9 Static Module",
+	"ARM7 Static Module",
+	"ARM9 Secondary Module",
+	"ARM7 Secondary Module",
+	"Resources Pack"
+};
+
+static const char *const sModuleArgs[] = { "arm9", "arm7", "arm9s", "arm7s", "rsrc" };
+
+void CmdHelpSymbolize(void) {
+	puts("");
+	puts("Usage: symbolize <address file> [-s <module> <symbol file>...] [-o <file>]");
+	puts("");
+	puts("Resolves every RAM address in a file to the module loaded there, the offset in");
+	puts("the module and, if a symbol map is given for the module, the nearest symbol.");
+	puts("The address file has one address per line, in hexadecimal by default; the rest");
+	puts("of each line is ignored. Symbol maps may be nm output or .sym files, with");
+	puts("addresses in RAM. The modules are decompressed once for all addresses.");
+	puts("");
+	puts("Use one of the following for the module parameter:");
+	puts("  arm9   ARM9 Static module");
+	puts("  arm7   ARM7 static module");
+	puts("  arm9s  ARM9 Secondary module");
+	puts("  arm7s  ARM7 Secondary module");
+	puts("  rsrc   Resources pack");
+	puts("");
+	puts("Flags:");
+	puts("  -s     Symbol map for a module. May be given once per module.");
+	puts("  -o     Write the results to a file instead of the console.");
+}
+
+void CmdProcSymbolize(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 2) {
+		CmdHelpSymbolize();
+		return;
+	}
+	
+	SymTable tables[FW_MODULE_COUNT];
+	for (int i = 0; i < FW_MODULE_COUNT; i++) SymTableInit(&tables[i]);
+	
+	FILE *fpIn = NULL, *fpOut = stdout;
+	const char *outPath = NULL;
+	for (int i = 2; i < argc; i++) {
+		if (strcmp(argv[i], "-s") == 0 && (i + 2) < argc) {
+			int modno = -1;
+			for (int j = 0; j < FW_MODULE_COUNT; j++) {
+				if (strcmp(argv[i + 1], sModuleArgs[j]) == 0) modno = j;
+			}
+			if (modno == -1) {
+				printf("Unrecognized module %s.\n", argv[i + 1]);
+				goto End;
+			}
+			
+			int nSymbols = SymTableLoad(&tables[modno], argv[i + 2]);
+			if (nSymbols < 0) {
+				printf("Could not open file '%s' for read acces.\n", argv[i + 2]);
+				goto End;
+			}
+			printf("Read %d symbol(s) for %s.\n", nSymbols, sModuleNames[modno]);
+			i += 2;
+		} else if (strcmp(argv[i], "-o") == 0 && (i + 1) < argc) {
+			outPath = argv[++i];
+		} else {
+			printf("Unrecognized argument %s.\n", argv[i]);
+			goto End;
+		}
+	}
+	
+	fpIn = fopen(argv[1], "r");
+	if (fpIn == NULL) {
+		printf("Could not open file '%s' for read acces.\n", argv[1]);
+		goto End;
+	}
+	if (outPath != NULL) {
+		fpOut = fopen(outPath, "w");
+		if (fpOut == NULL) {
+			printf("Could not open file '%s' for write access.\n", outPath);
+			fpOut = stdout;
+			goto End;
+		}
+	}
+	
+	//decompress and index the modules once for all addresses
+	const FirmwareRamView *view = GetFirmwareRamView();
+	
+	unsigned int nAddresses = 0, nResolved = 0, nSymbolized = 0;
+	char line[256];
+	while (fgets(line, sizeof(line), fpIn) != NULL) {
+		const char *tok = strtok(line, " \t\r\n");
+		if (tok == NULL || tok[0] == '#' || tok[0] == ';') continue;
+		
+		uint32_t addr = ParseArgNumber(tok);
+		nAddresses++;
+		
+		int module;
+		if (FindFirmwareRamRegions(view, addr, &module, 1) == 0) {
+			fprintf(fpOut, "%08X: ?\n", addr);
+			continue;
+		}
+		nResolved++;
+		
+		const FirmwareModule *mod = &view->modules[module];
+		fprintf(fpOut, "%08X: %s + 0x%X", addr, sModuleNames[module], addr - mod->ramAddr);
+		
+		const SymSymbol *sym = SymTableFind(&tables[module], addr);
+		if (sym != NULL) {
+			if (addr == sym->addr) fprintf(fpOut, " (%s)", sym->name);
+			else fprintf(fpOut, " (%s + 0x%X)", sym->name, addr - sym->addr);
+			nSymbolized++;
+		}
+		fprintf(fpOut, "\n");
+	}
+	
+	if (fpOut != stdout) fclose(fpOut);
+	fpOut = stdout;
+	puts("");
+	printf("%d address(es): %d resolved to a module, %d to a symbol.\n", nAddresses, nResolved, nSymbolized);
+
+End:
+	if (fpIn != NULL) fclose(fpIn);
+	if (fpOut != stdout) fclose(fpOut);
+	for (int i = 0; i < FW_MODULE_COUNT; i++) SymTableFree(&tables[i]);
+}
@@ -0,0 +1,457 @@
+#include "cmd_common.h"
+#include "firmware.h"
+#include "blowfish.h"
+#include "compression.h"
+#include "digest.h"
+
+#include <string.h>
+
+#define UNPACK_MANIFEST_MAGIC  "fwutil-unpack 1"
+#define UNPACK_MANIFEST_NAME   "manifest.txt"
+#define UNPACK_BASE_NAME       "base.bin"
+#define UNPACK_CACHE_EXT       ".cmp"
+
+#define UNPACK_REGION_HEADER   0 // flash header
+#define UNPACK_REGION_WIRELESS 1 // wireless initialization tables
+#define UNPACK_REGION_USER     2 // user configuration (both copies)
+#define UNPACK_REGION_CONN     3 // connection settings
+#define UNPACK_REGION_CONNEX   4 // TWL connection settings
+#define UNPACK_REGION_COUNT    5
+
+static const char *const sRegionNames[] = { "header", "wireless", "user", "conn", "connex" };
+static const char *const sModuleNames[] = { "arm9", "arm7", "arm9s", "arm7s", "rsrc" };
+
+void CmdHelpUnpack(void) {
+	puts("");
+	puts("Usage: unpack <directory>");
+	puts("");
+	puts("Writes the parts of the firmware image to files in an existing directory, for");
+	puts("editing with external tools and rebuilding with pack. The directory receives:");
+	puts("  header.bin    Flash header");
+	puts("  wireless.bin  Wireless initialization tables");
+	puts("  user.bin      User configuration (both copies)");
+	puts("  conn.bin      Connection settings");
+	puts("  connex.bin    TWL connection settings (TWL firmware only)");
+	puts("  arm9.bin ...  Decompressed and decrypted modules (arm9, arm7, arm9s, arm7s,");
+	puts("                rsrc), each with its compressed form in a .cmp file");
+	puts("  base.bin      The image with the modules erased");
+	puts("  " UNPACK_MANIFEST_NAME "  The layout of the image and digests of the files");
+}
+
+void CmdHelpPack(void) {
+	puts("");
+	puts("Usage: pack <directory>");
+	puts("");
+	puts("Rebuilds the working firmware image from a directory written by unpack, then");
+	puts("updates the CRCs of the modules and of the tables that changed. Only modules");
+	puts("whose files changed since they were unpacked or last packed are compressed; the");
+	puts("others reuse their compressed form from the directory. The image must be the");
+	puts("size recorded in the manifest.");
+}
+
+typedef struct UnpackRegion_ {
+	int present;
+	uint32_t addr;
+	uint32_t size;
+	char digest[33];
+} UnpackRegion;
+
+typedef struct UnpackModule_ {
+	int present;
+	CxCompressionType type;
+	char digest[33];                        // digest of the decompressed module
+} UnpackModule;
+
+typedef struct UnpackManifest_ {
+	unsigned int size;                      // image size
+	UnpackRegion regions[UNPACK_REGION_COUNT];
+	UnpackModule modules[FW_MODULE_COUNT];
+} UnpackManifest;
+
+static char *UnpackGetPath(const char *dir, const char *name, const char *ext) {
+	size_t len = strlen(dir) + 1 + strlen(name) + strlen(ext) + 1;
+	char *path = malloc(len);
+	sprintf(path, "%s/%s%s", dir, name, ext);
+	return path;
+}
+
+static unsigned char *UnpackReadFile(const char *dir, const char *name, const char *ext, unsigned int *pSize) {
+	char *path = UnpackGetPath(dir, name, ext);
+	FILE *fp = fopen(path, "rb");
+	free(path);
+	if (fp == NULL) return NULL;
+	
+	fseek(fp, 0, SEEK_END);
+	unsigned int size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	
+	unsigned char *buf = malloc(size + 1);
+	if (fread(buf, 1, size, fp) != size) {
+		free(buf);
+		fclose(fp);
+		return NULL;
+	}
+	fclose(fp);
+	
+	buf[size] = '\0';
+	*pSize = size;
+	return buf;
+}
+
+static int UnpackWriteFile(const char *dir, const char *name, const char *ext, const unsigned char *buf, unsigned int size) {
+	char *path = UnpackGetPath(dir, name, ext);
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) {
+		printf("Could not open '%s' for write access.\n", path);
+		free(path);
+		return 0;
+	}
+	
+	int ok = fwrite(buf, 1, size, fp) == size;
+	fclose(fp);
+	if (!ok) printf("Could not write '%s'.\n", path);
+	free(path);
+	return ok;
+}
+
+static void UnpackDigest(const unsigned char *buf, unsigned int size, char *digestStr) {
+	unsigned char digest[DG_DIGEST_SIZE];
+	ComputeMd5(buf, size, digest);
+	DgDigestToString(digest, digestStr);
+}
+
+//
+// Locate the header, wireless table and settings regions of an image.
+//
+static void UnpackGetRegions(const unsigned char *buffer, unsigned int size, UnpackRegion *regions) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	memset(regions, 0, UNPACK_REGION_COUNT * sizeof(UnpackRegion));
+	
+	regions[UNPACK_REGION_HEADER].addr = 0;
+	regions[UNPACK_REGION_HEADER].size = 0x2A;
+	regions[UNPACK_REGION_WIRELESS].addr = 0x2A;
+	regions[UNPACK_REGION_WIRELESS].size = 0x200 - 0x2A;
+	
+	uint32_t ncdAddr = hdr->nvramUserConfigAddr * 8;
+	if (ncdAddr >= 0x400 && ncdAddr < size && (ncdAddr + 0x200) <= size) {
+		regions[UNPACK_REGION_USER].addr = ncdAddr;
+		regions[UNPACK_REGION_USER].size = 0x200;
+		regions[UNPACK_REGION_CONN].addr = ncdAddr - 0x400;
+		regions[UNPACK_REGION_CONN].size = 0x400;
+		if (HasTwlSettings(hdr->ipl2Type) && ncdAddr >= 0xA00) {
+			regions[UNPACK_REGION_CONNEX].addr = ncdAddr - 0xA00;
+			regions[UNPACK_REGION_CONNEX].size = 0x600;
+		}
+	}
+	
+	for (int i = 0; i < UNPACK_REGION_COUNT; i++) {
+		regions[i].present = regions[i].size > 0;
+	}
+}
+
+static int UnpackWriteManifest(const char *dir, const UnpackManifest *manifest) {
+	char text[2048];
+	unsigned int len = 0;
+	
+	len += sprintf(text + len, "%s\nsize %08X\n", UNPACK_MANIFEST_MAGIC, manifest->size);
+	for (int i = 0; i < UNPACK_REGION_COUNT; i++) {
+		const UnpackRegion *region = &manifest->regions[i];
+		if (!region->present) continue;
+		len += sprintf(text + len, "region %s %08X %08X %s\n", sRegionNames[i], region->addr, region->size, region->digest);
+	}
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		const UnpackModule *mod = &manifest->modules[i];
+		if (!mod->present) continue;
+		len += sprintf(text + len, "module %s %s %s\n", sModuleNames[i], mod->type == CX_COMPRESSION_ASH ? "ash" : "lz", mod->digest);
+	}
+	
+	return UnpackWriteFile(dir, UNPACK_MANIFEST_NAME, "", (const unsigned char *) text, len);
+}
+
+static int UnpackFindName(const char *const *names, int count, const char *name) {
+	for (int i = 0; i < count; i++) {
+		if (strcmp(names[i], name) == 0) return i;
+	}
+	return -1;
+}
+
+static int UnpackReadManifest(const char *dir, UnpackManifest *manifest) {
+	memset(manifest, 0, sizeof(*manifest));
+	
+	unsigned int textSize;
+	char *text = (char *) UnpackReadFile(dir, UNPACK_MANIFEST_NAME, "", &textSize);
+	if (text == NULL) {
+		printf("Could not read '%s/%s'.\n", dir, UNPACK_MANIFEST_NAME);
+		return 0;
+	}
+	
+	int ok = 0;
+	char *line = strtok(text, "\r\n");
+	if (line == NULL || strcmp(line, UNPACK_MANIFEST_MAGIC) != 0) {
+		printf("'%s' is not an unpacked firmware directory.\n", dir);
+		goto End;
+	}
+	
+	while ((line = strtok(NULL, "\r\n")) != NULL) {
+		char name[16], type[8], digest[33];
+		uint32_t addr, size;
+		if (sscanf(line, "size %x", &manifest->size) == 1) continue;
+		
+		if (sscanf(line, "region %15s %x %x %32s", name, &addr, &size, digest) == 4) {
+			int index = UnpackFindName(sRegionNames, UNPACK_REGION_COUNT, name);
+			if (index != -1) {
+				UnpackRegion *region = &manifest->regions[index];
+				region->present = 1;
+				region->addr = addr;
+				region->size = size;
+				strcpy(region->digest, digest);
+				continue;
+			}
+		} else if (sscanf(line, "module %15s %7s %32s", name, type, digest) == 3) {
+			int index = UnpackFindName(sModuleNames, FW_MODULE_COUNT, name);
+			if (index != -1) {
+				UnpackModule *mod = &manifest->modules[index];
+				mod->present = 1;
+				mod->type = strcmp(type, "ash") == 0 ? CX_COMPRESSION_ASH : CX_COMPRESSION_LZ;
+				strcpy(mod->digest, digest);
+				continue;
+			}
+		}
+		printf("Unrecognized manifest line: %s\n", line);
+		goto End;
+	}
+	
+	if (manifest->size < 0x200 || !manifest->regions[UNPACK_REGION_HEADER].present || !manifest->regions[UNPACK_REGION_WIRELESS].present) {
+		printf("The manifest in '%s' is incomplete.\n", dir);
+		goto End;
+	}
+	for (int i = 0; i < UNPACK_REGION_COUNT; i++) {
+		UnpackRegion *region = &manifest->regions[i];
+		if (region->present && (region->addr > manifest->size || region->size > (manifest->size - region->addr))) {
+			printf("The %s region is outside of the image.\n", sRegionNames[i]);
+			goto End;
+		}
+	}
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (!manifest->modules[i].present) {
+			printf("The manifest in '%s' has no %s module.\n", dir, sModuleNames[i]);
+			goto End;
+		}
+	}
+	ok = 1;
+
+End:
+	free(text);
+	return ok;
+}
+
+// ----- unpack
+
+void CmdProcUnpack(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 2) {
+		CmdHelpUnpack();
+		return;
+	}
+	const char *dir = argv[1];
+	
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	
+	FirmwareModule mods[FW_MODULE_COUNT];
+	GetFirmwareModules(buffer, size, mods);
+	
+	unsigned char *base = malloc(size);
+	memcpy(base, buffer, size);
+	
+	UnpackManifest manifest;
+	memset(&manifest, 0, sizeof(manifest));
+	manifest.size = size;
+	
+	//modules: the decompressed module, and its compressed form as the cache for pack
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		FirmwareModule *mod = &mods[i];
+		if (mod->data == NULL || mod->romAddr > size || mod->size > (size - mod->romAddr)) {
+			printf("The %s module could not be decompressed.\n", sModuleNames[i]);
+			goto End;
+		}
+		
+		unsigned char *comp = malloc(mod->size);
+		memcpy(comp, buffer + mod->romAddr, mod->size);
+		if (i == FW_MODULE_ARM9_STATIC || i == FW_MODULE_ARM7_STATIC) BfDecrypt(comp, mod->size, buffer);
+		int ok = UnpackWriteFile(dir, sModuleNames[i], UNPACK_CACHE_EXT, comp, mod->size);
+		free(comp);
+		
+		if (!ok || !UnpackWriteFile(dir, sModuleNames[i], ".bin", mod->data, mod->uncompressed)) goto End;
+		
+		manifest.modules[i].present = 1;
+		manifest.modules[i].type = mod->type;
+		UnpackDigest(mod->data, mod->uncompressed, manifest.modules[i].digest);
+		memset(base + mod->romAddr, 0xFF, mod->size);
+	}
+	
+	//header, wireless tables and settings
+	UnpackGetRegions(buffer, size, manifest.regions);
+	for (int i = 0; i < UNPACK_REGION_COUNT; i++) {
+		UnpackRegion *region = &manifest.regions[i];
+		if (!region->present) continue;
+		
+		if (!UnpackWriteFile(dir, sRegionNames[i], ".bin", buffer + region->addr, region->size)) goto End;
+		UnpackDigest(buffer + region->addr, region->size, region->digest);
+	}
+	
+	if (!UnpackWriteFile(dir, UNPACK_BASE_NAME, "", base, size)) goto End;
+	if (!UnpackWriteManifest(dir, &manifest)) goto End;
+	
+	printf("Unpacked %s to '%s'.\n", GetCurrentFilePath(), dir);
+
+End:
+	free(base);
+	FreeFirmwareModules(mods);
+}
+
+// ----- pack
+
+void CmdProcPack(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 2) {
+		CmdHelpPack();
+		return;
+	}
+	const char *dir = argv[1];
+	
+	unsigned int size;
+	unsigned char *buffer = GetFirmwareImage(&size);
+	
+	UnpackManifest manifest;
+	if (!UnpackReadManifest(dir, &manifest)) return;
+	if (manifest.size != size) {
+		printf("The image is %d bytes, but the directory was unpacked from a %d byte image.\n", size, manifest.size);
+		return;
+	}
+	
+	unsigned char *image = NULL;
+	unsigned char *data[FW_MODULE_COUNT] = { NULL };
+	unsigned char *comp[FW_MODULE_COUNT] = { NULL };
+	uint32_t dataSizes[FW_MODULE_COUNT], compSizes[FW_MODULE_COUNT];
+	unsigned int changedRegions = 0, changedModules = 0;
+	
+	unsigned int baseSize;
+	image = UnpackReadFile(dir, UNPACK_BASE_NAME, "", &baseSize);
+	if (image == NULL || baseSize != size) {
+		printf("Could not read '%s/%s', or it is the wrong size.\n", dir, UNPACK_BASE_NAME);
+		goto End;
+	}
+	
+	//header, wireless tables and settings
+	for (int i = 0; i < UNPACK_REGION_COUNT; i++) {
+		UnpackRegion *region = &manifest.regions[i];
+		if (!region->present) continue;
+		
+		unsigned int regionSize;
+		unsigned char *buf = UnpackReadFile(dir, sRegionNames[i], ".bin", &regionSize);
+		if (buf == NULL || regionSize != region->size) {
+			printf("Could not read %s.bin, or it is not %d bytes.\n", sRegionNames[i], region->size);
+			if (buf != NULL) free(buf);
+			goto End;
+		}
+		
+		char digest[33];
+		UnpackDigest(buf, regionSize, digest);
+		if (strcmp(digest, region->digest) != 0) {
+			strcpy(region->digest, digest);
+			changedRegions |= 1 << i;
+		}
+		memcpy(image + region->addr, buf, regionSize);
+		free(buf);
+	}
+	
+	//modules: only those whose content changed are compressed, the others come from the cache. The cache
+	//holds the static modules unencrypted, since the header with the key may have changed.
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		UnpackModule *mod = &manifest.modules[i];
+		data[i] = UnpackReadFile(dir, sModuleNames[i], ".bin", &dataSizes[i]);
+		if (data[i] == NULL) {
+			printf("Could not read %s.bin.\n", sModuleNames[i]);
+			goto End;
+		}
+		
+		char digest[33];
+		UnpackDigest(data[i], dataSizes[i], digest);
+		if (strcmp(digest, mod->digest) == 0) {
+			comp[i] = UnpackReadFile(dir, sModuleNames[i], UNPACK_CACHE_EXT, &compSizes[i]);
+			if (comp[i] != NULL && compSizes[i] > 0) continue;
+			
+			if (comp[i] != NULL) free(comp[i]);
+			comp[i] = NULL;
+		}
+		
+		if (mod->type == CX_COMPRESSION_ASH) printf("Compressing %s...\n", sModuleNames[i]);
+		comp[i] = CompressFirmwareModule(image, i, mod->type, data[i], dataSizes[i], &compSizes[i]);
+		if (i == FW_MODULE_ARM9_STATIC || i == FW_MODULE_ARM7_STATIC) BfDecrypt(comp[i], compSizes[i], image);
+		if (!UnpackWriteFile(dir, sModuleNames[i], UNPACK_CACHE_EXT, comp[i], compSizes[i])) goto End;
+		
+		strcpy(mod->digest, digest);
+		changedModules |= 1 << i;
+	}
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (i == FW_MODULE_ARM9_STATIC || i == FW_MODULE_ARM7_STATIC) BfEncrypt(comp[i], compSizes[i], image);
+	}
+	
+	//modules stay at their unpacked addresses when they still fit. The modules are erased in the base
+	//image, so they are written without clearing their old extents.
+	FirmwareLayout layout;
+	if (!PlanFirmwareLayout(image, size, compSizes, FW_LAYOUT_MIN_MOVED, 0, &layout)) {
+		puts("The modules do not fit in the image.");
+		goto End;
+	}
+	uint32_t oldRomAddrs[FW_MODULE_COUNT];
+	GetFirmwareModuleRomAddrs(image, oldRomAddrs);
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (layout.romAddrs[i] != oldRomAddrs[i]) SetFirmwareModuleRomAddr(image, i, layout.romAddrs[i]);
+		memcpy(image + layout.romAddrs[i], comp[i], compSizes[i]);
+	}
+	
+	//the module CRCs are computed from the module files, so no module is decompressed
+	FlashHeader *hdr = (FlashHeader *) image;
+	hdr->staticCrc = ComputeStaticCrc(data[FW_MODULE_ARM9_STATIC], dataSizes[FW_MODULE_ARM9_STATIC], data[FW_MODULE_ARM7_STATIC], dataSizes[FW_MODULE_ARM7_STATIC]);
+	hdr->secondaryCrc = ComputeSecondaryCrc(data[FW_MODULE_ARM9_SECONDARY], dataSizes[FW_MODULE_ARM9_SECONDARY], data[FW_MODULE_ARM7_SECONDARY], dataSizes[FW_MODULE_ARM7_SECONDARY]);
+	hdr->resourceCrc = ComputeCrc(data[FW_MODULE_RESOURCES], dataSizes[FW_MODULE_RESOURCES], 0xFFFF);
+	
+	if (changedRegions & (1 << UNPACK_REGION_WIRELESS)) UpdateWirelessTableChecksum(image);
+	if (changedRegions & (1 << UNPACK_REGION_USER)) {
+		for (int i = 0; i < 2; i++) UpdateUserConfigChecksum(image, size, i);
+	}
+	if (changedRegions & (1 << UNPACK_REGION_CONN)) {
+		for (int i = 0; i < 3; i++) UpdateConnectionChecksum(image, size, i);
+	}
+	if (changedRegions & (1 << UNPACK_REGION_CONNEX)) {
+		for (int i = 3; i < 6; i++) UpdateConnectionChecksum(image, size, i);
+	}
+	
+	//the manifest now describes the packed files, so the next pack only compresses later changes
+	if (!UnpackWriteManifest(dir, &manifest)) goto End;
+	memcpy(buffer, image, size);
+	
+	printf("Packed '%s'.\n", dir);
+	printf("  Modules compressed    :");
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (changedModules & (1 << i)) printf(" %s", sModuleNames[i]);
+	}
+	puts(changedModules ? "" : " none");
+	printf("  Tables changed        :");
+	for (int i = 0; i < UNPACK_REGION_COUNT; i++) {
+		if (changedRegions & (1 << i)) printf(" %s", sRegionNames[i]);
+	}
+	puts(changedRegions ? "" : " none");
+
+End:
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (data[i] != NULL) free(data[i]);
+		if (comp[i] != NULL) free(comp[i]);
+	}
+	if (image != NULL) free(image);
+}
@@ -1,106 +1,354 @@
 #include "cmd_common.h"
 #include "firmware.h"
+#include "digest.h"
+#include "thread.h"
+#include "libfwutil.h"
+
+#include <string.h>
+
+#define VERIFY_TRUST_MAGIC     "fwutil-trusted 1"
+#define VERIFY_DEFAULT_TRUST   "fwtrusted.txt"
+
+#define VF_GROUP_COUNT         3 // header CRCs: static, secondary and resources pack
+#define VF_GROUP_SIZE          2 // most modules covered by one CRC
 
 void CmdHelpVerify(void) {
 	puts("");
-	puts("Usage: verify");
+	puts("Usage: verify [--fast | --trust] [-d <database>] [-j <threads>]");
 	puts("");
 	puts("Verifies the integrity of the firmware image. This command verifies the");
 	puts("checksums and data validity of the firmware.");
+	puts("");
+	puts("The modules are decompressed and their checksums computed in parallel. By");
+	puts("default one thread per processor is used; use -j to set the number of threads.");
+	puts("");
+	puts("  --fast  Skip decompressing the modules covered by a header CRC when their");
+	puts("          compressed data was trusted together with that CRC. Other modules are");
+	puts("          fully checked.");
+	puts("  --trust Verify fully, then add the modules that passed to the database.");
+	puts("  -d      Trusted module database to use (default " VERIFY_DEFAULT_TRUST ").");
 }
 
-static int VerifyArm7Accessible(uint32_t addr, uint32_t size) {
-	//address must be in WRAM or main memory
-	if (addr <  0x02000000) return 0;
-	if (addr >= 0x04000000) return 0;
-	if ((addr + size) < addr) return 0;
-	if ((addr + size) >= 0x04000000) return 0;
+// ----- trusted module database
+
+typedef struct VfTrusted_ {
+	int group;
+	uint16_t crc;                           // header CRC the group was verified against
+	uint32_t uncompressed[VF_GROUP_SIZE];   // uncompressed size of each module of the group
+	struct VfTrusted_ *next;
+} VfTrusted;
+
+//modules checked by each header CRC, -1 where a group has fewer modules
+static const int sVfGroupModules[VF_GROUP_COUNT][VF_GROUP_SIZE] = {
+	{ FW_MODULE_ARM9_STATIC, FW_MODULE_ARM7_STATIC },
+	{ FW_MODULE_ARM9_SECONDARY, FW_MODULE_ARM7_SECONDARY },
+	{ FW_MODULE_RESOURCES, -1 }
+};
+
+//header CRC field covering each group
+static uint16_t VfGetHeaderCrc(const unsigned char *buffer, int group) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	switch (group) {
+		case 0:
+			return hdr->staticCrc;
+		case 1:
+			return hdr->secondaryCrc;
+	}
+	return hdr->resourceCrc;
+}
+
+static unsigned int VfGetGroupMask(int group) {
+	unsigned int mask = 0;
+	for (int i = 0; i < VF_GROUP_SIZE; i++) {
+		if (sVfGroupModules[group][i] >= 0) mask |= 1 << sVfGroupModules[group][i];
+	}
+	return mask;
+}
+
+//
+// Compute the digest of each CRC group: the digests of its modules' compressed data followed by the
+// header CRC. The static modules are decrypted with a key from the header, so the key is part of their
+// digest. Returns 0 if the module extents could not be found.
+//
+static int VfDigestGroups(const unsigned char *buffer, unsigned int size, unsigned char (*digests)[DG_DIGEST_SIZE]) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	uint32_t romAddrs[FW_MODULE_COUNT], compSizes[FW_MODULE_COUNT];
+	if (!GetFirmwareModuleExtents(buffer, size, romAddrs, compSizes)) return 0;
+	
+	unsigned char modDigests[FW_MODULE_COUNT][DG_DIGEST_SIZE];
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (compSizes[i] > (size - romAddrs[i])) return 0;
+		
+		unsigned int keySize = 0;
+		unsigned char *data = malloc(sizeof(hdr->blowfishKey) + sizeof(hdr->unscrambleKey) + compSizes[i]);
+		if (data == NULL) return 0;
+		if (i == FW_MODULE_ARM9_STATIC || i == FW_MODULE_ARM7_STATIC) {
+			memcpy(data, &hdr->blowfishKey, sizeof(hdr->blowfishKey));
+			memcpy(data + sizeof(hdr->blowfishKey), hdr->unscrambleKey, sizeof(hdr->unscrambleKey));
+			keySize = sizeof(hdr->blowfishKey) + sizeof(hdr->unscrambleKey);
+		}
+		memcpy(data + keySize, buffer + romAddrs[i], compSizes[i]);
+		ComputeMd5(data, keySize + compSizes[i], modDigests[i]);
+		free(data);
+	}
 	
+	for (int g = 0; g < VF_GROUP_COUNT; g++) {
+		unsigned char groupData[VF_GROUP_SIZE * DG_DIGEST_SIZE + 2];
+		unsigned int groupSize = 0;
+		for (int i = 0; i < VF_GROUP_SIZE; i++) {
+			int module = sVfGroupModules[g][i];
+			if (module < 0) continue;
+			
+			memcpy(groupData + groupSize, modDigests[module], DG_DIGEST_SIZE);
+			groupSize += DG_DIGEST_SIZE;
+		}
+		
+		uint16_t crc = VfGetHeaderCrc(buffer, g);
+		groupData[groupSize++] = (crc >> 0) & 0xFF;
+		groupData[groupSize++] = (crc >> 8) & 0xFF;
+		ComputeMd5(groupData, groupSize, digests[g]);
+	}
 	return 1;
 }
 
-static int VerifyArm9StaticAddress(uint32_t addr, uint32_t size) {
-	//ARM9 static must be accessible from the ARM7.
-	if (!VerifyArm7Accessible(addr, size)) return 0;
+static void VfFreeTrusted(DgTable *table) {
+	for (unsigned int i = 0; i < table->capacity; i++) {
+		if (!table->entries[i].used) continue;
+		
+		VfTrusted *entry = (VfTrusted *) table->entries[i].value;
+		while (entry != NULL) {
+			VfTrusted *next = entry->next;
+			free(entry);
+			entry = next;
+		}
+	}
+	DgTableFree(table);
+}
+
+static void VfAddTrusted(DgTable *table, const unsigned char *digest, int group, uint16_t crc, const uint32_t *uncompressed) {
+	VfTrusted **slot = (VfTrusted **) DgTableInsert(table, digest);
+	VfTrusted *entry = malloc(sizeof(VfTrusted));
+	entry->group = group;
+	entry->crc = crc;
+	memcpy(entry->uncompressed, uncompressed, sizeof(entry->uncompressed));
+	entry->next = *slot;
+	*slot = entry;
+}
+
+static const VfTrusted *VfFindTrusted(const DgTable *table, const unsigned char *digest, int group, uint16_t crc) {
+	VfTrusted **slot = (VfTrusted **) DgTableFind(table, digest);
+	if (slot == NULL) return NULL;
 	
-	return 1;
+	for (VfTrusted *entry = *slot; entry != NULL; entry = entry->next) {
+		if (entry->group == group && entry->crc == crc) return entry;
+	}
+	return NULL;
 }
 
-static int VerifyArm7StaticAddress(uint32_t addr, uint32_t size) {
-	//ARM7 static must be accessible from the ARM7.
-	if (!VerifyArm7Accessible(addr, size)) return 0;
+static int VfLoadTrusted(DgTable *table, const char *path, int mustExist) {
+	DgTableInit(table);
+	
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		if (mustExist) printf("Could not open trusted module database '%s'.\n", path);
+		return !mustExist;
+	}
 	
+	char line[512];
+	int lineNo = 0;
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		line[strcspn(line, "\r\n")] = '\0';
+		lineNo++;
+		
+		if (lineNo == 1) {
+			if (strcmp(line, VERIFY_TRUST_MAGIC) == 0) continue;
+			printf("'%s' is not a trusted module database.\n", path);
+			fclose(fp);
+			return 0;
+		}
+		
+		int group;
+		unsigned int crc, uncompressed[VF_GROUP_SIZE];
+		char digestStr[33];
+		unsigned char digest[DG_DIGEST_SIZE];
+		if (sscanf(line, "group %d %4x %u %u %32s", &group, &crc, &uncompressed[0], &uncompressed[1], digestStr) == 5 && DgParseDigest(digestStr, digest) && group >= 0 && group < VF_GROUP_COUNT) {
+			uint32_t sizes[VF_GROUP_SIZE] = { uncompressed[0], uncompressed[1] };
+			VfAddTrusted(table, digest, group, crc, sizes);
+		} else if (line[0] != '\0') {
+			printf("%s(%d): unrecognized database entry.\n", path, lineNo);
+		}
+	}
+	fclose(fp);
 	return 1;
 }
 
+//
+// Add the CRC groups whose header CRC checked out to the trusted module database.
+//
+static void VfTrustGroups(const char *path, const unsigned char *buffer, unsigned int size, const uint32_t *moduleSizes, unsigned int passedGroups) {
+	unsigned char digests[VF_GROUP_COUNT][DG_DIGEST_SIZE];
+	if (!passedGroups || !VfDigestGroups(buffer, size, digests)) {
+		puts("No modules added to the trusted module database.");
+		return;
+	}
+	
+	FILE *fp = fopen(path, "rb");
+	int isNew = fp == NULL;
+	if (fp != NULL) fclose(fp);
+	
+	DgTable table;
+	if (!VfLoadTrusted(&table, path, 0)) {
+		VfFreeTrusted(&table);
+		return;
+	}
+	
+	fp = fopen(path, isNew ? "wb" : "ab");
+	if (fp == NULL) {
+		printf("Could not open '%s' for write access.\n", path);
+		VfFreeTrusted(&table);
+		return;
+	}
+	if (isNew) fprintf(fp, "%s\n", VERIFY_TRUST_MAGIC);
+	
+	int nAdded = 0;
+	char digestStr[33];
+	for (int g = 0; g < VF_GROUP_COUNT; g++) {
+		uint16_t crc = VfGetHeaderCrc(buffer, g);
+		if (!(passedGroups & (1 << g)) || VfFindTrusted(&table, digests[g], g, crc) != NULL) continue;
+		
+		uint32_t uncompressed[VF_GROUP_SIZE] = { 0 };
+		for (int i = 0; i < VF_GROUP_SIZE; i++) {
+			if (sVfGroupModules[g][i] >= 0) uncompressed[i] = moduleSizes[sVfGroupModules[g][i]];
+		}
+		
+		DgDigestToString(digests[g], digestStr);
+		fprintf(fp, "group %d %04X %u %u %s\n", g, crc, uncompressed[0], uncompressed[1], digestStr);
+		for (int i = 0; i < VF_GROUP_SIZE; i++) {
+			if (sVfGroupModules[g][i] >= 0) nAdded++;
+		}
+	}
+	fclose(fp);
+	
+	printf("Added %d module(s) to the trusted module database.\n", nAdded);
+	VfFreeTrusted(&table);
+}
+
+// ----- verification
+
 void CmdProcVerify(int argc, const char **argv) {
 	if (!RequireFirmwareImage()) return;
 	
-	(void) argc;
-	(void) argv;
+	int nThreads = ThGetProcessorCount();
+	int fast = 0, trust = 0;
+	const char *trustPath = VERIFY_DEFAULT_TRUST;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-j") == 0 && (i + 1) < argc) {
+			nThreads = ParseArgNumberULLEx(argv[++i], 10);
+		} else if (strcmp(argv[i], "-d") == 0 && (i + 1) < argc) {
+			trustPath = argv[++i];
+		} else if (strcmp(argv[i], "--fast") == 0) {
+			fast = 1;
+		} else if (strcmp(argv[i], "--trust") == 0) {
+			trust = 1;
+		} else {
+			printf("Unrecognized argument %s.\n", argv[i]);
+			return;
+		}
+	}
+	if (fast && trust) {
+		puts("--fast and --trust cannot be combined.");
+		return;
+	}
 	
 	unsigned int size;
 	unsigned char *buffer = GetFirmwareImage(&size);
 	
-	//flash header
-	FlashHeader *hdr = (FlashHeader *) buffer;
-	FlashRfBbInfo *wl = (FlashRfBbInfo *) (buffer + 0x2A);
-	
-	uint32_t arm9SecondaryRomAddr, arm9SecondarySize, arm9SecondaryRamAddr, arm9SecondaryUncompressed;
-	uint32_t arm7SecondaryRomAddr, arm7SecondarySize, arm7SecondaryRamAddr, arm7SecondaryUncompressed;
-	uint32_t    arm9StaticRomAddr,    arm9StaticSize,    arm9StaticRamAddr,    arm9StaticUncompressed;
-	uint32_t    arm7StaticRomAddr,    arm7StaticSize,    arm7StaticRamAddr,    arm7StaticUncompressed;
-	uint32_t          rsrcRomAddr,          rsrcSize,          rsrcRamAddr,          rsrcUncompressed;
-	
-	//unpack firmware and data headers
-	CxCompressionType type9, type7, typeRsrc;
-	unsigned char *arm9Static = GetArm9StaticInfo(buffer, size, &arm9StaticRomAddr, &arm9StaticRamAddr, &arm9StaticSize, &arm9StaticUncompressed);
-	unsigned char *arm7Static = GetArm7StaticInfo(buffer, size, &arm7StaticRomAddr, &arm7StaticRamAddr, &arm7StaticSize, &arm7StaticUncompressed);
-	unsigned char *arm9Secondary = GetArm9SecondaryInfo(buffer, size, &arm9SecondaryRomAddr, &arm9SecondaryRamAddr, &arm9SecondarySize, &arm9SecondaryUncompressed, &type9);
-	unsigned char *arm7Secondary = GetArm7SecondaryInfo(buffer, size, &arm7SecondaryRomAddr, &arm7SecondaryRamAddr, &arm7SecondarySize, &arm7SecondaryUncompressed, &type7);
-	unsigned char *rsrc = GetResourcesPackInfo(buffer, size, &rsrcRomAddr, &rsrcRamAddr, &rsrcSize, &rsrcUncompressed, &typeRsrc);
-	
-	int nErrors = 0;
+	FwVerifyOptions options;
+	memset(&options, 0, sizeof(options));
+	options.nThreads = nThreads < 1 ? 1 : nThreads;
+	
+	//a CRC group is trusted when the compressed data of all of its modules was verified together before
+	//against the same header CRC. Trusted groups are not decoded.
+	int nTrusted = 0;
+	if (fast) {
+		DgTable table;
+		unsigned char digests[VF_GROUP_COUNT][DG_DIGEST_SIZE];
+		if (!VfLoadTrusted(&table, trustPath, 1)) {
+			VfFreeTrusted(&table);
+			return;
+		}
+		
+		if (VfDigestGroups(buffer, size, digests)) {
+			for (int g = 0; g < VF_GROUP_COUNT; g++) {
+				const VfTrusted *entry = VfFindTrusted(&table, digests[g], g, VfGetHeaderCrc(buffer, g));
+				if (entry == NULL) continue;
+				
+				for (int i = 0; i < VF_GROUP_SIZE; i++) {
+					int module = sVfGroupModules[g][i];
+					if (module < 0) continue;
+					
+					options.trustedUncompressed[module] = entry->uncompressed[i];
+					nTrusted++;
+				}
+				options.trustedModules |= VfGetGroupMask(g);
+			}
+		}
+		VfFreeTrusted(&table);
+	}
+	
+	FwVerifyResult result;
+	if (FwVerify(GetFirmwareContext(), &options, &result) != FW_OK) {
+		puts("The firmware could not be verified.");
+		return;
+	}
+	
+	if (fast) {
+		printf("\n%d of %d module(s) matched the trusted module database.\n", nTrusted, FW_MODULE_COUNT);
+	}
+	
 	printf("\nError list:\n");
 	
-	//validate module data validity
-	if (arm9Static == NULL)    { printf("  The ARM9 static module could not be decompressed.\n");    nErrors++; }
-	if (arm7Static == NULL)    { printf("  The ARM7 static module could not be decompressed.\n");    nErrors++; }
-	if (arm9Secondary == NULL) { printf("  The ARM9 secondary module could not be decompressed.\n"); nErrors++; }
-	if (arm7Secondary == NULL) { printf("  The ARM7 secondary module could not be decompressed.\n"); nErrors++; }
-	if (rsrc == NULL)          { printf("  The resources pack could not be decompressed.\n");        nErrors++; }
-	
-	//validate load addresses
-	int arm9StaticLoadOK = VerifyArm9StaticAddress(arm9StaticRamAddr, arm9StaticUncompressed);
-	int arm7StaticLoadOK = VerifyArm7StaticAddress(arm7StaticRamAddr, arm7StaticUncompressed);
-	if (arm9Static != NULL && !arm9StaticLoadOK) { printf("  Invalid load address for ARM9 static module.\n"); nErrors++; }
-	if (arm7Static != NULL && !arm7StaticLoadOK) { printf("  Invalid load address for ARM7 static module.\n"); nErrors++; }
-	
-	//get checksums from header
-	uint16_t staticCrc = hdr->staticCrc, secondaryCrc = hdr->secondaryCrc, rsrcCrc = hdr->resourceCrc;
-	uint16_t staticCrc2 = ComputeStaticCrc(arm9Static, arm9StaticUncompressed, arm7Static, arm7StaticUncompressed);
-	uint16_t secondaryCrc2 = ComputeSecondaryCrc(arm9Secondary, arm9SecondaryUncompressed, arm7Secondary, arm7SecondaryUncompressed);
-	uint16_t rsrcCrc2 = ComputeCrc(rsrc, rsrcUncompressed, 0xFFFF);
-	if (arm9Static != NULL && arm7Static != NULL && staticCrc != staticCrc2) { printf("  Checksum mismatch for static module: %04X (expected %04X)\n", staticCrc2, staticCrc); nErrors++; }
-	if (arm9Secondary != NULL && arm7Secondary != NULL && secondaryCrc != secondaryCrc2) { printf("  Checksum mismatch for secondary module: %04X (expected %04X)\n", secondaryCrc2, secondaryCrc); nErrors++; }
-	if (rsrc != NULL && rsrcCrc != rsrcCrc2) { printf("  Checksum mismatch for resources pack: %04X (expected %04X)\n", rsrcCrc2, rsrcCrc); nErrors++; }
-	
-	//validate wireless info
-	int isValidChannels = ((wl->allowedChannel & 0x8001) == 0) && ((wl->allowedChannel & 0x7FFE) != 0);
-	uint16_t wlCrc = 0;
-	if ((wl->tableSize + 0x2C) <= 0x200 || wl->tableSize < sizeof(*wl)) {
-		wlCrc = ComputeCrc(&wl->tableSize, wl->tableSize, 0);
-	} else                            { printf("  Invalid wireless init table size.\n");             nErrors++; }
-	if (wlCrc!= wl->crc)              { printf("  CRC mismatch for wireless initialization.\n");     nErrors++; };
-	if (!IsValidRfType(wl->rfType))   { printf("  No valid wireless RF type specified.\n");          nErrors++; }
-	if (!isValidChannels)             { printf("  Invalid wireless channel specification.\n");       nErrors++; }
+	//module data validity
+	const char *const modErrors[] = {
+		"The ARM9 static module could not be decompressed.",
+		"The ARM7 static module could not be decompressed.",
+		"The ARM9 secondary module could not be decompressed.",
+		"The ARM7 secondary module could not be decompressed.",
+		"The resources pack could not be decompressed."
+	};
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (result.corruptModules & (1 << i)) printf("  %s\n", modErrors[i]);
+	}
+	
+	//load addresses
+	if (result.badLoadAddrs & (1 << FW_MODULE_ARM9_STATIC)) printf("  Invalid load address for ARM9 static module.\n");
+	if (result.badLoadAddrs & (1 << FW_MODULE_ARM7_STATIC)) printf("  Invalid load address for ARM7 static module.\n");
+	
+	//module checksums
+	const char *const crcNames[] = { "static module", "secondary module", "resources pack" };
+	for (int i = 0; i < FW_CRC_COUNT; i++) {
+		if (result.badCrcs & (1 << i)) printf("  Checksum mismatch for %s: %04X (expected %04X)\n", crcNames[i], result.computedCrcs[i], result.headerCrcs[i]);
+	}
+	
+	//wireless info
+	if (result.tableErrors & FW_VERIFY_WL_TABLE_SIZE) printf("  Invalid wireless init table size.\n");
+	if (result.tableErrors & FW_VERIFY_WL_CRC)        printf("  CRC mismatch for wireless initialization.\n");
+	if (result.tableErrors & FW_VERIFY_RF_TYPE)       printf("  No valid wireless RF type specified.\n");
+	if (result.tableErrors & FW_VERIFY_CHANNELS)      printf("  Invalid wireless channel specification.\n");
+	
+	//user configuration
+	for (int i = 0; i < 2; i++) {
+		if (result.badUserConfigs & (1 << i))   printf("  CRC mismatch for user configuration %d.\n", i);
+		if (result.badExUserConfigs & (1 << i)) printf("  CRC mismatch for extended user configuration %d.\n", i);
+	}
+	if (result.tableErrors & FW_VERIFY_USER_CONFIG_ADDR) printf("  Invalid user configuration address.\n");
 	
 	//error footer
-	printf("\n%d error(s) found.\n\n", nErrors);
+	printf("\n%d error(s) found.\n\n", result.nErrors);
 	
-	if (arm9Static    != NULL) free(arm9Static);
-	if (arm7Static    != NULL) free(arm7Static);
-	if (arm9Secondary != NULL) free(arm9Secondary);
-	if (arm7Secondary != NULL) free(arm7Secondary);
-	if (rsrc          != NULL) free(rsrc);
+	if (trust) {
+		unsigned int passedGroups = result.checkedCrcs & ~result.badCrcs;
+		if (result.badLoadAddrs) passedGroups &= ~(1 << FW_CRC_STATIC);
+		VfTrustGroups(trustPath, buffer, size, result.uncompressed, passedGroups);
+	}
 }
@@ -826,49 +826,10 @@ static void CmdHelpWlSetMac(void) {
 }
 
 static void GenOUI(unsigned char *pMac, int gen) {
-	//original module and X2B uses this OUI. This OUI is checked by DWC.
-	unsigned char ouiOriginal[3] = { 0x00, 0x09, 0xBF };
-	
-	//middle range modules used this OUI
-	unsigned char ouiSecond[3] = { 0x00, 0x16, 0x56 };
-	
-	//these seen later on later modules. This list may not be comprehensive.
-	unsigned char ouiLate[][3] = {
-		{ 0x00, 0x16, 0x56 },
-		{ 0x00, 0x17, 0xAB },
-		{ 0x00, 0x19, 0xFD },
-		{ 0x00, 0x1A, 0xE9 },
-		{ 0x00, 0x1B, 0x7A },
-		{ 0x00, 0x1B, 0xEA },
-		{ 0x00, 0x1D, 0xBC },
-		{ 0x00, 0x1E, 0xA9 },
-		{ 0x00, 0x21, 0x47 },
-		{ 0x00, 0x22, 0x4C },
-		{ 0x00, 0x22, 0xAA },
-		{ 0x00, 0x22, 0xD7 },
-		{ 0x00, 0x23, 0xCC },
-		{ 0x00, 0x24, 0x1E },
-		{ 0x00, 0x24, 0xF3 },
-		{ 0x00, 0x25, 0xA0 },
-		{ 0x00, 0x26, 0x59 },
-		{ 0x00, 0x27, 0x09 },
-		{ 0xE0, 0xE7, 0x51 },
-		{ 0xE8, 0x4E, 0xCE }
-	};
-	
 	//based on the generation selected, pick an OUI.
-	switch (gen) {
-		case 0: // original
-		default:
-			memcpy(pMac, ouiOriginal, sizeof(ouiOriginal));
-			break;
-		case 1: // second
-			memcpy(pMac, ouiSecond, sizeof(ouiSecond));
-			break;
-		case 2: // late (random; must NOT return original OUI)
-			memcpy(pMac, ouiLate[rand() % (int) (sizeof(ouiLate) / sizeof(ouiLate[0]))], 3);
-			break;
-	}
+	const unsigned char (*ouis)[3];
+	int nOuis = GetWirelessOuis(gen, &ouis);
+	memcpy(pMac, ouis[rand() % nOuis], 3);
 }
 
 static void CmdWlSetMac(FlashHeader *hdr, FlashRfBbInfo *wl, int argc, const char **argv) {
@@ -891,20 +852,7 @@ static void CmdWlSetMac(FlashHeader *hdr, FlashRfBbInfo *wl, int argc, const cha
 		
 		unsigned char addr[6] = { 0 };
 		
-		int ipl2Type = hdr->ipl2Type;
-		if (ipl2Type == 0xFF) ipl2Type = 0x00;
-		
-		int gen = 0;
-		if (!(ipl2Type & IPL2_TYPE_USG)) {
-			//original OUI (even on later IS-NITRO)
-			gen = 0;
-		} else if (wl->module == 5) {
-			//middle range OUI
-			gen = 1;
-		} else {
-			//late range OUI
-			gen = 2;
-		}
+		int gen = GetWirelessOuiGeneration((const unsigned char *) hdr);
 		GenOUI(addr, gen);
 		
 		//put random digits
@@ -0,0 +1,52 @@
+#include "cmd_common.h"
+#include "firmware.h"
+
+static const char *const sModuleNames[] = {
+	"ARM9 Static", "ARM7 Static", "ARM9 Secondary", "ARM7 Secondary", "Resources Pack"
+};
+
+void CmdHelpXref(void) {
+	puts("");
+	puts("Usage: xref <address> [address...]");
+	puts("");
+	puts("Lists the calls to a RAM address and the PC-relative literal loads of the value,");
+	puts("in the ARM9 and ARM7 static and secondary modules. The references are looked up");
+	puts("in an index built once when the modules are decompressed. Since the modules are");
+	puts("not disassembled, references found in data are also listed.");
+}
+
+void CmdProcXref(int argc, const char **argv) {
+	if (!RequireFirmwareImage()) return;
+	
+	if (argc < 2) {
+		CmdHelpXref();
+		return;
+	}
+	
+	const FirmwareRamView *view = GetFirmwareRamView();
+	
+	for (int i = 1; i < argc; i++) {
+		uint32_t addr = ParseArgNumber(argv[i]);
+		unsigned int nTotal = 0;
+		puts("");
+		
+		for (int j = 0; j < FW_MODULE_COUNT; j++) {
+			const XrIndex *xrefs = &view->xrefs[j];
+			
+			const XrRef *refs;
+			unsigned int nRefs = XrFindCalls(xrefs, addr, &refs);
+			for (unsigned int k = 0; k < nRefs; k++) {
+				printf("%08X: %-9s  %08X  %s + 0x%X\n", addr, XrGetKindString(refs[k].kind), refs[k].site, sModuleNames[j], refs[k].site - xrefs->base);
+			}
+			nTotal += nRefs;
+			
+			nRefs = XrFindLiterals(xrefs, addr, &refs);
+			for (unsigned int k = 0; k < nRefs; k++) {
+				printf("%08X: %-9s  %08X  %s + 0x%X, R%d from %08X\n", addr, XrGetKindString(refs[k].kind), refs[k].site, sModuleNames[j], refs[k].site - xrefs->base, refs[k].reg, refs[k].literal);
+			}
+			nTotal += nRefs;
+		}
+		
+		if (nTotal == 0) printf("%08X: no references.\n", addr);
+	}
+}
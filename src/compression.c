@@ -1,4 +1,5 @@
 #include "compression.h"
+#include "thread.h"
 
 #include <stdint.h>
 #include <string.h>
@@ -19,109 +20,216 @@ static void *CxiShrink(void *block, unsigned int to) {
 
 // ----- LZ decompression routines
 
-unsigned char *CxDecompressLZ(const unsigned char *buffer, unsigned int size, unsigned int *uncompressedSize) {
-	if (size < 4) return NULL;
+unsigned int CxDecompressLZBound(const unsigned char *buffer, unsigned int size) {
+	if (size < 4) return 0;
+	return (*(const uint32_t *) buffer) >> 8;
+}
 
-	//find the length of the decompressed buffer.
-	uint32_t length = (*(uint32_t *) buffer) >> 8;
+int CxDecompressLZInto(const unsigned char *buffer, unsigned int size, unsigned char *dst, unsigned int capacity, unsigned int *pSize) {
+	*pSize = 0;
+	if (size < 4) return 0;
 
-	//create a buffer for the decompressed buffer
-	unsigned char *result = (unsigned char *) malloc(length);
-	if (result == NULL) return NULL;
-	*uncompressedSize = length;
+	//find the length of the decompressed buffer.
+	uint32_t length = (*(const uint32_t *) buffer) >> 8;
+	if (length > capacity) {
+		*pSize = length;
+		return 0;
+	}
 
 	//initialize variables
 	uint32_t offset = 4;
 	uint32_t dstOffset = 0;
-	while (1) {
+	while (dstOffset < length) {
+		if (offset >= size) return 0;
 		uint8_t head = buffer[offset];
 		offset++;
 		//loop 8 times
-		for (int i = 0; i < 8; i++) {
+		for (int i = 0; i < 8 && dstOffset < length; i++) {
 			int flag = head >> 7;
 			head <<= 1;
 
 			if (!flag) {
-				result[dstOffset] = buffer[offset];
+				if (offset >= size) return 0;
+				dst[dstOffset] = buffer[offset];
 				dstOffset++, offset++;
-				if (dstOffset == length) return result;
 			} else {
+				if (offset + 2 > size) return 0;
 				uint8_t high = buffer[offset++];
 				uint8_t low = buffer[offset++];
 
 				//length of uncompressed chunk and offset
 				uint32_t offs = (((high & 0xF) << 8) | low) + 1;
 				uint32_t len = (high >> 4) + 3;
-				for (uint32_t j = 0; j < len; j++) {
-					result[dstOffset] = result[dstOffset - offs];
+				if (offs > dstOffset) return 0;
+				for (uint32_t j = 0; j < len && dstOffset < length; j++) {
+					dst[dstOffset] = dst[dstOffset - offs];
 					dstOffset++;
-					if (dstOffset == length) return result;
 				}
 			}
 		}
 	}
+	
+	*pSize = length;
+	return 1;
+}
+
+unsigned char *CxDecompressLZ(const unsigned char *buffer, unsigned int size, unsigned int *uncompressedSize) {
+	if (size < 4) return NULL;
+	
+	//create a buffer for the decompressed buffer
+	unsigned int length = CxDecompressLZBound(buffer, size);
+	unsigned char *result = (unsigned char *) malloc(length ? length : 1);
+	if (result == NULL) return NULL;
+	
+	if (!CxDecompressLZInto(buffer, size, result, length, uncompressedSize)) {
+		free(result);
+		return NULL;
+	}
 	return result;
 }
 
-unsigned char *CxDecompressLZStream(unsigned int *uncompressedSize, CxStreamReadCallback callback, void *arg) {
+int CxScanLZStream(unsigned int *uncompressedSize, CxStreamReadCallback callback, void *arg) {
 	int b = callback(arg);
-	if (b != 0x10) return NULL;
+	if (b != 0x10) return 0;
 	
 	unsigned int length = 0;
 	for (int i = 0; i < 3; i++) {
 		b = callback(arg);
-		if (b == CX_STREAM_EOF) return NULL;
+		if (b == CX_STREAM_EOF) return 0;
 		
 		length |= b << (i * 8);
 	}
-	
-	unsigned char *result = (unsigned char *) malloc(length);
 	*uncompressedSize = length;
 	
+	//walk the tokens without producing output
+	uint32_t dstOffset = 0;
+	while (dstOffset < length) {
+		if ((b = callback(arg)) == CX_STREAM_EOF) return 0;
+		uint8_t head = b;
+		
+		for (int i = 0; i < 8 && dstOffset < length; i++) {
+			int flag = head >> 7;
+			head <<= 1;
+			
+			if (!flag) {
+				if (callback(arg) == CX_STREAM_EOF) return 0;
+				dstOffset++;
+			} else {
+				if ((b = callback(arg)) == CX_STREAM_EOF) return 0;
+				uint8_t high = b;
+				if ((b = callback(arg)) == CX_STREAM_EOF) return 0;
+				uint8_t low = b;
+				
+				uint32_t offs = (((high & 0xF) << 8) | low) + 1;
+				uint32_t len = (high >> 4) + 3;
+				
+				if (offs > dstOffset)           return 0; // reference underflow
+				if ((dstOffset + len) > length) return 0; // reference overflow
+				if (offs == 1)                  return 0; // BIOS uses SVC UnCompLZShort
+				dstOffset += len;
+			}
+		}
+	}
+	return 1;
+}
+
+int CxDecompressLZStreamInto(unsigned char *dst, unsigned int capacity, unsigned int *pSize, CxStreamReadCallback callback, void *arg) {
+	*pSize = 0;
+	int b = callback(arg);
+	if (b != 0x10) return 0;
+	
+	unsigned int length = 0;
+	for (int i = 0; i < 3; i++) {
+		b = callback(arg);
+		if (b == CX_STREAM_EOF) return 0;
+		
+		length |= b << (i * 8);
+	}
+	if (length > capacity) {
+		*pSize = length;
+		return 0;
+	}
+	
 	//initialize variables
 	uint32_t dstOffset = 0;
-	while (1) {
-		if ((b = callback(arg)) == CX_STREAM_EOF) goto Error;
+	while (dstOffset < length) {
+		if ((b = callback(arg)) == CX_STREAM_EOF) return 0;
 		uint8_t head = b;
-		//printf("Out pos: %08X\n", dstOffset);
 		
 		//loop 8 times
-		for (int i = 0; i < 8; i++) {
+		for (int i = 0; i < 8 && dstOffset < length; i++) {
 			int flag = head >> 7;
 			head <<= 1;
 
 			if (!flag) {
-				if ((b = callback(arg)) == CX_STREAM_EOF) goto Error;
+				if ((b = callback(arg)) == CX_STREAM_EOF) return 0;
 				
-				result[dstOffset] = b;
+				dst[dstOffset] = b;
 				dstOffset++;
 			} else {
-				if ((b = callback(arg)) == CX_STREAM_EOF) goto Error;
+				if ((b = callback(arg)) == CX_STREAM_EOF) return 0;
 				uint8_t high = b;
-				if ((b = callback(arg)) == CX_STREAM_EOF) goto Error;
+				if ((b = callback(arg)) == CX_STREAM_EOF) return 0;
 				uint8_t low = b;
 
 				//length of uncompressed chunk and offset
 				uint32_t offs = (((high & 0xF) << 8) | low) + 1;
 				uint32_t len = (high >> 4) + 3;
 				
-				if (offs > dstOffset)           goto Error; // reference underflow
-				if ((dstOffset + len) > length) goto Error; // reference overflow
-				if (offs == 1)                  goto Error; // BIOS uses SVC UnCompLZShort
+				if (offs > dstOffset)           return 0; // reference underflow
+				if ((dstOffset + len) > length) return 0; // reference overflow
+				if (offs == 1)                  return 0; // BIOS uses SVC UnCompLZShort
 				
 				for (uint32_t j = 0; j < len; j++) {
-					result[dstOffset] = result[dstOffset - offs];
+					dst[dstOffset] = dst[dstOffset - offs];
 					dstOffset++;
 				}
 			}
-			if (dstOffset == length) return result;
 		}
 	}
-	return result;
 	
-Error:
-	if (result != NULL) free(result);
-	return NULL;
+	*pSize = length;
+	return 1;
+}
+
+//
+// Stream callback that replays the header already read to size the output, then reads the rest of the
+// stream.
+//
+typedef struct CxiLzStreamAlloc_ {
+	CxStreamReadCallback callback;
+	void *arg;
+	unsigned int nRead;
+	int header[4];
+} CxiLzStreamAlloc;
+
+static int CxiLzStreamAllocRead(void *pArg) {
+	CxiLzStreamAlloc *state = (CxiLzStreamAlloc *) pArg;
+	if (state->nRead < 4) return state->header[state->nRead++];
+	return state->callback(state->arg);
+}
+
+unsigned char *CxDecompressLZStream(unsigned int *uncompressedSize, CxStreamReadCallback callback, void *arg) {
+	CxiLzStreamAlloc state;
+	state.callback = callback;
+	state.arg = arg;
+	state.nRead = 0;
+	
+	unsigned int length = 0;
+	for (int i = 0; i < 4; i++) {
+		state.header[i] = callback(arg);
+		if (state.header[i] == CX_STREAM_EOF || (i == 0 && state.header[i] != 0x10)) return NULL;
+		if (i > 0) length |= state.header[i] << ((i - 1) * 8);
+	}
+	
+	unsigned char *result = (unsigned char *) malloc(length ? length : 1);
+	if (result == NULL) return NULL;
+	
+	if (!CxDecompressLZStreamInto(result, length, uncompressedSize, CxiLzStreamAllocRead, &state)) {
+		free(result);
+		return NULL;
+	}
+	return result;
 }
 
 
@@ -269,30 +377,36 @@ Error:
 	return UINT32_MAX;
 }
 
-unsigned char *CxDecompressAsh(const unsigned char *buffer, unsigned int size, unsigned int *uncompressedSize) {
-	if (size < 0xC) {
-		*uncompressedSize = 0;
-		return NULL;
-	}
+unsigned int CxDecompressAshBound(const unsigned char *buffer, unsigned int size) {
+	if (size < 0xC) return 0;
+	return BigToLittle32(*(const uint32_t *) (buffer + 4)) & 0x00FFFFFF;
+}
+
+int CxDecompressAshInto(const unsigned char *buffer, unsigned int size, unsigned char *dst, unsigned int capacity, unsigned int *pSize) {
+	*pSize = 0;
+	if (size < 0xC) return 0;
 	
 	int symBits = 9, distBits = 11;
-	uint32_t uncompSize = BigToLittle32(*(uint32_t *) (buffer + 4)) & 0x00FFFFFF;
+	uint32_t uncompSize = CxDecompressAshBound(buffer, size);
 	uint32_t outSize = uncompSize;
+	if (outSize > capacity) {
+		*pSize = outSize;
+		return 0;
+	}
 	
 	BIT_READER_8 reader, reader2;
 	const unsigned char *endp = buffer + size;
 	uint32_t offsDstStream = BigToLittle32(*(const uint32_t *) (buffer + 0x8));
 	if (offsDstStream >= size) {
 		//must reserve at least some space to write a minimal tree there
-		*uncompressedSize = 0;
-		return NULL;
+		return 0;
 	}
 	
 	CxiInitBitReader(&reader, buffer + offsDstStream, endp, 1);
 	CxiInitBitReader(&reader2, buffer + 0xC, endp, 1);
 	
-	uint8_t *outbuf = calloc(uncompSize, 1);
-	uint8_t *destp = outbuf;
+	uint8_t *destp = dst;
+	int ok = 0;
 
 	uint32_t symMax = (1 << symBits);
 	uint32_t distMax = (1 << distBits);
@@ -301,6 +415,7 @@ unsigned char *CxDecompressAsh(const unsigned char *buffer, unsigned int size, u
 	uint32_t *symRightTree = calloc(2 * symMax - 1, sizeof(uint32_t));
 	uint32_t *distLeftTree = calloc(2 * distMax - 1, sizeof(uint32_t));
 	uint32_t *distRightTree = calloc(2 * distMax - 1, sizeof(uint32_t));
+	if (symLeftTree == NULL || symRightTree == NULL || distLeftTree == NULL || distRightTree == NULL) goto Error;
 
 	uint32_t symRoot, distRoot;
 	symRoot = CxAshReadTree(&reader2, symBits, symLeftTree, symRightTree);
@@ -308,7 +423,7 @@ unsigned char *CxDecompressAsh(const unsigned char *buffer, unsigned int size, u
 	if (symRoot == UINT32_MAX || distRoot == UINT32_MAX) goto Error;
 
 	//main uncompress loop
-	do {
+	while (uncompSize > 0) {
 		uint32_t sym = symRoot;
 		while (sym >= symMax) {
 			if (!CxiConsumeBit(&reader2)) {
@@ -335,33 +450,50 @@ unsigned char *CxDecompressAsh(const unsigned char *buffer, unsigned int size, u
 			const uint8_t *srcp = destp - distsym - 1;
 			
 			if (copylen > uncompSize) goto Error;
-			//if ((distsym + 1) >= (size_t) (destp - outbuf)) goto Error;
+			if ((distsym + 1) > (size_t) (destp - dst)) goto Error;
 			
 			uncompSize -= copylen;
 			while (copylen--) {
 				*(destp++) = *(srcp++);
 			}
 		}
-	} while (uncompSize > 0);
-
-	if (0) {	
-Error:
-		//free output
-		if (outbuf != NULL) free(outbuf);
-		outbuf = NULL;
-		outSize = 0;
 	}
+	ok = 1;
+	*pSize = outSize;
 
-	if (symLeftTree != NULL) free(symLeftTree);
-	if (symLeftTree != NULL) free(symRightTree);
-	if (symLeftTree != NULL) free(distLeftTree);
-	if (symLeftTree != NULL) free(distRightTree);
+Error:
+	free(symLeftTree);
+	free(symRightTree);
+	free(distLeftTree);
+	free(distRightTree);
+	return ok;
+}
 
-	*uncompressedSize = outSize;
+unsigned char *CxDecompressAsh(const unsigned char *buffer, unsigned int size, unsigned int *uncompressedSize) {
+	*uncompressedSize = 0;
+	if (size < 0xC) return NULL;
+	
+	unsigned int length = CxDecompressAshBound(buffer, size);
+	unsigned char *outbuf = (unsigned char *) malloc(length ? length : 1);
+	if (outbuf == NULL) return NULL;
+	
+	if (!CxDecompressAshInto(buffer, size, outbuf, length, uncompressedSize)) {
+		free(outbuf);
+		return NULL;
+	}
 	return outbuf;
 }
 
 
+int CxPadCompressedInto(unsigned char *comp, unsigned int size, unsigned int capacity, unsigned int boundary, unsigned int *pOutSize) {
+	unsigned int outSize = (size + boundary - 1) / boundary * boundary;
+	*pOutSize = outSize;
+	if (outSize > capacity) return 0;
+	
+	memset(comp + size, 0, outSize - size);
+	return 1;
+}
+
 unsigned char *CxPadCompressed(unsigned char *comp, unsigned int size, unsigned int boundary, unsigned int *pOutSize) {
 	//check if size is already aligned to boundary
 	if ((size % boundary) == 0) {
@@ -378,7 +510,7 @@ unsigned char *CxPadCompressed(unsigned char *comp, unsigned int size, unsigned
 		return NULL;
 	}
 	
-	*pOutSize = outSize;
+	CxPadCompressedInto(out, size, outSize, boundary, pOutSize);
 	return out;
 }
 
@@ -592,14 +724,50 @@ static inline unsigned int CxiLzTokenCost(unsigned int length) {
 }
 
 
-unsigned char *CxCompressLZ(const unsigned char *buffer, unsigned int size, unsigned int *compressedSize) {
-	CxiLzState state;
-	CxiLzStateInit(&state, buffer, size, LZ_MIN_LENGTH, LZ_MAX_LENGTH, LZ_MIN_SAFE_DISTANCE, LZ_MAX_DISTANCE);
+static int CxiCancelled(const CxEffort *effort) {
+	return effort != NULL && effort->progress != NULL && effort->progress->cancel;
+}
 
-	//create node list and fill in the maximum string reference sizes
-	CxiLzNode *nodes = (CxiLzNode *) calloc(size, sizeof(CxiLzNode));
-	unsigned int pos = 0;
-	while (pos < size) {
+static int CxiDeadlinePassed(const CxEffort *effort) {
+	return effort != NULL && effort->deadline > 0.0 && ThGetTime() >= effort->deadline;
+}
+
+//report progress and check whether to stop, which is done once every few KB of input
+static int CxiUpdateProgress(const CxEffort *effort, unsigned int pass, unsigned int pos) {
+	if (effort == NULL) return 0;
+	
+	if (effort->progress != NULL) {
+		effort->progress->pass = pass;
+		effort->progress->pos = pos;
+	}
+	return CxiCancelled(effort) || CxiDeadlinePassed(effort);
+}
+
+static void CxiStartProgress(const CxEffort *effort, unsigned int nPasses, unsigned int size) {
+	if (effort == NULL || effort->progress == NULL) return;
+	
+	effort->progress->nPasses = nPasses;
+	effort->progress->size = size;
+	effort->progress->pass = 0;
+	effort->progress->pos = 0;
+}
+
+static int CxiLzFindMatches(CxiLzNode *nodes, const unsigned char *buffer, unsigned int start, unsigned int end, const CxEffort *effort) {
+	//matches may not extend past end. Only the last window of data before start is needed as history.
+	CxiLzState state;
+	CxiLzStateInit(&state, buffer, end, LZ_MIN_LENGTH, LZ_MAX_LENGTH, LZ_MIN_SAFE_DISTANCE, LZ_MAX_DISTANCE);
+	state.pos = (start > LZ_MAX_DISTANCE) ? (start - LZ_MAX_DISTANCE) : 0;
+	CxiLzStateSlide(&state, start - state.pos);
+
+	//fill in the maximum string reference sizes
+	unsigned int pos = start;
+	while (pos < end) {
+		//give up once the deadline passes or the compression is cancelled, checking once per window
+		if ((pos & (LZ_MAX_DISTANCE - 1)) == 0 && CxiUpdateProgress(effort, 1, pos)) {
+			CxiLzStateFree(&state);
+			return 0;
+		}
+		
 		unsigned int dst;
 		unsigned int len = CxiLzSearch(&state, &dst);
 
@@ -611,10 +779,43 @@ unsigned char *CxCompressLZ(const unsigned char *buffer, unsigned int size, unsi
 		CxiLzStateSlide(&state, 1);
 	}
 	CxiLzStateFree(&state);
+	return 1;
+}
+
+static int CxiLzGreedyParse(CxiLzNode *nodes, const unsigned char *buffer, unsigned int size, const CxEffort *effort) {
+	//take the longest match at each token boundary, so only the token boundaries are searched
+	CxiLzState state;
+	CxiLzStateInit(&state, buffer, size, LZ_MIN_LENGTH, LZ_MAX_LENGTH, LZ_MIN_SAFE_DISTANCE, LZ_MAX_DISTANCE);
+	
+	unsigned int pos = 0, nextCheck = 0;
+	while (pos < size) {
+		//the greedy parse is the fallback for a deadline, so only cancellation stops it
+		if (pos >= nextCheck) {
+			CxiUpdateProgress(effort, 0, pos);
+			if (CxiCancelled(effort)) {
+				CxiLzStateFree(&state);
+				return 0;
+			}
+			nextCheck = pos + LZ_MAX_DISTANCE;
+		}
+		
+		unsigned int dst;
+		unsigned int len = CxiLzSearch(&state, &dst);
+		
+		nodes[pos].length = len;
+		nodes[pos].distance = dst;
+		
+		pos += len;
+		CxiLzStateSlide(&state, len);
+	}
+	CxiLzStateFree(&state);
+	return 1;
+}
 
+static void CxiLzOptimalParse(CxiLzNode *nodes, unsigned int start, unsigned int end) {
 	//work backwards from the end of file
-	pos = size;
-	while (pos--) {
+	unsigned int pos = end;
+	while (pos-- > start) {
 		//get node at pos
 		CxiLzNode *node = nodes + pos;
 
@@ -623,7 +824,7 @@ unsigned char *CxCompressLZ(const unsigned char *buffer, unsigned int size, unsi
 		unsigned int dist = nodes[pos].distance;
 
 		//if node takes us to the end of file, set weight to cost of this node.
-		if ((pos + len) == size) {
+		if ((pos + len) == end) {
 			//token takes us to the end of the file, its weight equals this token cost.
 			node->length = len;
 			node->distance = dist;
@@ -652,19 +853,26 @@ unsigned char *CxCompressLZ(const unsigned char *buffer, unsigned int size, unsi
 			node->weight = weightBest;
 		}
 	}
+}
 
-	//from here on, we have a direct path to the end of file. All we need to do is traverse it.
-
-	//get max compressed size
-	unsigned int maxCompressed = 4 + size + (size + 7) / 8;
+//
+// Encode the parsed nodes into dst if the output fits in capacity. Returns the size of the output.
+//
+static unsigned int CxiLzEncodeNodesInto(const unsigned char *buffer, unsigned int size, const CxiLzNode *nodes, unsigned char *dst, unsigned int capacity) {
+	//measure the output first, so nothing is written unless it fits
+	unsigned int outSize = 4, nTokens = 0;
+	for (unsigned int srcpos = 0; srcpos < size; srcpos += nodes[srcpos].length) {
+		if ((nTokens++ % 8) == 0) outSize++;
+		outSize += CxiLzNodeIsReference(&nodes[srcpos]) ? 2 : 1;
+	}
+	if (outSize > capacity) return outSize;
 
 	//encode LZ data
-	unsigned char *buf = (unsigned char *) calloc(maxCompressed, 1);
-	unsigned char *bufpos = buf;
+	unsigned char *bufpos = dst;
 	*(uint32_t *) (bufpos) = (size << 8) | 0x10;
 	bufpos += 4;
 
-	CxiLzNode *curnode = &nodes[0];
+	const CxiLzNode *curnode = &nodes[0];
 
 	unsigned int srcpos = 0;
 	while (srcpos < size) {
@@ -694,14 +902,136 @@ unsigned char *CxCompressLZ(const unsigned char *buffer, unsigned int size, unsi
 		*headpos = head;
 	}
 
-	//nodes no longer needed
-	free(nodes);
+	return outSize;
+}
 
-	unsigned int outSize = bufpos - buf;
+static unsigned char *CxiLzEncodeNodes(const unsigned char *buffer, unsigned int size, const CxiLzNode *nodes, unsigned int *compressedSize) {
+	unsigned int maxCompressed = CxCompressLZBound(size);
+	unsigned char *buf = (unsigned char *) malloc(maxCompressed);
+	if (buf == NULL) return NULL;
+	
+	unsigned int outSize = CxiLzEncodeNodesInto(buffer, size, nodes, buf, maxCompressed);
 	*compressedSize = outSize;
 	return CxiShrink(buf, outSize); //reduce buffer size
 }
 
+unsigned int CxCompressLZBound(unsigned int size) {
+	return 4 + size + (size + 7) / 8;
+}
+
+unsigned char *CxCompressLZ(const unsigned char *buffer, unsigned int size, unsigned int *compressedSize) {
+	return CxCompressLZEx(buffer, size, NULL, compressedSize);
+}
+
+unsigned char *CxCompressLZEx(const unsigned char *buffer, unsigned int size, const CxEffort *effort, unsigned int *compressedSize) {
+	unsigned int maxCompressed = CxCompressLZBound(size);
+	unsigned char *out = (unsigned char *) malloc(maxCompressed);
+	if (out == NULL) return NULL;
+	
+	if (!CxCompressLZInto(buffer, size, effort, out, maxCompressed, compressedSize)) {
+		free(out);
+		return NULL;
+	}
+	return CxiShrink(out, *compressedSize); //reduce buffer size
+}
+
+int CxCompressLZInto(const unsigned char *buffer, unsigned int size, const CxEffort *effort, unsigned char *dst, unsigned int capacity, unsigned int *pSize) {
+	int limited = effort != NULL && (effort->targetSize || effort->deadline > 0.0);
+	CxiStartProgress(effort, 1, size);
+	*pSize = 0;
+	
+	CxiLzNode *nodes = (CxiLzNode *) calloc(size ? size : 1, sizeof(CxiLzNode));
+	if (nodes == NULL) return 0;
+	
+	//with a target or deadline, a cheap greedy parse comes first. It is used if it meets the target,
+	//or if the deadline passes before the optimal parse is done.
+	unsigned int greedySize = 0;
+	if (limited) {
+		if (!CxiLzGreedyParse(nodes, buffer, size, effort)) {
+			free(nodes);
+			return 0;
+		}
+		greedySize = CxiLzEncodeNodesInto(buffer, size, nodes, dst, capacity);
+		
+		if ((effort->targetSize && greedySize <= effort->targetSize) || CxiDeadlinePassed(effort)) {
+			free(nodes);
+			*pSize = greedySize;
+			return greedySize <= capacity;
+		}
+	}
+	
+	//find the shortest path to the end of file
+	if (!CxiLzFindMatches(nodes, buffer, 0, size, effort)) {
+		free(nodes);
+		if (CxiCancelled(effort) || !limited) return 0;
+		*pSize = greedySize;
+		return greedySize <= capacity;
+	}
+	CxiLzOptimalParse(nodes, 0, size);
+	
+	//from here on, we have a direct path to the end of file. All we need to do is traverse it.
+	*pSize = CxiLzEncodeNodesInto(buffer, size, nodes, dst, capacity);
+	
+	//nodes no longer needed
+	free(nodes);
+	return *pSize <= capacity;
+}
+
+unsigned char *CxRecompressLZ(const unsigned char *comp, unsigned int compSize, const unsigned char *buffer, unsigned int size, unsigned int editStart, unsigned int editEnd, unsigned int *compressedSize) {
+	if (compSize < 4 || comp[0] != 0x10 || (*(const uint32_t *) comp >> 8) != size) return NULL;
+	if (editStart >= editEnd || editEnd > size) return NULL;
+	
+	//recover the token path of the old stream. Each node holds the token starting at its position.
+	CxiLzNode *nodes = (CxiLzNode *) calloc(size, sizeof(CxiLzNode));
+	unsigned int srcpos = 4, dstpos = 0;
+	unsigned int restart = 0, rejoin = size;
+	unsigned int rejoinMin = (editEnd > size - LZ_MAX_DISTANCE) ? size : (editEnd + LZ_MAX_DISTANCE);
+	while (dstpos < size) {
+		if (srcpos >= compSize) goto Invalid;
+		uint8_t head = comp[srcpos++];
+		
+		for (int i = 0; i < 8 && dstpos < size; i++) {
+			//the edit is re-parsed from the token boundary before it. Old tokens from the first
+			//boundary a window past the edit only reference unchanged data, so the parse rejoins there.
+			if (dstpos <= editStart) restart = dstpos;
+			if (dstpos >= rejoinMin && rejoin == size) rejoin = dstpos;
+			
+			if (head & (0x80 >> i)) {
+				if ((compSize - srcpos) < 2) goto Invalid;
+				uint16_t enc = (comp[srcpos] << 8) | comp[srcpos + 1];
+				srcpos += 2;
+				
+				unsigned int length = (enc >> 12) + LZ_MIN_LENGTH;
+				unsigned int distance = (enc & 0xFFF) + LZ_MIN_DISTANCE;
+				if (distance > dstpos || length > (size - dstpos)) goto Invalid;
+				
+				nodes[dstpos].length = length;
+				nodes[dstpos].distance = distance;
+				dstpos += length;
+			} else {
+				if (srcpos >= compSize) goto Invalid;
+				srcpos++;
+				
+				nodes[dstpos].length = 1;
+				nodes[dstpos].distance = 0;
+				dstpos++;
+			}
+		}
+	}
+	
+	//re-parse the edited region, ending exactly at the rejoin point
+	CxiLzFindMatches(nodes, buffer, restart, rejoin, NULL);
+	CxiLzOptimalParse(nodes, restart, rejoin);
+	
+	unsigned char *out = CxiLzEncodeNodes(buffer, size, nodes, compressedSize);
+	free(nodes);
+	return out;
+
+Invalid:
+	free(nodes);
+	return NULL;
+}
+
 
 // ----- ASH compression routines
 
@@ -767,8 +1097,7 @@ static void CxiBitStreamWrite(BITSTREAM *stream, int bit) {
 	stream->length++;
 }
 
-static void *CxiBitStreamGetBytes(BITSTREAM *stream, int wordAlign, int beBytes, int beBits, unsigned int *size) {
-	//allocate buffer
+static unsigned int CxiBitStreamGetSize(const BITSTREAM *stream, int wordAlign) {
 	unsigned int outSize = stream->nWords * 4;
 	if (!wordAlign) {
 		//nBitsInLast word is 32 if last word is full, 0 if empty.
@@ -777,8 +1106,11 @@ static void *CxiBitStreamGetBytes(BITSTREAM *stream, int wordAlign, int beBytes,
 		if (stream->nBitsInLastWord <=  8) outSize--;
 		if (stream->nBitsInLastWord <=  0) outSize--;
 	}
-	unsigned char *outbuf = (unsigned char *) calloc(outSize, 1);
-	if (outbuf == NULL) return NULL;
+	return outSize;
+}
+
+static void CxiBitStreamCopyBytes(const BITSTREAM *stream, int wordAlign, int beBytes, int beBits, unsigned char *outbuf) {
+	unsigned int outSize = CxiBitStreamGetSize(stream, wordAlign);
 
 	//this function handles converting byte and bit orders from the internal
 	//representation. Internally, we store the bit sequence as an array of
@@ -798,9 +1130,6 @@ static void *CxiBitStreamGetBytes(BITSTREAM *stream, int wordAlign, int beBytes,
 		}
 		outbuf[i] = byte;
 	}
-
-	*size = outSize;
-	return outbuf;
 }
 
 static void CxiBitStreamWriteBitsBE(BITSTREAM *stream, uint32_t bits, int nBits) {
@@ -1069,14 +1398,24 @@ static void CxiAshWriteTree(BITSTREAM *stream, CxiHuffNode *nodes, int nBits) {
 	}
 }
 
-static CxiLzToken *CxiAshTokenize(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, unsigned int *pnTokens) {
+static CxiLzToken *CxiAshTokenize(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, const CxEffort *effort, unsigned int *pnTokens) {
 	unsigned int nTokens = 0, tokenBufferSize = 16;
 	CxiLzToken *tokenBuffer = (CxiLzToken *) calloc(tokenBufferSize, sizeof(CxiLzToken));
 	if (tokenBuffer == NULL) return NULL;
 	
 	//
-	unsigned int curpos = 0;
+	unsigned int curpos = 0, nextCheck = 0;
 	while (curpos < size) {
+		//the first parse is the fallback for a deadline, so only cancellation stops it
+		if (curpos >= nextCheck) {
+			CxiUpdateProgress(effort, 0, curpos);
+			if (CxiCancelled(effort)) {
+				free(tokenBuffer);
+				return NULL;
+			}
+			nextCheck = curpos + 0x1000;
+		}
+		
 		//ensure buffer capacity
 		if (nTokens + 1 > tokenBufferSize) {
 			tokenBufferSize = (tokenBufferSize + 2) * 3 / 2;
@@ -1166,7 +1505,7 @@ static unsigned int CxiAshRoundDown(unsigned int sym, unsigned int *vals, unsign
 	return lo;
 }
 
-static CxiLzToken *CxiAshRetokenize(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, CxiHuffNode *symNodes, CxiHuffNode *dstNodes, unsigned int *pnTokens) {
+static CxiLzToken *CxiAshRetokenize(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, CxiHuffNode *symNodes, CxiHuffNode *dstNodes, const CxEffort *effort, unsigned int pass, unsigned int *pnTokens) {
 	//allocate graph
 	CxiLzNode *nodes = (CxiLzNode *) calloc(size, sizeof(CxiLzNode));
 	if (nodes == NULL) return NULL;
@@ -1198,9 +1537,15 @@ static CxiLzToken *CxiAshRetokenize(const unsigned char *buffer, unsigned int si
 	unsigned int *dsts = (unsigned int *) calloc(nDstNodesAvailable, sizeof(unsigned int));
 	for (int i = 0; i < nDstNodesAvailable; i++) dsts[i] = dstInfo[i].sym + 1;
 	
-	//scan backwards from end of file
+	//scan backwards from end of file. Give up once the deadline passes or the compression is cancelled.
+	int stopped = 0;
 	unsigned int pos = size;
 	while (pos-- > 0) {
+		if ((pos & 0xFFF) == 0 && CxiUpdateProgress(effort, pass, size - pos)) {
+			stopped = 1;
+			break;
+		}
+		
 		//search LZ
 		unsigned int length = 0, distance = 0;
 		if (nLenNodesAvailable > 0) {
@@ -1331,6 +1676,11 @@ static CxiLzToken *CxiAshRetokenize(const unsigned char *buffer, unsigned int si
 	free(symDepths);
 	free(dstDepths);
 	
+	if (stopped) {
+		free(nodes);
+		return NULL;
+	}
+	
 	//convert graph into node array
 	unsigned int nTokens = 0;
 	pos = 0;
@@ -1372,7 +1722,89 @@ static CxiLzToken *CxiAshRetokenize(const unsigned char *buffer, unsigned int si
 	return tokens;
 }
 
+//
+// Encode the tokens into dst if the output is no larger than limit. Returns the size of the output.
+//
+static unsigned int CxiAshEncodeInto(const CxiLzToken *tokens, unsigned int nTokens, CxiHuffNode *symNodes, int nSymBits, CxiHuffNode *dstNodes, int nDstBits, unsigned int size, unsigned char *dst, unsigned int limit) {
+	//init streams
+	BITSTREAM symStream, dstStream;
+	CxiBitStreamCreate(&symStream);
+	CxiBitStreamCreate(&dstStream);
+	
+	//first, write huffman trees.
+	CxiAshWriteTree(&symStream, symNodes, nSymBits);
+	CxiAshWriteTree(&dstStream, dstNodes, nDstBits);
+	
+	//write data stream
+	for (unsigned int i = 0; i < nTokens; i++) {
+		const CxiLzToken *token = &tokens[i];
+		
+		if (token->isReference) {
+			CxiHuffmanWriteSymbol(&symStream, token->length - 3 + 0x100, symNodes);
+			CxiHuffmanWriteSymbol(&dstStream, token->distance - 1, dstNodes);
+		} else {
+			CxiHuffmanWriteSymbol(&symStream, token->symbol, symNodes);
+		}
+	}
+	
+	//write data out
+	unsigned int symStreamSize = CxiBitStreamGetSize(&symStream, 1);
+	unsigned int dstStreamSize = CxiBitStreamGetSize(&dstStream, 1);
+	unsigned int outSize = 0xC + symStreamSize + dstStreamSize;
+	if (outSize <= limit) {
+		//write header
+		uint32_t header[3];
+		header[0] = 0x30485341;    // 'ASH0'
+		header[1] = LittleToBig(size);
+		header[2] = LittleToBig(0xC + symStreamSize);
+		memcpy(dst, header, sizeof(header));
+		
+		//write streams
+		CxiBitStreamCopyBytes(&symStream, 1, 1, 1, dst + sizeof(header));
+		CxiBitStreamCopyBytes(&dstStream, 1, 1, 1, dst + sizeof(header) + symStreamSize);
+	}
+	
+	//free stuff
+	CxiBitStreamFree(&symStream);
+	CxiBitStreamFree(&dstStream);
+	return outSize;
+}
+
+unsigned int CxCompressAshBound(unsigned int size, int nSymBits, int nDstBits) {
+	//each tree takes a bit per branch and leaf plus the leaf values. Each code is no longer than a fixed
+	//length code would be, every token covers at least one byte and every reference at least three.
+	uint64_t symBits = (uint64_t) (1 << nSymBits) * (nSymBits + 2) + (uint64_t) size * nSymBits;
+	uint64_t dstBits = (uint64_t) (1 << nDstBits) * (nDstBits + 2) + (uint64_t) (size / 3) * nDstBits;
+	uint64_t bound = 0xC + (symBits + 31) / 32 * 4 + (dstBits + 31) / 32 * 4;
+	return bound > UINT32_MAX ? UINT32_MAX : (unsigned int) bound;
+}
+
 unsigned char *CxCompressAsh(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, unsigned int nPasses, unsigned int *compressedSize) {
+	CxEffort effort = { 0 };
+	effort.nPasses = nPasses;
+	return CxCompressAshEx(buffer, size, nSymBits, nDstBits, &effort, compressedSize);
+}
+
+unsigned char *CxCompressAshEx(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, const CxEffort *effort, unsigned int *compressedSize) {
+	unsigned int maxCompressed = CxCompressAshBound(size, nSymBits, nDstBits);
+	unsigned char *out = (unsigned char *) malloc(maxCompressed);
+	if (out == NULL) return NULL;
+	
+	if (!CxCompressAshInto(buffer, size, nSymBits, nDstBits, effort, out, maxCompressed, compressedSize)) {
+		free(out);
+		return NULL;
+	}
+	return CxiShrink(out, *compressedSize); //reduce buffer size
+}
+
+int CxCompressAshInto(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, const CxEffort *effort, unsigned char *dst, unsigned int capacity, unsigned int *pSize) {
+	CxEffort defEffort = { CX_ASH_DEFAULT_PASSES, 0, 0.0, NULL };
+	if (effort == NULL) effort = &defEffort;
+	
+	//with a target or deadline, every pass is encoded so that the best result so far is at hand
+	int keepBest = effort->targetSize || effort->deadline > 0.0;
+	*pSize = 0;
+	
 	//allocate tree structures
 	int nSymNodes = (1 << nSymBits);
 	int nDstNodes = (1 << nDstBits);
@@ -1381,16 +1813,17 @@ unsigned char *CxCompressAsh(const unsigned char *buffer, unsigned int size, int
 	if (symNodes == NULL || dstNodes == NULL) {
 		if (symNodes != NULL) free(symNodes);
 		if (dstNodes != NULL) free(dstNodes);
-		return NULL;
+		return 0;
 	}
 	
 	//tokenize
+	CxiStartProgress(effort, effort->nPasses, size);
 	unsigned int nTokens = 0;
-	CxiLzToken *tokens = CxiAshTokenize(buffer, size, nSymBits, nDstBits, &nTokens);
+	CxiLzToken *tokens = CxiAshTokenize(buffer, size, nSymBits, nDstBits, effort, &nTokens);
 	if (tokens == NULL) {
 		free(symNodes);
 		free(dstNodes);
-		return NULL;
+		return 0;
 	}
 	
 	CxiAshGenHuffman(tokens, nTokens, symNodes, nSymNodes, dstNodes, nDstNodes);
@@ -1399,19 +1832,36 @@ unsigned char *CxCompressAsh(const unsigned char *buffer, unsigned int size, int
 	//    Herein lies the really expensive operations (both memory and time).
 	// ----------------------------------------------------------------------------------------------
 	
-	//iterate on adjusting the frequency distribution and traversing the encoding space
-	for (unsigned int i = 0; i < nPasses; i++) {
-		//discard tokenized sequence. 
-		free(tokens);
-
+	//iterate on adjusting the frequency distribution and traversing the encoding space. The best
+	//output so far is kept in dst when it fits, and only a smaller output replaces it.
+	unsigned int bestSize = 0;
+	for (unsigned int i = 0; ; i++) {
+		if (keepBest) {
+			unsigned int limit = capacity;
+			if (bestSize && bestSize - 1 < limit) limit = bestSize - 1;
+			
+			unsigned int outSize = CxiAshEncodeInto(tokens, nTokens, symNodes, nSymBits, dstNodes, nDstBits, size, dst, limit);
+			if (bestSize == 0 || outSize < bestSize) bestSize = outSize;
+			if (effort->targetSize && bestSize <= effort->targetSize) break;
+		}
+		if (i == effort->nPasses || CxiDeadlinePassed(effort)) break;
+		
 		//re-tokenize
-		tokens = CxiAshRetokenize(buffer, size, nSymBits, nDstBits, symNodes, dstNodes, &nTokens);
-		if (tokens == NULL) {
+		CxiLzToken *next = CxiAshRetokenize(buffer, size, nSymBits, nDstBits, symNodes, dstNodes, effort, i + 1, &nTokens);
+		if (next == NULL) {
+			//out of time: the last tokens and trees are still consistent
+			if (!CxiCancelled(effort) && CxiDeadlinePassed(effort)) break;
+			
+			free(tokens);
 			free(symNodes);
 			free(dstNodes);
-			return NULL;
+			return 0;
 		}
 		
+		//discard tokenized sequence. 
+		free(tokens);
+		tokens = next;
+		
 		//regenerate huffman tree due to changes in frequency distribution
 		CxiAshGenHuffman(tokens, nTokens, symNodes, nSymNodes, dstNodes, nDstNodes);
 	}
@@ -1420,61 +1870,35 @@ unsigned char *CxCompressAsh(const unsigned char *buffer, unsigned int size, int
 	//    End of super intense operations
 	// ----------------------------------------------------------------------------------------------
 	
-	//init streams
-	BITSTREAM symStream, dstStream;
-	CxiBitStreamCreate(&symStream);
-	CxiBitStreamCreate(&dstStream);
-	
-	//first, write huffman trees.
-	CxiAshWriteTree(&symStream, symNodes, nSymBits);
-	CxiAshWriteTree(&dstStream, dstNodes, nDstBits);
-	
-	//write data stream
-	for (unsigned int i = 0; i < nTokens; i++) {
-		CxiLzToken *token = &tokens[i];
-		
-		if (token->isReference) {
-			CxiHuffmanWriteSymbol(&symStream, token->length - 3 + 0x100, symNodes);
-			CxiHuffmanWriteSymbol(&dstStream, token->distance - 1, dstNodes);
-		} else {
-			CxiHuffmanWriteSymbol(&symStream, token->symbol, symNodes);
-		}
-	}
+	if (!keepBest) bestSize = CxiAshEncodeInto(tokens, nTokens, symNodes, nSymBits, dstNodes, nDstBits, size, dst, capacity);
 	
 	//free node and tree structs
 	free(tokens);
 	free(symNodes);
 	free(dstNodes);
 	
-	//encode data output
-	unsigned int symStreamSize = 0;
-	unsigned int dstStreamSize = 0;
-	void *symBytes = CxiBitStreamGetBytes(&symStream, 1, 1, 1, &symStreamSize);
-	void *dstBytes = CxiBitStreamGetBytes(&dstStream, 1, 1, 1, &dstStreamSize);
-	
-	//write data out
-	unsigned char *out = (unsigned char *) calloc(0xC + symStreamSize + dstStreamSize, 1);
-	{
-		//write header
-		uint32_t header[3];
-		header[0] = 0x30485341;    // 'ASH0'
-		header[1] = LittleToBig(size);
-		header[2] = LittleToBig(0xC + symStreamSize);
-		memcpy(out, header, sizeof(header));
-		
-		//write streams
-		memcpy(out + sizeof(header), symBytes, symStreamSize);
-		memcpy(out + sizeof(header) + symStreamSize, dstBytes, dstStreamSize);
-	}
-	free(symBytes);
-	free(dstBytes);
-	
-	//free stuff
-	CxiBitStreamFree(&symStream);
-	CxiBitStreamFree(&dstStream);
+	*pSize = bestSize;
+	return bestSize <= capacity;
+}
+
+static void CxiAshSetFirmwareHeader(unsigned char *out, unsigned int compressedSize) {
+	uint32_t hdr = (compressedSize << 2) | 0x80000000;
+	out[0] = (hdr >>  0) & 0xFF;
+	out[1] = (hdr >>  8) & 0xFF;
+	out[2] = (hdr >> 16) & 0xFF;
+	out[3] = (hdr >> 24) & 0xFF;
 	
-	*compressedSize = 0xC + symStreamSize + dstStreamSize;
-	return out;
+	out[4] |= 0x80;
 }
 
+unsigned char *CxCompressAshFirmwareEx(const unsigned char *buffer, unsigned int size, const CxEffort *effort, unsigned int *compressedSize) {
+	unsigned char *out = CxCompressAshEx(buffer, size, 9, 11, effort, compressedSize);
+	if (out != NULL) CxiAshSetFirmwareHeader(out, *compressedSize);
+	return out;
+}
 
+int CxCompressAshFirmwareInto(const unsigned char *buffer, unsigned int size, const CxEffort *effort, unsigned char *dst, unsigned int capacity, unsigned int *pSize) {
+	if (!CxCompressAshInto(buffer, size, 9, 11, effort, dst, capacity, pSize)) return 0;
+	CxiAshSetFirmwareHeader(dst, *pSize);
+	return 1;
+}
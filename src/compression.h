@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define CX_STREAM_EOF -1 // EOF return value for CxStreamReadCallback
@@ -12,28 +13,108 @@ typedef enum CxCompressionType_ {
 
 typedef int (*CxStreamReadCallback) (void *pArg);
 
+#define CX_ASH_DEFAULT_PASSES 2 // refinement passes used for firmware modules
+
+//
+// Progress of a compression, written by the compressing thread so that other threads can read it.
+// Setting cancel from another thread makes the compression stop and return NULL.
+//
+typedef struct CxProgress_ {
+	volatile unsigned int pass;             // current pass, 0 for the first parse
+	volatile unsigned int nPasses;          // number of passes after the first parse
+	volatile unsigned int pos;              // bytes of input processed in the current pass
+	volatile unsigned int size;             // size of the input
+	volatile int cancel;
+} CxProgress;
+
+//
+// Limits on the effort spent compressing. With a target size, compression stops as soon as the output
+// is no larger than the target. With a deadline (a ThGetTime value), the best result so far is returned
+// once it passes. A zero target or deadline is no limit.
+//
+typedef struct CxEffort_ {
+	unsigned int nPasses;                   // maximum refinement passes of ASH compression
+	unsigned int targetSize;                // compressed size that is good enough
+	double deadline;                        // time at which to stop refining
+	CxProgress *progress;                   // progress report and cancellation, may be NULL
+} CxEffort;
+
+//
+// The *Into functions write their output to a caller's buffer instead of allocating it, so that buffers
+// can be reused from one call to the next. They return 1 on success with the output size in *pSize. If
+// the output does not fit in capacity they return 0 with the size needed in *pSize, and on any other
+// failure they return 0 with *pSize set to 0. The *Bound functions give a capacity that is always large
+// enough: the exact size for decompression, read from the header, and a worst case for compression.
+//
+
 unsigned char *CxDecompressLZ(const unsigned char *buffer, unsigned int size, unsigned int *uncompressedSize);
+unsigned int CxDecompressLZBound(const unsigned char *buffer, unsigned int size);
+int CxDecompressLZInto(const unsigned char *buffer, unsigned int size, unsigned char *dst, unsigned int capacity, unsigned int *pSize);
 
 unsigned char *CxDecompressLZStream(unsigned int *uncompressedSize, CxStreamReadCallback callback, void *arg);
 
+//
+// Decompress an LZ stream into a caller's buffer. The header has been read when the output is found not
+// to fit, so the stream must be restarted to try again with a larger buffer; CxScanLZStream gives the
+// size without decompressing.
+//
+int CxDecompressLZStreamInto(unsigned char *dst, unsigned int capacity, unsigned int *pSize, CxStreamReadCallback callback, void *arg);
+
+int CxScanLZStream(unsigned int *uncompressedSize, CxStreamReadCallback callback, void *arg);
+
 unsigned char *CxDecompressAsh(const unsigned char *buffer, unsigned int size, unsigned int *uncompressedSize);
+unsigned int CxDecompressAshBound(const unsigned char *buffer, unsigned int size);
+int CxDecompressAshInto(const unsigned char *buffer, unsigned int size, unsigned char *dst, unsigned int capacity, unsigned int *pSize);
 
 unsigned char *CxCompressLZ(const unsigned char *buffer, unsigned int size, unsigned int *compressedSize);
+unsigned int CxCompressLZBound(unsigned int size);
+
+//
+// LZ compress within an effort budget. A greedy parse is tried before the optimal parse, and is returned
+// if it meets the target size or the deadline passes before the optimal parse finishes. The pass count
+// is not used. A NULL effort runs the full optimal parse. Pass 0 is the greedy parse, pass 1 the optimal
+// parse.
+//
+unsigned char *CxCompressLZEx(const unsigned char *buffer, unsigned int size, const CxEffort *effort, unsigned int *compressedSize);
+int CxCompressLZInto(const unsigned char *buffer, unsigned int size, const CxEffort *effort, unsigned char *dst, unsigned int capacity, unsigned int *pSize);
+
+//
+// Recompress LZ data after the bytes in [editStart, editEnd) changed. comp is the LZ stream of the data
+// before the edit, and buffer is the data after the edit, of the same size. Only the tokens from the
+// token boundary before the edit up to the first boundary a full window (4KB) past the edit are
+// re-parsed; the rest of the old token stream is kept. Returns NULL if comp is not a valid LZ stream
+// of the same size.
+//
+unsigned char *CxRecompressLZ(const unsigned char *comp, unsigned int compSize, const unsigned char *buffer, unsigned int size, unsigned int editStart, unsigned int editEnd, unsigned int *compressedSize);
 
 unsigned char *CxCompressAsh(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, unsigned int nPasses, unsigned int *compressedSize);
+unsigned int CxCompressAshBound(unsigned int size, int nSymBits, int nDstBits);
+
+//
+// ASH compress within an effort budget. Up to nPasses refinement passes are run; with a target size or
+// deadline, the smallest output of any pass is returned. A NULL effort runs CX_ASH_DEFAULT_PASSES passes.
+//
+unsigned char *CxCompressAshEx(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, const CxEffort *effort, unsigned int *compressedSize);
+
+int CxCompressAshInto(const unsigned char *buffer, unsigned int size, int nSymBits, int nDstBits, const CxEffort *effort, unsigned char *dst, unsigned int capacity, unsigned int *pSize);
+
+//
+// Firmware modules are ASH compressed with 9-bit symbols and 11-bit distances, and their header holds
+// the compressed size.
+//
+#define CxCompressAshFirmwareBound(size) CxCompressAshBound((size), 9, 11)
+
+unsigned char *CxCompressAshFirmwareEx(const unsigned char *buffer, unsigned int size, const CxEffort *effort, unsigned int *compressedSize);
+int CxCompressAshFirmwareInto(const unsigned char *buffer, unsigned int size, const CxEffort *effort, unsigned char *dst, unsigned int capacity, unsigned int *pSize);
 
 static inline unsigned char *CxCompressAshFirmware(const unsigned char *buffer, unsigned int size, unsigned int *compressedSize) {
-	unsigned char *out = CxCompressAsh(buffer, size, 9, 11, 2, compressedSize);
-	if (out != NULL) {
-		uint32_t hdr = (*compressedSize << 2) | 0x80000000;
-		out[0] = (hdr >>  0) & 0xFF;
-		out[1] = (hdr >>  8) & 0xFF;
-		out[2] = (hdr >> 16) & 0xFF;
-		out[3] = (hdr >> 24) & 0xFF;
-		
-		out[4] |= 0x80;
-	}
-	return out;
+	return CxCompressAshFirmwareEx(buffer, size, NULL, compressedSize);
 }
 
 unsigned char *CxPadCompressed(unsigned char *comp, unsigned int size, unsigned int boundary, unsigned int *pOutSize);
+
+//
+// Pad compressed data in place with zeroes up to a multiple of boundary, within a buffer of capacity
+// bytes.
+//
+int CxPadCompressedInto(unsigned char *comp, unsigned int size, unsigned int capacity, unsigned int boundary, unsigned int *pOutSize);
@@ -0,0 +1,152 @@
+#include "delta.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define DL_BLOCK_SIZE      16 // size of blocks indexed in the source buffer
+#define DL_HASH_BASE      257 // rolling hash multiplier
+#define DL_MAX_CANDIDATES  16 // maximum number of source blocks examined per hash match
+
+typedef struct DlContext_ {
+	const unsigned char *src;
+	unsigned int srcSize;
+	const unsigned char *dst;
+	unsigned int dstSize;
+	uint32_t *head;                         // hash bucket -> first source block + 1
+	uint32_t *next;                         // source block -> next source block with the same bucket + 1
+	uint32_t hashMask;
+	DlOp *ops;
+	unsigned int nOps;
+	unsigned int opsCapacity;
+} DlContext;
+
+static uint32_t DlHashBlock(const unsigned char *p) {
+	uint32_t hash = 0;
+	for (int i = 0; i < DL_BLOCK_SIZE; i++) hash = hash * DL_HASH_BASE + p[i];
+	return hash;
+}
+
+static void DlEmit(DlContext *ctx, DlOpType type, uint32_t srcOffset, uint32_t dstOffset, uint32_t length) {
+	if (length == 0) return;
+	
+	//merge with a contiguous previous operation
+	if (ctx->nOps > 0) {
+		DlOp *last = &ctx->ops[ctx->nOps - 1];
+		if (last->type == type && (type == DL_OP_INSERT || (last->srcOffset + last->length) == srcOffset)) {
+			last->length += length;
+			return;
+		}
+	}
+	
+	if (ctx->nOps == ctx->opsCapacity) {
+		ctx->opsCapacity = ctx->opsCapacity ? ctx->opsCapacity * 2 : 16;
+		ctx->ops = realloc(ctx->ops, ctx->opsCapacity * sizeof(DlOp));
+	}
+	
+	DlOp *op = &ctx->ops[ctx->nOps++];
+	op->type = type;
+	op->srcOffset = srcOffset;
+	op->dstOffset = dstOffset;
+	op->length = length;
+}
+
+static unsigned int DlMatchLength(DlContext *ctx, unsigned int srcPos, unsigned int dstPos) {
+	unsigned int len = 0;
+	while ((srcPos + len) < ctx->srcSize && (dstPos + len) < ctx->dstSize && ctx->src[srcPos + len] == ctx->dst[dstPos + len]) len++;
+	return len;
+}
+
+static void DlBuildIndex(DlContext *ctx) {
+	unsigned int nBlocks = ctx->srcSize / DL_BLOCK_SIZE;
+	unsigned int nBuckets = 1;
+	while (nBuckets < nBlocks * 2) nBuckets <<= 1;
+	
+	ctx->hashMask = nBuckets - 1;
+	ctx->head = calloc(nBuckets, sizeof(uint32_t));
+	ctx->next = calloc(nBlocks + 1, sizeof(uint32_t));
+	
+	//insert in reverse so that chains are in ascending address order
+	for (unsigned int i = nBlocks; i > 0; i--) {
+		unsigned int block = i - 1;
+		uint32_t bucket = DlHashBlock(ctx->src + block * DL_BLOCK_SIZE) & ctx->hashMask;
+		ctx->next[block] = ctx->head[bucket];
+		ctx->head[bucket] = block + 1;
+	}
+}
+
+DlOp *DlComputeDelta(const unsigned char *src, unsigned int srcSize, const unsigned char *dst, unsigned int dstSize, unsigned int *pnOps) {
+	DlContext ctx;
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.src = src;
+	ctx.srcSize = srcSize;
+	ctx.dst = dst;
+	ctx.dstSize = dstSize;
+	DlBuildIndex(&ctx);
+	
+	//DL_HASH_BASE^DL_BLOCK_SIZE, to remove the outgoing byte from the rolling hash
+	uint32_t outFactor = 1;
+	for (int i = 0; i < DL_BLOCK_SIZE; i++) outFactor *= DL_HASH_BASE;
+	
+	unsigned int pos = 0, insertStart = 0;
+	unsigned int expectSrc = 0;             // source position that continues the last copy
+	uint32_t hash = 0;
+	int hashValid = 0;
+	
+	while ((pos + DL_BLOCK_SIZE) <= dstSize) {
+		if (!hashValid) {
+			hash = DlHashBlock(dst + pos);
+			hashValid = 1;
+		}
+		
+		//prefer continuing in step with the previous copy, which catches in-place edits cheaply
+		unsigned int bestSrc = 0, bestLen = 0;
+		unsigned int expect = expectSrc + (pos - insertStart);
+		if (expect < srcSize) {
+			bestLen = DlMatchLength(&ctx, expect, pos);
+			bestSrc = expect;
+		}
+		
+		if (bestLen < DL_BLOCK_SIZE) {
+			bestLen = 0;
+			unsigned int nCandidates = 0;
+			for (uint32_t block = ctx.head[hash & ctx.hashMask]; block != 0 && nCandidates < DL_MAX_CANDIDATES; block = ctx.next[block - 1]) {
+				unsigned int srcPos = (block - 1) * DL_BLOCK_SIZE;
+				unsigned int len = DlMatchLength(&ctx, srcPos, pos);
+				if (len > bestLen) {
+					bestLen = len;
+					bestSrc = srcPos;
+				}
+				nCandidates++;
+			}
+		}
+		
+		if (bestLen < DL_BLOCK_SIZE) {
+			//roll hash forward by one byte
+			if ((pos + DL_BLOCK_SIZE) < dstSize) {
+				hash = hash * DL_HASH_BASE + dst[pos + DL_BLOCK_SIZE] - outFactor * dst[pos];
+			}
+			pos++;
+			continue;
+		}
+		
+		//extend the match backwards into the pending insertion
+		while (pos > insertStart && bestSrc > 0 && src[bestSrc - 1] == dst[pos - 1]) {
+			pos--;
+			bestSrc--;
+			bestLen++;
+		}
+		
+		DlEmit(&ctx, DL_OP_INSERT, 0, insertStart, pos - insertStart);
+		DlEmit(&ctx, DL_OP_COPY, bestSrc, pos, bestLen);
+		pos += bestLen;
+		insertStart = pos;
+		expectSrc = bestSrc + bestLen;
+		hashValid = 0;
+	}
+	DlEmit(&ctx, DL_OP_INSERT, 0, insertStart, dstSize - insertStart);
+	
+	free(ctx.head);
+	free(ctx.next);
+	*pnOps = ctx.nOps;
+	return ctx.ops;
+}
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef enum DlOpType_ {
+	DL_OP_COPY,                             // copy bytes from the source buffer
+	DL_OP_INSERT                            // insert bytes from the destination buffer
+} DlOpType;
+
+typedef struct DlOp_ {
+	DlOpType type;
+	uint32_t srcOffset;                     // source offset (copy only)
+	uint32_t dstOffset;                     // destination offset
+	uint32_t length;                        // number of bytes
+} DlOp;
+
+//
+// Compute a list of operations that produce dst from src. Regions of dst that also occur in src are found
+// with a rolling hash over blocks of src, so insertions and deletions do not disturb the matching of the
+// data that follows them. The operations cover dst in ascending order. The returned list must be freed.
+//
+DlOp *DlComputeDelta(const unsigned char *src, unsigned int srcSize, const unsigned char *dst, unsigned int dstSize, unsigned int *pnOps);
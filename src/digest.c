@@ -0,0 +1,86 @@
+#include "digest.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DG_TABLE_INITIAL_CAPACITY 64
+
+void DgDigestToString(const unsigned char *digest, char *str) {
+	for (int i = 0; i < DG_DIGEST_SIZE; i++) sprintf(str + i * 2, "%02x", digest[i]);
+}
+
+int DgParseDigest(const char *str, unsigned char *digest) {
+	for (int i = 0; i < DG_DIGEST_SIZE * 2; i++) {
+		char c = str[i];
+		int nybble;
+		if (c >= '0' && c <= '9') nybble = (c - '0') + 0x0;
+		else if (c >= 'A' && c <= 'F') nybble = (c - 'A') + 0xA;
+		else if (c >= 'a' && c <= 'f') nybble = (c - 'a') + 0xA;
+		else return 0;
+		
+		if (i & 1) digest[i / 2] |= nybble;
+		else digest[i / 2] = nybble << 4;
+	}
+	return 1;
+}
+
+void DgTableInit(DgTable *table) {
+	table->entries = NULL;
+	table->capacity = 0;
+	table->count = 0;
+}
+
+void DgTableFree(DgTable *table) {
+	if (table->entries != NULL) free(table->entries);
+	DgTableInit(table);
+}
+
+static unsigned int DgHash(const unsigned char *digest) {
+	return digest[0] | (digest[1] << 8) | (digest[2] << 16) | ((unsigned int) digest[3] << 24);
+}
+
+static DgTableEntry *DgTableLookup(const DgTableEntry *entries, unsigned int capacity, const unsigned char *digest) {
+	//linear probing, capacity is a power of 2
+	unsigned int i = DgHash(digest) & (capacity - 1);
+	while (entries[i].used && memcmp(entries[i].digest, digest, DG_DIGEST_SIZE) != 0) {
+		i = (i + 1) & (capacity - 1);
+	}
+	return (DgTableEntry *) &entries[i];
+}
+
+void **DgTableFind(const DgTable *table, const unsigned char *digest) {
+	if (table->capacity == 0) return NULL;
+	
+	DgTableEntry *entry = DgTableLookup(table->entries, table->capacity, digest);
+	if (!entry->used) return NULL;
+	return &entry->value;
+}
+
+static void DgTableGrow(DgTable *table) {
+	unsigned int capacity = table->capacity ? table->capacity * 2 : DG_TABLE_INITIAL_CAPACITY;
+	DgTableEntry *entries = calloc(capacity, sizeof(DgTableEntry));
+	
+	for (unsigned int i = 0; i < table->capacity; i++) {
+		if (!table->entries[i].used) continue;
+		*DgTableLookup(entries, capacity, table->entries[i].digest) = table->entries[i];
+	}
+	
+	if (table->entries != NULL) free(table->entries);
+	table->entries = entries;
+	table->capacity = capacity;
+}
+
+void **DgTableInsert(DgTable *table, const unsigned char *digest) {
+	//keep load factor at most 1/2
+	if ((table->count + 1) * 2 > table->capacity) DgTableGrow(table);
+	
+	DgTableEntry *entry = DgTableLookup(table->entries, table->capacity, digest);
+	if (!entry->used) {
+		memcpy(entry->digest, digest, DG_DIGEST_SIZE);
+		entry->value = NULL;
+		entry->used = 1;
+		table->count++;
+	}
+	return &entry->value;
+}
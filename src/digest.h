@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+#define DG_DIGEST_SIZE 16 // size of an MD5 digest
+
+typedef struct DgTableEntry_ {
+	unsigned char digest[DG_DIGEST_SIZE];
+	void *value;
+	int used;
+} DgTableEntry;
+
+typedef struct DgTable_ {
+	DgTableEntry *entries;
+	unsigned int capacity;
+	unsigned int count;
+} DgTable;
+
+//
+// Convert between digests and their hexadecimal string form (33 bytes including terminator).
+//
+void DgDigestToString(const unsigned char *digest, char *str);
+int DgParseDigest(const char *str, unsigned char *digest);
+
+//
+// Hash table keyed by digest. Since digests are uniformly distributed, they are used directly as hashes.
+//
+void DgTableInit(DgTable *table);
+void DgTableFree(DgTable *table);
+
+//
+// Get the value slot for a digest, or NULL if the digest is not in the table.
+//
+void **DgTableFind(const DgTable *table, const unsigned char *digest);
+
+//
+// Get the value slot for a digest, inserting it with a NULL value if it is not in the table.
+//
+void **DgTableInsert(DgTable *table, const unsigned char *digest);
@@ -6,6 +6,8 @@
 #include "firmware.h"
 #include "compression.h"
 #include "blowfish.h"
+#include "search.h"
+#include "xref.h"
 
 uint16_t ComputeCrc(const void *p, unsigned int length, uint16_t init) {
 	const uint16_t tbl[] = {
@@ -35,7 +37,29 @@ uint16_t ComputeSecondaryCrc(const void *arm9Secondary, unsigned int arm9Seconda
 	return ComputeCrc(arm7Secondary, arm7SecondarySize, crc);
 }
 
+uint32_t ComputeCrc32(const void *p, unsigned int length, uint32_t init) {
+	const uint32_t tbl[] = {
+		0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC,
+		0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+		0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C,
+		0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+	};
+	
+	uint32_t r = ~init;
+	const unsigned char *pp = (const unsigned char *) p;
+	for (unsigned int i = 0; i < length; i++) {
+		r = tbl[(r ^ *pp) & 0x0F] ^ (r >> 4);
+		r = tbl[(r ^ (*pp >> 4)) & 0x0F] ^ (r >> 4);
+		pp++;
+	}
+	return ~r;
+}
+
 void UpdateFirmwareModuleChecksums(unsigned char *buffer, unsigned int size) {
+	UpdateFirmwareModuleChecksumsEx(buffer, size, FW_MODULE_MASK_ALL);
+}
+
+int UpdateFirmwareModuleChecksumsEx(unsigned char *buffer, unsigned int size, unsigned int moduleMask) {
 	//header
 	FlashHeader *hdr = (FlashHeader *) buffer;
 	
@@ -45,15 +69,31 @@ void UpdateFirmwareModuleChecksums(unsigned char *buffer, unsigned int size) {
 	uint32_t    arm7StaticRomAddr,    arm7StaticSize,    arm7StaticRamAddr,    arm7StaticUncompressed;
 	uint32_t          rsrcRomAddr,          rsrcSize,          rsrcRamAddr,          rsrcUncompressed;
 	
+	//only decompress the modules that contribute to a checksum being updated
+	int updateStatic = (moduleMask & ((1 << FW_MODULE_ARM9_STATIC) | (1 << FW_MODULE_ARM7_STATIC))) != 0;
+	int updateSecondary = (moduleMask & ((1 << FW_MODULE_ARM9_SECONDARY) | (1 << FW_MODULE_ARM7_SECONDARY))) != 0;
+	int updateRsrc = (moduleMask & (1 << FW_MODULE_RESOURCES)) != 0;
+	
 	//unpack firmware and data headers
 	CxCompressionType type9, type7, typeRsrc;
-	unsigned char *arm9Static = GetArm9StaticInfo(buffer, size, &arm9StaticRomAddr, &arm9StaticRamAddr, &arm9StaticSize, &arm9StaticUncompressed);
-	unsigned char *arm7Static = GetArm7StaticInfo(buffer, size, &arm7StaticRomAddr, &arm7StaticRamAddr, &arm7StaticSize, &arm7StaticUncompressed);
-	unsigned char *arm9Secondary = GetArm9SecondaryInfo(buffer, size, &arm9SecondaryRomAddr, &arm9SecondaryRamAddr, &arm9SecondarySize, &arm9SecondaryUncompressed, &type9);
-	unsigned char *arm7Secondary = GetArm7SecondaryInfo(buffer, size, &arm7SecondaryRomAddr, &arm7SecondaryRamAddr, &arm7SecondarySize, &arm7SecondaryUncompressed, &type7);
-	unsigned char *rsrc = GetResourcesPackInfo(buffer, size, &rsrcRomAddr, &rsrcRamAddr, &rsrcSize, &rsrcUncompressed, &typeRsrc);
+	unsigned char *arm9Static = NULL, *arm7Static = NULL, *arm9Secondary = NULL, *arm7Secondary = NULL, *rsrc = NULL;
+	if (updateStatic) {
+		arm9Static = GetArm9StaticInfo(buffer, size, &arm9StaticRomAddr, &arm9StaticRamAddr, &arm9StaticSize, &arm9StaticUncompressed);
+		arm7Static = GetArm7StaticInfo(buffer, size, &arm7StaticRomAddr, &arm7StaticRamAddr, &arm7StaticSize, &arm7StaticUncompressed);
+	}
+	if (updateSecondary) {
+		arm9Secondary = GetArm9SecondaryInfo(buffer, size, &arm9SecondaryRomAddr, &arm9SecondaryRamAddr, &arm9SecondarySize, &arm9SecondaryUncompressed, &type9);
+		arm7Secondary = GetArm7SecondaryInfo(buffer, size, &arm7SecondaryRomAddr, &arm7SecondaryRamAddr, &arm7SecondarySize, &arm7SecondaryUncompressed, &type7);
+	}
+	if (updateRsrc) {
+		rsrc = GetResourcesPackInfo(buffer, size, &rsrcRomAddr, &rsrcRamAddr, &rsrcSize, &rsrcUncompressed, &typeRsrc);
+	}
 	
 	//static module checksum
+	int ok = 1;
+	if (updateStatic && (arm9Static == NULL || arm7Static == NULL)) ok = 0;
+	if (updateSecondary && (arm9Secondary == NULL || arm7Secondary == NULL)) ok = 0;
+	if (updateRsrc && rsrc == NULL) ok = 0;
 	if (arm9Static != NULL && arm7Static != NULL) {
 		uint16_t sum = ComputeStaticCrc(arm9Static, arm9StaticUncompressed, arm7Static, arm7StaticUncompressed);
 		hdr->staticCrc = sum;
@@ -76,6 +116,165 @@ void UpdateFirmwareModuleChecksums(unsigned char *buffer, unsigned int size) {
 	if (arm9Secondary != NULL) free(arm9Secondary);
 	if (arm7Secondary != NULL) free(arm7Secondary);
 	if (rsrc != NULL) free(rsrc);
+	return ok;
+}
+
+
+//MD5 sine table
+static const uint32_t sMd5SineTable[] = {
+	0xD76AA478, 0xE8C7B756, 0x242070DB, 0xC1BDCEEE,
+	0xF57C0FAF, 0x4787C62A, 0xA8304613, 0xFD469501,
+	0x698098D8, 0x8B44F7AF, 0xFFFF5BB1, 0x895CD7BE,
+	0x6B901122, 0xFD987193, 0xA679438E, 0x49B40821,
+	0xF61E2562, 0xC040B340, 0x265E5A51, 0xE9B6C7AA,
+	0xD62F105D, 0x02441453, 0xD8A1E681, 0xE7D3FBC8,
+	0x21E1CDE6, 0xC33707D6, 0xF4D50D87, 0x455A14ED,
+	0xA9E3E905, 0xFCEFA3F8, 0x676F02D9, 0x8D2A4C8A,
+	0xFFFA3942, 0x8771F681, 0x6D9D6122, 0xFDE5380C,
+	0xA4BEEA44, 0x4BDECFA9, 0xF6BB4B60, 0xBEBFBC70,
+	0x289B7EC6, 0xEAA127FA, 0xD4EF3085, 0x04881D05,
+	0xD9D4D039, 0xE6DB99E5, 0x1FA27CF8, 0xC4AC5665,
+	0xF4292244, 0x432AFF97, 0xAB9423A7, 0xFC93A039,
+	0x655b59C3, 0x8F0CCC92, 0xFFEFF47D, 0x85845DD1,
+	0x6FA87E4F, 0xFE2CE6E0, 0xA3014314, 0x4E0811A1,
+	0xF7537E82, 0xBD3AF235, 0x2AD7D2BB, 0xEB86D391
+};
+
+//MD5 rotate table
+static const int sMd5RotateTable[] = {
+	7, 12, 17, 22,   7, 12, 17, 22,   7, 12, 17, 22,   7, 12, 17, 22,
+	5,  9, 14, 20,   5,  9, 14, 20,   5,  9, 14, 20,   5,  9, 14, 20, 
+	4, 11, 16, 23,   4, 11, 16, 23,   4, 11, 16, 23,   4, 11, 16, 23,
+	6, 10, 15, 21,   6, 10, 15, 21,   6, 10, 15, 21,   6, 10, 15, 21
+};
+
+
+static uint32_t Md5RotL(uint32_t v1, int amt){
+	return (v1 << amt) | (v1 >> (32 - amt));
+}
+
+void ComputeMd5(const unsigned char *buf, unsigned int len, unsigned char *pDigest) {
+	unsigned int processedLen = len + 1; // added 1-bit
+	
+	//compute padding size (to 56 bytes mod 64)
+	if ((processedLen % 64) < 56) {
+		processedLen += 56 - (processedLen % 64);
+	} else if ((processedLen % 64) > 56) {
+		processedLen += 64 + 56 - (processedLen % 64);
+	}
+	processedLen += 8;
+	unsigned char *processed = calloc(processedLen, 1);
+	memcpy(processed, buf, len);
+	processed[len] = 0x80;
+	
+	uint64_t nBitsSrc = len * 8;
+	for (int i = 0; i < 8; i++) {
+		processed[processedLen - 8 + i] = (nBitsSrc >> (8 * i)) & 0xFF;
+	}
+	
+	//initial MD5 state
+	unsigned int a0 = 0x67452301;
+	unsigned int b0 = 0xEFCDAB89;
+	unsigned int c0 = 0x98BADCFE;
+	unsigned int d0 = 0x10325476;
+	
+	for (unsigned int n = 0; n < processedLen; n += 64) {
+		uint32_t chunk[16];
+		const unsigned char *chunksrc = processed + n;
+		for (int i = 0; i < 16; i++) {
+			chunk[i] = (chunksrc[i * 4 + 0] << 0) | (chunksrc[i * 4 + 1] << 8)
+				| (chunksrc[i * 4 + 2] << 16) | (chunksrc[i * 4 + 3] << 24);
+		}
+		
+		uint32_t a = a0;
+		uint32_t b = b0;
+		uint32_t c = c0;
+		uint32_t d = d0;
+		for (int i = 0; i < 64; i++) {
+			
+			uint32_t f = 0, g = 0;
+			switch ((i >> 4)) {
+				case 0:
+					f = (b & c) | ((~b) & d);
+					g = i;
+					break;
+				case 1:
+					f = (d & b) | ((~d) & c);
+					g = 5 * i + 1;
+					break;
+				case 2:
+					f = b ^ c ^ d;
+					g = 3 * i + 5;
+					break;
+				case 3:
+					f = c ^ (b | (~d));
+					g = 7 * i;
+					break;
+			}
+			
+			uint32_t tmp = d;
+			d = c;
+			c = b;
+			b = b + Md5RotL(a + f + sMd5SineTable[i] + chunk[g % 16], sMd5RotateTable[i]);
+			a = tmp;
+		}
+		a0 += a;
+		b0 += b;
+		c0 += c;
+		d0 += d;
+	}
+	free(processed);
+	
+	//write digest
+	for (int i = 0; i < 4; i++) *(pDigest++) = (a0 >> (8 * i)) & 0xFF;
+	for (int i = 0; i < 4; i++) *(pDigest++) = (b0 >> (8 * i)) & 0xFF;
+	for (int i = 0; i < 4; i++) *(pDigest++) = (c0 >> (8 * i)) & 0xFF;
+	for (int i = 0; i < 4; i++) *(pDigest++) = (d0 >> (8 * i)) & 0xFF;
+}
+
+void UpdateWirelessTableChecksum(unsigned char *buffer) {
+	FlashRfBbInfo *wl = (FlashRfBbInfo *) (buffer + 0x2A);
+	if (wl->tableSize >= (0x200 - 0x2E)) return;
+	
+	wl->crc = ComputeCrc(buffer + 0x2A + 2, wl->tableSize, 0);
+}
+
+void UpdateUserConfigChecksum(unsigned char *buffer, unsigned int size, int index) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	unsigned int ncdAddr = hdr->nvramUserConfigAddr * 8;
+	if (ncdAddr >= size || (ncdAddr + 0x200) > size) return;
+	
+	FlashUserConfigData *ncd = (FlashUserConfigData *) (buffer + ncdAddr + index * 0x100);
+	if (ncd->version != 5) return;
+	
+	ncd->crc = ComputeCrc(ncd, FLASH_NCD_SIZE-4, 0xFFFF);
+	if (HasExConfig(hdr->ipl2Type) && ncd->exVersion == 1) {
+		ncd->exCrc = ComputeCrc(&ncd->exVersion, FLASH_NCD_EX_SIZE-2, 0xFFFF);
+	}
+}
+
+void UpdateConnectionChecksum(unsigned char *buffer, unsigned int size, int index) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	unsigned int ncdAddr = hdr->nvramUserConfigAddr * 8;
+	if (ncdAddr < 0x400 || ncdAddr > size) return;
+	
+	unsigned int connAddr = ncdAddr - 0x400;
+	if (index < 3) {
+		FlashConnSetting *conn = (FlashConnSetting *) (buffer + connAddr + index * 0x100);
+		if (conn->setType == 0xFF) return;
+		
+		conn->crc = ComputeCrc(conn, sizeof(FlashConnSetting)-2, 0);
+		return;
+	}
+	
+	//TWL connection settings
+	if (!HasTwlSettings(hdr->ipl2Type) || connAddr < 0x600) return;
+	
+	FlashConnExSetting *conn = (FlashConnExSetting *) (buffer + connAddr - 0x600 + (index - 3) * 0x200);
+	if (conn->base.setType == 0xFF) return;
+	
+	conn->base.crc = ComputeCrc(&conn->base, sizeof(FlashConnSetting)-2, 0);
+	conn->exCrc = ComputeCrc(&conn->base + 1, sizeof(FlashConnExSetting)-sizeof(FlashConnSetting)-2, 0);
 }
 
 
@@ -105,6 +304,72 @@ int IsValidRfType(int type) {
 	return 0;
 }
 
+//original module and X2B uses this OUI. This OUI is checked by DWC.
+static const unsigned char sOuiOriginal[][3] = {
+	{ 0x00, 0x09, 0xBF }
+};
+
+//middle range modules used this OUI
+static const unsigned char sOuiSecond[][3] = {
+	{ 0x00, 0x16, 0x56 }
+};
+
+//these seen later on later modules. This list may not be comprehensive.
+static const unsigned char sOuiLate[][3] = {
+	{ 0x00, 0x16, 0x56 },
+	{ 0x00, 0x17, 0xAB },
+	{ 0x00, 0x19, 0xFD },
+	{ 0x00, 0x1A, 0xE9 },
+	{ 0x00, 0x1B, 0x7A },
+	{ 0x00, 0x1B, 0xEA },
+	{ 0x00, 0x1D, 0xBC },
+	{ 0x00, 0x1E, 0xA9 },
+	{ 0x00, 0x21, 0x47 },
+	{ 0x00, 0x22, 0x4C },
+	{ 0x00, 0x22, 0xAA },
+	{ 0x00, 0x22, 0xD7 },
+	{ 0x00, 0x23, 0xCC },
+	{ 0x00, 0x24, 0x1E },
+	{ 0x00, 0x24, 0xF3 },
+	{ 0x00, 0x25, 0xA0 },
+	{ 0x00, 0x26, 0x59 },
+	{ 0x00, 0x27, 0x09 },
+	{ 0xE0, 0xE7, 0x51 },
+	{ 0xE8, 0x4E, 0xCE }
+};
+
+int GetWirelessOuis(int gen, const unsigned char (**pOuis)[3]) {
+	switch (gen) {
+		case WL_OUI_GEN_ORIGINAL:
+		default:
+			*pOuis = sOuiOriginal;
+			return sizeof(sOuiOriginal) / sizeof(sOuiOriginal[0]);
+		case WL_OUI_GEN_SECOND:
+			*pOuis = sOuiSecond;
+			return sizeof(sOuiSecond) / sizeof(sOuiSecond[0]);
+		case WL_OUI_GEN_LATE:
+			*pOuis = sOuiLate;
+			return sizeof(sOuiLate) / sizeof(sOuiLate[0]);
+	}
+}
+
+int GetWirelessOuiGeneration(const unsigned char *buffer) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	FlashRfBbInfo *wl = (FlashRfBbInfo *) (buffer + 0x2A);
+	
+	int ipl2Type = hdr->ipl2Type;
+	if (ipl2Type == 0xFF) ipl2Type = 0x00;
+	
+	//original OUI (even on later IS-NITRO)
+	if (!(ipl2Type & IPL2_TYPE_USG)) return WL_OUI_GEN_ORIGINAL;
+	
+	//middle range OUI
+	if (wl->module == 5) return WL_OUI_GEN_SECOND;
+	
+	//late range OUI
+	return WL_OUI_GEN_LATE;
+}
+
 
 
 
@@ -112,51 +377,64 @@ int IsValidRfType(int type) {
 // ----- unpack routines
 
 
-/*
- * Searches for a byte pattern in the firmware image.
- */
-static unsigned char *SearchPattern(const unsigned char *buf, unsigned int size, const unsigned char *search, unsigned int searchlen) {
-	if (searchlen > size) return NULL;
-	
-	for (unsigned int i = 0; i < (size - searchlen); i++) {
-		if (memcmp(buf + i, search, searchlen) == 0) return (unsigned char *) (buf + i);
-	}
-	return NULL;
-}
-
-/*
- *  Searches for the decode_ash routine in the firmware image.
- */
-static unsigned char *SearchDecodeAsh(const unsigned char *buf, unsigned int size) {
-	//signature of decode_ash in newer firmware versions
-	const unsigned char signature[] = {
-		0xF0, 0x5F, 0x2D, 0xE9, // PUSH    { R4-R12, LR }
-		0x04, 0xD0, 0x4D, 0xE2, // SUB     SP, #4
-		0x04, 0x40, 0x91, 0xE5, // LDR     R4, [R1, #4]
-		0x64, 0x58, 0x24, 0xE0, // EOR     R5, R4, R4, ROR #16
-		0xFF, 0x58, 0xC5, 0xE3, // BIC     R5, R5, #0x00FF000000
-		0x64, 0x44, 0xA0, 0xE1, // MOV     R4, R4, ROR #8
-		0x25, 0x44, 0x24, 0xE0, // EOR     R4, R4, R5, LSR #8
-		0xFF, 0x44, 0xC4, 0xE3, // BIC     R4, R4, #0xFF000000
-	};
-	unsigned char *p = SearchPattern(buf, size, signature, sizeof(signature));
-	if (p != NULL) return p;
+typedef struct FirmwareSignature_ {
+	int function;
+	const char *pattern;                    // hexadecimal, ? digits match any nibble
+} FirmwareSignature;
+
+//register fields of the instructions after the prologue are masked, so that builds differing only
+//in register allocation match the same signature.
+static const FirmwareSignature sFirmwareSignatures[] = {
+	//decode_ash in newer firmware versions
+	{ FW_FUNCTION_DECODE_ASH,
+		"F05F2DE9"  // PUSH    { R4-R12, LR }
+		"04D04DE2"  // SUB     SP, #4
+		"04?09?E5"  // LDR     R4, [R1, #4]
+		"6??82?E0"  // EOR     R5, R4, R4, ROR #16
+		"FF?8C?E3"  // BIC     R5, R5, #0x00FF0000
+		"6??4A0E1"  // MOV     R4, R4, ROR #8
+		"2??42?E0"  // EOR     R4, R4, R5, LSR #8
+		"FF?4C?E3"  // BIC     R4, R4, #0xFF000000
+	},
 	
 	//original decode_ash in older firmware versions
-	const unsigned char signature2[] = {
-		0xF0, 0x4F, 0x2D, 0xE9, // PUSH    { R4-R11, LR }
-		0x0C, 0xD0, 0x4D, 0xE2, // SUB     SP, #0xC
-		0x01, 0x90, 0xA0, 0xE1, // MOV     sb, R1
-		0x05, 0x10, 0xD9, 0xE5, // LDRB    R1, [sb, #5]
-		0x06, 0x20, 0xD9, 0xE5, // LDRB    R2, [sb, #6]
-		0x08, 0x30, 0xD9, 0xE5, // LDRB    R3, [sb, #8]
-		0x01, 0x48, 0xA0, 0xE1, // MOV     R4, R1, LSL #16
-		0x02, 0x54, 0x84, 0xE1, // ORR     R5, R4, R2, LSL #8
-	};
-	p = SearchPattern(buf, size, signature2, sizeof(signature2));
-	if (p != NULL) return p;
+	{ FW_FUNCTION_DECODE_ASH,
+		"F04F2DE9"  // PUSH    { R4-R11, LR }
+		"0CD04DE2"  // SUB     SP, #0xC
+		"0??0A0E1"  // MOV     sb, R1
+		"05?0D?E5"  // LDRB    R1, [sb, #5]
+		"06?0D?E5"  // LDRB    R2, [sb, #6]
+		"08?0D?E5"  // LDRB    R3, [sb, #8]
+		"0??8A0E1"  // MOV     R4, R1, LSL #16
+		"0??48?E1"  // ORR     R5, R4, R2, LSL #8
+	},
+};
+
+static int FindFunctionsCallback(int pattern, unsigned int offset, void *arg) {
+	uint32_t *offsets = (uint32_t *) arg;
 	
-	return NULL;
+	//keep the first occurrence of each function
+	int function = sFirmwareSignatures[pattern].function;
+	if (offsets[function] == FW_FUNCTION_NOT_FOUND) offsets[function] = offset;
+	return 0;
+}
+
+void FindFirmwareFunctions(const unsigned char *module, unsigned int size, uint32_t *offsets) {
+	for (int i = 0; i < FW_FUNCTION_COUNT; i++) offsets[i] = FW_FUNCTION_NOT_FOUND;
+	if (module == NULL) return;
+	
+	//all signatures share one automaton keyed on their longest unmasked run
+	SrMatcher matcher;
+	SrMatcherInit(&matcher);
+	for (unsigned int i = 0; i < sizeof(sFirmwareSignatures) / sizeof(sFirmwareSignatures[0]); i++) {
+		unsigned char bytes[64], mask[64];
+		unsigned int length;
+		SrParseHexPattern(sFirmwareSignatures[i].pattern, bytes, mask, sizeof(bytes), &length);
+		SrMatcherAdd(&matcher, bytes, mask, length);
+	}
+	
+	SrMatcherScan(&matcher, module, size, FindFunctionsCallback, offsets);
+	SrMatcherFree(&matcher);
 }
 
 
@@ -218,12 +496,98 @@ unsigned char *UncompressLZNormal(const unsigned char *buffer, unsigned int size
 	return uncomp;
 }
 
+void GetFirmwareModuleRomAddrs(const unsigned char *buffer, uint32_t *romAddrs) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	
+	romAddrs[FW_MODULE_ARM9_STATIC]    = (4 * hdr->arm9StaticRomAddr) << hdr->arm9RomAddrScale;
+	romAddrs[FW_MODULE_ARM7_STATIC]    = (4 * hdr->arm7StaticRomAddr) << hdr->arm7RomAddrScale;
+	romAddrs[FW_MODULE_ARM9_SECONDARY] = (4 * hdr->arm9SecondaryRomAddr) * 2;
+	romAddrs[FW_MODULE_ARM7_SECONDARY] = (4 * hdr->arm7SecondaryRomAddr) * 2;
+	romAddrs[FW_MODULE_RESOURCES]      = (4 * hdr->resourceRomAddr) * 2;
+}
+
+int GetFirmwareModuleExtents(const unsigned char *buffer, unsigned int size, uint32_t *romAddrs, uint32_t *compSizes) {
+	GetFirmwareModuleRomAddrs(buffer, romAddrs);
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		uint32_t romAddr = romAddrs[i];
+		if (romAddr >= size || (size - romAddr) < 4) return 0;
+		
+		unsigned int uncompSize;
+		if (i == FW_MODULE_ARM9_STATIC || i == FW_MODULE_ARM7_STATIC) {
+			BfStream *stream = BfDecryptStreamInit(buffer + romAddr, size - romAddr, buffer);
+			int valid = CxScanLZStream(&uncompSize, ReadBlowfishCallback, stream);
+			compSizes[i] = (stream->srcpos + 7) & ~7;
+			BfDecryptStreamEnd(stream);
+			if (!valid) return 0;
+			continue;
+		}
+		
+		StreamState stream;
+		stream.buf = buffer;
+		stream.pos = romAddr;
+		stream.size = size;
+		if (buffer[romAddr] == 0x10 && CxScanLZStream(&uncompSize, ReadNormalCallback, &stream)) {
+			compSizes[i] = (stream.pos - romAddr + 7) & ~7;
+			continue;
+		}
+		
+		//ASH: compressed size is in the header
+		uint32_t header = *(const uint32_t *) (buffer + romAddr);
+		unsigned int compSize = (header & 0x00FFFFFF) >> 2;
+		if ((size - romAddr) < 0xC || compSize > (size - romAddr)) return 0;
+		compSizes[i] = compSize;
+	}
+	return 1;
+}
+
+uint32_t AlignFirmwareModuleRomAddr(int module, uint32_t romAddr) {
+	if (module == FW_MODULE_ARM9_STATIC || module == FW_MODULE_ARM7_STATIC) {
+		//static modules: 16-bit field in units of 4 << scale
+		for (int scale = 0; scale < 8; scale++) {
+			uint32_t unit = 4 << scale;
+			uint32_t aligned = (romAddr + unit - 1) & ~(unit - 1);
+			if ((aligned / unit) <= 0xFFFF) return aligned;
+		}
+		return 0;
+	}
+	
+	//other modules: 16-bit field in units of 8
+	uint32_t aligned = (romAddr + 7) & ~7;
+	if ((aligned / 8) > 0xFFFF) return 0;
+	return aligned;
+}
+
+void SetFirmwareModuleRomAddr(unsigned char *buffer, int module, uint32_t romAddr) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	
+	//smallest scale that encodes the address
+	int scale = 0;
+	while (scale < 7 && (romAddr / (4 << scale)) > 0xFFFF) scale++;
+	
+	switch (module) {
+		case FW_MODULE_ARM9_STATIC:    hdr->arm9StaticRomAddr    = romAddr / (4 << scale); hdr->arm9RomAddrScale = scale; break;
+		case FW_MODULE_ARM7_STATIC:    hdr->arm7StaticRomAddr    = romAddr / (4 << scale); hdr->arm7RomAddrScale = scale; break;
+		case FW_MODULE_ARM9_SECONDARY: hdr->arm9SecondaryRomAddr = romAddr / 8; break;
+		case FW_MODULE_ARM7_SECONDARY: hdr->arm7SecondaryRomAddr = romAddr / 8; break;
+		case FW_MODULE_RESOURCES:      hdr->resourceRomAddr      = romAddr / 8; break;
+	}
+}
+
+void GetFirmwareStaticRamAddrs(const unsigned char *buffer, uint32_t *pArm9RamAddr, uint32_t *pArm7RamAddr) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	
+	*pArm9RamAddr = 0x02800000 - ((hdr->arm9StaticRamAddr * 4) << hdr->arm9RamAddrScale);
+	*pArm7RamAddr = (hdr->arm7RamLocation ? 0x02800000 : 0x03810000) - ((hdr->arm7StaticRamAddr * 4) << hdr->arm7RamAddrScale);
+}
+
 unsigned char *GetArm9StaticInfo(const unsigned char *buffer, unsigned int size, uint32_t *pRomAddr, uint32_t *pRamAddr, uint32_t *pSize, uint32_t *pUncompressed) {
 	//flash header
 	FlashHeader *hdr = (FlashHeader *) buffer;
+	uint32_t arm7RamAddr;
 	
 	*pRomAddr      = (4 * hdr->arm9StaticRomAddr) << hdr->arm9RomAddrScale;
-	*pRamAddr      = 0x02800000 - ((hdr->arm9StaticRamAddr * 4) << hdr->arm9RamAddrScale);
+	GetFirmwareStaticRamAddrs(buffer, pRamAddr, &arm7RamAddr);
 	*pSize         = 0;
 	*pUncompressed = 0;
 	return UncompressLZBlowfish(buffer, size, *pRomAddr, pSize, pUncompressed);
@@ -233,8 +597,10 @@ unsigned char *GetArm7StaticInfo(const unsigned char *buffer, unsigned int size,
 	//flash header
 	FlashHeader *hdr = (FlashHeader *) buffer;
 	
+	uint32_t arm9RamAddr;
+	
 	*pRomAddr      = (4 * hdr->arm7StaticRomAddr) << hdr->arm7RomAddrScale;
-	*pRamAddr      = (hdr->arm7RamLocation ? 0x02800000 : 0x03810000) - ((hdr->arm7StaticRamAddr * 4) << hdr->arm7RamAddrScale);
+	GetFirmwareStaticRamAddrs(buffer, &arm9RamAddr, pRamAddr);
 	*pSize         = 0;
 	*pUncompressed = 0;
 	return UncompressLZBlowfish(buffer, size, *pRomAddr, pSize, pUncompressed);
@@ -312,11 +678,13 @@ unsigned char *GetResourcesPackInfo(const unsigned char *buffer, unsigned int si
 	return uncomp;
 }
 
-void GetSecondaryResourceLoadAddresses(
+void GetSecondaryResourceLoadAddressesEx(
 	const unsigned char *arm9Static,
 	unsigned int arm9StaticUncompressed,
+	const XrIndex *arm9StaticXrefs,
 	const unsigned char *arm7Static,
 	unsigned int arm7StaticUncompressed,
+	const XrIndex *arm7StaticXrefs,
 	uint32_t *pArm9SecondaryLoadAddr,
 	uint32_t *pArm7SecondaryLoadAddr,
 	uint32_t *pRsrcLoadAddr
@@ -325,26 +693,22 @@ void GetSecondaryResourceLoadAddresses(
 	//decode_ash function in the ARM9 static module. We look for thumb calls to this function
 	//and use that those to identify the load addresses.
 	if (arm9Static != NULL) {
-		unsigned char *pDecodeAsh = SearchDecodeAsh(arm9Static, arm9StaticUncompressed);
-		if (pDecodeAsh != NULL) {
+		uint32_t functions[FW_FUNCTION_COUNT];
+		FindFirmwareFunctions(arm9Static, arm9StaticUncompressed, functions);
+		if (functions[FW_FUNCTION_DECODE_ASH] != FW_FUNCTION_NOT_FOUND) {
 			
 			//get offset to decode_ash
-			uint32_t ofsDecodeAsh = pDecodeAsh - arm9Static;
+			uint32_t ofsDecodeAsh = functions[FW_FUNCTION_DECODE_ASH];
 			
 			uint32_t rsrcRamAddr = 0x00000000;
 			uint32_t arm9SecondaryRamAddr = 0x00000000;
 			
-			//search for thumb BL decode_ash
-			for (unsigned int i = 4; i < ((arm9StaticUncompressed & ~1) - 2); i += 2) {
-				uint32_t rel = ((((ofsDecodeAsh - (i + 4)) + 2) & ~3) >> 1) & 0x3FFFFF;
-				
-				uint16_t u1 = *(uint16_t *) (arm9Static + i + 0);
-				uint16_t u2 = *(uint16_t *) (arm9Static + i + 2);
-				if ((u1 & 0xF800) != 0xF000) continue;
-				if ((u2 & 0xF800) != 0xE800) continue;
-				
-				if ((u1 & 0x7FF) != ((rel >> 11) & 0x7FF)) continue;
-				if ((u2 & 0x7FF) != ((rel >>  0) & 0x7FF)) continue;
+			//thumb BLX decode_ash, in address order
+			const XrRef *calls;
+			unsigned int nCalls = XrFindCalls(arm9StaticXrefs, arm9StaticXrefs->base + ofsDecodeAsh, &calls);
+			for (unsigned int j = 0; j < nCalls; j++) {
+				uint32_t i = calls[j].site - arm9StaticXrefs->base;
+				if (calls[j].kind != XR_THUMB_BLX || i < 4) continue;
 				
 				// case 1: (resources pack)
 				// LDR     R0, =rsrcTarget
@@ -362,13 +726,11 @@ void GetSecondaryResourceLoadAddresses(
 				// BLX     decode_ash
 				
 				uint16_t instr1 = *(uint16_t *) (arm9Static + i - 4);
-				uint16_t instr2 = *(uint16_t *) (arm9Static + i - 2);
-				(void) instr2;
 				
 				if ((instr1 & 0xFF00) == 0x4800) {        // LDR R0, [PC, #X]
 					unsigned int pool = (i + ((instr1 & 0x00FF) << 2)) & ~3;
+					if ((pool + 4) > arm9StaticUncompressed) continue;
 					uint32_t addr = *(uint32_t *) (arm9Static + pool);
-					//printf("Case 1 at %08X (load to %08X)\n", i, *(uint32_t *) (arm9Static + pool));	
 					
 					if (arm9SecondaryRamAddr == 0) arm9SecondaryRamAddr = addr;
 					else                           rsrcRamAddr = addr;
@@ -386,26 +748,407 @@ void GetSecondaryResourceLoadAddresses(
 	
 	//the ARM7 secondary load address is determined by the ARM7. 
 	if (arm7Static != NULL) {
-		//the ARM7 secondary laod addess is located at 027FF86C. 
-		for (unsigned int i = 0; i < ((arm7StaticUncompressed & ~1) - 4); i += 2) {
-			uint16_t instr1 = *(uint16_t *) (arm7Static + i + 0);
-			uint16_t instr2 = *(uint16_t *) (arm7Static + i + 2);
-			uint16_t instr3 = *(uint16_t *) (arm7Static + i + 4);
-			(void) instr3;
+		//the ARM7 secondary laod addess is located at 027FF86C. Look for the literal loads of it
+		//preceded by the literal load of the load address.
+		const XrRef *refs;
+		unsigned int nRefs = XrFindLiterals(arm7StaticXrefs, 0x027FF86C, &refs);
+		for (unsigned int j = 0; j < nRefs; j++) {
+			uint32_t i = refs[j].site - arm7StaticXrefs->base;
+			if (refs[j].kind != XR_THUMB_LDR || i < 2) continue;
 			
+			uint16_t instr1 = *(uint16_t *) (arm7Static + i - 2);
 			if ((instr1 & 0xF800) != 0x4800) continue;  // LDR R2, =Arm7SecondaryLoadAddr
-			if ((instr2 & 0xF800) != 0x4800) continue;  // LDR R1, =0x027FF86C
 			
-			unsigned int pool = ((i + 2) & ~3) + 4 + ((instr2 & 0xFF) << 2);
-			uint32_t val = *(uint32_t *) (arm7Static + pool);
-			if (val != 0x027FF86C) continue;
+			unsigned int pool2 = ((i - 2) & ~3) + 4 + ((instr1 & 0xFF) << 2);
+			if ((pool2 + 4) > arm7StaticUncompressed) continue;
+			*pArm7SecondaryLoadAddr = *(uint32_t *) (arm7Static + pool2);
+		}
+	}
+}
+
+void GetSecondaryResourceLoadAddresses(
+	const unsigned char *arm9Static,
+	unsigned int arm9StaticUncompressed,
+	const unsigned char *arm7Static,
+	unsigned int arm7StaticUncompressed,
+	uint32_t *pArm9SecondaryLoadAddr,
+	uint32_t *pArm7SecondaryLoadAddr,
+	uint32_t *pRsrcLoadAddr
+) {
+	XrIndex arm9StaticXrefs = { 0 }, arm7StaticXrefs = { 0 };
+	if (arm9Static != NULL) XrIndexBuild(&arm9StaticXrefs, arm9Static, arm9StaticUncompressed, 0);
+	if (arm7Static != NULL) XrIndexBuild(&arm7StaticXrefs, arm7Static, arm7StaticUncompressed, 0);
+	
+	GetSecondaryResourceLoadAddressesEx(arm9Static, arm9StaticUncompressed, &arm9StaticXrefs, arm7Static, arm7StaticUncompressed, &arm7StaticXrefs,
+		pArm9SecondaryLoadAddr, pArm7SecondaryLoadAddr, pRsrcLoadAddr);
+	
+	XrIndexFree(&arm9StaticXrefs);
+	XrIndexFree(&arm7StaticXrefs);
+}
+
+
+static void GetFirmwareModulesInternal(const unsigned char *buffer, unsigned int size, FirmwareModule *mods, XrIndex *xrefs) {
+	FirmwareModule *arm9Static = &mods[FW_MODULE_ARM9_STATIC];
+	FirmwareModule *arm7Static = &mods[FW_MODULE_ARM7_STATIC];
+	FirmwareModule *arm9Secondary = &mods[FW_MODULE_ARM9_SECONDARY];
+	FirmwareModule *arm7Secondary = &mods[FW_MODULE_ARM7_SECONDARY];
+	FirmwareModule *rsrc = &mods[FW_MODULE_RESOURCES];
+	
+	//unpack firmware and data headers
+	arm9Static->type = CX_COMPRESSION_LZ;
+	arm7Static->type = CX_COMPRESSION_LZ;
+	arm9Static->data = GetArm9StaticInfo(buffer, size, &arm9Static->romAddr, &arm9Static->ramAddr, &arm9Static->size, &arm9Static->uncompressed);
+	arm7Static->data = GetArm7StaticInfo(buffer, size, &arm7Static->romAddr, &arm7Static->ramAddr, &arm7Static->size, &arm7Static->uncompressed);
+	arm9Secondary->data = GetArm9SecondaryInfo(buffer, size, &arm9Secondary->romAddr, &arm9Secondary->ramAddr, &arm9Secondary->size, &arm9Secondary->uncompressed, &arm9Secondary->type);
+	arm7Secondary->data = GetArm7SecondaryInfo(buffer, size, &arm7Secondary->romAddr, &arm7Secondary->ramAddr, &arm7Secondary->size, &arm7Secondary->uncompressed, &arm7Secondary->type);
+	rsrc->data = GetResourcesPackInfo(buffer, size, &rsrc->romAddr, &rsrc->ramAddr, &rsrc->size, &rsrc->uncompressed, &rsrc->type);
+	
+	//a module that failed to decompress has no known size
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (mods[i].data == NULL) {
+			mods[i].size = 0;
+			mods[i].uncompressed = 0;
+		}
+	}
+	
+	//locate the load addresses for secondary modules and resources pack
+	if (xrefs == NULL) {
+		GetSecondaryResourceLoadAddresses(arm9Static->data, arm9Static->uncompressed, arm7Static->data, arm7Static->uncompressed, &arm9Secondary->ramAddr, &arm7Secondary->ramAddr, &rsrc->ramAddr);
+		return;
+	}
+	
+	//index the static modules first, they are needed to find the other load addresses
+	for (int i = FW_MODULE_ARM9_STATIC; i <= FW_MODULE_ARM7_STATIC; i++) {
+		if (mods[i].data != NULL) XrIndexBuild(&xrefs[i], mods[i].data, mods[i].uncompressed, mods[i].ramAddr);
+	}
+	GetSecondaryResourceLoadAddressesEx(arm9Static->data, arm9Static->uncompressed, &xrefs[FW_MODULE_ARM9_STATIC], arm7Static->data, arm7Static->uncompressed, &xrefs[FW_MODULE_ARM7_STATIC],
+		&arm9Secondary->ramAddr, &arm7Secondary->ramAddr, &rsrc->ramAddr);
+	
+	for (int i = FW_MODULE_ARM9_SECONDARY; i <= FW_MODULE_ARM7_SECONDARY; i++) {
+		if (mods[i].data != NULL) XrIndexBuild(&xrefs[i], mods[i].data, mods[i].uncompressed, mods[i].ramAddr);
+	}
+}
+
+void GetFirmwareModules(const unsigned char *buffer, unsigned int size, FirmwareModule *mods) {
+	GetFirmwareModulesInternal(buffer, size, mods, NULL);
+}
+
+void FreeFirmwareModules(FirmwareModule *mods) {
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (mods[i].data != NULL) free(mods[i].data);
+		mods[i].data = NULL;
+	}
+}
+
+
+// ----- RAM view routines
+
+void BuildFirmwareRamView(const unsigned char *buffer, unsigned int size, FirmwareRamView *view) {
+	memset(view->xrefs, 0, sizeof(view->xrefs));
+	GetFirmwareModulesInternal(buffer, size, view->modules, view->xrefs);
+	
+	//insert each loaded module, sorted by load address
+	view->nRegions = 0;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		FirmwareModule *mod = &view->modules[i];
+		if (mod->data == NULL || mod->ramAddr == 0 || mod->uncompressed == 0) continue;
+		
+		int j = view->nRegions++;
+		while (j > 0 && view->regions[j - 1].start > mod->ramAddr) {
+			view->regions[j] = view->regions[j - 1];
+			j--;
+		}
+		view->regions[j].start = mod->ramAddr;
+		view->regions[j].end = mod->ramAddr + mod->uncompressed;
+		view->regions[j].module = i;
+	}
+	
+	uint32_t maxEnd = 0;
+	for (int i = 0; i < view->nRegions; i++) {
+		if (view->regions[i].end > maxEnd) maxEnd = view->regions[i].end;
+		view->regions[i].maxEnd = maxEnd;
+	}
+}
+
+void FreeFirmwareRamView(FirmwareRamView *view) {
+	FreeFirmwareModules(view->modules);
+	for (int i = 0; i < FW_MODULE_COUNT; i++) XrIndexFree(&view->xrefs[i]);
+	view->nRegions = 0;
+}
+
+int FindFirmwareRamRegions(const FirmwareRamView *view, uint32_t addr, int *modules, int nMax) {
+	//binary search for the last region starting at or below the address
+	int lo = 0, hi = view->nRegions;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (view->regions[mid].start <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+	
+	//earlier regions can only contain the address while their running end is past it
+	int first = lo;
+	while (first > 0 && view->regions[first - 1].maxEnd > addr) first--;
+	
+	int nFound = 0;
+	for (int i = first; i < lo; i++) {
+		if (view->regions[i].end <= addr) continue;
+		if (nFound < nMax) modules[nFound] = view->regions[i].module;
+		nFound++;
+	}
+	return nFound;
+}
+
+
+// ----- module layout routines
+
+unsigned char *CompressFirmwareModule(const unsigned char *fwHeader, int module, CxCompressionType type, const unsigned char *data, unsigned int size, unsigned int *pCompSize) {
+	return CompressFirmwareModuleEx(fwHeader, module, type, data, size, NULL, pCompSize);
+}
+
+unsigned char *CompressFirmwareModuleEx(const unsigned char *fwHeader, int module, CxCompressionType type, const unsigned char *data, unsigned int size, const CxEffort *effort, unsigned int *pCompSize) {
+	unsigned char *comp = NULL;
+	unsigned int compSize = 0;
+	
+	if (module == FW_MODULE_ARM9_STATIC || module == FW_MODULE_ARM7_STATIC) {
+		//ARM9 or ARM7 static: must be LZ compressed, then encrypted
+		comp = CxCompressLZEx(data, size, effort, &compSize);
+		if (comp == NULL) return NULL;
+		comp = CxPadCompressed(comp, compSize, 8, &compSize);
+		BfEncrypt(comp, compSize, fwHeader);
+	} else {
+		//secondary/resource: must be either LZ or ASH compressed
+		if (type == CX_COMPRESSION_ASH) comp = CxCompressAshFirmwareEx(data, size, effort, &compSize);
+		else comp = CxCompressLZEx(data, size, effort, &compSize);
+		if (comp == NULL) return NULL;
+		comp = CxPadCompressed(comp, compSize, 8, &compSize);
+	}
+	
+	*pCompSize = compSize;
+	return comp;
+}
+
+uint32_t GetFirmwareModuleLimit(const unsigned char *buffer, unsigned int size) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	
+	uint32_t maxAddr = hdr->nvramUserConfigAddr * 8 - 0x400;
+	if (HasTwlSettings(hdr->ipl2Type)) maxAddr -= 0x600;
+	if (maxAddr > size) maxAddr = size;
+	return maxAddr;
+}
+
+uint32_t GetLargestFreeRegion(const uint32_t *romAddrs, const uint32_t *modSizes, uint32_t limit) {
+	//walk the modules in address order, measuring the gaps between them
+	uint32_t largest = 0, pos = 0x200;
+	unsigned int placed = 0;
+	for (int n = 0; n < FW_MODULE_COUNT; n++) {
+		int next = -1;
+		for (int i = 0; i < FW_MODULE_COUNT; i++) {
+			if (placed & (1 << i)) continue;
+			if (next == -1 || romAddrs[i] < romAddrs[next]) next = i;
+		}
+		placed |= 1 << next;
+		
+		if (romAddrs[next] > pos && (romAddrs[next] - pos) > largest) largest = romAddrs[next] - pos;
+		if ((romAddrs[next] + modSizes[next]) > pos) pos = romAddrs[next] + modSizes[next];
+	}
+	if (limit > pos && (limit - pos) > largest) largest = limit - pos;
+	return largest;
+}
+
+typedef struct LayoutSearch_ {
+	uint32_t curAddrs[FW_MODULE_COUNT];
+	const uint32_t *modSizes;
+	uint32_t limit;
+	uint32_t minFree;
+	int objective;
+	uint32_t addrs[FW_MODULE_COUNT];
+	FirmwareLayout best;
+	int found;
+} LayoutSearch;
+
+static int LayoutIsBetter(const LayoutSearch *search, uint32_t largestFree, uint32_t bytesMoved) {
+	const FirmwareLayout *best = &search->best;
+	if (!search->found) return 1;
+	
+	if (search->objective == FW_LAYOUT_MIN_MOVED) {
+		//layouts meeting the free space requirement first, then the fewest bytes moved
+		int meets = largestFree >= search->minFree, bestMeets = best->largestFree >= search->minFree;
+		if (meets != bestMeets) return meets;
+		if (!meets) return largestFree > best->largestFree;
+		if (bytesMoved != best->bytesMoved) return bytesMoved < best->bytesMoved;
+		return largestFree > best->largestFree;
+	}
+	
+	if (largestFree != best->largestFree) return largestFree > best->largestFree;
+	return bytesMoved < best->bytesMoved;
+}
+
+static void PlanLayoutRecurse(LayoutSearch *search, unsigned int placed, uint32_t pos, uint32_t largestGap, uint32_t bytesMoved) {
+	if (placed == FW_MODULE_MASK_ALL) {
+		uint32_t largestFree = largestGap;
+		if ((search->limit - pos) > largestFree) largestFree = search->limit - pos;
+		
+		if (LayoutIsBetter(search, largestFree, bytesMoved)) {
+			memcpy(search->best.romAddrs, search->addrs, sizeof(search->addrs));
+			search->best.largestFree = largestFree;
+			search->best.bytesMoved = bytesMoved;
+			search->found = 1;
+		}
+		return;
+	}
+	
+	//place each remaining module next, either packed after the previous one or left where it is
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (placed & (1 << i)) continue;
+		
+		uint32_t candidates[2];
+		int nCandidates = 0;
+		uint32_t packed = AlignFirmwareModuleRomAddr(i, pos);
+		if (packed != 0) candidates[nCandidates++] = packed;
+		if (search->curAddrs[i] >= pos && search->curAddrs[i] != packed) candidates[nCandidates++] = search->curAddrs[i];
+		
+		for (int j = 0; j < nCandidates; j++) {
+			uint32_t addr = candidates[j];
+			if (addr > search->limit || search->modSizes[i] > (search->limit - addr)) continue;
 			
-			unsigned int pool2 = ((i + 0) & ~3) + 4 + ((instr1 & 0xFF) << 2);
-			uint32_t val2 = *(uint32_t *) (arm7Static + pool2);
+			uint32_t gap = addr - pos;
+			search->addrs[i] = addr;
+			PlanLayoutRecurse(search, placed | (1 << i), addr + search->modSizes[i], gap > largestGap ? gap : largestGap,
+				bytesMoved + (addr != search->curAddrs[i] ? search->modSizes[i] : 0));
+		}
+	}
+}
+
+int PlanFirmwareLayout(const unsigned char *buffer, unsigned int size, const uint32_t *modSizes, int objective, uint32_t minFree, FirmwareLayout *layout) {
+	LayoutSearch search = { 0 };
+	GetFirmwareModuleRomAddrs(buffer, search.curAddrs);
+	search.modSizes = modSizes;
+	search.limit = GetFirmwareModuleLimit(buffer, size);
+	search.minFree = minFree;
+	search.objective = objective;
+	
+	//every ordering of the modules, each either packed or kept in place (5! * 2^5 layouts)
+	if (search.limit > 0x200) PlanLayoutRecurse(&search, 0, 0x200, 0, 0);
+	if (!search.found) return 0;
+	
+	*layout = search.best;
+	return 1;
+}
+
+uint32_t GetFirmwareModuleCapacity(const unsigned char *buffer, unsigned int size, const uint32_t *modSizes, int module) {
+	uint32_t sizes[FW_MODULE_COUNT];
+	memcpy(sizes, modSizes, sizeof(sizes));
+	
+	//a smaller module fits wherever a larger one does, so search for the largest size that fits
+	FirmwareLayout layout;
+	uint32_t lo = 0, hi = GetFirmwareModuleLimit(buffer, size) / 8 + 1;
+	while (hi - lo > 1) {
+		uint32_t mid = (lo + hi) / 2;
+		sizes[module] = mid * 8;
+		if (PlanFirmwareLayout(buffer, size, sizes, FW_LAYOUT_MAX_FREE, 0, &layout)) lo = mid;
+		else hi = mid;
+	}
+	return lo * 8;
+}
+
+int RelayoutFirmwareModules(unsigned char *buffer, unsigned int size, unsigned char *const *mods, const uint32_t *modSizes) {
+	FirmwareLayout layout;
+	if (!PlanFirmwareLayout(buffer, size, modSizes, FW_LAYOUT_MAX_FREE, 0, &layout)) return 0;
+	
+	//clear the old module data so that the free space stays erased. The extents come from module headers,
+	//so they are clamped to the module area in case a header is corrupt: erasing the flash header would
+	//lose the key the static modules are encrypted with.
+	uint32_t oldAddrs[FW_MODULE_COUNT], oldSizes[FW_MODULE_COUNT];
+	uint32_t limit = GetFirmwareModuleLimit(buffer, size);
+	if (GetFirmwareModuleExtents(buffer, size, oldAddrs, oldSizes)) {
+		for (int i = 0; i < FW_MODULE_COUNT; i++) {
+			uint32_t oldAddr = oldAddrs[i], oldSize = oldSizes[i];
+			if (oldAddr < 0x200) {
+				if (oldSize <= 0x200 - oldAddr) continue;
+				oldSize -= 0x200 - oldAddr;
+				oldAddr = 0x200;
+			}
+			if (oldAddr >= limit) continue;
 			
-			*pArm7SecondaryLoadAddr = val2;
+			if (oldSize > limit - oldAddr) oldSize = limit - oldAddr;
+			memset(buffer + oldAddr, 0xFF, oldSize);
 		}
 	}
+	
+	//write modules
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		SetFirmwareModuleRomAddr(buffer, i, layout.romAddrs[i]);
+		memcpy(buffer + layout.romAddrs[i], mods[i], modSizes[i]);
+	}
+	return 1;
+}
+
+
+// ----- probe routines
+
+
+static unsigned int ProbeRead(FirmwareReadCallback callback, void *arg, FirmwareProbeInfo *info, uint32_t offset, void *dest, unsigned int size) {
+	if (offset >= info->imageSize || size > (info->imageSize - offset)) return 0;
+	
+	unsigned int nRead = callback(arg, offset, dest, size);
+	info->nBytesRead += nRead;
+	return nRead;
+}
+
+static void ProbeModuleHeader(FirmwareReadCallback callback, void *arg, FirmwareProbeInfo *info, int encrypted, FirmwareProbeModule *mod) {
+	mod->compressed   = 0;
+	mod->uncompressed = 0;
+	mod->type         = CX_COMPRESSION_NONE;
+	
+	//the module header words are all that we need: the LZ header or the ASH header
+	unsigned char hdrbuf[0xC];
+	unsigned int nHeader = encrypted ? 8 : sizeof(hdrbuf);
+	if (ProbeRead(callback, arg, info, mod->romAddr, hdrbuf, nHeader) != nHeader) return;
+	
+	//static modules: decrypt the first blowfish block
+	if (encrypted) BfDecrypt(hdrbuf, 8, info->header);
+	
+	uint32_t word0 = hdrbuf[0] | (hdrbuf[1] << 8) | (hdrbuf[2] << 16) | (hdrbuf[3] << 24);
+	if (hdrbuf[0] == 0x10) {
+		mod->type = CX_COMPRESSION_LZ;
+		mod->uncompressed = word0 >> 8;
+	} else if (!encrypted && (word0 & 0x80000000)) {
+		mod->type = CX_COMPRESSION_ASH;
+		mod->compressed = (word0 & 0x00FFFFFF) >> 2;
+		mod->uncompressed = ((hdrbuf[5] << 16) | (hdrbuf[6] << 8) | hdrbuf[7]) & 0x00FFFFFF;
+	}
+}
+
+int ProbeFirmware(FirmwareReadCallback callback, void *arg, uint32_t imageSize, FirmwareProbeInfo *info) {
+	memset(info, 0, sizeof(*info));
+	info->imageSize = imageSize;
+	
+	//flash header
+	if (ProbeRead(callback, arg, info, 0, info->header, sizeof(info->header)) != sizeof(info->header)) return 0;
+	FlashHeader *hdr = (FlashHeader *) info->header;
+	
+	FirmwareProbeModule *mods = info->modules;
+	mods[FW_MODULE_ARM9_STATIC].romAddr    = (4 * hdr->arm9StaticRomAddr) << hdr->arm9RomAddrScale;
+	mods[FW_MODULE_ARM9_STATIC].ramAddr    = 0x02800000 - ((hdr->arm9StaticRamAddr * 4) << hdr->arm9RamAddrScale);
+	mods[FW_MODULE_ARM7_STATIC].romAddr    = (4 * hdr->arm7StaticRomAddr) << hdr->arm7RomAddrScale;
+	mods[FW_MODULE_ARM7_STATIC].ramAddr    = (hdr->arm7RamLocation ? 0x02800000 : 0x03810000) - ((hdr->arm7StaticRamAddr * 4) << hdr->arm7RamAddrScale);
+	mods[FW_MODULE_ARM9_SECONDARY].romAddr = (4 * hdr->arm9SecondaryRomAddr) * 2;
+	mods[FW_MODULE_ARM7_SECONDARY].romAddr = (4 * hdr->arm7SecondaryRomAddr) * 2;
+	mods[FW_MODULE_RESOURCES].romAddr      = (4 * hdr->resourceRomAddr) * 2;
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		int encrypted = (i == FW_MODULE_ARM9_STATIC || i == FW_MODULE_ARM7_STATIC);
+		ProbeModuleHeader(callback, arg, info, encrypted, &mods[i]);
+	}
+	
+	//user config versions
+	info->ncdAddr = hdr->nvramUserConfigAddr * 8;
+	for (int i = 0; i < 2; i++) {
+		unsigned char version;
+		info->ncdVersion[i] = -1;
+		if (ProbeRead(callback, arg, info, info->ncdAddr + i * 0x100, &version, 1) == 1) info->ncdVersion[i] = version;
+	}
+	return 1;
 }
 
 
@@ -424,3 +1167,38 @@ int HasExConfig(int ipl2Type) {
 	return 0;
 }
 
+const char *GetIpl2TypeString(int type) {
+	//the strings are constant so that the function can be called from any thread
+	static const char *const names[4][3] = {
+		{ "DS (World)",                   "DS (iQue)",                   "DS (Korea)"                   },
+		{ "DS Lite (World)",              "DS Lite (iQue)",              "DS Lite (Korea)"              },
+		{ "DS Lite with CPU-NTR (World)", "DS Lite with CPU-NTR (iQue)", "DS Lite with CPU-NTR (Korea)" },
+		{ "DSi (World)",                  "DSi (iQue)",                  "DSi (Korea)"                  }
+	};
+	
+	if (type == IPL2_TYPE_NORMAL) type = 0;
+	
+	int model = 0;
+	if (type & IPL2_TYPE_USG) {
+		if (type & IPL2_TYPE_CPU_NTR) {
+			model = 2;
+		} else {
+			model = 1;
+		}
+	} else if (type & IPL2_TYPE_TWL) {
+		model = 3;
+		type &= ~(IPL2_TYPE_EXT_LANGUAGE | IPL2_TYPE_CHINESE | IPL2_TYPE_KOREAN);
+	}
+	
+	int region = 0;
+	if (type & IPL2_TYPE_EXT_LANGUAGE) {
+		if (type & IPL2_TYPE_CHINESE) {
+			region = 1;
+		} else if (type & IPL2_TYPE_KOREAN) {
+			region = 2;
+		}
+	}
+	
+	return names[model][region];
+}
+
@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 #include "compression.h"
+#include "xref.h"
 
 
 
@@ -203,8 +204,27 @@ typedef struct FlashConnectionEx_ {
 uint16_t ComputeCrc(const void *p, unsigned int length, uint16_t init);
 uint16_t ComputeStaticCrc(const void *arm9Static, unsigned int arm9StaticSize, const void *arm7Static, unsigned int arm7StaticSize);
 uint16_t ComputeSecondaryCrc(const void *arm9Secondary, unsigned int arm9SecondarySize, const void *arm7Secondary, unsigned int arm7SecondarySize);
+uint32_t ComputeCrc32(const void *p, unsigned int length, uint32_t init);
 void UpdateFirmwareModuleChecksums(unsigned char *buffer, unsigned int size);
 
+//
+// Update the header CRCs covering the modules in the mask. Returns 0 if a CRC could not be updated
+// because one of its modules could not be decompressed.
+//
+int UpdateFirmwareModuleChecksumsEx(unsigned char *buffer, unsigned int size, unsigned int moduleMask);
+void ComputeMd5(const unsigned char *buf, unsigned int len, unsigned char *pDigest);
+
+//
+// Update the CRC of the wireless initialization table and of one user configuration copy (0 or 1).
+//
+void UpdateWirelessTableChecksum(unsigned char *buffer);
+void UpdateUserConfigChecksum(unsigned char *buffer, unsigned int size, int index);
+
+//
+// Update the CRCs of a connection setting (0-2, or 3-5 for TWL connection settings). Unset connections are skipped.
+//
+void UpdateConnectionChecksum(unsigned char *buffer, unsigned int size, int index);
+
 
 // ----- RF routines
 
@@ -216,9 +236,52 @@ void UpdateFirmwareModuleChecksums(unsigned char *buffer, unsigned int size);
 const char *GetRfType(int type);
 int IsValidRfType(int type);
 
+#define WL_OUI_GEN_ORIGINAL 0 // original modules, the OUI checked by DWC
+#define WL_OUI_GEN_SECOND   1 // middle range modules
+#define WL_OUI_GEN_LATE     2 // later modules (never the original OUI)
+
+//
+// Get the MAC address OUIs used by a generation of wireless modules, and the generation of the wireless
+// module of a firmware image.
+//
+int GetWirelessOuis(int gen, const unsigned char (**pOuis)[3]);
+int GetWirelessOuiGeneration(const unsigned char *buffer);
+
 
 // ----- unpack routines
 
+#define FW_MODULE_ARM9_STATIC          0 // ARM9 static module
+#define FW_MODULE_ARM7_STATIC          1 // ARM7 static module
+#define FW_MODULE_ARM9_SECONDARY       2 // ARM9 secondary module
+#define FW_MODULE_ARM7_SECONDARY       3 // ARM7 secondary module
+#define FW_MODULE_RESOURCES            4 // resources pack
+#define FW_MODULE_COUNT                5
+#define FW_MODULE_MASK_ALL             ((1 << FW_MODULE_COUNT) - 1)
+
+//
+// Get the flash addresses of the modules from the header, without decompressing them.
+//
+void GetFirmwareModuleRomAddrs(const unsigned char *buffer, uint32_t *romAddrs);
+
+//
+// Get the flash addresses and compressed sizes of the modules by walking their compressed data, without
+// decompressing them. Returns 0 if a module is not valid compressed data.
+//
+int GetFirmwareModuleExtents(const unsigned char *buffer, unsigned int size, uint32_t *romAddrs, uint32_t *compSizes);
+
+//
+// Get the lowest flash address at or above romAddr that the header can encode for a module, or 0 if
+// there is none. Set a module's flash address in the header, using the smallest address scale that
+// encodes it for the static modules.
+//
+uint32_t AlignFirmwareModuleRomAddr(int module, uint32_t romAddr);
+void SetFirmwareModuleRomAddr(unsigned char *buffer, int module, uint32_t romAddr);
+
+//
+// Get the RAM addresses of the static modules from the header, without decompressing them.
+//
+void GetFirmwareStaticRamAddrs(const unsigned char *buffer, uint32_t *pArm9RamAddr, uint32_t *pArm7RamAddr);
+
 unsigned char *UncompressLZBlowfish(const unsigned char *buffer, unsigned int size, unsigned int romAddr, uint32_t *pSize, uint32_t *pUncompressed);
 unsigned char *GetArm9StaticInfo(const unsigned char *buffer, unsigned int size, uint32_t *pRomAddr, uint32_t *pRamAddr, uint32_t *pSize, uint32_t *pUncompressed);
 unsigned char *GetArm7StaticInfo(const unsigned char *buffer, unsigned int size, uint32_t *pRomAddr, uint32_t *pRamAddr, uint32_t *pSize, uint32_t *pUncompressed);
@@ -226,6 +289,16 @@ unsigned char *GetArm9SecondaryInfo(const unsigned char *buffer, unsigned int si
 unsigned char *GetArm7SecondaryInfo(const unsigned char *buffer, unsigned int size, uint32_t *pRomAddr, uint32_t *pRamAddr, uint32_t *pSize, uint32_t *pUncompressed, CxCompressionType *pType);
 unsigned char *GetResourcesPackInfo(const unsigned char *buffer, unsigned int size, uint32_t *pRomAddr, uint32_t *pRamAddr, uint32_t *pSize, uint32_t *pUncompressed, CxCompressionType *pType);
 
+#define FW_FUNCTION_DECODE_ASH         0 // ASH decompressor of the ARM9 static module
+#define FW_FUNCTION_COUNT              1
+#define FW_FUNCTION_NOT_FOUND          0xFFFFFFFF
+
+//
+// Find the offsets of known functions in a decompressed module with a single scan over the module,
+// using a database of masked code signatures. Functions that are not found get FW_FUNCTION_NOT_FOUND.
+//
+void FindFirmwareFunctions(const unsigned char *module, unsigned int size, uint32_t *offsets);
+
 void GetSecondaryResourceLoadAddresses(
 	const unsigned char *arm9Static,
 	unsigned int arm9StaticUncompressed,
@@ -236,5 +309,153 @@ void GetSecondaryResourceLoadAddresses(
 	uint32_t *pRsrcLoadAddr
 );
 
+//
+// Locate the load addresses from the cross-reference indexes of the static modules, instead of building
+// them for the call.
+//
+void GetSecondaryResourceLoadAddressesEx(
+	const unsigned char *arm9Static,
+	unsigned int arm9StaticUncompressed,
+	const XrIndex *arm9StaticXrefs,
+	const unsigned char *arm7Static,
+	unsigned int arm7StaticUncompressed,
+	const XrIndex *arm7StaticXrefs,
+	uint32_t *pArm9SecondaryLoadAddr,
+	uint32_t *pArm7SecondaryLoadAddr,
+	uint32_t *pRsrcLoadAddr
+);
+
+
+typedef struct FirmwareModule_ {
+	uint32_t romAddr;                       // ROM address of module
+	uint32_t ramAddr;                       // RAM address of module, 0 if unknown
+	uint32_t size;                          // size of module in flash
+	uint32_t uncompressed;                  // uncompressed size of module
+	CxCompressionType type;                 // compression type
+	unsigned char *data;                    // uncompressed module, NULL if it could not be decompressed
+} FirmwareModule;
+
+//
+// Decompress all of the firmware's modules and locate their load addresses.
+//
+void GetFirmwareModules(const unsigned char *buffer, unsigned int size, FirmwareModule *mods);
+void FreeFirmwareModules(FirmwareModule *mods);
+
+
+// ----- RAM view routines
+
+typedef struct FirmwareRamRegion_ {
+	uint32_t start;                         // RAM address of the first byte
+	uint32_t end;                           // RAM address after the last byte
+	uint32_t maxEnd;                        // highest end of this and all preceding regions
+	int module;                             // FW_MODULE_* index
+} FirmwareRamRegion;
+
+typedef struct FirmwareRamView_ {
+	FirmwareModule modules[FW_MODULE_COUNT];
+	FirmwareRamRegion regions[FW_MODULE_COUNT]; // decoded modules with a known load address, by address
+	int nRegions;
+	XrIndex xrefs[FW_MODULE_COUNT];         // cross-references of the code modules, by RAM address
+} FirmwareRamView;
+
+//
+// Decompress the modules, index where they are loaded in RAM and index the cross-references of the code
+// modules.
+//
+void BuildFirmwareRamView(const unsigned char *buffer, unsigned int size, FirmwareRamView *view);
+void FreeFirmwareRamView(FirmwareRamView *view);
+
+//
+// Get the modules loaded at a RAM address, in order of load address. Returns the number of modules found,
+// which may be more than nMax if module load ranges overlap.
+//
+int FindFirmwareRamRegions(const FirmwareRamView *view, uint32_t addr, int *modules, int nMax);
+
+
+// ----- module layout routines
+
+//
+// Compress a module for storage in flash. The static modules are LZ compressed and encrypted with the
+// key of the specified flash header, the others are compressed with the specified compression type.
+// The result is padded to a multiple of 8 bytes.
+//
+unsigned char *CompressFirmwareModule(const unsigned char *fwHeader, int module, CxCompressionType type, const unsigned char *data, unsigned int size, unsigned int *pCompSize);
+
+//
+// Compress a module for storage in flash within an effort budget. The target size applies to the padded
+// size. A NULL effort compresses as CompressFirmwareModule does. Returns NULL if the compression is
+// cancelled through the effort's progress.
+//
+unsigned char *CompressFirmwareModuleEx(const unsigned char *fwHeader, int module, CxCompressionType type, const unsigned char *data, unsigned int size, const CxEffort *effort, unsigned int *pCompSize);
+
+//
+// Get the highest flash address modules may occupy, below the connection settings.
+//
+uint32_t GetFirmwareModuleLimit(const unsigned char *buffer, unsigned int size);
+
+#define FW_LAYOUT_MAX_FREE   0 // maximize the largest free region
+#define FW_LAYOUT_MIN_MOVED  1 // move the fewest bytes that leave a free region of the requested size
+
+typedef struct FirmwareLayout_ {
+	uint32_t romAddrs[FW_MODULE_COUNT];
+	uint32_t largestFree;
+	uint32_t bytesMoved;               // size of the modules placed at a new address
+} FirmwareLayout;
+
+//
+// Get the size of the largest free region between the header and the module limit.
+//
+uint32_t GetLargestFreeRegion(const uint32_t *romAddrs, const uint32_t *modSizes, uint32_t limit);
+
+//
+// Plan flash addresses for modules of the given compressed sizes. All module orderings are searched,
+// with each module packed after the previous one at an address the header can encode, or kept at its
+// current address. Returns 0 if the modules do not fit below the module limit.
+//
+int PlanFirmwareLayout(const unsigned char *buffer, unsigned int size, const uint32_t *modSizes, int objective, uint32_t minFree, FirmwareLayout *layout);
+
+//
+// Get the largest compressed size a module may have for the modules to still fit in the image, with the
+// other modules at their given sizes. Returns 0 if they do not fit at all.
+//
+uint32_t GetFirmwareModuleCapacity(const unsigned char *buffer, unsigned int size, const uint32_t *modSizes, int module);
+
+//
+// Write compressed modules at the layout that leaves the largest free region and update the header's
+// module addresses. Returns 0 without changing the image if the modules do not fit.
+//
+int RelayoutFirmwareModules(unsigned char *buffer, unsigned int size, unsigned char *const *mods, const uint32_t *modSizes);
+
+
+// ----- probe routines
+
+//
+// Callback used to read a range of a firmware image. Returns the number of bytes read.
+//
+typedef unsigned int (*FirmwareReadCallback) (void *pArg, uint32_t offset, void *dest, unsigned int size);
+
+typedef struct FirmwareProbeModule_ {
+	uint32_t romAddr;                       // ROM address of module
+	uint32_t ramAddr;                       // RAM address of module (static modules only)
+	uint32_t compressed;                    // compressed size declared by module header (ASH only)
+	uint32_t uncompressed;                  // uncompressed size declared by module header
+	CxCompressionType type;                 // compression type, CX_COMPRESSION_NONE if header invalid
+} FirmwareProbeModule;
+
+typedef struct FirmwareProbeInfo_ {
+	unsigned char header[0x200];            // flash header and wireless tables
+	uint32_t imageSize;                     // size of the firmware image
+	uint32_t ncdAddr;                       // NVRAM user config address
+	int ncdVersion[2];                      // version of each user config copy, -1 if out of bounds
+	uint32_t nBytesRead;                    // number of bytes read from the image
+	FirmwareProbeModule modules[FW_MODULE_COUNT];
+} FirmwareProbeInfo;
+
+int ProbeFirmware(FirmwareReadCallback callback, void *arg, uint32_t imageSize, FirmwareProbeInfo *info);
+
+
+// ----- IPL2 type functions
+
 int HasTwlSettings(int ipl2Type);
 int HasExConfig(int ipl2Type);
+const char *GetIpl2TypeString(int type);
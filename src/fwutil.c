@@ -7,6 +7,9 @@
 #include "blowfish.h"
 #include "firmware.h"
 #include "cmd_common.h"
+#include "server.h"
+
+#define SERVER_MAX_IMAGES 16 // images a server keeps open
 
 
 void CmdHelpQuit(void) {
@@ -39,22 +42,47 @@ static CmdProcEntry sProcTable[] = {
 	
 	{ "load",    CmdProcLoad    },
 	{ "save",    CmdProcSave    },
+	{ "use",     CmdProcUse     },
+	{ "archive", CmdProcArchive },
+	{ "unpack",  CmdProcUnpack  },
+	{ "pack",    CmdProcPack    },
 	{ "info",    CmdProcInfo    },
 	{ "verify",  CmdProcVerify  },
 	{ "wl",      CmdProcWl      },
 	{ "map",     CmdProcMap     },
 	{ "compact", CmdProcCompact },
+	{ "defrag",  CmdProcDefrag  },
+	{ "probe",   CmdProcProbe   },
+	{ "identify", CmdProcIdentify },
+	{ "diff",    CmdProcDiff    },
 	
 	{ "md5",     CmdProcMD5     },
 	{ "clean",   CmdProcClean   },
 	{ "restore", CmdProcRestore },
 	{ "fix",     CmdProxFix     },
 	{ "import",  CmdProcImport  },
+	{ "batchimport", CmdProcBatchImport },
+	{ "provision", CmdProcProvision },
 	{ "export",  CmdProcExport  },
+	{ "mkpatch", CmdProcMkPatch },
+	{ "applypatch", CmdProcApplyPatch },
+	{ "applyips", CmdProcApplyIps },
+	{ "applybps", CmdProcApplyBps },
+	{ "undo",    CmdProcUndo    },
+	{ "redo",    CmdProcRedo    },
+	{ "snapshot", CmdProcSnapshot },
+	{ "revert",  CmdProcRevert  },
+	{ "jobs",    CmdProcJobs    },
+	{ "cancel",  CmdProcCancel  },
+	{ "wait",    CmdProcWait    },
 	{ "user",    CmdProcUser    },
 	{ "loc",     CmdProcLoc     },
+	{ "symbolize", CmdProcSymbolize },
+	{ "find",    CmdProcFind    },
+	{ "xref",    CmdProcXref    },
 	{ "eb",      CmdProcEB      },
-	{ "db",      CmdProcDB      }
+	{ "db",      CmdProcDB      },
+	{ "wr",      CmdProcWR      }
 };
 
 static void CmdParse(const char *buffer, int *pArgc, char ***pArgv) {
@@ -133,6 +161,13 @@ static void CmdFree(char **argv) {
 	}
 }
 
+static void CmdCommit(int argc, const char **argv) {
+	//the command line labels the edit in the undo history
+	char *label = JoinArgs(argc, argv);
+	CommitFirmwareImage(label);
+	free(label);
+}
+
 static void CmdDispatch(int argc, const char **argv) {
 	if (argc == 0) return;
 	
@@ -140,6 +175,7 @@ static void CmdDispatch(int argc, const char **argv) {
 		if (stricmp(sProcTable[i].cmd, argv[0]) == 0) {
 			if (sProcTable[i].proc != NULL) sProcTable[i].proc(argc, argv);
 			else puts("Unimplemented.");
+			CmdCommit(argc, argv);
 			return;
 		}
 	}
@@ -172,13 +208,81 @@ static void CmdMain(const char *defpath) {
 		char **argv;
 		int argc;
 		CmdParse(buffer, &argc, &argv);
-		CmdDispatch(argc, argv);
+		
+		//background jobs that are done are applied before the command sees the image
+		PollJobs();
+		CmdDispatch(argc, (const char **) argv);
 		CmdFree(argv);
 		puts("");
 	}
+	
+	WaitJobs(1);
+}
+
+typedef struct ServerSession_ {
+	unsigned int id;                        // identifies the connection's background jobs
+	char *imagePath;                        // the connection's current image
+} ServerSession;
+
+static int ServerCommand(void **pSession, const char *line) {
+	//each connection has its own current image, kept as the image's path
+	static unsigned int nextId = 1;
+	ServerSession *session = (ServerSession *) *pSession;
+	if (session == NULL) {
+		session = (ServerSession *) calloc(1, sizeof(ServerSession));
+		session->id = nextId++;
+		*pSession = session;
+	}
+	
+	if (!SelectFirmwareImage(session->imagePath)) {
+		printf("%s was closed to make room for other images.\n", session->imagePath);
+		SelectFirmwareImage(NULL);
+	}
+	SetJobClient(session->id);
+	
+	char **argv;
+	int argc;
+	CmdParse(line, &argc, &argv);
+	
+	PollJobs();
+	CmdDispatch(argc, (const char **) argv);
+	CmdFree(argv);
+	
+	const char *path = GetCurrentFilePath();
+	free(session->imagePath);
+	session->imagePath = path != NULL ? strdup(path) : NULL;
+	return IsExiting();
+}
+
+static void ServerClose(void *pSession) {
+	//the jobs of a client that is gone are not applied, since nobody would see them
+	ServerSession *session = (ServerSession *) pSession;
+	if (session == NULL) return;
+	
+	CancelClientJobs(session->id);
+	free(session->imagePath);
+	free(session);
+}
+
+static int ServerMain(const char *socketPath, int nImages, char **images) {
+	//images loaded up front are kept open for the clients to use
+	SetOpenImageLimit(SERVER_MAX_IMAGES);
+	for (int i = 0; i < nImages; i++) LoadFirmwareImage(images[i]);
+	SelectFirmwareImage(NULL);
+	
+	int ok = SvServe(socketPath, ServerCommand, ServerClose);
+	WaitJobs(1);
+	return ok ? 0 : 1;
 }
 
 int main(int argc, char **argv) {
+	if (argc >= 3 && strcmp(argv[1], "--serve") == 0) {
+		return ServerMain(argv[2], argc - 3, argv + 3);
+	}
+	if (argc >= 3 && strcmp(argv[1], "--client") == 0) {
+		return SvRunClient(argv[2], argc - 3, (const char *const *) argv + 3) ? 0 : 1;
+	}
+	
 	CmdMain(argc >= 1 ? argv[1] : NULL);
 	
 	return 0;
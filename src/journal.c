@@ -0,0 +1,319 @@
+#include "journal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct JnPage_ {
+	unsigned int refs;
+	unsigned char data[];
+};
+
+static void *JnDefaultAlloc(void *arg, size_t size) {
+	(void) arg;
+	return malloc(size);
+}
+
+static void JnDefaultFree(void *arg, void *p) {
+	(void) arg;
+	free(p);
+}
+
+static void *JnAlloc(const JnJournal *journal, size_t size) {
+	return journal->allocator.alloc(journal->allocator.arg, size);
+}
+
+static void JnDealloc(const JnJournal *journal, void *p) {
+	if (p != NULL) journal->allocator.free(journal->allocator.arg, p);
+}
+
+//
+// Grow an array from count to count + 1 elements. The allocator has no realloc, so the elements are
+// copied. Returns NULL, leaving the array as it was, if memory could not be allocated.
+//
+static void *JnGrowArray(const JnJournal *journal, void *array, unsigned int count, size_t elemSize) {
+	void *grown = JnAlloc(journal, (count + 1) * elemSize);
+	if (grown == NULL) return NULL;
+	
+	if (count > 0) memcpy(grown, array, count * elemSize);
+	JnDealloc(journal, array);
+	return grown;
+}
+
+static unsigned int JnGetPageSize(const JnJournal *journal, uint32_t page) {
+	uint32_t offset = page * JN_PAGE_SIZE;
+	return (journal->size - offset) < JN_PAGE_SIZE ? (journal->size - offset) : JN_PAGE_SIZE;
+}
+
+static JnPage *JnCreatePage(const JnJournal *journal, const unsigned char *data, unsigned int size) {
+	JnPage *page = JnAlloc(journal, sizeof(JnPage) + size);
+	if (page == NULL) return NULL;
+	
+	page->refs = 1;
+	memcpy(page->data, data, size);
+	return page;
+}
+
+static JnPage *JnRetainPage(JnPage *page) {
+	page->refs++;
+	return page;
+}
+
+static void JnReleasePage(const JnJournal *journal, JnPage *page) {
+	if (--page->refs == 0) JnDealloc(journal, page);
+}
+
+static char *JnCopyString(const JnJournal *journal, const char *prefix, const char *str) {
+	char *copy = JnAlloc(journal, strlen(prefix) + strlen(str) + 1);
+	if (copy == NULL) return NULL;
+	
+	strcpy(copy, prefix);
+	strcat(copy, str);
+	return copy;
+}
+
+static void JnFreeEntry(const JnJournal *journal, JnEntry *entry) {
+	for (unsigned int i = 0; i < entry->nChanges; i++) {
+		JnReleasePage(journal, entry->changes[i].before);
+		JnReleasePage(journal, entry->changes[i].after);
+	}
+	JnDealloc(journal, entry->changes);
+	JnDealloc(journal, entry->label);
+}
+
+static void JnFreePageTable(const JnJournal *journal, JnPage **pages) {
+	for (unsigned int i = 0; i < journal->nPages; i++) {
+		if (pages[i] != NULL) JnReleasePage(journal, pages[i]);
+	}
+	JnDealloc(journal, pages);
+}
+
+static JnPage **JnCopyPageTable(const JnJournal *journal, JnPage *const *pages) {
+	JnPage **copy = JnAlloc(journal, journal->nPages * sizeof(JnPage *));
+	if (copy == NULL) return NULL;
+	
+	for (unsigned int i = 0; i < journal->nPages; i++) copy[i] = JnRetainPage(pages[i]);
+	return copy;
+}
+
+int JnInit(JnJournal *journal, const unsigned char *image, unsigned int size, const JnAllocator *allocator) {
+	static const JnAllocator defaultAllocator = { JnDefaultAlloc, JnDefaultFree, NULL };
+	
+	memset(journal, 0, sizeof(*journal));
+	journal->allocator = allocator != NULL ? *allocator : defaultAllocator;
+	journal->size = size;
+	journal->nPages = (size + JN_PAGE_SIZE - 1) / JN_PAGE_SIZE;
+	journal->pages = JnAlloc(journal, journal->nPages * sizeof(JnPage *));
+	if (journal->pages == NULL) {
+		JnFree(journal);
+		return 0;
+	}
+	
+	for (unsigned int i = 0; i < journal->nPages; i++) {
+		journal->pages[i] = JnCreatePage(journal, image + i * JN_PAGE_SIZE, JnGetPageSize(journal, i));
+		if (journal->pages[i] == NULL) {
+			//the rest of the table is still unset
+			for (unsigned int j = i + 1; j < journal->nPages; j++) journal->pages[j] = NULL;
+			JnFree(journal);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+void JnFree(JnJournal *journal) {
+	for (unsigned int i = 0; i < journal->nEntries; i++) JnFreeEntry(journal, &journal->entries[i]);
+	for (unsigned int i = 0; i < journal->nSnapshots; i++) {
+		JnFreePageTable(journal, journal->snapshots[i].pages);
+		JnDealloc(journal, journal->snapshots[i].name);
+	}
+	if (journal->pages != NULL) JnFreePageTable(journal, journal->pages);
+	JnDealloc(journal, journal->entries);
+	JnDealloc(journal, journal->snapshots);
+	
+	JnAllocator allocator = journal->allocator;
+	memset(journal, 0, sizeof(*journal));
+	journal->allocator = allocator;
+}
+
+//
+// Make room for a new entry and copy its label, before anything else changes. Returns 0 if memory could
+// not be allocated.
+//
+static int JnReserveEntry(JnJournal *journal, const char *prefix, const char *label, char **pLabel) {
+	*pLabel = JnCopyString(journal, prefix, label);
+	if (*pLabel == NULL) return 0;
+	
+	//a full history makes room by dropping its oldest entry, so only a history below the limit grows
+	if (journal->nUndo < JN_MAX_HISTORY && journal->nUndo >= journal->nEntries) {
+		JnEntry *entries = JnGrowArray(journal, journal->entries, journal->nEntries, sizeof(JnEntry));
+		if (entries == NULL) {
+			JnDealloc(journal, *pLabel);
+			return 0;
+		}
+		journal->entries = entries;
+	}
+	return 1;
+}
+
+static void JnAddEntry(JnJournal *journal, char *label, JnChange *changes, unsigned int nChanges) {
+	//a new edit makes the undone edits unreachable
+	for (unsigned int i = journal->nUndo; i < journal->nEntries; i++) JnFreeEntry(journal, &journal->entries[i]);
+	journal->nEntries = journal->nUndo;
+	
+	//drop the oldest edit when the history is full
+	if (journal->nEntries == JN_MAX_HISTORY) {
+		JnFreeEntry(journal, &journal->entries[0]);
+		memmove(journal->entries, journal->entries + 1, (journal->nEntries - 1) * sizeof(JnEntry));
+		journal->nEntries--;
+	}
+	
+	JnEntry *entry = &journal->entries[journal->nEntries++];
+	entry->label = label;
+	entry->changes = changes;
+	entry->nChanges = nChanges;
+	journal->nUndo = journal->nEntries;
+}
+
+int JnCommit(JnJournal *journal, const unsigned char *image, const char *label) {
+	//everything the edit needs is allocated before the page table changes, so a failure leaves the
+	//journal as it was
+	unsigned int nChanges = 0;
+	for (unsigned int i = 0; i < journal->nPages; i++) {
+		if (memcmp(journal->pages[i]->data, image + i * JN_PAGE_SIZE, JnGetPageSize(journal, i)) != 0) nChanges++;
+	}
+	if (nChanges == 0) return 0;
+	
+	char *entryLabel;
+	JnChange *changes = JnAlloc(journal, nChanges * sizeof(JnChange));
+	if (changes == NULL) return -1;
+	if (!JnReserveEntry(journal, "", label, &entryLabel)) {
+		JnDealloc(journal, changes);
+		return -1;
+	}
+	
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < journal->nPages && n < nChanges; i++) {
+		const unsigned char *data = image + i * JN_PAGE_SIZE;
+		unsigned int pageSize = JnGetPageSize(journal, i);
+		if (memcmp(journal->pages[i]->data, data, pageSize) == 0) continue;
+		
+		changes[n].page = i;
+		changes[n].before = journal->pages[i];
+		changes[n].after = JnCreatePage(journal, data, pageSize);
+		if (changes[n].after == NULL) {
+			for (unsigned int j = 0; j < n; j++) JnReleasePage(journal, changes[j].after);
+			JnDealloc(journal, changes);
+			JnDealloc(journal, entryLabel);
+			return -1;
+		}
+		n++;
+	}
+	
+	//the table's reference to the old page moves to the change
+	for (unsigned int i = 0; i < nChanges; i++) journal->pages[changes[i].page] = JnRetainPage(changes[i].after);
+	JnAddEntry(journal, entryLabel, changes, nChanges);
+	return nChanges;
+}
+
+static void JnSetPage(JnJournal *journal, unsigned char *image, uint32_t page, JnPage *contents) {
+	if (journal->pages[page] == contents) return;
+	
+	memcpy(image + page * JN_PAGE_SIZE, contents->data, JnGetPageSize(journal, page));
+	JnReleasePage(journal, journal->pages[page]);
+	journal->pages[page] = JnRetainPage(contents);
+}
+
+const JnEntry *JnUndo(JnJournal *journal, unsigned char *image) {
+	if (journal->nUndo == 0) return NULL;
+	
+	JnEntry *entry = &journal->entries[--journal->nUndo];
+	for (unsigned int i = 0; i < entry->nChanges; i++) {
+		JnSetPage(journal, image, entry->changes[i].page, entry->changes[i].before);
+	}
+	return entry;
+}
+
+const JnEntry *JnRedo(JnJournal *journal, unsigned char *image) {
+	if (journal->nUndo == journal->nEntries) return NULL;
+	
+	JnEntry *entry = &journal->entries[journal->nUndo++];
+	for (unsigned int i = 0; i < entry->nChanges; i++) {
+		JnSetPage(journal, image, entry->changes[i].page, entry->changes[i].after);
+	}
+	return entry;
+}
+
+static int JnPagesEqual(const JnJournal *journal, uint32_t page, const JnPage *a, const JnPage *b) {
+	return a == b || memcmp(a->data, b->data, JnGetPageSize(journal, page)) == 0;
+}
+
+unsigned int JnCountSnapshotChanges(const JnJournal *journal, const JnSnapshot *snapshot) {
+	unsigned int nChanges = 0;
+	for (unsigned int i = 0; i < journal->nPages; i++) {
+		if (!JnPagesEqual(journal, i, journal->pages[i], snapshot->pages[i])) nChanges++;
+	}
+	return nChanges;
+}
+
+const JnSnapshot *JnFindSnapshot(const JnJournal *journal, const char *name) {
+	for (unsigned int i = 0; i < journal->nSnapshots; i++) {
+		if (strcmp(journal->snapshots[i].name, name) == 0) return &journal->snapshots[i];
+	}
+	return NULL;
+}
+
+int JnTakeSnapshot(JnJournal *journal, const char *name) {
+	JnPage **pages = JnCopyPageTable(journal, journal->pages);
+	if (pages == NULL) return 0;
+	
+	JnSnapshot *snapshot = (JnSnapshot *) JnFindSnapshot(journal, name);
+	if (snapshot != NULL) {
+		JnFreePageTable(journal, snapshot->pages);
+	} else {
+		char *copy = JnCopyString(journal, "", name);
+		JnSnapshot *snapshots = copy != NULL ? JnGrowArray(journal, journal->snapshots, journal->nSnapshots, sizeof(JnSnapshot)) : NULL;
+		if (snapshots == NULL) {
+			JnDealloc(journal, copy);
+			JnFreePageTable(journal, pages);
+			return 0;
+		}
+		
+		journal->snapshots = snapshots;
+		snapshot = &journal->snapshots[journal->nSnapshots++];
+		snapshot->name = copy;
+	}
+	snapshot->pages = pages;
+	return 1;
+}
+
+int JnRevert(JnJournal *journal, unsigned char *image, const char *name) {
+	const JnSnapshot *snapshot = JnFindSnapshot(journal, name);
+	if (snapshot == NULL) return -1;
+	
+	//pages shared with the snapshot are unchanged, so only the others are compared
+	unsigned int nChanges = JnCountSnapshotChanges(journal, snapshot);
+	if (nChanges == 0) return 0;
+	
+	char *label;
+	JnChange *changes = JnAlloc(journal, nChanges * sizeof(JnChange));
+	if (changes == NULL) return -2;
+	if (!JnReserveEntry(journal, "revert ", name, &label)) {
+		JnDealloc(journal, changes);
+		return -2;
+	}
+	
+	unsigned int n = 0;
+	for (unsigned int i = 0; i < journal->nPages; i++) {
+		if (JnPagesEqual(journal, i, journal->pages[i], snapshot->pages[i])) continue;
+		
+		JnChange *change = &changes[n++];
+		change->page = i;
+		change->before = JnRetainPage(journal->pages[i]);
+		change->after = JnRetainPage(snapshot->pages[i]);
+		JnSetPage(journal, image, i, snapshot->pages[i]);
+	}
+	
+	JnAddEntry(journal, label, changes, nChanges);
+	return nChanges;
+}
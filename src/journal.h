@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define JN_PAGE_SIZE    0x1000              // granularity of change tracking
+#define JN_MAX_HISTORY  256                 // number of undo steps kept
+
+//
+// Page contents are immutable and shared by reference between the current state, the undo history and
+// snapshots, so only pages that changed are ever copied.
+//
+typedef struct JnPage_ JnPage;
+
+typedef struct JnChange_ {
+	uint32_t page;                          // page index
+	JnPage *before;
+	JnPage *after;
+} JnChange;
+
+typedef struct JnEntry_ {
+	char *label;                            // description of the edit
+	JnChange *changes;
+	unsigned int nChanges;
+} JnEntry;
+
+typedef struct JnSnapshot_ {
+	char *name;
+	JnPage **pages;                         // page table of the image when the snapshot was taken
+} JnSnapshot;
+
+//
+// Allocator for all of a journal's memory.
+//
+typedef struct JnAllocator_ {
+	void *(*alloc)(void *arg, size_t size);
+	void (*free)(void *arg, void *p);
+	void *arg;
+} JnAllocator;
+
+typedef struct JnJournal_ {
+	JnAllocator allocator;
+	unsigned int size;                      // image size
+	unsigned int nPages;
+	JnPage **pages;                         // page table of the image as of the last commit
+	JnEntry *entries;                       // edit history, oldest first
+	unsigned int nEntries;
+	unsigned int nUndo;                     // entries before this one can be undone, the rest redone
+	JnSnapshot *snapshots;
+	unsigned int nSnapshots;
+} JnJournal;
+
+//
+// Start a journal for an image, or free a journal with its history and snapshots. A NULL allocator uses
+// malloc and free. Returns 0 if memory could not be allocated, leaving the journal empty.
+//
+int JnInit(JnJournal *journal, const unsigned char *image, unsigned int size, const JnAllocator *allocator);
+void JnFree(JnJournal *journal);
+
+//
+// Record the pages of the image that changed since the last commit as one undoable edit. Edits that
+// could be redone are discarded. Returns the number of pages that changed; no edit is recorded if none.
+// Returns -1 if memory could not be allocated, in which case nothing is recorded and the pages are
+// recorded by the next commit instead.
+//
+int JnCommit(JnJournal *journal, const unsigned char *image, const char *label);
+
+//
+// Undo or redo an edit, restoring only the pages it changed. Returns the edit, or NULL if there is
+// nothing to undo or redo.
+//
+const JnEntry *JnUndo(JnJournal *journal, unsigned char *image);
+const JnEntry *JnRedo(JnJournal *journal, unsigned char *image);
+
+//
+// Save the current state under a name, replacing a snapshot of the same name. The snapshot shares the
+// pages of the current state. Returns 0 if memory could not be allocated.
+//
+int JnTakeSnapshot(JnJournal *journal, const char *name);
+const JnSnapshot *JnFindSnapshot(const JnJournal *journal, const char *name);
+
+//
+// Count the pages of the current state that differ from a snapshot.
+//
+unsigned int JnCountSnapshotChanges(const JnJournal *journal, const JnSnapshot *snapshot);
+
+//
+// Restore a snapshot. The revert is recorded as an edit, so it can be undone. Returns the number of
+// pages restored, -1 if there is no snapshot of that name, or -2 if memory could not be allocated.
+//
+int JnRevert(JnJournal *journal, unsigned char *image, const char *name);
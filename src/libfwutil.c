@@ -0,0 +1,1151 @@
+#include "libfwutil_internal.h"
+#include "blowfish.h"
+#include "journal.h"
+#include "thread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FW_RAM_VIEW_CACHE_SIZE 4
+
+typedef struct FwRamViewCacheEntry_ {
+	FirmwareRamView view;
+	unsigned char *image;                   // copy of the image the RAM view was built from
+	unsigned int size;
+	unsigned int lastUse;
+} FwRamViewCacheEntry;
+
+struct FwContext_ {
+	FwAllocator allocator;
+	char *path;
+	unsigned char *image;
+	unsigned int size;
+	JnJournal journal;
+	unsigned char savedDigest[16];          // MD5 of the image when it was last loaded or saved to its path
+	FwRamViewCacheEntry ramViews[FW_RAM_VIEW_CACHE_SIZE]; // views of recent states, so that undoing an edit does not decompress the modules again
+	unsigned int ramViewClock;
+};
+
+struct FwCompact_ {
+	FwAllocator allocator;
+	unsigned char digest[16];               // MD5 of the image the operation was prepared from
+	unsigned char header[0x200];            // flash header, for encrypting the static modules
+	unsigned char *data[FW_MODULE_COUNT];   // uncompressed modules
+	uint32_t dataSizes[FW_MODULE_COUNT];
+	uint32_t oldSizes[FW_MODULE_COUNT];
+	unsigned char *comp[FW_MODULE_COUNT];   // recompressed modules, as stored
+	uint32_t compSizes[FW_MODULE_COUNT];
+	CxEffort effort;
+};
+
+struct FwImport_ {
+	FwAllocator allocator;
+	unsigned char digest[16];
+	unsigned char header[0x200];
+	int module;
+	CxCompressionType type;
+	unsigned char *data;                    // module to compress, NULL if it was imported compressed
+	unsigned int dataSize;
+	unsigned char *mods[FW_MODULE_COUNT];   // modules to lay out, as stored
+	uint32_t modSizes[FW_MODULE_COUNT];
+	uint32_t oldSize;
+	CxEffort effort;
+};
+
+
+// ----- allocation
+
+static void *FwiDefaultAlloc(void *arg, size_t size) {
+	(void) arg;
+	return malloc(size);
+}
+
+static void FwiDefaultFree(void *arg, void *p) {
+	(void) arg;
+	free(p);
+}
+
+static const FwAllocator sDefaultAllocator = { FwiDefaultAlloc, FwiDefaultFree, NULL };
+
+static void *FwiAlloc(const FwAllocator *allocator, size_t size) {
+	void *p = allocator->alloc(allocator->arg, size);
+	if (p != NULL) memset(p, 0, size);
+	return p;
+}
+
+static void FwiFree(const FwAllocator *allocator, void *p) {
+	if (p != NULL) allocator->free(allocator->arg, p);
+}
+
+//
+// Copy data into memory from the allocator. Returns NULL if memory could not be allocated.
+//
+static void *FwiCopy(const FwAllocator *allocator, const void *data, size_t size) {
+	void *copy = allocator->alloc(allocator->arg, size > 0 ? size : 1);
+	if (copy != NULL && size > 0) memcpy(copy, data, size);
+	return copy;
+}
+
+static char *FwiCopyString(const FwAllocator *allocator, const char *str) {
+	return FwiCopy(allocator, str, strlen(str) + 1);
+}
+
+static void FwiFreeRamView(FwContext *ctx, FirmwareRamView *view) {
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		FwiFree(&ctx->allocator, view->modules[i].data);
+		FwiFree(&ctx->allocator, view->xrefs[i].calls);
+		FwiFree(&ctx->allocator, view->xrefs[i].literals);
+	}
+	memset(view, 0, sizeof(*view));
+}
+
+
+// ----- context
+
+FwContext *FwCreateContext(const FwAllocator *allocator) {
+	if (allocator == NULL) allocator = &sDefaultAllocator;
+	
+	FwContext *ctx = FwiAlloc(allocator, sizeof(FwContext));
+	if (ctx == NULL) return NULL;
+	ctx->allocator = *allocator;
+	return ctx;
+}
+
+static void FwiFreeImage(FwContext *ctx) {
+	FwiFree(&ctx->allocator, ctx->path);
+	FwiFree(&ctx->allocator, ctx->image);
+	JnFree(&ctx->journal);
+	ctx->path = NULL;
+	ctx->image = NULL;
+	ctx->size = 0;
+}
+
+void FwFreeContext(FwContext *ctx) {
+	if (ctx == NULL) return;
+	
+	FwiFreeImage(ctx);
+	for (int i = 0; i < FW_RAM_VIEW_CACHE_SIZE; i++) {
+		FwRamViewCacheEntry *entry = &ctx->ramViews[i];
+		if (entry->image == NULL) continue;
+		
+		FwiFreeRamView(ctx, &entry->view);
+		FwiFree(&ctx->allocator, entry->image);
+	}
+	FwiFree(&ctx->allocator, ctx);
+}
+
+const char *FwGetStatusString(FwStatus status) {
+	switch (status) {
+		case FW_OK:                   return "success";
+		case FW_ERR_IO:               return "the file could not be read or written";
+		case FW_ERR_INVALID_IMAGE:    return "not a valid firmware image";
+		case FW_ERR_NO_IMAGE:         return "no firmware image loaded";
+		case FW_ERR_INVALID_ARGUMENT: return "invalid argument";
+		case FW_ERR_CORRUPT_MODULE:   return "a module could not be decompressed";
+		case FW_ERR_NO_SPACE:         return "the modules do not fit in the image";
+		case FW_ERR_CANCELLED:        return "cancelled";
+		case FW_ERR_STALE:            return "the image changed";
+		case FW_ERR_NO_MEMORY:        return "out of memory";
+		case FW_ERR_NOT_FOUND:        return "not found";
+	}
+	return "unknown error";
+}
+
+//
+// Take ownership of an image buffer allocated with the context's allocator.
+//
+static FwStatus FwiSetImage(FwContext *ctx, unsigned char *buf, unsigned int size, const char *path) {
+	if (size < (4 * 1024)) {
+		FwiFree(&ctx->allocator, buf);
+		return FW_ERR_INVALID_IMAGE;
+	}
+	
+	//a loaded image starts with an empty history. The context is only changed once everything is
+	//allocated.
+	JnAllocator jnAllocator = { ctx->allocator.alloc, ctx->allocator.free, ctx->allocator.arg };
+	JnJournal journal;
+	char *pathCopy = path != NULL ? FwiCopyString(&ctx->allocator, path) : NULL;
+	if ((path != NULL && pathCopy == NULL) || !JnInit(&journal, buf, size, &jnAllocator)) {
+		FwiFree(&ctx->allocator, pathCopy);
+		FwiFree(&ctx->allocator, buf);
+		return FW_ERR_NO_MEMORY;
+	}
+	
+	FwiFreeImage(ctx);
+	ctx->image = buf;
+	ctx->size = size;
+	ctx->path = pathCopy;
+	ctx->journal = journal;
+	ComputeMd5(ctx->image, ctx->size, ctx->savedDigest);
+	return FW_OK;
+}
+
+FwStatus FwLoadFile(FwContext *ctx, const char *path) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) return FW_ERR_IO;
+	
+	//directories and unseekable files have no size
+	long end = -1;
+	if (fseek(fp, 0, SEEK_END) == 0) end = ftell(fp);
+	if (end < 0 || fseek(fp, 0, SEEK_SET) != 0) {
+		fclose(fp);
+		return FW_ERR_IO;
+	}
+	unsigned int size = end;
+	
+	unsigned char *buf = FwiAlloc(&ctx->allocator, size);
+	if (buf == NULL || fread(buf, 1, size, fp) != size) {
+		FwiFree(&ctx->allocator, buf);
+		fclose(fp);
+		return buf == NULL ? FW_ERR_NO_MEMORY : FW_ERR_IO;
+	}
+	fclose(fp);
+	
+	return FwiSetImage(ctx, buf, size, path);
+}
+
+FwStatus FwLoadImage(FwContext *ctx, const unsigned char *data, unsigned int size, const char *path) {
+	unsigned char *buf = FwiCopy(&ctx->allocator, data, size);
+	if (buf == NULL) return FW_ERR_NO_MEMORY;
+	
+	return FwiSetImage(ctx, buf, size, path);
+}
+
+FwStatus FwSaveFile(FwContext *ctx, const char *path) {
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	if (path == NULL) path = ctx->path;
+	if (path == NULL) return FW_ERR_INVALID_ARGUMENT;
+	
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) return FW_ERR_IO;
+	
+	int ok = fwrite(ctx->image, 1, ctx->size, fp) == ctx->size;
+	fclose(fp);
+	if (!ok) return FW_ERR_IO;
+	
+	if (ctx->path != NULL && strcmp(path, ctx->path) == 0) ComputeMd5(ctx->image, ctx->size, ctx->savedDigest);
+	return FW_OK;
+}
+
+int FwIsModified(FwContext *ctx) {
+	if (ctx->image == NULL) return 0;
+	
+	unsigned char current[16];
+	ComputeMd5(ctx->image, ctx->size, current);
+	return memcmp(current, ctx->savedDigest, sizeof(current)) != 0;
+}
+
+const char *FwGetPath(const FwContext *ctx) {
+	return ctx->path;
+}
+
+unsigned char *FwGetImage(FwContext *ctx, unsigned int *pSize) {
+	*pSize = ctx->size;
+	return ctx->image;
+}
+
+//
+// Build the RAM view of the image in memory from the context's allocator. The decoders and the index
+// allocate as they go, so the view is built with malloc and then copied. Returns 0 if memory could not
+// be allocated.
+//
+static int FwiBuildRamView(FwContext *ctx, FirmwareRamView *view) {
+	FirmwareRamView built;
+	BuildFirmwareRamView(ctx->image, ctx->size, &built);
+	
+	*view = built;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		view->modules[i].data = NULL;
+		view->xrefs[i].calls = NULL;
+		view->xrefs[i].literals = NULL;
+	}
+	
+	int ok = 1;
+	for (int i = 0; i < FW_MODULE_COUNT && ok; i++) {
+		const FirmwareModule *mod = &built.modules[i];
+		const XrIndex *xrefs = &built.xrefs[i];
+		if (mod->data != NULL) {
+			view->modules[i].data = FwiCopy(&ctx->allocator, mod->data, mod->uncompressed);
+			ok = view->modules[i].data != NULL;
+		}
+		if (ok && xrefs->calls != NULL) {
+			view->xrefs[i].calls = FwiCopy(&ctx->allocator, xrefs->calls, xrefs->nCalls * sizeof(XrRef));
+			ok = view->xrefs[i].calls != NULL;
+		}
+		if (ok && xrefs->literals != NULL) {
+			view->xrefs[i].literals = FwiCopy(&ctx->allocator, xrefs->literals, xrefs->nLiterals * sizeof(XrRef));
+			ok = view->xrefs[i].literals != NULL;
+		}
+	}
+	
+	FreeFirmwareRamView(&built);
+	if (!ok) FwiFreeRamView(ctx, view);
+	return ok;
+}
+
+const FirmwareRamView *FwGetRamView(FwContext *ctx) {
+	if (ctx->image == NULL) return NULL;
+	
+	//comparing the image is much cheaper than decompressing the modules again
+	FwRamViewCacheEntry *entry = NULL;
+	for (int i = 0; i < FW_RAM_VIEW_CACHE_SIZE; i++) {
+		FwRamViewCacheEntry *cand = &ctx->ramViews[i];
+		if (cand->image != NULL && cand->size == ctx->size && memcmp(cand->image, ctx->image, ctx->size) == 0) {
+			cand->lastUse = ++ctx->ramViewClock;
+			return &cand->view;
+		}
+		
+		//replace an unused entry, or else the least recently used
+		if (entry == NULL || (entry->image != NULL && (cand->image == NULL || cand->lastUse < entry->lastUse))) entry = cand;
+	}
+	
+	FirmwareRamView view;
+	unsigned char *image = FwiCopy(&ctx->allocator, ctx->image, ctx->size);
+	if (image == NULL) return NULL;
+	if (!FwiBuildRamView(ctx, &view)) {
+		FwiFree(&ctx->allocator, image);
+		return NULL;
+	}
+	
+	if (entry->image != NULL) {
+		FwiFreeRamView(ctx, &entry->view);
+		FwiFree(&ctx->allocator, entry->image);
+	}
+	entry->view = view;
+	entry->image = image;
+	entry->size = ctx->size;
+	entry->lastUse = ++ctx->ramViewClock;
+	return &entry->view;
+}
+
+
+// ----- edit history
+
+FwStatus FwCommit(FwContext *ctx, const char *label, unsigned int *pnPages) {
+	if (pnPages != NULL) *pnPages = 0;
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	int nPages = JnCommit(&ctx->journal, ctx->image, label);
+	if (nPages < 0) return FW_ERR_NO_MEMORY;
+	if (pnPages != NULL) *pnPages = nPages;
+	return FW_OK;
+}
+
+static FwStatus FwiDescribeEdit(const JnEntry *entry, FwEditInfo *edit) {
+	if (entry == NULL) return FW_ERR_NOT_FOUND;
+	
+	edit->label = entry->label;
+	edit->nPages = entry->nChanges;
+	return FW_OK;
+}
+
+FwStatus FwUndo(FwContext *ctx, FwEditInfo *edit) {
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	return FwiDescribeEdit(JnUndo(&ctx->journal, ctx->image), edit);
+}
+
+FwStatus FwRedo(FwContext *ctx, FwEditInfo *edit) {
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	return FwiDescribeEdit(JnRedo(&ctx->journal, ctx->image), edit);
+}
+
+FwStatus FwTakeSnapshot(FwContext *ctx, const char *name) {
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	return JnTakeSnapshot(&ctx->journal, name) ? FW_OK : FW_ERR_NO_MEMORY;
+}
+
+FwStatus FwRevert(FwContext *ctx, const char *name, unsigned int *pnPages) {
+	if (pnPages != NULL) *pnPages = 0;
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	int nPages = JnRevert(&ctx->journal, ctx->image, name);
+	if (nPages == -1) return FW_ERR_NOT_FOUND;
+	if (nPages < 0) return FW_ERR_NO_MEMORY;
+	if (pnPages != NULL) *pnPages = nPages;
+	return FW_OK;
+}
+
+unsigned int FwGetSnapshotCount(const FwContext *ctx) {
+	return ctx->journal.nSnapshots;
+}
+
+FwStatus FwGetSnapshot(const FwContext *ctx, unsigned int index, FwSnapshotInfo *info) {
+	if (index >= ctx->journal.nSnapshots) return FW_ERR_NOT_FOUND;
+	
+	const JnSnapshot *snapshot = &ctx->journal.snapshots[index];
+	info->name = snapshot->name;
+	info->nPagesDiffer = JnCountSnapshotChanges(&ctx->journal, snapshot);
+	return FW_OK;
+}
+
+
+// ----- info
+
+FwStatus FwGetInfo(FwContext *ctx, FwInfo *info) {
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	const FirmwareRamView *view = FwGetRamView(ctx);
+	if (view == NULL) return FW_ERR_NO_MEMORY;
+	const FlashHeader *hdr = (const FlashHeader *) ctx->image;
+	
+	memset(info, 0, sizeof(*info));
+	info->imageSize = ctx->size;
+	info->ipl2Type = hdr->ipl2Type;
+	info->moduleLimit = GetFirmwareModuleLimit(ctx->image, ctx->size);
+	
+	uint32_t romAddrs[FW_MODULE_COUNT], sizes[FW_MODULE_COUNT];
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		const FirmwareModule *mod = &view->modules[i];
+		info->modules[i].romAddr = mod->romAddr;
+		info->modules[i].ramAddr = mod->ramAddr;
+		info->modules[i].size = mod->size;
+		info->modules[i].uncompressed = mod->uncompressed;
+		info->modules[i].type = mod->type;
+		info->modules[i].valid = mod->data != NULL;
+		romAddrs[i] = view->modules[i].romAddr;
+		sizes[i] = view->modules[i].size;
+	}
+	info->largestFree = GetLargestFreeRegion(romAddrs, sizes, info->moduleLimit);
+	return FW_OK;
+}
+
+
+// ----- export
+
+FwStatus FwExportModule(FwContext *ctx, int module, int form, unsigned char **pData, unsigned int *pSize) {
+	*pData = NULL;
+	*pSize = 0;
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	if (module < 0 || module >= FW_MODULE_COUNT || form < FW_FORM_UNCOMPRESSED || form > FW_FORM_STORED) return FW_ERR_INVALID_ARGUMENT;
+	
+	//the RAM view holds the decompressed modules, and tells where the compressed ones end
+	const FirmwareRamView *view = FwGetRamView(ctx);
+	if (view == NULL) return FW_ERR_NO_MEMORY;
+	const FirmwareModule *mod = &view->modules[module];
+	if (mod->data == NULL) return FW_ERR_CORRUPT_MODULE;
+	
+	const unsigned char *src = form == FW_FORM_UNCOMPRESSED ? mod->data : ctx->image + mod->romAddr;
+	unsigned int size = form == FW_FORM_UNCOMPRESSED ? mod->uncompressed : mod->size;
+	
+	unsigned char *data = FwiCopy(&ctx->allocator, src, size);
+	if (data == NULL) return FW_ERR_NO_MEMORY;
+	
+	int isStatic = module == FW_MODULE_ARM9_STATIC || module == FW_MODULE_ARM7_STATIC;
+	if (form == FW_FORM_COMPRESSED && isStatic) BfDecrypt(data, size, ctx->image);
+	
+	*pData = data;
+	*pSize = size;
+	return FW_OK;
+}
+
+void FwFreeData(FwContext *ctx, void *data) {
+	FwiFree(&ctx->allocator, data);
+}
+
+
+// ----- operations
+
+static const CxEffort sDefaultEffort = { CX_ASH_DEFAULT_PASSES, 0, 0.0, NULL };
+
+static FwStatus FwiCheckImage(FwContext *ctx, const unsigned char *digest) {
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	unsigned char current[16];
+	ComputeMd5(ctx->image, ctx->size, current);
+	return memcmp(current, digest, sizeof(current)) == 0 ? FW_OK : FW_ERR_STALE;
+}
+
+static FwStatus FwiCompressionFailed(const CxProgress *progress) {
+	return (progress != NULL && progress->cancel) ? FW_ERR_CANCELLED : FW_ERR_CORRUPT_MODULE;
+}
+
+//
+// Compress a module as it is stored in flash, into memory from the allocator: the static modules are LZ
+// compressed and encrypted with the key of the flash header, the others compressed with the given type.
+// The result is padded to 8 bytes.
+//
+static FwStatus FwiCompressModule(const FwAllocator *allocator, const unsigned char *header, int module, CxCompressionType type, const unsigned char *data, unsigned int size, const CxEffort *effort, unsigned char **pComp, unsigned int *pCompSize) {
+	*pComp = NULL;
+	*pCompSize = 0;
+	int isStatic = module == FW_MODULE_ARM9_STATIC || module == FW_MODULE_ARM7_STATIC;
+	int isAsh = !isStatic && type == CX_COMPRESSION_ASH;
+	
+	//the bound leaves room for the padding
+	unsigned int capacity = (isAsh ? CxCompressAshFirmwareBound(size) : CxCompressLZBound(size)) + 8;
+	unsigned char *comp = allocator->alloc(allocator->arg, capacity);
+	if (comp == NULL) return FW_ERR_NO_MEMORY;
+	
+	unsigned int compSize;
+	int ok;
+	if (isAsh) ok = CxCompressAshFirmwareInto(data, size, effort, comp, capacity, &compSize);
+	else ok = CxCompressLZInto(data, size, effort, comp, capacity, &compSize);
+	if (!ok || !CxPadCompressedInto(comp, compSize, capacity, 8, &compSize)) {
+		FwiFree(allocator, comp);
+		return FwiCompressionFailed(effort->progress);
+	}
+	
+	if (isStatic) BfEncrypt(comp, compSize, header);
+	*pComp = comp;
+	*pCompSize = compSize;
+	return FW_OK;
+}
+
+FwStatus FwBeginCompact(FwContext *ctx, const CxEffort *effort, FwCompact **pCompact) {
+	*pCompact = NULL;
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	const FirmwareRamView *view = FwGetRamView(ctx);
+	if (view == NULL) return FW_ERR_NO_MEMORY;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (view->modules[i].data == NULL) return FW_ERR_CORRUPT_MODULE;
+	}
+	
+	FwCompact *compact = FwiAlloc(&ctx->allocator, sizeof(FwCompact));
+	if (compact == NULL) return FW_ERR_NO_MEMORY;
+	compact->allocator = ctx->allocator;
+	compact->effort = effort != NULL ? *effort : sDefaultEffort;
+	compact->effort.progress = NULL;
+	ComputeMd5(ctx->image, ctx->size, compact->digest);
+	memcpy(compact->header, ctx->image, sizeof(compact->header));
+	
+	//the modules are copied, since the view may be rebuilt while they are compressed
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		const FirmwareModule *mod = &view->modules[i];
+		compact->data[i] = FwiCopy(&ctx->allocator, mod->data, mod->uncompressed);
+		if (compact->data[i] == NULL) {
+			FwFreeCompact(compact);
+			return FW_ERR_NO_MEMORY;
+		}
+		compact->dataSizes[i] = mod->uncompressed;
+		compact->oldSizes[i] = mod->size;
+	}
+	
+	*pCompact = compact;
+	return FW_OK;
+}
+
+FwStatus FwRunCompactModule(FwCompact *compact, int module, CxProgress *progress) {
+	if (module < 0 || module >= FW_MODULE_COUNT) return FW_ERR_INVALID_ARGUMENT;
+	if (compact->comp[module] != NULL) return FW_OK;
+	
+	CxEffort effort = compact->effort;
+	effort.progress = progress;
+	
+	//the static modules are LZ compressed and encrypted, the others ASH compressed
+	return FwiCompressModule(&compact->allocator, compact->header, module, CX_COMPRESSION_ASH, compact->data[module], compact->dataSizes[module], &effort,
+		&compact->comp[module], &compact->compSizes[module]);
+}
+
+FwStatus FwApplyCompact(FwContext *ctx, FwCompact *compact, FwCompactResult *result) {
+	FwStatus status = FwiCheckImage(ctx, compact->digest);
+	if (status != FW_OK) return status;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (compact->comp[i] == NULL) return FW_ERR_INVALID_ARGUMENT;
+	}
+	
+	if (result != NULL) {
+		memcpy(result->oldSizes, compact->oldSizes, sizeof(result->oldSizes));
+		memcpy(result->newSizes, compact->compSizes, sizeof(result->newSizes));
+	}
+	
+	if (!RelayoutFirmwareModules(ctx->image, ctx->size, compact->comp, compact->compSizes)) return FW_ERR_NO_SPACE;
+	return FW_OK;
+}
+
+void FwFreeCompact(FwCompact *compact) {
+	if (compact == NULL) return;
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		FwiFree(&compact->allocator, compact->data[i]);
+		FwiFree(&compact->allocator, compact->comp[i]);
+	}
+	FwiFree(&compact->allocator, compact);
+}
+
+FwStatus FwCompactImage(FwContext *ctx, const CxEffort *effort, FwCompactResult *result) {
+	FwCompact *compact;
+	FwStatus status = FwBeginCompact(ctx, effort, &compact);
+	for (int i = 0; i < FW_MODULE_COUNT && status == FW_OK; i++) {
+		status = FwRunCompactModule(compact, i, effort != NULL ? effort->progress : NULL);
+	}
+	if (status == FW_OK) status = FwApplyCompact(ctx, compact, result);
+	
+	FwFreeCompact(compact);
+	return status;
+}
+
+FwStatus FwBeginImport(FwContext *ctx, int module, int form, const unsigned char *data, unsigned int size, const CxEffort *effort, unsigned int flags, FwImport **pImport) {
+	*pImport = NULL;
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	if (module < 0 || module >= FW_MODULE_COUNT || form < FW_FORM_UNCOMPRESSED || form > FW_FORM_STORED) return FW_ERR_INVALID_ARGUMENT;
+	
+	//the other modules are moved as they are stored, so only the one being replaced may be corrupt
+	const FirmwareRamView *view = FwGetRamView(ctx);
+	if (view == NULL) return FW_ERR_NO_MEMORY;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (i != module && view->modules[i].data == NULL) return FW_ERR_CORRUPT_MODULE;
+	}
+	
+	FwImport *import = FwiAlloc(&ctx->allocator, sizeof(FwImport));
+	if (import == NULL) return FW_ERR_NO_MEMORY;
+	import->allocator = ctx->allocator;
+	import->module = module;
+	import->effort = effort != NULL ? *effort : sDefaultEffort;
+	import->effort.progress = NULL;
+	import->oldSize = view->modules[module].size;
+	ComputeMd5(ctx->image, ctx->size, import->digest);
+	memcpy(import->header, ctx->image, sizeof(import->header));
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (i == module) continue;
+		
+		import->mods[i] = FwiCopy(&ctx->allocator, ctx->image + view->modules[i].romAddr, view->modules[i].size);
+		if (import->mods[i] == NULL) {
+			FwFreeImport(import);
+			return FW_ERR_NO_MEMORY;
+		}
+		import->modSizes[i] = view->modules[i].size;
+	}
+	
+	//a module that cannot be read keeps the compression type its header byte names
+	int isStatic = module == FW_MODULE_ARM9_STATIC || module == FW_MODULE_ARM7_STATIC;
+	if (isStatic) import->type = CX_COMPRESSION_NONE;
+	else if (view->modules[module].data != NULL) import->type = view->modules[module].type;
+	else import->type = ctx->image[view->modules[module].romAddr] == 0x10 ? CX_COMPRESSION_LZ : CX_COMPRESSION_ASH;
+	
+	if (form == FW_FORM_UNCOMPRESSED) {
+		//with FW_IMPORT_FIT, the space the module can take is the same space the layout checks it against
+		if (flags & FW_IMPORT_FIT) import->effort.targetSize = GetFirmwareModuleCapacity(ctx->image, ctx->size, import->modSizes, module);
+		import->data = FwiCopy(&ctx->allocator, data, size);
+		if (import->data == NULL) {
+			FwFreeImport(import);
+			return FW_ERR_NO_MEMORY;
+		}
+		import->dataSize = size;
+	} else {
+		//compressed modules are padded to 8 bytes, and the static modules must be encrypted
+		unsigned int padSize = (size + 7) & ~7;
+		import->mods[module] = FwiAlloc(&ctx->allocator, padSize);
+		if (import->mods[module] == NULL) {
+			FwFreeImport(import);
+			return FW_ERR_NO_MEMORY;
+		}
+		memcpy(import->mods[module], data, size);
+		import->modSizes[module] = padSize;
+		if (form == FW_FORM_COMPRESSED && isStatic) BfEncrypt(import->mods[module], padSize, import->header);
+	}
+	
+	*pImport = import;
+	return FW_OK;
+}
+
+FwStatus FwRunImport(FwImport *import, CxProgress *progress) {
+	if (import->mods[import->module] != NULL) return FW_OK;
+	
+	CxEffort effort = import->effort;
+	effort.progress = progress;
+	
+	return FwiCompressModule(&import->allocator, import->header, import->module, import->type, import->data, import->dataSize, &effort,
+		&import->mods[import->module], &import->modSizes[import->module]);
+}
+
+FwStatus FwApplyImport(FwContext *ctx, FwImport *import, FwImportResult *result) {
+	FwStatus status = FwiCheckImage(ctx, import->digest);
+	if (status != FW_OK) return status;
+	if (import->mods[import->module] == NULL) return FW_ERR_INVALID_ARGUMENT;
+	
+	//the modules are laid out in a copy, so that an image whose CRCs cannot be updated is left as it was
+	unsigned char *image = FwiCopy(&ctx->allocator, ctx->image, ctx->size);
+	if (image == NULL) return FW_ERR_NO_MEMORY;
+	if (!RelayoutFirmwareModules(image, ctx->size, import->mods, import->modSizes)) {
+		FwiFree(&ctx->allocator, image);
+		return FW_ERR_NO_SPACE;
+	}
+	if (!UpdateFirmwareModuleChecksumsEx(image, ctx->size, FW_MODULE_MASK_ALL)) {
+		FwiFree(&ctx->allocator, image);
+		return FW_ERR_CORRUPT_MODULE;
+	}
+	memcpy(ctx->image, image, ctx->size);
+	FwiFree(&ctx->allocator, image);
+	
+	if (result != NULL) {
+		result->oldSize = import->oldSize;
+		result->newSize = import->modSizes[import->module];
+		GetFirmwareModuleRomAddrs(ctx->image, result->romAddrs);
+	}
+	return FW_OK;
+}
+
+void FwFreeImport(FwImport *import) {
+	if (import == NULL) return;
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		FwiFree(&import->allocator, import->mods[i]);
+	}
+	FwiFree(&import->allocator, import->data);
+	FwiFree(&import->allocator, import);
+}
+
+FwStatus FwImportModule(FwContext *ctx, int module, int form, const unsigned char *data, unsigned int size, const CxEffort *effort, unsigned int flags, FwImportResult *result) {
+	FwImport *import;
+	FwStatus status = FwBeginImport(ctx, module, form, data, size, effort, flags, &import);
+	if (status == FW_OK) status = FwRunImport(import, effort != NULL ? effort->progress : NULL);
+	if (status == FW_OK) status = FwApplyImport(ctx, import, result);
+	
+	FwFreeImport(import);
+	return status;
+}
+
+
+// ----- verification
+
+typedef struct FwVerifyState_ {
+	const unsigned char *buffer;
+	unsigned int size;
+	FirmwareModule mods[FW_MODULE_COUNT];
+	int tasks[FW_MODULE_COUNT];             // modules to decode
+	uint16_t crcs[FW_CRC_COUNT];
+	int checked[FW_CRC_COUNT];              // CRCs whose modules were all decoded
+} FwVerifyState;
+
+static void FwiVerifyDecodeTask(unsigned int task, void *arg) {
+	FwVerifyState *state = (FwVerifyState *) arg;
+	int module = state->tasks[task];
+	FirmwareModule *mod = &state->mods[module];
+	
+	mod->type = CX_COMPRESSION_LZ;
+	switch (module) {
+		case FW_MODULE_ARM9_STATIC:
+			mod->data = GetArm9StaticInfo(state->buffer, state->size, &mod->romAddr, &mod->ramAddr, &mod->size, &mod->uncompressed);
+			break;
+		case FW_MODULE_ARM7_STATIC:
+			mod->data = GetArm7StaticInfo(state->buffer, state->size, &mod->romAddr, &mod->ramAddr, &mod->size, &mod->uncompressed);
+			break;
+		case FW_MODULE_ARM9_SECONDARY:
+			mod->data = GetArm9SecondaryInfo(state->buffer, state->size, &mod->romAddr, &mod->ramAddr, &mod->size, &mod->uncompressed, &mod->type);
+			break;
+		case FW_MODULE_ARM7_SECONDARY:
+			mod->data = GetArm7SecondaryInfo(state->buffer, state->size, &mod->romAddr, &mod->ramAddr, &mod->size, &mod->uncompressed, &mod->type);
+			break;
+		case FW_MODULE_RESOURCES:
+			mod->data = GetResourcesPackInfo(state->buffer, state->size, &mod->romAddr, &mod->ramAddr, &mod->size, &mod->uncompressed, &mod->type);
+			break;
+	}
+}
+
+//
+// Compute a header CRC from the decompressed modules. Returns 0 if one of them could not be decompressed.
+//
+static int FwiComputeHeaderCrc(const FirmwareModule *mods, int crc, uint16_t *pCrc) {
+	const FirmwareModule *arm9Static = &mods[FW_MODULE_ARM9_STATIC], *arm7Static = &mods[FW_MODULE_ARM7_STATIC];
+	const FirmwareModule *arm9Secondary = &mods[FW_MODULE_ARM9_SECONDARY], *arm7Secondary = &mods[FW_MODULE_ARM7_SECONDARY];
+	const FirmwareModule *rsrc = &mods[FW_MODULE_RESOURCES];
+	
+	switch (crc) {
+		case FW_CRC_STATIC:
+			if (arm9Static->data == NULL || arm7Static->data == NULL) return 0;
+			*pCrc = ComputeStaticCrc(arm9Static->data, arm9Static->uncompressed, arm7Static->data, arm7Static->uncompressed);
+			return 1;
+		case FW_CRC_SECONDARY:
+			if (arm9Secondary->data == NULL || arm7Secondary->data == NULL) return 0;
+			*pCrc = ComputeSecondaryCrc(arm9Secondary->data, arm9Secondary->uncompressed, arm7Secondary->data, arm7Secondary->uncompressed);
+			return 1;
+		case FW_CRC_RESOURCES:
+			if (rsrc->data == NULL) return 0;
+			*pCrc = ComputeCrc(rsrc->data, rsrc->uncompressed, 0xFFFF);
+			return 1;
+	}
+	return 0;
+}
+
+static void FwiVerifyCrcTask(unsigned int task, void *arg) {
+	FwVerifyState *state = (FwVerifyState *) arg;
+	state->checked[task] = FwiComputeHeaderCrc(state->mods, task, &state->crcs[task]);
+}
+
+static uint16_t FwiGetHeaderCrc(const unsigned char *buffer, int crc) {
+	const FlashHeader *hdr = (const FlashHeader *) buffer;
+	if (crc == FW_CRC_STATIC) return hdr->staticCrc;
+	if (crc == FW_CRC_SECONDARY) return hdr->secondaryCrc;
+	return hdr->resourceCrc;
+}
+
+static void FwiSetHeaderCrc(unsigned char *buffer, int crc, uint16_t value) {
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	if (crc == FW_CRC_STATIC) hdr->staticCrc = value;
+	else if (crc == FW_CRC_SECONDARY) hdr->secondaryCrc = value;
+	else hdr->resourceCrc = value;
+}
+
+static int FwiIsArm7Accessible(uint32_t addr, uint32_t size) {
+	//address must be in WRAM or main memory
+	if (addr <  0x02000000) return 0;
+	if (addr >= 0x04000000) return 0;
+	if ((addr + size) < addr) return 0;
+	if ((addr + size) >= 0x04000000) return 0;
+	
+	return 1;
+}
+
+FwStatus FwVerify(FwContext *ctx, const FwVerifyOptions *options, FwVerifyResult *result) {
+	memset(result, 0, sizeof(*result));
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	unsigned char *buffer = ctx->image;
+	unsigned int size = ctx->size;
+	const FlashHeader *hdr = (const FlashHeader *) buffer;
+	const FlashRfBbInfo *wl = (const FlashRfBbInfo *) (buffer + 0x2A);
+	unsigned int trusted = options != NULL ? options->trustedModules : 0;
+	int nThreads = (options != NULL && options->nThreads > 0) ? options->nThreads : ThGetProcessorCount();
+	
+	FwVerifyState state;
+	memset(&state, 0, sizeof(state));
+	state.buffer = buffer;
+	state.size = size;
+	
+	//trusted modules are not decoded, so their sizes come from the caller
+	if (trusted) {
+		for (int i = 0; i < FW_MODULE_COUNT; i++) {
+			if (trusted & (1 << i)) state.mods[i].uncompressed = options->trustedUncompressed[i];
+		}
+		GetFirmwareStaticRamAddrs(buffer, &state.mods[FW_MODULE_ARM9_STATIC].ramAddr, &state.mods[FW_MODULE_ARM7_STATIC].ramAddr);
+	}
+	
+	//unpack the modules, then compute their checksums. The modules are independent, so each is its own
+	//task.
+	int nTasks = 0;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (!(trusted & (1 << i))) state.tasks[nTasks++] = i;
+	}
+	ThRunTasks(FwiVerifyDecodeTask, &state, nTasks, nThreads);
+	ThRunTasks(FwiVerifyCrcTask, &state, FW_CRC_COUNT, nThreads);
+	
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		int ok = state.mods[i].data != NULL || (trusted & (1 << i));
+		if (!ok) result->corruptModules |= 1 << i;
+		if (ok) result->uncompressed[i] = state.mods[i].uncompressed;
+		
+		int isStatic = i == FW_MODULE_ARM9_STATIC || i == FW_MODULE_ARM7_STATIC;
+		if (isStatic && ok && !FwiIsArm7Accessible(state.mods[i].ramAddr, state.mods[i].uncompressed)) result->badLoadAddrs |= 1 << i;
+	}
+	
+	//trusted modules were decoded with these CRCs before, and are not checked again
+	for (int i = 0; i < FW_CRC_COUNT; i++) {
+		result->headerCrcs[i] = FwiGetHeaderCrc(buffer, i);
+		if (!state.checked[i]) continue;
+		
+		result->computedCrcs[i] = state.crcs[i];
+		result->checkedCrcs |= 1 << i;
+		if (state.crcs[i] != result->headerCrcs[i]) result->badCrcs |= 1 << i;
+	}
+	
+	//validate wireless info
+	int isValidChannels = ((wl->allowedChannel & 0x8001) == 0) && ((wl->allowedChannel & 0x7FFE) != 0);
+	uint16_t wlCrc = 0;
+	if ((wl->tableSize + 0x2C) <= 0x200 || wl->tableSize < sizeof(*wl)) {
+		wlCrc = ComputeCrc(&wl->tableSize, wl->tableSize, 0);
+	} else {
+		result->tableErrors |= FW_VERIFY_WL_TABLE_SIZE;
+	}
+	if (wlCrc != wl->crc) result->tableErrors |= FW_VERIFY_WL_CRC;
+	if (!IsValidRfType(wl->rfType)) result->tableErrors |= FW_VERIFY_RF_TYPE;
+	if (!isValidChannels) result->tableErrors |= FW_VERIFY_CHANNELS;
+	
+	//validate user configuration
+	uint32_t ncdAddr = hdr->nvramUserConfigAddr * 8;
+	if (ncdAddr < size && (ncdAddr + 0x200) <= size) {
+		//copies that are not version 5 are ignored by the firmware, so they are not checked
+		for (int i = 0; i < 2; i++) {
+			FlashUserConfigData *ncd = (FlashUserConfigData *) (buffer + ncdAddr + i * 0x100);
+			if (ncd->version != 5) continue;
+			
+			if (ncd->crc != ComputeCrc(ncd, FLASH_NCD_SIZE - 4, 0xFFFF)) result->badUserConfigs |= 1 << i;
+			if (HasExConfig(hdr->ipl2Type) && ncd->exVersion == 1 && ncd->exCrc != ComputeCrc(&ncd->exVersion, FLASH_NCD_EX_SIZE - 2, 0xFFFF)) {
+				result->badExUserConfigs |= 1 << i;
+			}
+		}
+	} else {
+		result->tableErrors |= FW_VERIFY_USER_CONFIG_ADDR;
+	}
+	
+	unsigned int masks[] = { result->corruptModules, result->badLoadAddrs, result->badCrcs, result->tableErrors, result->badUserConfigs, result->badExUserConfigs };
+	for (unsigned int i = 0; i < sizeof(masks) / sizeof(masks[0]); i++) {
+		for (unsigned int m = masks[i]; m != 0; m &= m - 1) result->nErrors++;
+	}
+	
+	FreeFirmwareModules(state.mods);
+	return FW_OK;
+}
+
+
+// ----- edits
+
+static void FwiAddCorrection(FwFixResult *result, int field, int index, uint16_t oldCrc, uint16_t newCrc) {
+	FwCorrection *correction = &result->corrections[result->nCorrections++];
+	correction->field = field;
+	correction->index = index;
+	correction->oldCrc = oldCrc;
+	correction->newCrc = newCrc;
+}
+
+FwStatus FwFixChecksums(FwContext *ctx, FwFixResult *result) {
+	memset(result, 0, sizeof(*result));
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	const FirmwareRamView *view = FwGetRamView(ctx);
+	if (view == NULL) return FW_ERR_NO_MEMORY;
+	
+	unsigned char *buffer = ctx->image;
+	unsigned int size = ctx->size;
+	FlashHeader *hdr = (FlashHeader *) buffer;
+	FlashRfBbInfo *wl = (FlashRfBbInfo *) (buffer + 0x2A);
+	
+	//module CRCs
+	for (int i = 0; i < FW_CRC_COUNT; i++) {
+		uint16_t crc;
+		if (!FwiComputeHeaderCrc(view->modules, i, &crc)) {
+			result->uncheckedCrcs |= 1 << i;
+			continue;
+		}
+		
+		uint16_t oldCrc = FwiGetHeaderCrc(buffer, i);
+		if (crc == oldCrc) continue;
+		FwiSetHeaderCrc(buffer, i, crc);
+		FwiAddCorrection(result, FW_FIELD_STATIC_CRC + i, 0, oldCrc, crc);
+	}
+	
+	//wireless table CRC
+	uint16_t wlCrc = ComputeCrc(buffer + 0x2A + 2, wl->tableSize, 0);
+	if (wl->tableSize < (0x200 - 0x2E) && wl->crc != wlCrc) {
+		FwiAddCorrection(result, FW_FIELD_WIRELESS_CRC, 0, wl->crc, wlCrc);
+		wl->crc = wlCrc;
+	}
+	
+	int hasExConfig = HasExConfig(hdr->ipl2Type);
+	int hasTwlConfig = HasTwlSettings(hdr->ipl2Type);
+	unsigned int ncdAddr = hdr->nvramUserConfigAddr * 8;
+	
+	//connection settings CRCs
+	if (ncdAddr >= 0x400) {
+		unsigned int connAddr = ncdAddr - 0x400;
+		for (int i = 0; i < 3; i++) {
+			FlashConnSetting *conn = (FlashConnSetting *) (buffer + connAddr + i * 0x100);
+			if (conn->setType == 0xFF) continue;
+			
+			uint16_t crc = ComputeCrc(conn, sizeof(FlashConnSetting) - 2, 0);
+			if (crc == conn->crc) continue;
+			FwiAddCorrection(result, FW_FIELD_CONNECTION_CRC, i, conn->crc, crc);
+			conn->crc = crc;
+		}
+		
+		if (hasTwlConfig && connAddr >= 0x600) {
+			unsigned int connExAddr = connAddr - 0x600;
+			for (int i = 0; i < 3; i++) {
+				FlashConnExSetting *conn = (FlashConnExSetting *) (buffer + connExAddr + i * 0x200);
+				if (conn->base.setType == 0xFF) continue;
+				
+				uint16_t crc = ComputeCrc(&conn->base, sizeof(FlashConnSetting) - 2, 0);
+				if (crc != conn->base.crc) {
+					FwiAddCorrection(result, FW_FIELD_CONNECTION_CRC, i + 3, conn->base.crc, crc);
+					conn->base.crc = crc;
+				}
+				
+				uint16_t exCrc = ComputeCrc(&conn->base + 1, sizeof(FlashConnExSetting) - sizeof(FlashConnSetting) - 2, 0);
+				if (exCrc != conn->exCrc) {
+					FwiAddCorrection(result, FW_FIELD_CONNECTION_EX_CRC, i + 3, conn->exCrc, exCrc);
+					conn->exCrc = exCrc;
+				}
+			}
+		}
+	}
+	
+	//user configuration CRCs. Only version 5 is supported.
+	if (ncdAddr < size && (ncdAddr + 0x200) < size) {
+		for (int i = 0; i < 2; i++) {
+			FlashUserConfigData *ncd = (FlashUserConfigData *) (buffer + ncdAddr + i * 0x100);
+			result->userConfigVersions[i] = ncd->version;
+			if (ncd->version != 5) {
+				result->unsupportedUserConfigs |= 1 << i;
+				continue;
+			}
+			
+			uint16_t crc = ComputeCrc(ncd, FLASH_NCD_SIZE - 4, 0xFFFF);
+			if (crc != ncd->crc) {
+				FwiAddCorrection(result, FW_FIELD_USER_CONFIG_CRC, i, ncd->crc, crc);
+				ncd->crc = crc;
+			}
+			
+			if (hasExConfig) {
+				ncd->exVersion = 1;
+				
+				uint16_t exCrc = ComputeCrc(&ncd->exVersion, FLASH_NCD_EX_SIZE - 2, 0xFFFF);
+				if (exCrc != ncd->exCrc) {
+					FwiAddCorrection(result, FW_FIELD_USER_CONFIG_EX_CRC, i, ncd->exCrc, exCrc);
+					ncd->exCrc = exCrc;
+				}
+			}
+		}
+	}
+	return FW_OK;
+}
+
+FwStatus FwWriteBytes(FwContext *ctx, uint32_t offset, const unsigned char *data, unsigned int size, unsigned int *pnWritten) {
+	*pnWritten = 0;
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	if (offset >= ctx->size) return FW_ERR_INVALID_ARGUMENT;
+	
+	unsigned int n = (ctx->size - offset) < size ? (ctx->size - offset) : size;
+	memcpy(ctx->image + offset, data, n);
+	*pnWritten = n;
+	return FW_OK;
+}
+
+FwStatus FwWriteRam(FwContext *ctx, uint32_t addr, const unsigned char *data, unsigned int size, FwWriteRamResult *result) {
+	memset(result, 0, sizeof(*result));
+	result->module = -1;
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	const FirmwareRamView *view = FwGetRamView(ctx);
+	if (view == NULL) return FW_ERR_NO_MEMORY;
+	
+	//find the module loaded at the address
+	int modno = -1;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		const FirmwareModule *mod = &view->modules[i];
+		if (mod->data == NULL) return FW_ERR_CORRUPT_MODULE;
+		if (mod->ramAddr && addr >= mod->ramAddr && addr < (mod->ramAddr + mod->uncompressed)) modno = i;
+	}
+	if (modno == -1) return FW_ERR_NOT_FOUND;
+	
+	//the view is rebuilt by the next call, so the module and its extent are copied now
+	const FirmwareModule *mod = &view->modules[modno];
+	FirmwareModule target = *mod;
+	uint32_t editStart = addr - mod->ramAddr;
+	uint32_t editEnd = editStart + ((mod->uncompressed - editStart) < size ? (mod->uncompressed - editStart) : size);
+	
+	FwStatus status = FW_ERR_NO_MEMORY;
+	unsigned char *mods[FW_MODULE_COUNT] = { 0 };
+	uint32_t modSizes[FW_MODULE_COUNT] = { 0 };
+	unsigned char *oldComp = NULL;
+	unsigned char *edited = FwiCopy(&ctx->allocator, mod->data, mod->uncompressed);
+	if (edited == NULL) goto End;
+	memcpy(edited + editStart, data, editEnd - editStart);
+	
+	//carry the other modules over as they are
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		if (i == modno) continue;
+		
+		mods[i] = FwiCopy(&ctx->allocator, ctx->image + view->modules[i].romAddr, view->modules[i].size);
+		if (mods[i] == NULL) goto End;
+		modSizes[i] = view->modules[i].size;
+	}
+	
+	//recompress the module: only around the edit for LZ
+	int encrypted = modno == FW_MODULE_ARM9_STATIC || modno == FW_MODULE_ARM7_STATIC;
+	if (target.type == CX_COMPRESSION_LZ) {
+		oldComp = FwiCopy(&ctx->allocator, ctx->image + target.romAddr, target.size);
+		if (oldComp == NULL) goto End;
+		if (encrypted) BfDecrypt(oldComp, target.size, ctx->image);
+		
+		unsigned int compSize;
+		unsigned char *comp = CxRecompressLZ(oldComp, target.size, edited, target.uncompressed, editStart, editEnd, &compSize);
+		if (comp != NULL) {
+			comp = CxPadCompressed(comp, compSize, 8, &compSize);
+			if (encrypted) BfEncrypt(comp, compSize, ctx->image);
+			mods[modno] = FwiCopy(&ctx->allocator, comp, compSize);
+			modSizes[modno] = compSize;
+			free(comp);
+			if (mods[modno] == NULL) goto End;
+		}
+	}
+	if (mods[modno] == NULL) {
+		status = FwiCompressModule(&ctx->allocator, ctx->image, modno, target.type, edited, target.uncompressed, &sDefaultEffort, &mods[modno], &modSizes[modno]);
+		if (status != FW_OK) goto End;
+	}
+	
+	if (!RelayoutFirmwareModules(ctx->image, ctx->size, mods, modSizes)) {
+		status = FW_ERR_NO_SPACE;
+		goto End;
+	}
+	UpdateFirmwareModuleChecksumsEx(ctx->image, ctx->size, 1 << modno);
+	
+	result->module = modno;
+	result->offset = editStart;
+	result->nWritten = editEnd - editStart;
+	result->oldSize = target.size;
+	result->newSize = modSizes[modno];
+	status = FW_OK;
+	
+End:
+	for (int i = 0; i < FW_MODULE_COUNT; i++) FwiFree(&ctx->allocator, mods[i]);
+	FwiFree(&ctx->allocator, oldComp);
+	FwiFree(&ctx->allocator, edited);
+	return status;
+}
+
+FwStatus FwDefragment(FwContext *ctx, FwDefragResult *result) {
+	memset(result, 0, sizeof(*result));
+	if (ctx->image == NULL) return FW_ERR_NO_IMAGE;
+	
+	unsigned char *buffer = ctx->image;
+	unsigned int size = ctx->size;
+	
+	//find module extents without decompressing
+	uint32_t romAddrs[FW_MODULE_COUNT], compSizes[FW_MODULE_COUNT];
+	if (!GetFirmwareModuleExtents(buffer, size, romAddrs, compSizes)) return FW_ERR_CORRUPT_MODULE;
+	
+	//sort modules by flash address
+	int order[FW_MODULE_COUNT];
+	for (int i = 0; i < FW_MODULE_COUNT; i++) order[i] = i;
+	for (int i = 1; i < FW_MODULE_COUNT; i++) {
+		for (int j = i; j > 0 && romAddrs[order[j - 1]] > romAddrs[order[j]]; j--) {
+			int t = order[j];
+			order[j] = order[j - 1];
+			order[j - 1] = t;
+		}
+	}
+	
+	uint32_t limit = GetFirmwareModuleLimit(buffer, size);
+	uint32_t end = 0x200;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		int mod = order[i];
+		if (romAddrs[mod] < end) return FW_ERR_INVALID_IMAGE;
+		end = romAddrs[mod] + compSizes[mod];
+	}
+	if (end > limit) return FW_ERR_NO_SPACE;
+	
+	//compute new addresses. Modules only move down, so moving them in address order never
+	//overwrites a module that has not been moved yet.
+	uint32_t newAddrs[FW_MODULE_COUNT];
+	uint32_t pos = 0x200;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		int mod = order[i];
+		uint32_t addr = AlignFirmwareModuleRomAddr(mod, pos);
+		if (addr == 0 || addr > romAddrs[mod]) addr = romAddrs[mod];
+		newAddrs[mod] = addr;
+		pos = addr + compSizes[mod];
+	}
+	
+	pos = 0x200;
+	for (int i = 0; i < FW_MODULE_COUNT; i++) {
+		int mod = order[i];
+		if (newAddrs[mod] > pos) memset(buffer + pos, 0xFF, newAddrs[mod] - pos);
+		if (newAddrs[mod] != romAddrs[mod]) memmove(buffer + newAddrs[mod], buffer + romAddrs[mod], compSizes[mod]);
+		SetFirmwareModuleRomAddr(buffer, mod, newAddrs[mod]);
+		pos = newAddrs[mod] + compSizes[mod];
+	}
+	
+	//clear the space freed after the last module
+	if (end > pos) memset(buffer + pos, 0xFF, end - pos);
+	
+	memcpy(result->oldAddrs, romAddrs, sizeof(romAddrs));
+	memcpy(result->newAddrs, newAddrs, sizeof(newAddrs));
+	memcpy(result->sizes, compSizes, sizeof(compSizes));
+	result->oldFree = limit - end;
+	result->newFree = limit - pos;
+	return FW_OK;
+}
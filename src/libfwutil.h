@@ -0,0 +1,296 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "compression.h"
+#include "firmware.h"
+
+//
+// Library interface to firmware images. All state lives in a context, so the library can be linked into
+// other programs and used without the command processor. Results are returned in structures rather
+// than printed.
+//
+// Thread safety: a context may be used by one thread at a time, and different contexts may be used by
+// different threads at once. The run step of an operation (FwRunCompactModule, FwRunImport) uses only
+// the operation, so it may run on any thread while the context it was prepared from is used for other
+// things. Nothing in the library keeps global mutable state; the Blowfish key schedule cache is per
+// thread.
+//
+
+typedef enum FwStatus_ {
+	FW_OK,
+	FW_ERR_IO,                              // a file could not be read or written
+	FW_ERR_INVALID_IMAGE,                   // the data is not a firmware image
+	FW_ERR_NO_IMAGE,                        // no image is loaded in the context
+	FW_ERR_INVALID_ARGUMENT,                // unknown module or form
+	FW_ERR_CORRUPT_MODULE,                  // a module could not be decompressed
+	FW_ERR_NO_SPACE,                        // the modules do not fit in the image
+	FW_ERR_CANCELLED,                       // the operation was cancelled through its progress
+	FW_ERR_STALE,                           // the image changed since the operation was prepared
+	FW_ERR_NO_MEMORY,                       // memory could not be allocated
+	FW_ERR_NOT_FOUND                        // no such snapshot or module, or nothing to undo or redo
+} FwStatus;
+
+//
+// Allocator for all memory a context owns or returns to the caller: the context itself, the image, its
+// edit history, its cache of decompressed modules, prepared operations with their module buffers, and
+// exported modules. Only working memory that is freed before a call returns comes from malloc.
+//
+typedef struct FwAllocator_ {
+	void *(*alloc)(void *arg, size_t size);
+	void (*free)(void *arg, void *p);
+	void *arg;
+} FwAllocator;
+
+typedef struct FwContext_ FwContext;
+
+#define FW_FORM_UNCOMPRESSED 0 // module as loaded in RAM
+#define FW_FORM_COMPRESSED   1 // compressed, not encrypted
+#define FW_FORM_STORED       2 // as stored in flash: compressed, and encrypted for the static modules
+
+typedef struct FwModuleInfo_ {
+	uint32_t romAddr;                       // flash address
+	uint32_t ramAddr;                       // load address, 0 if unknown
+	uint32_t size;                          // size in flash, 0 if the module could not be decompressed
+	uint32_t uncompressed;
+	CxCompressionType type;
+	int valid;                              // nonzero if the module could be decompressed
+} FwModuleInfo;
+
+typedef struct FwInfo_ {
+	uint32_t imageSize;
+	int ipl2Type;
+	uint32_t moduleLimit;                   // highest flash address modules may occupy
+	uint32_t largestFree;                   // largest free region below the module limit
+	FwModuleInfo modules[FW_MODULE_COUNT];
+} FwInfo;
+
+typedef struct FwEditInfo_ {
+	const char *label;                      // valid until the edit history next changes
+	unsigned int nPages;                    // 4KB pages the edit changed
+} FwEditInfo;
+
+typedef struct FwSnapshotInfo_ {
+	const char *name;                       // valid until the snapshot is replaced or the image is loaded
+	unsigned int nPagesDiffer;              // pages of the image that differ from the snapshot
+} FwSnapshotInfo;
+
+typedef struct FwCompactResult_ {
+	uint32_t oldSizes[FW_MODULE_COUNT];     // compressed sizes before compacting
+	uint32_t newSizes[FW_MODULE_COUNT];
+} FwCompactResult;
+
+typedef struct FwImportResult_ {
+	uint32_t oldSize;                       // compressed size of the module that was replaced
+	uint32_t newSize;
+	uint32_t romAddrs[FW_MODULE_COUNT];     // module addresses after the import
+} FwImportResult;
+
+#define FW_IMPORT_FIT 1 // stop compressing as soon as the module fits in the image
+
+#define FW_CRC_STATIC       0 // header CRC of the two static modules
+#define FW_CRC_SECONDARY    1 // header CRC of the two secondary modules
+#define FW_CRC_RESOURCES    2 // header CRC of the resources pack
+#define FW_CRC_COUNT        3
+
+#define FW_VERIFY_WL_TABLE_SIZE    0x01 // the wireless initialization table size is invalid
+#define FW_VERIFY_WL_CRC           0x02 // the wireless initialization table CRC is wrong
+#define FW_VERIFY_RF_TYPE          0x04 // no valid RF type is set
+#define FW_VERIFY_CHANNELS         0x08 // the allowed channels are invalid
+#define FW_VERIFY_USER_CONFIG_ADDR 0x10 // the user configuration address is outside the image
+
+typedef struct FwVerifyOptions_ {
+	int nThreads;                           // threads to decompress the modules with, 0 for one per processor
+	unsigned int trustedModules;            // modules known to be intact, as 1 << FW_MODULE_*, which are not decompressed
+	uint32_t trustedUncompressed[FW_MODULE_COUNT]; // uncompressed sizes of the trusted modules
+} FwVerifyOptions;
+
+typedef struct FwVerifyResult_ {
+	unsigned int corruptModules;            // untrusted modules that could not be decompressed, as 1 << FW_MODULE_*
+	unsigned int badLoadAddrs;              // static modules loaded where the ARM7 cannot reach them
+	unsigned int checkedCrcs;               // header CRCs whose modules were all decompressed, as 1 << FW_CRC_*
+	unsigned int badCrcs;                   // checked header CRCs that do not match the modules
+	uint16_t headerCrcs[FW_CRC_COUNT];
+	uint16_t computedCrcs[FW_CRC_COUNT];    // CRCs of the modules, where checked
+	unsigned int tableErrors;               // FW_VERIFY_* flags
+	unsigned int badUserConfigs;            // user configuration copies with a wrong CRC, as 1 << copy
+	unsigned int badExUserConfigs;          // user configuration copies with a wrong extended CRC
+	uint32_t uncompressed[FW_MODULE_COUNT]; // uncompressed sizes of the decompressed and trusted modules
+	unsigned int nErrors;
+} FwVerifyResult;
+
+#define FW_FIELD_STATIC_CRC         0
+#define FW_FIELD_SECONDARY_CRC      1
+#define FW_FIELD_RESOURCES_CRC      2
+#define FW_FIELD_WIRELESS_CRC       3
+#define FW_FIELD_CONNECTION_CRC     4 // index is the connection, 0-5
+#define FW_FIELD_CONNECTION_EX_CRC  5 // index is the connection, 3-5
+#define FW_FIELD_USER_CONFIG_CRC    6 // index is the copy, 0 or 1
+#define FW_FIELD_USER_CONFIG_EX_CRC 7
+
+#define FW_FIX_MAX_CORRECTIONS 17 // one for every CRC an image has
+
+typedef struct FwCorrection_ {
+	int field;                              // FW_FIELD_*
+	int index;
+	uint16_t oldCrc;
+	uint16_t newCrc;
+} FwCorrection;
+
+typedef struct FwFixResult_ {
+	FwCorrection corrections[FW_FIX_MAX_CORRECTIONS]; // in image order
+	unsigned int nCorrections;
+	unsigned int uncheckedCrcs;             // header CRCs left alone because a module could not be decompressed
+	unsigned int unsupportedUserConfigs;    // user configuration copies left alone, as 1 << copy
+	int userConfigVersions[2];
+} FwFixResult;
+
+typedef struct FwWriteRamResult_ {
+	int module;                             // module written to
+	uint32_t offset;                        // offset of the first byte in the module
+	unsigned int nWritten;                  // bytes written, fewer than given at the end of the module
+	uint32_t oldSize;                       // compressed sizes
+	uint32_t newSize;
+} FwWriteRamResult;
+
+typedef struct FwDefragResult_ {
+	uint32_t oldAddrs[FW_MODULE_COUNT];
+	uint32_t newAddrs[FW_MODULE_COUNT];
+	uint32_t sizes[FW_MODULE_COUNT];
+	uint32_t oldFree;                       // free space after the last module
+	uint32_t newFree;
+} FwDefragResult;
+
+typedef struct FwCompact_ FwCompact;
+typedef struct FwImport_ FwImport;
+
+//
+// Create a context with no image, or free it with everything it holds. A NULL allocator uses malloc and
+// free. Returns NULL if memory could not be allocated.
+//
+FwContext *FwCreateContext(const FwAllocator *allocator);
+void FwFreeContext(FwContext *ctx);
+
+const char *FwGetStatusString(FwStatus status);
+
+//
+// Load an image from a file or from memory (the data is copied), replacing the context's image and
+// clearing its edit history. Save the image to a file, or to its own path if path is NULL.
+//
+FwStatus FwLoadFile(FwContext *ctx, const char *path);
+FwStatus FwLoadImage(FwContext *ctx, const unsigned char *data, unsigned int size, const char *path);
+FwStatus FwSaveFile(FwContext *ctx, const char *path);
+
+//
+// Returns nonzero if the image differs from when it was last loaded or saved to its own path.
+//
+int FwIsModified(FwContext *ctx);
+
+//
+// Get the image path, or NULL if none, and the image buffer, or NULL if no image is loaded. The buffer
+// may be edited directly; FwCommit records the edits as one undoable change.
+//
+const char *FwGetPath(const FwContext *ctx);
+unsigned char *FwGetImage(FwContext *ctx, unsigned int *pSize);
+
+//
+// Record the edits to the image since the last commit as one undoable change, with the number of pages
+// changed in *pnPages if it is not NULL. If memory runs out, nothing is recorded and the edits become
+// part of the next commit.
+//
+FwStatus FwCommit(FwContext *ctx, const char *label, unsigned int *pnPages);
+
+//
+// Undo or redo one change, describing it in *edit. Returns FW_ERR_NOT_FOUND if there is nothing to undo
+// or redo.
+//
+FwStatus FwUndo(FwContext *ctx, FwEditInfo *edit);
+FwStatus FwRedo(FwContext *ctx, FwEditInfo *edit);
+
+//
+// Save the image's state under a name, replacing a snapshot of the same name, or return to a snapshot.
+// A revert is recorded as a change, with the number of pages restored in *pnPages if it is not NULL, and
+// returns FW_ERR_NOT_FOUND if there is no snapshot of that name.
+//
+FwStatus FwTakeSnapshot(FwContext *ctx, const char *name);
+FwStatus FwRevert(FwContext *ctx, const char *name, unsigned int *pnPages);
+
+//
+// List the snapshots of the image.
+//
+unsigned int FwGetSnapshotCount(const FwContext *ctx);
+FwStatus FwGetSnapshot(const FwContext *ctx, unsigned int index, FwSnapshotInfo *info);
+
+//
+// Get the layout of the image's modules. The decompressed modules are cached, so they are only
+// decompressed again if the image changed.
+//
+FwStatus FwGetInfo(FwContext *ctx, FwInfo *info);
+
+//
+// Extract a module in one of the FW_FORM_* forms. The data is allocated with the context's allocator and
+// freed with FwFreeData.
+//
+FwStatus FwExportModule(FwContext *ctx, int module, int form, unsigned char **pData, unsigned int *pSize);
+void FwFreeData(FwContext *ctx, void *data);
+
+//
+// Recompress all modules and lay them out to leave the largest free region. The operation is prepared
+// from the image, each module is compressed in the run step, and the result is applied to the image,
+// which fails with FW_ERR_STALE if the image changed since it was prepared. A NULL effort compresses
+// as hard as the defaults allow. FwCompactImage does all three steps.
+//
+FwStatus FwBeginCompact(FwContext *ctx, const CxEffort *effort, FwCompact **pCompact);
+FwStatus FwRunCompactModule(FwCompact *compact, int module, CxProgress *progress);
+FwStatus FwApplyCompact(FwContext *ctx, FwCompact *compact, FwCompactResult *result);
+void FwFreeCompact(FwCompact *compact);
+FwStatus FwCompactImage(FwContext *ctx, const CxEffort *effort, FwCompactResult *result);
+
+//
+// Replace a module with data in one of the FW_FORM_* forms and lay out the modules again, in the same
+// three steps as compacting. Only uncompressed data is compressed in the run step. flags is a
+// combination of FW_IMPORT_* flags. Applying fails with FW_ERR_CORRUPT_MODULE, leaving the image
+// unchanged, if the imported module cannot be decompressed to update its CRC. FwImportModule does all
+// three steps.
+//
+FwStatus FwBeginImport(FwContext *ctx, int module, int form, const unsigned char *data, unsigned int size, const CxEffort *effort, unsigned int flags, FwImport **pImport);
+FwStatus FwRunImport(FwImport *import, CxProgress *progress);
+FwStatus FwApplyImport(FwContext *ctx, FwImport *import, FwImportResult *result);
+void FwFreeImport(FwImport *import);
+FwStatus FwImportModule(FwContext *ctx, int module, int form, const unsigned char *data, unsigned int size, const CxEffort *effort, unsigned int flags, FwImportResult *result);
+
+//
+// Check the image: decompress the modules, compare them with the header CRCs, and check the static
+// module load addresses, the wireless initialization table and the user configuration. Problems are
+// reported in the result, so the return value is FW_OK even when the image has errors. The modules are
+// decompressed in parallel. A NULL options checks every module with one thread per processor.
+//
+FwStatus FwVerify(FwContext *ctx, const FwVerifyOptions *options, FwVerifyResult *result);
+
+//
+// Correct the CRCs of the modules, the wireless initialization table, the connection settings and the
+// user configuration. Header CRCs are only corrected when their modules can be decompressed.
+//
+FwStatus FwFixChecksums(FwContext *ctx, FwFixResult *result);
+
+//
+// Write bytes at a flash offset without adjusting any CRC, stopping at the end of the image. The number
+// of bytes written is returned in *pnWritten. Returns FW_ERR_INVALID_ARGUMENT if the offset is outside
+// the image.
+//
+FwStatus FwWriteBytes(FwContext *ctx, uint32_t offset, const unsigned char *data, unsigned int size, unsigned int *pnWritten);
+
+//
+// Write bytes into the decompressed module loaded at a RAM address, stopping at the end of the module.
+// The module is recompressed, laid out again and its CRC updated. LZ modules are only re-encoded around
+// the edit. Returns FW_ERR_NOT_FOUND if no module is loaded at the address.
+//
+FwStatus FwWriteRam(FwContext *ctx, uint32_t addr, const unsigned char *data, unsigned int size, FwWriteRamResult *result);
+
+//
+// Move the modules together after the header without recompressing them. Returns FW_ERR_CORRUPT_MODULE
+// if the modules cannot be located, FW_ERR_INVALID_IMAGE if they overlap, or FW_ERR_NO_SPACE if they
+// extend into the user configuration.
+//
+FwStatus FwDefragment(FwContext *ctx, FwDefragResult *result);
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "firmware.h"
+#include "libfwutil.h"
+
+//
+// Parts of the library that the fwutil commands use, but that are not part of the library interface.
+//
+
+//
+// Get the RAM view of the image, rebuilt only when the image has changed since it was last built. The
+// view is held in memory from the context's allocator and stays valid until the next call on the
+// context. Returns NULL if no image is loaded or memory could not be allocated.
+//
+const FirmwareRamView *FwGetRamView(FwContext *ctx);
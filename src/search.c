@@ -0,0 +1,192 @@
+#include "search.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+static int SrNewNode(SrMatcher *matcher) {
+	if (matcher->nNodes == matcher->capacity) {
+		matcher->capacity = matcher->capacity ? (matcher->capacity * 2) : 16;
+		matcher->nodes = realloc(matcher->nodes, matcher->capacity * sizeof(SrNode));
+	}
+	
+	SrNode *node = &matcher->nodes[matcher->nNodes];
+	for (int i = 0; i < 256; i++) node->next[i] = -1;
+	node->fail = 0;
+	node->output = -1;
+	node->dictLink = -1;
+	return matcher->nNodes++;
+}
+
+void SrMatcherInit(SrMatcher *matcher) {
+	matcher->patterns = NULL;
+	matcher->nPatterns = 0;
+	matcher->nodes = NULL;
+	matcher->nNodes = 0;
+	matcher->capacity = 0;
+	matcher->built = 0;
+	SrNewNode(matcher); // root
+}
+
+void SrMatcherFree(SrMatcher *matcher) {
+	for (unsigned int i = 0; i < matcher->nPatterns; i++) {
+		free(matcher->patterns[i].bytes);
+		free(matcher->patterns[i].mask);
+	}
+	free(matcher->patterns);
+	free(matcher->nodes);
+	matcher->patterns = NULL;
+	matcher->nodes = NULL;
+	matcher->nPatterns = 0;
+	matcher->nNodes = 0;
+	matcher->capacity = 0;
+}
+
+int SrMatcherAdd(SrMatcher *matcher, const unsigned char *bytes, const unsigned char *mask, unsigned int length) {
+	//find the longest run of bytes that must match exactly
+	unsigned int anchor = 0, anchorLength = 0, run = 0;
+	for (unsigned int i = 0; i < length; i++) {
+		if (mask != NULL && mask[i] != 0xFF) {
+			run = 0;
+			continue;
+		}
+		
+		run++;
+		if (run > anchorLength) {
+			anchorLength = run;
+			anchor = i + 1 - run;
+		}
+	}
+	if (anchorLength == 0) return -1;
+	
+	//the trie transitions are overwritten when the automaton is built
+	if (matcher->built) return -1;
+	
+	int index = matcher->nPatterns++;
+	matcher->patterns = realloc(matcher->patterns, matcher->nPatterns * sizeof(SrPattern));
+	SrPattern *pattern = &matcher->patterns[index];
+	pattern->bytes = malloc(length);
+	pattern->mask = malloc(length);
+	pattern->length = length;
+	pattern->anchor = anchor;
+	pattern->anchorLength = anchorLength;
+	memcpy(pattern->bytes, bytes, length);
+	if (mask != NULL) memcpy(pattern->mask, mask, length);
+	else memset(pattern->mask, 0xFF, length);
+	for (unsigned int i = 0; i < length; i++) pattern->bytes[i] &= pattern->mask[i];
+	
+	//insert the anchor into the trie
+	int state = 0;
+	for (unsigned int i = 0; i < anchorLength; i++) {
+		unsigned char c = bytes[anchor + i];
+		if (matcher->nodes[state].next[c] == -1) {
+			int node = SrNewNode(matcher);
+			matcher->nodes[state].next[c] = node;
+		}
+		state = matcher->nodes[state].next[c];
+	}
+	pattern->nextOutput = matcher->nodes[state].output;
+	matcher->nodes[state].output = index;
+	return index;
+}
+
+int SrParseHexPattern(const char *text, unsigned char *bytes, unsigned char *mask, unsigned int maxLength, unsigned int *pLength) {
+	unsigned int length = 0, nDigits = 0;
+	unsigned char b = 0, m = 0;
+	for (const char *p = text; *p; p++) {
+		char c = *p;
+		if (c == ' ') continue;
+		
+		b <<= 4;
+		m <<= 4;
+		if (c != '?') {
+			if (!isxdigit((unsigned char) c)) return 0;
+			b |= isdigit((unsigned char) c) ? (c - '0') : ((c | 0x20) - 'a' + 10);
+			m |= 0xF;
+		}
+		
+		if (++nDigits == 2) {
+			if (length >= maxLength) return 0;
+			bytes[length] = b;
+			mask[length++] = m;
+			nDigits = 0;
+		}
+	}
+	if (nDigits != 0) return 0;
+	
+	*pLength = length;
+	return length > 0;
+}
+
+static void SrMatcherBuild(SrMatcher *matcher) {
+	//breadth-first, so that failure links always point to nodes already completed
+	int *queue = malloc(matcher->nNodes * sizeof(int));
+	unsigned int head = 0, tail = 0;
+	
+	SrNode *root = &matcher->nodes[0];
+	for (int c = 0; c < 256; c++) {
+		if (root->next[c] == -1) {
+			root->next[c] = 0;
+		} else {
+			matcher->nodes[root->next[c]].fail = 0;
+			queue[tail++] = root->next[c];
+		}
+	}
+	
+	while (head < tail) {
+		int state = queue[head++];
+		SrNode *node = &matcher->nodes[state];
+		
+		SrNode *fail = &matcher->nodes[node->fail];
+		node->dictLink = (fail->output != -1) ? node->fail : fail->dictLink;
+		
+		//missing transitions follow the failure link, making the automaton a DFA
+		for (int c = 0; c < 256; c++) {
+			int child = node->next[c];
+			if (child == -1) {
+				node->next[c] = fail->next[c];
+			} else {
+				matcher->nodes[child].fail = fail->next[c];
+				queue[tail++] = child;
+			}
+		}
+	}
+	
+	free(queue);
+	matcher->built = 1;
+}
+
+static int SrMatchPattern(const SrPattern *pattern, const unsigned char *p) {
+	for (unsigned int i = 0; i < pattern->length; i++) {
+		if ((p[i] & pattern->mask[i]) != pattern->bytes[i]) return 0;
+	}
+	return 1;
+}
+
+void SrMatcherScan(SrMatcher *matcher, const unsigned char *buf, unsigned int size, SrMatchCallback callback, void *arg) {
+	if (matcher->nPatterns == 0) return;
+	if (!matcher->built) SrMatcherBuild(matcher);
+	
+	const SrNode *nodes = matcher->nodes;
+	int state = 0;
+	for (unsigned int i = 0; i < size; i++) {
+		state = nodes[state].next[buf[i]];
+		
+		//each node on the dictionary chain ends some pattern's anchor here
+		int n = (nodes[state].output != -1) ? state : nodes[state].dictLink;
+		for (; n != -1; n = nodes[n].dictLink) {
+			for (int p = nodes[n].output; p != -1; p = matcher->patterns[p].nextOutput) {
+				const SrPattern *pattern = &matcher->patterns[p];
+				
+				//anchor ends at i; check the whole pattern fits around it
+				unsigned int anchorStart = i + 1 - pattern->anchorLength;
+				if (anchorStart < pattern->anchor) continue;
+				unsigned int start = anchorStart - pattern->anchor;
+				if (pattern->length > (size - start)) continue;
+				
+				if (!SrMatchPattern(pattern, buf + start)) continue;
+				if (callback(p, start, arg)) return;
+			}
+		}
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct SrPattern_ {
+	unsigned char *bytes;
+	unsigned char *mask;                    // bits that must match, per byte
+	unsigned int length;
+	unsigned int anchor;                    // offset of the literal run matched by the automaton
+	unsigned int anchorLength;
+	int nextOutput;                         // next pattern with the same anchor, -1 if none
+} SrPattern;
+
+typedef struct SrNode_ {
+	int next[256];                          // transitions, including failure transitions once built
+	int fail;
+	int output;                             // first pattern whose anchor ends at this node, -1 if none
+	int dictLink;                           // nearest node on the failure chain with an output, -1 if none
+} SrNode;
+
+typedef struct SrMatcher_ {
+	SrPattern *patterns;
+	unsigned int nPatterns;
+	SrNode *nodes;
+	unsigned int nNodes;
+	unsigned int capacity;
+	int built;
+} SrMatcher;
+
+//
+// Called for each match with the pattern index and the offset of the match. Return nonzero to stop
+// scanning.
+//
+typedef int (*SrMatchCallback)(int pattern, unsigned int offset, void *arg);
+
+void SrMatcherInit(SrMatcher *matcher);
+void SrMatcherFree(SrMatcher *matcher);
+
+//
+// Add a pattern with a mask to the matcher. A NULL mask matches all bits. The longest run of fully masked
+// bytes is used as the pattern's key in the Aho-Corasick automaton, and the rest of the pattern is
+// compared under its mask. Patterns must be added before the first scan. Returns the pattern index, or
+// -1 if the pattern has no fully masked byte or the matcher was already used.
+//
+int SrMatcherAdd(SrMatcher *matcher, const unsigned char *bytes, const unsigned char *mask, unsigned int length);
+
+//
+// Parse a hexadecimal pattern, two digits per byte. A ? digit matches any nibble, and spaces are ignored.
+// Returns 0 if the pattern is empty, invalid or longer than maxLength.
+//
+int SrParseHexPattern(const char *text, unsigned char *bytes, unsigned char *mask, unsigned int maxLength, unsigned int *pLength);
+
+//
+// Find all occurrences of all patterns in one pass over a buffer. The automaton is built on first use.
+//
+void SrMatcherScan(SrMatcher *matcher, const unsigned char *buf, unsigned int size, SrMatchCallback callback, void *arg);
@@ -0,0 +1,277 @@
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+
+int SvServe(const char *path, SvCommandProc proc, SvCloseProc closeProc) {
+	(void) path;
+	(void) proc;
+	(void) closeProc;
+	
+	puts("Server mode is not supported on this platform.");
+	return 0;
+}
+
+int SvRunClient(const char *path, int nCommands, const char *const *commands) {
+	(void) path;
+	(void) nCommands;
+	(void) commands;
+	
+	puts("Client mode is not supported on this platform.");
+	return 0;
+}
+
+#else
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+typedef struct SvClient_ {
+	int fd;
+	char *line;                             // received bytes not yet run as a command
+	unsigned int lineSize;
+	void *session;
+} SvClient;
+
+static int SvMakeAddress(const char *path, struct sockaddr_un *addr) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		printf("Socket path '%s' is too long.\n", path);
+		return 0;
+	}
+	strcpy(addr->sun_path, path);
+	return 1;
+}
+
+static int SvConnect(const char *path) {
+	struct sockaddr_un addr;
+	if (!SvMakeAddress(path, &addr)) return -1;
+	
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int SvWriteAll(int fd, const void *data, size_t size) {
+	const char *p = (const char *) data;
+	while (size > 0) {
+		ssize_t n = write(fd, p, size);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		p += n;
+		size -= n;
+	}
+	return 1;
+}
+
+static void SvCloseClient(SvClient *clients, unsigned int *pnClients, unsigned int index, SvCloseProc closeProc) {
+	close(clients[index].fd);
+	free(clients[index].line);
+	closeProc(clients[index].session);
+	
+	memmove(clients + index, clients + index + 1, (*pnClients - index - 1) * sizeof(SvClient));
+	(*pnClients)--;
+}
+
+//
+// Run a command for a client and send its output. Returns -1 if the output could not be sent, 1 if the
+// command stopped the server, or 0.
+//
+static int SvRunCommand(SvClient *client, SvCommandProc proc, const char *line) {
+	//the command prints to stdout, so point stdout at a temporary file while it runs. The output is sent
+	//once the command is done, so a client that does not read cannot stall a command.
+	FILE *out = tmpfile();
+	if (out == NULL) return -1;
+	
+	fflush(stdout);
+	int savedStdout = dup(STDOUT_FILENO);
+	dup2(fileno(out), STDOUT_FILENO);
+	
+	int stop = proc(&client->session, line);
+	
+	fflush(stdout);
+	dup2(savedStdout, STDOUT_FILENO);
+	close(savedStdout);
+	
+	//writes to the client time out, and a client that does not take its output in time is dropped
+	int sent = 1;
+	char buf[4096];
+	size_t n;
+	rewind(out);
+	while (sent && (n = fread(buf, 1, sizeof(buf), out)) > 0) sent = SvWriteAll(client->fd, buf, n);
+	fclose(out);
+	
+	char end = SV_END_OF_OUTPUT;
+	if (sent) sent = SvWriteAll(client->fd, &end, 1);
+	if (stop) return 1;
+	return sent ? 0 : -1;
+}
+
+//
+// Read what a client sent and run the complete lines. Returns -1 if the connection closed or the client
+// did not take its output, 1 if a command stopped the server, or 0.
+//
+static int SvReadClient(SvClient *client, SvCommandProc proc) {
+	char buf[4096];
+	ssize_t n = read(client->fd, buf, sizeof(buf));
+	if (n < 0 && errno == EINTR) return 0;
+	if (n <= 0) return -1;
+	
+	if (client->lineSize + n > SV_MAX_LINE) return -1;
+	client->line = realloc(client->line, client->lineSize + n + 1);
+	memcpy(client->line + client->lineSize, buf, n);
+	client->lineSize += n;
+	
+	unsigned int start = 0;
+	for (unsigned int i = 0; i < client->lineSize; i++) {
+		if (client->line[i] != '\n') continue;
+		
+		client->line[i] = '\0';
+		if (i > start && client->line[i - 1] == '\r') client->line[i - 1] = '\0';
+		int result = SvRunCommand(client, proc, client->line + start);
+		start = i + 1;
+		if (result != 0) return result;
+	}
+	
+	memmove(client->line, client->line + start, client->lineSize - start);
+	client->lineSize -= start;
+	return 0;
+}
+
+int SvServe(const char *path, SvCommandProc proc, SvCloseProc closeProc) {
+	struct sockaddr_un addr;
+	if (!SvMakeAddress(path, &addr)) return 0;
+	
+	//a socket file left by a server that is no longer running is replaced
+	int fd = SvConnect(path);
+	if (fd >= 0) {
+		close(fd);
+		printf("A server is already running at '%s'.\n", path);
+		return 0;
+	}
+	unlink(path);
+	
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listenFd < 0 || bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) != 0 || listen(listenFd, SV_MAX_CLIENTS) != 0) {
+		printf("Could not create socket '%s'.\n", path);
+		if (listenFd >= 0) close(listenFd);
+		return 0;
+	}
+	chmod(path, S_IRUSR | S_IWUSR);
+	
+	//a client that disconnects while its output is written must not end the server, and commands that
+	//prompt for input read none
+	signal(SIGPIPE, SIG_IGN);
+	if (freopen("/dev/null", "r", stdin) == NULL) clearerr(stdin);
+	
+	printf("Serving on '%s'.\n", path);
+	fflush(stdout);
+	
+	SvClient clients[SV_MAX_CLIENTS];
+	unsigned int nClients = 0;
+	struct pollfd fds[SV_MAX_CLIENTS + 1];
+	int stop = 0;
+	
+	while (!stop) {
+		fds[0].fd = listenFd;
+		fds[0].events = nClients < SV_MAX_CLIENTS ? POLLIN : 0;
+		fds[0].revents = 0;
+		for (unsigned int i = 0; i < nClients; i++) {
+			fds[i + 1].fd = clients[i].fd;
+			fds[i + 1].events = POLLIN;
+			fds[i + 1].revents = 0;
+		}
+		
+		if (poll(fds, nClients + 1, -1) < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		
+		//serve the clients in the order they connected. Closing a client shifts the later ones down.
+		unsigned int nPolled = nClients, nClosed = 0;
+		for (unsigned int i = 0; i < nPolled && !stop; i++) {
+			if (fds[i + 1].revents == 0) continue;
+			
+			unsigned int index = i - nClosed;
+			int result = SvReadClient(&clients[index], proc);
+			if (result < 0) {
+				SvCloseClient(clients, &nClients, index, closeProc);
+				nClosed++;
+			}
+			if (result > 0) stop = 1;
+		}
+		
+		if (!stop && (fds[0].revents & POLLIN)) {
+			int clientFd = accept(listenFd, NULL, NULL);
+			if (clientFd >= 0) {
+				struct timeval timeout = { SV_SEND_TIMEOUT, 0 };
+				setsockopt(clientFd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+				
+				SvClient *client = &clients[nClients++];
+				memset(client, 0, sizeof(*client));
+				client->fd = clientFd;
+			}
+		}
+	}
+	
+	while (nClients > 0) SvCloseClient(clients, &nClients, nClients - 1, closeProc);
+	close(listenFd);
+	unlink(path);
+	return 1;
+}
+
+static int SvSendCommand(int fd, const char *command) {
+	if (!SvWriteAll(fd, command, strlen(command)) || !SvWriteAll(fd, "\n", 1)) return 0;
+	
+	//copy the output up to the end marker
+	char buf[4096];
+	while (1) {
+		ssize_t n = read(fd, buf, sizeof(buf));
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return 0;
+		
+		char *end = memchr(buf, SV_END_OF_OUTPUT, n);
+		fwrite(buf, 1, end != NULL ? (size_t) (end - buf) : (size_t) n, stdout);
+		if (end != NULL) break;
+	}
+	fflush(stdout);
+	return 1;
+}
+
+int SvRunClient(const char *path, int nCommands, const char *const *commands) {
+	int fd = SvConnect(path);
+	if (fd < 0) {
+		printf("Could not connect to '%s'.\n", path);
+		return 0;
+	}
+	
+	int ok = 1;
+	if (nCommands > 0) {
+		for (int i = 0; i < nCommands && ok; i++) ok = SvSendCommand(fd, commands[i]);
+	} else {
+		char line[SV_MAX_LINE];
+		while (ok && fgets(line, sizeof(line), stdin) != NULL) {
+			line[strcspn(line, "\r\n")] = '\0';
+			ok = SvSendCommand(fd, line);
+		}
+	}
+	
+	close(fd);
+	return ok;
+}
+
+#endif
@@ -0,0 +1,31 @@
+#pragma once
+
+#define SV_MAX_CLIENTS   32            // connections served at once
+#define SV_MAX_LINE      0x10000       // longest command line a client may send
+#define SV_END_OF_OUTPUT '\0'          // sent after the output of each command
+#define SV_SEND_TIMEOUT  5             // seconds a client may take to accept output before it is dropped
+
+//
+// Run one command line for a client. The command's output to stdout is sent to the client. pSession
+// points to state kept for the connection, NULL when it opens. Returns nonzero to stop the server.
+//
+typedef int (*SvCommandProc)(void **pSession, const char *line);
+
+//
+// Release the state kept for a connection when it closes. session may be NULL.
+//
+typedef void (*SvCloseProc)(void *session);
+
+//
+// Serve clients over a Unix domain socket at path until a command stops the server. Each line a client
+// sends is a command, answered with the command's output and SV_END_OF_OUTPUT. Commands are run one at
+// a time in the order their lines arrive. closeProc is called for each connection that closes. Returns 0
+// if the socket could not be created.
+//
+int SvServe(const char *path, SvCommandProc proc, SvCloseProc closeProc);
+
+//
+// Send commands to a server and write their output to stdout. With no commands, each line of stdin is
+// sent as a command. Returns 0 if the server could not be reached or closed the connection.
+//
+int SvRunClient(const char *path, int nCommands, const char *const *commands);
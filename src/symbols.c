@@ -0,0 +1,103 @@
+#include "symbols.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+void SymTableInit(SymTable *table) {
+	table->symbols = NULL;
+	table->count = 0;
+	table->capacity = 0;
+}
+
+void SymTableFree(SymTable *table) {
+	for (unsigned int i = 0; i < table->count; i++) {
+		free(table->symbols[i].name);
+	}
+	free(table->symbols);
+	SymTableInit(table);
+}
+
+static int SymParseHex(const char *str, uint32_t *pValue) {
+	if (str[0] == '0' && (str[1] == 'x' || str[1] == 'X')) str += 2;
+	if (*str == '\0') return 0;
+	
+	uint32_t value = 0;
+	for (; *str; str++) {
+		if (!isxdigit((unsigned char) *str)) return 0;
+		value = (value << 4) | (isdigit((unsigned char) *str) ? (*str - '0') : ((*str | 0x20) - 'a' + 10));
+	}
+	*pValue = value;
+	return 1;
+}
+
+static int SymSymbolComparator(const void *e1, const void *e2) {
+	const SymSymbol *s1 = (const SymSymbol *) e1;
+	const SymSymbol *s2 = (const SymSymbol *) e2;
+	
+	if (s1->addr < s2->addr) return -1;
+	if (s1->addr > s2->addr) return  1;
+	return 0;
+}
+
+int SymTableLoad(SymTable *table, const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) return -1;
+	
+	int nRead = 0;
+	char line[512];
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		char *tokens[4];
+		int nTokens = 0;
+		for (char *tok = strtok(line, " \t\r\n"); tok != NULL && nTokens < 4; tok = strtok(NULL, " \t\r\n")) {
+			tokens[nTokens++] = tok;
+		}
+		if (nTokens < 2 || tokens[0][0] == ';' || tokens[0][0] == '#') continue;
+		
+		//nm: addr type name, or addr size type name. .sym: addr name
+		uint32_t addr, size = 0;
+		const char *name;
+		if (!SymParseHex(tokens[0], &addr)) continue;
+		if (nTokens >= 4 && strlen(tokens[2]) == 1 && SymParseHex(tokens[1], &size)) {
+			name = tokens[3];
+		} else if (nTokens >= 3 && strlen(tokens[1]) == 1) {
+			name = tokens[2];
+		} else {
+			name = tokens[1];
+		}
+		
+		//.sym directives mark code and data ranges, not symbols
+		if (name[0] == '.') continue;
+		
+		if (table->count == table->capacity) {
+			table->capacity = table->capacity ? (table->capacity * 2) : 256;
+			table->symbols = realloc(table->symbols, table->capacity * sizeof(SymSymbol));
+		}
+		
+		SymSymbol *sym = &table->symbols[table->count++];
+		sym->addr = addr;
+		sym->size = size;
+		sym->name = strdup(name);
+		nRead++;
+	}
+	fclose(fp);
+	
+	qsort(table->symbols, table->count, sizeof(SymSymbol), SymSymbolComparator);
+	return nRead;
+}
+
+const SymSymbol *SymTableFind(const SymTable *table, uint32_t addr) {
+	//binary search for the last symbol at or below the address
+	unsigned int lo = 0, hi = table->count;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (table->symbols[mid].addr <= addr) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo == 0) return NULL;
+	
+	const SymSymbol *sym = &table->symbols[lo - 1];
+	if (sym->size != 0 && (addr - sym->addr) >= sym->size) return NULL;
+	return sym;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef struct SymSymbol_ {
+	uint32_t addr;
+	uint32_t size;                          // 0 if unknown
+	char *name;
+} SymSymbol;
+
+typedef struct SymTable_ {
+	SymSymbol *symbols;                     // sorted by address
+	unsigned int count;
+	unsigned int capacity;
+} SymTable;
+
+void SymTableInit(SymTable *table);
+void SymTableFree(SymTable *table);
+
+//
+// Add the symbols of a symbol map file to a table. Both nm output ("addr [size] type name") and .sym
+// files ("addr name") are accepted; undefined symbols, comments and .sym directives are skipped.
+// Returns the number of symbols read, or -1 if the file could not be opened.
+//
+int SymTableLoad(SymTable *table, const char *path);
+
+//
+// Get the symbol with the highest address at or below addr, or NULL if there is none or addr is past the
+// end of a symbol of known size.
+//
+const SymSymbol *SymTableFind(const SymTable *table, uint32_t addr);
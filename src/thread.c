@@ -0,0 +1,194 @@
+#include "thread.h"
+
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+struct ThThread_ {
+#ifdef _WIN32
+	HANDLE handle;
+#else
+	pthread_t thread;
+#endif
+	ThThreadProc proc;
+	void *arg;
+};
+
+struct ThMutex_ {
+#ifdef _WIN32
+	CRITICAL_SECTION cs;
+#else
+	pthread_mutex_t mutex;
+#endif
+};
+
+#ifdef _WIN32
+
+static DWORD WINAPI ThThreadEntry(LPVOID param) {
+	ThThread *thread = (ThThread *) param;
+	thread->proc(thread->arg);
+	return 0;
+}
+
+ThThread *ThCreateThread(ThThreadProc proc, void *arg) {
+	ThThread *thread = calloc(1, sizeof(ThThread));
+	thread->proc = proc;
+	thread->arg = arg;
+	thread->handle = CreateThread(NULL, 0, ThThreadEntry, thread, 0, NULL);
+	if (thread->handle == NULL) {
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+void ThJoinThread(ThThread *thread) {
+	WaitForSingleObject(thread->handle, INFINITE);
+	CloseHandle(thread->handle);
+	free(thread);
+}
+
+ThMutex *ThCreateMutex(void) {
+	ThMutex *mutex = calloc(1, sizeof(ThMutex));
+	InitializeCriticalSection(&mutex->cs);
+	return mutex;
+}
+
+void ThFreeMutex(ThMutex *mutex) {
+	DeleteCriticalSection(&mutex->cs);
+	free(mutex);
+}
+
+void ThLockMutex(ThMutex *mutex) {
+	EnterCriticalSection(&mutex->cs);
+}
+
+void ThUnlockMutex(ThMutex *mutex) {
+	LeaveCriticalSection(&mutex->cs);
+}
+
+int ThGetProcessorCount(void) {
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return info.dwNumberOfProcessors;
+}
+
+double ThGetTime(void) {
+	LARGE_INTEGER count, freq;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (double) count.QuadPart / (double) freq.QuadPart;
+}
+
+#else
+
+static void *ThThreadEntry(void *param) {
+	ThThread *thread = (ThThread *) param;
+	thread->proc(thread->arg);
+	return NULL;
+}
+
+ThThread *ThCreateThread(ThThreadProc proc, void *arg) {
+	ThThread *thread = calloc(1, sizeof(ThThread));
+	thread->proc = proc;
+	thread->arg = arg;
+	if (pthread_create(&thread->thread, NULL, ThThreadEntry, thread) != 0) {
+		free(thread);
+		return NULL;
+	}
+	return thread;
+}
+
+void ThJoinThread(ThThread *thread) {
+	pthread_join(thread->thread, NULL);
+	free(thread);
+}
+
+ThMutex *ThCreateMutex(void) {
+	ThMutex *mutex = calloc(1, sizeof(ThMutex));
+	pthread_mutex_init(&mutex->mutex, NULL);
+	return mutex;
+}
+
+void ThFreeMutex(ThMutex *mutex) {
+	pthread_mutex_destroy(&mutex->mutex);
+	free(mutex);
+}
+
+void ThLockMutex(ThMutex *mutex) {
+	pthread_mutex_lock(&mutex->mutex);
+}
+
+void ThUnlockMutex(ThMutex *mutex) {
+	pthread_mutex_unlock(&mutex->mutex);
+}
+
+int ThGetProcessorCount(void) {
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n < 1) ? 1 : (int) n;
+}
+
+double ThGetTime(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
+
+
+// ----- task routines
+
+typedef struct ThTaskQueue_ {
+	ThTaskProc proc;
+	void *arg;
+	unsigned int nTasks;
+	unsigned int next;
+	ThMutex *mutex;
+} ThTaskQueue;
+
+static void ThTaskWorker(void *arg) {
+	ThTaskQueue *queue = (ThTaskQueue *) arg;
+	
+	while (1) {
+		ThLockMutex(queue->mutex);
+		unsigned int task = queue->next;
+		if (task < queue->nTasks) queue->next++;
+		ThUnlockMutex(queue->mutex);
+		
+		if (task >= queue->nTasks) break;
+		queue->proc(task, queue->arg);
+	}
+}
+
+void ThRunTasks(ThTaskProc proc, void *arg, unsigned int nTasks, int nThreads) {
+	if (nThreads < 1) nThreads = 1;
+	if ((unsigned int) nThreads > nTasks) nThreads = nTasks;
+	
+	ThTaskQueue queue;
+	queue.proc = proc;
+	queue.arg = arg;
+	queue.nTasks = nTasks;
+	queue.next = 0;
+	queue.mutex = ThCreateMutex();
+	
+	//the calling thread is one of the workers. If a thread cannot be started, its tasks are picked up
+	//by the remaining workers.
+	ThThread **threads = calloc(nThreads, sizeof(ThThread *));
+	for (int i = 1; i < nThreads; i++) {
+		threads[i] = ThCreateThread(ThTaskWorker, &queue);
+	}
+	ThTaskWorker(&queue);
+	
+	for (int i = 1; i < nThreads; i++) {
+		if (threads[i] != NULL) ThJoinThread(threads[i]);
+	}
+	free(threads);
+	ThFreeMutex(queue.mutex);
+}
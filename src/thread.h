@@ -0,0 +1,34 @@
+#pragma once
+
+typedef struct ThThread_ ThThread;
+typedef struct ThMutex_ ThMutex;
+
+typedef void (*ThThreadProc)(void *arg);
+typedef void (*ThTaskProc)(unsigned int task, void *arg);
+
+//
+// Start a thread, and wait for it to finish and free it.
+//
+ThThread *ThCreateThread(ThThreadProc proc, void *arg);
+void ThJoinThread(ThThread *thread);
+
+ThMutex *ThCreateMutex(void);
+void ThFreeMutex(ThMutex *mutex);
+void ThLockMutex(ThMutex *mutex);
+void ThUnlockMutex(ThMutex *mutex);
+
+//
+// Get the number of processors available to the process.
+//
+int ThGetProcessorCount(void);
+
+//
+// Get a monotonic clock reading in seconds, for measuring elapsed time.
+//
+double ThGetTime(void);
+
+//
+// Run tasks 0 to nTasks-1 on up to nThreads threads, including the calling thread, and return when all
+// tasks have finished.
+//
+void ThRunTasks(ThTaskProc proc, void *arg, unsigned int nTasks, int nThreads);
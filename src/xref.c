@@ -0,0 +1,134 @@
+#include "xref.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct XrList_ {
+	XrRef *refs;
+	unsigned int count;
+	unsigned int capacity;
+} XrList;
+
+static void XrListAppend(XrList *list, uint32_t key, uint32_t site, uint32_t literal, int kind, int reg) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? (list->capacity * 2) : 256;
+		list->refs = realloc(list->refs, list->capacity * sizeof(XrRef));
+	}
+	
+	XrRef *ref = &list->refs[list->count++];
+	ref->key = key;
+	ref->site = site;
+	ref->literal = literal;
+	ref->kind = kind;
+	ref->reg = reg;
+}
+
+static int XrRefComparator(const void *e1, const void *e2) {
+	const XrRef *r1 = (const XrRef *) e1;
+	const XrRef *r2 = (const XrRef *) e2;
+	
+	if (r1->key != r2->key) return (r1->key < r2->key) ? -1 : 1;
+	if (r1->site != r2->site) return (r1->site < r2->site) ? -1 : 1;
+	return 0;
+}
+
+void XrIndexBuild(XrIndex *index, const unsigned char *module, unsigned int size, uint32_t base) {
+	XrList calls = { 0 }, literals = { 0 };
+	
+	//Thumb: every halfword
+	for (unsigned int i = 0; (i + 2) <= (size & ~1); i += 2) {
+		uint16_t u1 = *(const uint16_t *) (module + i);
+		
+		if ((u1 & 0xF800) == 0x4800) {
+			//LDR Rd, [PC, #imm]
+			uint32_t pool = ((i + 4) & ~3) + ((u1 & 0xFF) << 2);
+			if ((pool + 4) <= size) {
+				XrListAppend(&literals, *(const uint32_t *) (module + pool), base + i, base + pool, XR_THUMB_LDR, (u1 >> 8) & 7);
+			}
+		} else if ((u1 & 0xF800) == 0xF000 && (i + 4) <= size) {
+			//BL/BLX pair
+			uint16_t u2 = *(const uint16_t *) (module + i + 2);
+			if ((u2 & 0xE800) != 0xE800) continue;
+			
+			int32_t offs = (int32_t) (((uint32_t) (u1 & 0x7FF) << 21) | ((uint32_t) (u2 & 0x7FF) << 10)) >> 9;
+			uint32_t target = base + i + 4 + offs;
+			if ((u2 & 0xF800) == 0xF800) {
+				XrListAppend(&calls, target, base + i, 0, XR_THUMB_BL, 0);
+			} else {
+				XrListAppend(&calls, target & ~3, base + i, 0, XR_THUMB_BLX, 0);
+			}
+		}
+	}
+	
+	//ARM: every word
+	for (unsigned int i = 0; (i + 4) <= (size & ~3); i += 4) {
+		uint32_t instr = *(const uint32_t *) (module + i);
+		
+		if ((instr & 0xFE000000) == 0xFA000000) {
+			//BLX imm
+			int32_t offs = ((int32_t) (instr << 8) >> 6) | ((instr >> 23) & 2);
+			XrListAppend(&calls, base + i + 8 + offs, base + i, 0, XR_ARM_BLX, 0);
+		} else if ((instr & 0x0F000000) == 0x0B000000 && (instr >> 28) != 0xF) {
+			//BL
+			int32_t offs = (int32_t) (instr << 8) >> 6;
+			XrListAppend(&calls, base + i + 8 + offs, base + i, 0, XR_ARM_BL, 0);
+		} else if ((instr & 0x0F7F0000) == 0x051F0000 && (instr >> 28) != 0xF) {
+			//LDR Rd, [PC, #+/-imm]
+			uint32_t imm = instr & 0xFFF;
+			uint32_t pool = (instr & (1 << 23)) ? (i + 8 + imm) : (i + 8 - imm);
+			if (pool <= (size - 4) && (pool & 3) == 0) {
+				XrListAppend(&literals, *(const uint32_t *) (module + pool), base + i, base + pool, XR_ARM_LDR, (instr >> 12) & 0xF);
+			}
+		}
+	}
+	
+	qsort(calls.refs, calls.count, sizeof(XrRef), XrRefComparator);
+	qsort(literals.refs, literals.count, sizeof(XrRef), XrRefComparator);
+	index->base = base;
+	index->calls = calls.refs;
+	index->nCalls = calls.count;
+	index->literals = literals.refs;
+	index->nLiterals = literals.count;
+}
+
+void XrIndexFree(XrIndex *index) {
+	free(index->calls);
+	free(index->literals);
+	memset(index, 0, sizeof(XrIndex));
+}
+
+static unsigned int XrFind(const XrRef *refs, unsigned int count, uint32_t key, const XrRef **pFirst) {
+	//binary search for the first reference with the key
+	unsigned int lo = 0, hi = count;
+	while (lo < hi) {
+		unsigned int mid = (lo + hi) / 2;
+		if (refs[mid].key < key) lo = mid + 1;
+		else hi = mid;
+	}
+	
+	unsigned int end = lo;
+	while (end < count && refs[end].key == key) end++;
+	
+	*pFirst = refs + lo;
+	return end - lo;
+}
+
+unsigned int XrFindCalls(const XrIndex *index, uint32_t target, const XrRef **pFirst) {
+	return XrFind(index->calls, index->nCalls, target, pFirst);
+}
+
+unsigned int XrFindLiterals(const XrIndex *index, uint32_t value, const XrRef **pFirst) {
+	return XrFind(index->literals, index->nLiterals, value, pFirst);
+}
+
+const char *XrGetKindString(int kind) {
+	switch (kind) {
+		case XR_THUMB_BL:  return "Thumb BL";
+		case XR_THUMB_BLX: return "Thumb BLX";
+		case XR_ARM_BL:    return "ARM BL";
+		case XR_ARM_BLX:   return "ARM BLX";
+		case XR_THUMB_LDR: return "Thumb LDR";
+		case XR_ARM_LDR:   return "ARM LDR";
+	}
+	return "-";
+}
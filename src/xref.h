@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+#define XR_THUMB_BL          0 // Thumb BL
+#define XR_THUMB_BLX         1 // Thumb BLX to ARM code
+#define XR_ARM_BL            2 // ARM BL
+#define XR_ARM_BLX           3 // ARM BLX to Thumb code
+#define XR_THUMB_LDR         4 // Thumb LDR Rd, [PC, #imm]
+#define XR_ARM_LDR           5 // ARM LDR Rd, [PC, #imm]
+
+typedef struct XrRef_ {
+	uint32_t key;                           // call target, or literal value
+	uint32_t site;                          // address of the referencing instruction
+	uint32_t literal;                       // address of the literal, for literal references
+	uint8_t kind;                           // XR_* reference kind
+	uint8_t reg;                            // destination register, for literal references
+} XrRef;
+
+typedef struct XrIndex_ {
+	uint32_t base;                          // address the module was indexed at
+	XrRef *calls;                           // sorted by target, then site
+	unsigned int nCalls;
+	XrRef *literals;                        // sorted by value, then site
+	unsigned int nLiterals;
+} XrIndex;
+
+//
+// Index the branches and PC-relative literal loads of a code module loaded at base. Every halfword is
+// decoded as Thumb and every word as ARM, since the module is not disassembled.
+//
+void XrIndexBuild(XrIndex *index, const unsigned char *module, unsigned int size, uint32_t base);
+void XrIndexFree(XrIndex *index);
+
+//
+// Get the calls to a target, or the literal loads of a value. Returns the number of references, and the
+// first reference in pFirst.
+//
+unsigned int XrFindCalls(const XrIndex *index, uint32_t target, const XrRef **pFirst);
+unsigned int XrFindLiterals(const XrIndex *index, uint32_t value, const XrRef **pFirst);
+
+//
+// Get a printable name of a reference kind.
+//
+const char *XrGetKindString(int kind);